@@ -0,0 +1,82 @@
+/*
+ * Event loop latency with many armed timers.
+ *
+ *   cc -O2 -Isrc/cxy/stdlib/native/evloop benchmarks/timers.c \
+ *       src/cxy/stdlib/native/evloop/ae.c -o timers
+ *   ./timers [armed timers] [iterations]
+ *
+ * Arms a large number of long timers (idle keep-alive connections, sleeping
+ * coroutines), then measures the cost of arming/cancelling a timer and of a
+ * non-blocking loop iteration, which must find the nearest timer each time.
+ */
+#include "ae.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static enum Status onTimer(aeEventLoop *eventLoop, long long id, void *data)
+{
+    (void)eventLoop;
+    (void)id;
+    (*(long *)data)++;
+    return AE_NO_MORE;
+}
+
+static double nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+    long armed = argc > 1 ? atol(argv[1]) : 100000;
+    long iterations = argc > 2 ? atol(argv[2]) : 10000;
+    long fired = 0;
+    long long *ids = malloc(sizeof(long long) * armed);
+    aeEventLoop *eventLoop = aeCreateEventLoop(NULL, 1024);
+    double start;
+    long i;
+
+    if (eventLoop == NULL || ids == NULL) {
+        fprintf(stderr, "creating event loop failed\n");
+        return EXIT_FAILURE;
+    }
+
+    srand(42);
+    start = nowNs();
+    for (i = 0; i < armed; i++) {
+        /* Between 10 minutes and an hour, none fires during the run */
+        ids[i] = aeCreateTimeEvent(
+            eventLoop, 600000 + rand() % 3000000, onTimer, &fired, NULL);
+    }
+    printf("arm:     %8.1f ns/timer (%ld timers)\n",
+           (nowNs() - start) / armed,
+           armed);
+
+    start = nowNs();
+    for (i = 0; i < iterations; i++)
+        aeProcessEvents(eventLoop, AE_ALL_EVENTS | AE_DONT_WAIT, 0);
+    printf("poll:    %8.1f ns/iteration\n", (nowNs() - start) / iterations);
+
+    /* A short timer per iteration, as a coroutine sleep would add */
+    start = nowNs();
+    for (i = 0; i < iterations; i++) {
+        aeCreateTimeEvent(eventLoop, 0, onTimer, &fired, NULL);
+        aeProcessEvents(eventLoop, AE_ALL_EVENTS, -1);
+    }
+    printf("sleep(0):%8.1f ns/iteration (%ld fired)\n",
+           (nowNs() - start) / iterations,
+           fired);
+
+    start = nowNs();
+    for (i = 0; i < armed; i++)
+        aeDeleteTimeEvent(eventLoop, ids[i]);
+    printf("cancel:  %8.1f ns/timer\n", (nowNs() - start) / armed);
+
+    aeDeleteEventLoop(eventLoop);
+    free(ids);
+    return EXIT_SUCCESS;
+}
@@ -898,3 +898,86 @@ bool runCommandWithProgressFull(const char *header, const char *command, void *l
     freeOutputBuffer(&outputBuf);
     return success;
 }
+
+pid_t waitForAnyOf(const pid_t *pids, u64 count, int *status)
+{
+    for (;;) {
+        bool waiting = false;
+        for (u64 i = 0; i < count; i++) {
+            if (pids[i] <= 0)
+                continue;
+            pid_t pid = waitpid(pids[i], status, WNOHANG);
+            if (pid == pids[i])
+                return pid;
+            if (pid == -1 && errno != EINTR)
+                return -1;
+            waiting = true;
+        }
+        if (!waiting)
+            return -1;
+
+        // Block until some child can be reaped, without reaping it. If it
+        // belongs to someone else, leave it alone and poll instead
+        siginfo_t info = {0};
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) == 0) {
+            bool ours = false;
+            for (u64 i = 0; i < count && !ours; i++)
+                ours = pids[i] > 0 && pids[i] == info.si_pid;
+            if (ours)
+                continue;
+        }
+        usleep(5000);
+    }
+}
+
+i64 execParallel(const char *const *commands, u64 count, u32 jobs)
+{
+    i64 failed = -1;
+    u64 next = 0, running = 0;
+    jobs = jobs ?: 1;
+    pid_t *pids = callocOrDie(jobs, sizeof(pid_t));
+    u64 *indices = callocOrDie(jobs, sizeof(u64));
+
+    while (running > 0 || (next < count && failed < 0)) {
+        // Fill up the free slots
+        for (u32 slot = 0; slot < jobs && next < count && failed < 0; slot++) {
+            if (pids[slot] != 0)
+                continue;
+            pid_t pid = fork();
+            if (pid == -1) {
+                failed = next;
+                break;
+            }
+            if (pid == 0) {
+                execl("/bin/sh", "sh", "-c", commands[next], (char *)NULL);
+                _exit(127);
+            }
+            pids[slot] = pid;
+            indices[slot] = next++;
+            running++;
+        }
+
+        if (running == 0)
+            break;
+
+        int status = 0;
+        pid_t pid = waitForAnyOf(pids, jobs, &status);
+        if (pid == -1)
+            break;
+
+        for (u32 slot = 0; slot < jobs; slot++) {
+            if (pids[slot] != pid)
+                continue;
+            pids[slot] = 0;
+            running--;
+            bool success = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            if (!success && (failed < 0 || (i64)indices[slot] < failed))
+                failed = indices[slot];
+            break;
+        }
+    }
+
+    free(indices);
+    free(pids);
+    return failed;
+}
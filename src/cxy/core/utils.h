@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
 #include <time.h>
 
 #ifdef __APPLE__
@@ -410,6 +411,33 @@ static inline bool runCommandWithProgress(const char *header, const char *comman
     return runCommandWithProgressFull(header, command, log, false);
 }
 
+/**
+ * Wait until one of the given child processes exits and reap it. Unlike
+ * `waitpid(-1, ...)` this never reaps children the caller did not list, so
+ * it is safe to use from a process that owns other children.
+ *
+ * @param pids The children to wait on, entries <= 0 are ignored
+ * @param count The number of entries in `pids`
+ * @param status Receives the exit status of the reaped child
+ *
+ * @return The pid of the reaped child, or -1 if there is no child to wait
+ *      on or waiting failed
+ */
+pid_t waitForAnyOf(const pid_t *pids, u64 count, int *status);
+
+/**
+ * Run shell commands concurrently, keeping at most `jobs` of them running at
+ * any given time. Once a command fails no new commands are started, the ones
+ * already running are waited for.
+ *
+ * @param commands Commands to execute
+ * @param count Number of commands
+ * @param jobs Maximum number of concurrently running commands
+ * @return The index of the first command that failed, or -1 if all of them
+ *      succeeded
+ */
+i64 execParallel(const char *const *commands, u64 count, u32 jobs);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,1350 @@
+#include "cache.hpp"
+#include "import.hpp"
+
+#include "driver/cache.h"
+
+#include "core/log.h"
+#include "core/strpool.h"
+#include "core/utils.h"
+#include "lang/frontend/ast.h"
+#include "lang/frontend/flag.h"
+#include "lang/frontend/strings.h"
+#include "lang/frontend/ttable.h"
+
+#include "msgpack.h"
+
+#include <clang/Basic/Version.h>
+#include <llvm/TargetParser/Host.h>
+
+#include <filesystem>
+#include <limits.h>
+#include <string.h>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
+
+// Bump whenever the layout of an entry changes
+#define C_HEADER_CACHE_MAGIC "cxy-cheader-4"
+
+namespace cxy {
+
+// Names generated by the importer for anonymous records and fields, they
+// are generated again when an entry is loaded to avoid clashing with the
+// names generated by the current compilation
+static const char *sAnonymousPrefixes[] = {"__ext_s", "__ext_f"};
+
+static void getCachedHeaderPath(CompilerDriver *driver,
+                                char *buf,
+                                const std::vector<std::string> &key)
+{
+    HashCode hash = hashInit();
+    for (auto &part : key)
+        hash = hashStr(hash, part.c_str());
+    snprintf(buf,
+             PATH_MAX,
+             "%s/cache/c-%08x.ast",
+             driver->options.buildDir,
+             hash);
+}
+
+class CHeaderEncoder {
+public:
+    CHeaderEncoder()
+    {
+        msgpack_sbuffer_init(&typesBuffer);
+        msgpack_packer_init(&typesPacker, &typesBuffer, msgpack_sbuffer_write);
+        msgpack_sbuffer_init(&itemsBuffer);
+        msgpack_packer_init(&itemsPacker, &itemsBuffer, msgpack_sbuffer_write);
+    }
+
+    ~CHeaderEncoder()
+    {
+        msgpack_sbuffer_destroy(&typesBuffer);
+        msgpack_sbuffer_destroy(&itemsBuffer);
+    }
+
+    bool encode(const CHeaderRecording &recording)
+    {
+        for (auto &item : recording.items) {
+            encodeItem(item);
+            if (failed)
+                return false;
+        }
+        itemsCount = recording.items.size();
+        return true;
+    }
+
+    void write(msgpack_packer *packer)
+    {
+        msgpack_pack_array(packer, typeIds.size());
+        msgpack_sbuffer_write(
+            packer->data, typesBuffer.data, typesBuffer.size);
+        msgpack_pack_array(packer, itemsCount);
+        msgpack_sbuffer_write(
+            packer->data, itemsBuffer.data, itemsBuffer.size);
+    }
+
+private:
+    static void packString(msgpack_packer *packer, cstring str)
+    {
+        if (str == NULL) {
+            msgpack_pack_nil(packer);
+            return;
+        }
+        size_t len = strlen(str);
+        msgpack_pack_str(packer, len);
+        msgpack_pack_str_body(packer, str, len);
+    }
+
+    static void packLoc(msgpack_packer *packer, const FileLoc &loc)
+    {
+        msgpack_pack_array(packer, 7);
+        packString(packer, loc.fileName);
+        msgpack_pack_uint64(packer, loc.begin.row);
+        msgpack_pack_uint64(packer, loc.begin.col);
+        msgpack_pack_uint64(packer, loc.begin.byteOffset);
+        msgpack_pack_uint64(packer, loc.end.row);
+        msgpack_pack_uint64(packer, loc.end.col);
+        msgpack_pack_uint64(packer, loc.end.byteOffset);
+    }
+
+    // Types are written to their own table, children before their parents
+    // so that decoding can never loop
+    u64 encodeType(const Type *type)
+    {
+        if (failed || type == nullptr) {
+            failed = true;
+            return 0;
+        }
+
+        auto it = typeIds.find(type);
+        if (it != typeIds.end())
+            return it->second;
+
+        auto packer = &typesPacker;
+        switch (type->tag) {
+        case typPrimitive:
+            msgpack_pack_array(packer, 2);
+            msgpack_pack_uint64(packer, type->tag);
+            msgpack_pack_uint64(packer, type->primitive.id);
+            break;
+        case typVoid:
+        case typAuto:
+        case typString:
+            msgpack_pack_array(packer, 1);
+            msgpack_pack_uint64(packer, type->tag);
+            break;
+        case typPointer: {
+            if (type->pointer.isAllocated) {
+                failed = true;
+                return 0;
+            }
+            u64 pointed = encodeType(type->pointer.pointed);
+            msgpack_pack_array(packer, 3);
+            msgpack_pack_uint64(packer, type->tag);
+            msgpack_pack_uint64(packer, type->flags);
+            msgpack_pack_uint64(packer, pointed);
+            break;
+        }
+        case typArray: {
+            u64 element = encodeType(type->array.elementType);
+            msgpack_pack_array(packer, 3);
+            msgpack_pack_uint64(packer, type->tag);
+            msgpack_pack_uint64(packer, type->array.len);
+            msgpack_pack_uint64(packer, element);
+            break;
+        }
+        case typWrapped: {
+            u64 target = encodeType(type->wrapped.target);
+            msgpack_pack_array(packer, 3);
+            msgpack_pack_uint64(packer, type->tag);
+            msgpack_pack_uint64(packer, type->flags);
+            msgpack_pack_uint64(packer, target);
+            break;
+        }
+        case typFunc: {
+            u64 ret = encodeType(type->func.retType);
+            std::vector<u64> params;
+            for (u64 i = 0; i < type->func.paramsCount; i++)
+                params.push_back(encodeType(type->func.params[i]));
+            msgpack_pack_array(packer, 5);
+            msgpack_pack_uint64(packer, type->tag);
+            msgpack_pack_uint64(packer, type->flags);
+            packString(packer, type->name);
+            msgpack_pack_uint64(packer, ret);
+            msgpack_pack_array(packer, params.size());
+            for (auto param : params)
+                msgpack_pack_uint64(packer, param);
+            break;
+        }
+        case typStruct:
+        case typUntaggedUnion:
+        case typEnum:
+        case typThis:
+            // Created by a declaration, looked up by name
+            msgpack_pack_array(packer, 3);
+            msgpack_pack_uint64(packer, type->tag);
+            msgpack_pack_uint64(packer, type->flags);
+            packString(packer, type->name);
+            break;
+        case typAlias: {
+            u64 aliased = encodeType(type->alias.aliased);
+            msgpack_pack_array(packer, 4);
+            msgpack_pack_uint64(packer, type->tag);
+            msgpack_pack_uint64(packer, type->flags);
+            packString(packer, type->name);
+            msgpack_pack_uint64(packer, aliased);
+            break;
+        }
+        case typOpaque: {
+            const AstNode *decl = type->opaque.decl;
+            msgpack_pack_array(packer, 5);
+            msgpack_pack_uint64(packer, type->tag);
+            msgpack_pack_uint64(packer, type->flags);
+            packString(packer, type->name);
+            if (decl) {
+                msgpack_pack_uint64(packer, decl->flags);
+                packLoc(packer, decl->loc);
+            }
+            else {
+                msgpack_pack_nil(packer);
+                msgpack_pack_nil(packer);
+            }
+            break;
+        }
+        default:
+            failed = true;
+            return 0;
+        }
+
+        if (failed)
+            return 0;
+        u64 id = typeIds.size();
+        typeIds.emplace(type, id);
+        return id;
+    }
+
+    // Type references are `[loc, type]`
+    void encodeTypeRef(const AstNode *node)
+    {
+        if (node == nullptr || !nodeIs(node, TypeRef)) {
+            failed = true;
+            return;
+        }
+        u64 id = encodeType(node->type);
+        msgpack_pack_array(&itemsPacker, 2);
+        packLoc(&itemsPacker, node->loc);
+        msgpack_pack_uint64(&itemsPacker, id);
+    }
+
+    void encodeLiteral(const AstNode *node)
+    {
+        auto packer = &itemsPacker;
+        u64 type = encodeType(node->type);
+        switch (node->tag) {
+        case astIntegerLit:
+            if (node->intLiteral.value < INT64_MIN ||
+                node->intLiteral.value > INT64_MAX) {
+                failed = true;
+                return;
+            }
+            msgpack_pack_array(packer, 4);
+            msgpack_pack_uint64(packer, node->tag);
+            packLoc(packer, node->loc);
+            msgpack_pack_int64(packer, (i64)node->intLiteral.value);
+            break;
+        case astFloatLit:
+            msgpack_pack_array(packer, 4);
+            msgpack_pack_uint64(packer, node->tag);
+            packLoc(packer, node->loc);
+            msgpack_pack_double(packer, node->floatLiteral.value);
+            break;
+        case astStringLit:
+            msgpack_pack_array(packer, 4);
+            msgpack_pack_uint64(packer, node->tag);
+            packLoc(packer, node->loc);
+            packString(packer, node->stringLiteral.value);
+            break;
+        default:
+            failed = true;
+            return;
+        }
+        msgpack_pack_uint64(packer, type);
+    }
+
+    void encodeField(const AstNode *field)
+    {
+        auto packer = &itemsPacker;
+        msgpack_pack_array(packer, 6);
+        packLoc(packer, field->loc);
+        packString(packer, field->structField.name);
+        msgpack_pack_uint64(packer, field->flags);
+        encodeTypeRef(field->structField.type);
+        msgpack_pack_uint64(packer, field->structField.bits);
+        msgpack_pack_uint64(packer, field->structField.index);
+    }
+
+    void encodeStruct(const AstNode *node)
+    {
+        auto packer = &itemsPacker;
+        if (!typeIs(node->type, Struct) && !typeIs(node->type, UntaggedUnion)) {
+            failed = true;
+            return;
+        }
+        bool isUnion = typeIs(node->type, UntaggedUnion);
+        const TypeMembersContainer *members =
+            isUnion ? node->type->untaggedUnion.members
+                    : node->type->tStruct.members;
+        const AstNode *decl = isUnion ? node->type->untaggedUnion.decl
+                                      : node->type->tStruct.decl;
+        // The fields of a redeclaration are dropped by the type table
+        u64 count = decl == node ? members->count : 0;
+        u64 packed = 0;
+        for (const AstNode *attr = node->attrs; attr; attr = attr->next)
+            packed += attr->attr.name == S_packed;
+
+        msgpack_pack_array(packer, 7);
+        msgpack_pack_uint64(packer, node->tag);
+        packLoc(packer, node->loc);
+        msgpack_pack_uint64(packer, node->flags);
+        packString(packer, node->structDecl.name);
+        msgpack_pack_uint64(packer, packed);
+        msgpack_pack_uint64(packer, isUnion);
+        msgpack_pack_array(packer, count);
+        for (u64 i = 0; i < count; i++)
+            encodeField(members->members[i].decl);
+    }
+
+    void encodeDeclaration(const AstNode *node)
+    {
+        auto packer = &itemsPacker;
+        switch (node->tag) {
+        case astFuncDecl: {
+            u64 count = 0;
+            for (const AstNode *param = node->funcDecl.signature->params; param;
+                 param = param->next)
+                count++;
+            msgpack_pack_array(packer, 8);
+            msgpack_pack_uint64(packer, node->tag);
+            packLoc(packer, node->loc);
+            msgpack_pack_uint64(packer, node->flags);
+            packString(packer, node->funcDecl.name);
+            msgpack_pack_uint64(packer, node->funcDecl.requiredParamsCount);
+            msgpack_pack_uint64(packer, node->type->flags);
+            encodeTypeRef(node->funcDecl.signature->ret);
+            msgpack_pack_array(packer, count);
+            for (const AstNode *param = node->funcDecl.signature->params; param;
+                 param = param->next) {
+                msgpack_pack_array(packer, 4);
+                packLoc(packer, param->loc);
+                packString(packer, param->funcParam.name);
+                msgpack_pack_uint64(packer, param->flags);
+                encodeTypeRef(param->funcParam.type);
+            }
+            break;
+        }
+        case astStructDecl:
+            encodeStruct(node);
+            break;
+        case astTypeDecl: {
+            u64 type = encodeType(node->type);
+            msgpack_pack_array(packer, 6);
+            msgpack_pack_uint64(packer, node->tag);
+            packLoc(packer, node->loc);
+            msgpack_pack_uint64(packer, node->flags);
+            packString(packer, node->typeDecl.name);
+            encodeTypeRef(node->typeDecl.aliased);
+            msgpack_pack_uint64(packer, type);
+            break;
+        }
+        case astVarDecl:
+            msgpack_pack_array(packer, 5);
+            msgpack_pack_uint64(packer, node->tag);
+            packLoc(packer, node->loc);
+            msgpack_pack_uint64(packer, node->flags);
+            packString(packer, node->varDecl.name);
+            encodeTypeRef(node->varDecl.type);
+            break;
+        case astEnumDecl: {
+            u64 count = 0;
+            for (const AstNode *option = node->enumDecl.options; option;
+                 option = option->next)
+                count++;
+            msgpack_pack_array(packer, 7);
+            msgpack_pack_uint64(packer, node->tag);
+            packLoc(packer, node->loc);
+            msgpack_pack_uint64(packer, node->flags);
+            packString(packer, node->enumDecl.name);
+            encodeTypeRef(node->enumDecl.base);
+            msgpack_pack_uint64(packer, node->type->flags);
+            msgpack_pack_array(packer, count);
+            for (const AstNode *option = node->enumDecl.options; option;
+                 option = option->next) {
+                const AstNode *value = option->enumOption.value;
+                if (!nodeIs(value, IntegerLit)) {
+                    failed = true;
+                    return;
+                }
+                msgpack_pack_array(packer, 4);
+                packLoc(packer, option->loc);
+                packString(packer, option->enumOption.name);
+                msgpack_pack_uint64(packer, option->flags);
+                msgpack_pack_int64(packer, (i64)value->intLiteral.value);
+            }
+            break;
+        }
+        default:
+            failed = true;
+            break;
+        }
+    }
+
+    void encodeItem(const CHeaderRecording::Item &item)
+    {
+        auto packer = &itemsPacker;
+        switch (item.kind) {
+        case CHeaderRecording::Declaration:
+            msgpack_pack_array(packer, 2);
+            msgpack_pack_uint64(packer, item.kind);
+            encodeDeclaration(item.node);
+            break;
+        case CHeaderRecording::Macro:
+        case CHeaderRecording::QuietMacro:
+            msgpack_pack_array(packer, 5);
+            msgpack_pack_uint64(packer, item.kind);
+            packLoc(packer, item.node->loc);
+            msgpack_pack_uint64(packer, item.node->flags);
+            packString(packer, item.node->macroDecl.name);
+            encodeLiteral(item.node->macroDecl.body);
+            break;
+        case CHeaderRecording::MacroAlias:
+            msgpack_pack_array(packer, 4);
+            msgpack_pack_uint64(packer, item.kind);
+            packLoc(packer, item.loc);
+            packString(packer, item.name);
+            packString(packer, item.target);
+            break;
+        }
+    }
+
+    msgpack_sbuffer typesBuffer, itemsBuffer;
+    msgpack_packer typesPacker, itemsPacker;
+    std::unordered_map<const Type *, u64> typeIds{};
+    u64 itemsCount{0};
+    bool failed{false};
+};
+
+class CHeaderDecoder {
+public:
+    CHeaderDecoder(MemPool *pool,
+                   StrPool *strings,
+                   TypeTable *table,
+                   const msgpack_object_array &types)
+        : pool{pool}, strings{strings}, table{table}, types{types}
+    {
+    }
+
+    bool decode(const msgpack_object_array &items, CHeaderRecording &into)
+    {
+        recording = &into;
+        for (u32 i = 0; i < items.size && !failed; i++)
+            decodeItem(items.ptr[i]);
+        return !failed;
+    }
+
+private:
+    static bool isUint(const msgpack_object &obj)
+    {
+        return obj.type == MSGPACK_OBJECT_POSITIVE_INTEGER;
+    }
+
+    const msgpack_object *fields(const msgpack_object &obj, u32 size)
+    {
+        if (obj.type != MSGPACK_OBJECT_ARRAY || obj.via.array.size != size) {
+            failed = true;
+            return nullptr;
+        }
+        return obj.via.array.ptr;
+    }
+
+    u64 decodeUint(const msgpack_object &obj)
+    {
+        if (!isUint(obj)) {
+            failed = true;
+            return 0;
+        }
+        return obj.via.u64;
+    }
+
+    i64 decodeInt(const msgpack_object &obj)
+    {
+        if (obj.type != MSGPACK_OBJECT_POSITIVE_INTEGER &&
+            obj.type != MSGPACK_OBJECT_NEGATIVE_INTEGER) {
+            failed = true;
+            return 0;
+        }
+        return obj.via.i64;
+    }
+
+    cstring decodeString(const msgpack_object &obj)
+    {
+        if (obj.type == MSGPACK_OBJECT_NIL)
+            return nullptr;
+        if (obj.type != MSGPACK_OBJECT_STR) {
+            failed = true;
+            return nullptr;
+        }
+        return makeStringSized(strings, obj.via.str.ptr, obj.via.str.size);
+    }
+
+    cstring decodeName(const msgpack_object &obj)
+    {
+        cstring name = decodeString(obj);
+        if (name == nullptr)
+            return name;
+
+        for (auto prefix : sAnonymousPrefixes) {
+            if (strncmp(name, prefix, strlen(prefix)) != 0)
+                continue;
+            auto &renamed = anonymous[name];
+            if (renamed == nullptr)
+                renamed = makeAnonymousVariable(strings, prefix);
+            return renamed;
+        }
+        return name;
+    }
+
+    FileLoc decodeLoc(const msgpack_object &obj)
+    {
+        auto loc = fields(obj, 7);
+        if (loc == nullptr)
+            return {};
+        return FileLoc{.fileName = decodeString(loc[0]),
+                       .begin = {.row = (u32)decodeUint(loc[1]),
+                                 .col = (u32)decodeUint(loc[2]),
+                                 .byteOffset = decodeUint(loc[3])},
+                       .end = {.row = (u32)decodeUint(loc[4]),
+                               .col = (u32)decodeUint(loc[5]),
+                               .byteOffset = decodeUint(loc[6])}};
+    }
+
+    // Types are created again rather than memoized, the named types they
+    // refer to are looked up as the declarations creating them are replayed
+    const Type *decodeType(u64 id, u64 limit)
+    {
+        if (failed || id >= limit) {
+            failed = true;
+            return nullptr;
+        }
+
+        const msgpack_object &obj = types.ptr[id];
+        if (obj.type != MSGPACK_OBJECT_ARRAY || obj.via.array.size == 0 ||
+            !isUint(obj.via.array.ptr[0])) {
+            failed = true;
+            return nullptr;
+        }
+
+        const msgpack_object *f = obj.via.array.ptr;
+        u32 size = obj.via.array.size;
+        const Type *type = nullptr;
+        switch (f[0].via.u64) {
+        case typPrimitive:
+            if (size == 2 && isUint(f[1]) && f[1].via.u64 < prtCOUNT)
+                type = getPrimitiveType(table, (PrtId)f[1].via.u64);
+            break;
+        case typVoid:
+            type = makeVoidType(table);
+            break;
+        case typAuto:
+            type = makeAutoType(table);
+            break;
+        case typString:
+            type = makeStringType(table);
+            break;
+        case typPointer: {
+            auto pointed =
+                size == 3 ? decodeType(decodeUint(f[2]), id) : nullptr;
+            if (pointed)
+                type = makePointerType(table, pointed, decodeUint(f[1]));
+            break;
+        }
+        case typArray: {
+            auto element =
+                size == 3 ? decodeType(decodeUint(f[2]), id) : nullptr;
+            if (element)
+                type = makeArrayType(table, element, decodeUint(f[1]));
+            break;
+        }
+        case typWrapped: {
+            auto target =
+                size == 3 ? decodeType(decodeUint(f[2]), id) : nullptr;
+            if (target)
+                type = makeWrappedType(table, target, decodeUint(f[1]));
+            break;
+        }
+        case typFunc: {
+            if (size != 5 || f[4].type != MSGPACK_OBJECT_ARRAY)
+                break;
+            std::vector<const Type *> params;
+            for (u32 i = 0; i < f[4].via.array.size; i++)
+                params.push_back(
+                    decodeType(decodeUint(f[4].via.array.ptr[i]), id));
+            Type func = {.tag = typFunc,
+                         .flags = decodeUint(f[1]),
+                         .name = decodeName(f[2]),
+                         .func = {
+                             .paramsCount = (u16)params.size(),
+                             .retType = decodeType(decodeUint(f[3]), id),
+                             .params = params.data(),
+                         }};
+            if (!failed)
+                type = makeFuncType(table, &func);
+            break;
+        }
+        case typStruct:
+            if (size == 3)
+                type = findStructType(
+                    table, decodeName(f[2]), decodeUint(f[1]));
+            break;
+        case typUntaggedUnion:
+            if (size == 3)
+                type = findUntaggedUnionType(
+                    table, decodeName(f[2]), decodeUint(f[1]));
+            break;
+        case typEnum:
+            if (size == 3)
+                type = findEnumType(table, decodeName(f[2]), decodeUint(f[1]));
+            break;
+        case typThis:
+            if (size == 3)
+                type = makeThisType(table, decodeName(f[2]), decodeUint(f[1]));
+            break;
+        case typAlias: {
+            auto aliased =
+                size == 4 ? decodeType(decodeUint(f[3]), id) : nullptr;
+            if (aliased)
+                type = makeAliasType(
+                    table, aliased, decodeName(f[2]), decodeUint(f[1]));
+            break;
+        }
+        case typOpaque: {
+            if (size != 5)
+                break;
+            cstring name = decodeName(f[2]);
+            AstNode *decl = nullptr;
+            if (f[3].type != MSGPACK_OBJECT_NIL) {
+                auto loc = decodeLoc(f[4]);
+                auto node = AstNode{.tag = astTypeDecl,
+                                    .flags = decodeUint(f[3]),
+                                    .typeDecl = {.name = name}};
+                decl = makeAstNode(pool, &loc, &node);
+            }
+            type = makeOpaqueTypeWithFlags(table, name, decl, decodeUint(f[1]));
+            break;
+        }
+        default:
+            break;
+        }
+
+        if (type == nullptr)
+            failed = true;
+        return failed ? nullptr : type;
+    }
+
+    const Type *decodeType(const msgpack_object &obj)
+    {
+        return decodeType(decodeUint(obj), types.size);
+    }
+
+    AstNode *decodeTypeRef(const msgpack_object &obj)
+    {
+        auto ref = fields(obj, 2);
+        if (ref == nullptr)
+            return nullptr;
+        auto loc = decodeLoc(ref[0]);
+        auto type = decodeType(ref[1]);
+        return failed ? nullptr : makeTypeReferenceNode(pool, type, &loc);
+    }
+
+    AstNode *decodeLiteral(const msgpack_object &obj)
+    {
+        auto f = fields(obj, 4);
+        if (f == nullptr || !isUint(f[0]))
+            return nullptr;
+        auto loc = decodeLoc(f[1]);
+        auto type = decodeType(f[3]);
+        if (failed)
+            return nullptr;
+
+        switch (f[0].via.u64) {
+        case astIntegerLit:
+            return makeIntegerLiteral(pool, &loc, decodeInt(f[2]), NULL, type);
+        case astFloatLit:
+            if (f[2].type != MSGPACK_OBJECT_FLOAT64 &&
+                f[2].type != MSGPACK_OBJECT_FLOAT32)
+                break;
+            return makeFloatLiteral(pool, &loc, f[2].via.f64, NULL, type);
+        case astStringLit:
+            if (cstring value = decodeString(f[2]))
+                return makeStringLiteral(pool, &loc, value, NULL, type);
+            break;
+        default:
+            break;
+        }
+        failed = true;
+        return nullptr;
+    }
+
+    AstNode *decodeFunction(const msgpack_object *f)
+    {
+        auto loc = decodeLoc(f[1]);
+        cstring name = decodeName(f[3]);
+        auto ret = decodeTypeRef(f[6]);
+        if (failed || f[7].type != MSGPACK_OBJECT_ARRAY) {
+            failed = true;
+            return nullptr;
+        }
+
+        AstNodeList params = {};
+        std::vector<const Type *> paramTypes;
+        for (u32 i = 0; i < f[7].via.array.size; i++) {
+            auto param = fields(f[7].via.array.ptr[i], 4);
+            if (param == nullptr)
+                return nullptr;
+            auto paramLoc = decodeLoc(param[0]);
+            auto type = decodeTypeRef(param[3]);
+            if (failed)
+                return nullptr;
+            paramTypes.push_back(type->type);
+            insertAstNode(&params,
+                          makeFunctionParam(pool,
+                                            &paramLoc,
+                                            decodeName(param[1]),
+                                            type,
+                                            nullptr,
+                                            decodeUint(param[2]),
+                                            nullptr));
+        }
+
+        auto node = makeFunctionDecl(pool,
+                                     &loc,
+                                     name,
+                                     params.first,
+                                     ret,
+                                     nullptr,
+                                     decodeUint(f[2]),
+                                     nullptr,
+                                     nullptr);
+        node->funcDecl.requiredParamsCount = decodeUint(f[4]);
+
+        Type func = {.tag = typFunc,
+                     .flags = decodeUint(f[5]),
+                     .name = name,
+                     .func = {
+                         .paramsCount = (u16)paramTypes.size(),
+                         .retType = ret->type,
+                         .params = paramTypes.data(),
+                         .decl = node,
+                     }};
+        node->type = makeFuncType(table, &func);
+        return node;
+    }
+
+    AstNode *decodeStruct(const msgpack_object *f)
+    {
+        auto flags = flgExtern | flgPublic;
+        auto loc = decodeLoc(f[1]);
+        cstring name = decodeName(f[3]);
+        u64 packed = decodeUint(f[4]);
+        bool isUnion = decodeUint(f[5]);
+        if (failed || f[6].type != MSGPACK_OBJECT_ARRAY) {
+            failed = true;
+            return nullptr;
+        }
+
+        auto thisType = makeThisType(table, name, flags);
+        auto node = makeStructDecl(
+            pool, &loc, decodeUint(f[2]), name, nullptr, nullptr, nullptr);
+        AstNodeList attrs = {};
+        for (u64 i = 0; i < packed; i++)
+            insertAstNode(&attrs,
+                          makeAttribute(pool, &loc, S_packed, NULL, NULL));
+        node->attrs = attrs.first;
+
+        std::vector<NamedTypeMember> members;
+        for (u32 i = 0; i < f[6].via.array.size; i++) {
+            auto field = fields(f[6].via.array.ptr[i], 6);
+            if (field == nullptr)
+                return nullptr;
+            auto fieldLoc = decodeLoc(field[0]);
+            auto type = decodeTypeRef(field[3]);
+            if (failed)
+                return nullptr;
+            auto fieldDecl = makeStructField(pool,
+                                             &fieldLoc,
+                                             decodeName(field[1]),
+                                             decodeUint(field[2]),
+                                             type,
+                                             nullptr,
+                                             nullptr);
+            fieldDecl->structField.bits = decodeUint(field[4]);
+            fieldDecl->structField.index = decodeUint(field[5]);
+            fieldDecl->type = type->type;
+            fieldDecl->parentScope = node;
+            members.push_back(
+                NamedTypeMember{.name = fieldDecl->structField.name,
+                                .type = fieldDecl->type,
+                                .decl = fieldDecl});
+        }
+        if (failed)
+            return nullptr;
+
+        if (isUnion) {
+            node->type = makeReplaceUntaggedUnionType(
+                table, node, members.data(), members.size());
+        }
+        else {
+            node->type = makeReplaceStructType(
+                table, name, members.data(), members.size(), node, flags);
+        }
+        const_cast<Type *>(thisType)->_this.that = node->type;
+        return node;
+    }
+
+    AstNode *decodeEnum(const msgpack_object *f)
+    {
+        auto loc = decodeLoc(f[1]);
+        cstring name = decodeName(f[3]);
+        auto base = decodeTypeRef(f[4]);
+        if (failed || f[6].type != MSGPACK_OBJECT_ARRAY) {
+            failed = true;
+            return nullptr;
+        }
+
+        AstNodeList options = {};
+        std::vector<EnumOptionDecl> members;
+        for (u32 i = 0; i < f[6].via.array.size; i++) {
+            auto option = fields(f[6].via.array.ptr[i], 4);
+            if (option == nullptr)
+                return nullptr;
+            auto optionLoc = decodeLoc(option[0]);
+            cstring optionName = decodeName(option[1]);
+            i64 value = decodeInt(option[3]);
+            insertAstNode(
+                &options,
+                makeEnumOptionAst(
+                    pool,
+                    &optionLoc,
+                    decodeUint(option[2]),
+                    optionName,
+                    makeIntegerLiteral(
+                        pool, &optionLoc, value, nullptr, base->type),
+                    nullptr,
+                    nullptr));
+            members.push_back(EnumOptionDecl{
+                .name = optionName, .value = value, .decl = options.last});
+        }
+        if (failed)
+            return nullptr;
+
+        auto node = makeEnumAst(pool,
+                                &loc,
+                                decodeUint(f[2]),
+                                name,
+                                base,
+                                options.first,
+                                nullptr,
+                                nullptr);
+        Type enum_ = {.tag = typEnum,
+                      .flags = decodeUint(f[5]),
+                      .name = name,
+                      .tEnum = {.base = base->type,
+                                .options = members.data(),
+                                .optionsCount = members.size(),
+                                .decl = node}};
+        node->type = makeEnum(table, &enum_);
+        for (AstNode *it = options.first; it; it = it->next)
+            it->type = node->type;
+        return node;
+    }
+
+    AstNode *decodeDeclaration(const msgpack_object &obj)
+    {
+        if (obj.type != MSGPACK_OBJECT_ARRAY || obj.via.array.size < 4 ||
+            !isUint(obj.via.array.ptr[0])) {
+            failed = true;
+            return nullptr;
+        }
+
+        const msgpack_object *f = obj.via.array.ptr;
+        u32 size = obj.via.array.size;
+        switch (f[0].via.u64) {
+        case astFuncDecl:
+            if (size == 8)
+                return decodeFunction(f);
+            break;
+        case astStructDecl:
+            if (size == 7)
+                return decodeStruct(f);
+            break;
+        case astTypeDecl: {
+            if (size != 6)
+                break;
+            auto loc = decodeLoc(f[1]);
+            auto aliased = decodeTypeRef(f[4]);
+            auto type = decodeType(f[5]);
+            if (failed)
+                return nullptr;
+            return makeTypeDeclAstNode(pool,
+                                       &loc,
+                                       decodeUint(f[2]),
+                                       decodeName(f[3]),
+                                       aliased,
+                                       NULL,
+                                       type);
+        }
+        case astVarDecl: {
+            if (size != 5)
+                break;
+            auto loc = decodeLoc(f[1]);
+            auto type = decodeTypeRef(f[4]);
+            if (failed)
+                return nullptr;
+            return makeVarDecl(pool,
+                               &loc,
+                               decodeUint(f[2]),
+                               decodeName(f[3]),
+                               type,
+                               nullptr,
+                               nullptr,
+                               type->type);
+        }
+        case astEnumDecl:
+            if (size == 7)
+                return decodeEnum(f);
+            break;
+        default:
+            break;
+        }
+        failed = true;
+        return nullptr;
+    }
+
+    void decodeItem(const msgpack_object &obj)
+    {
+        if (obj.type != MSGPACK_OBJECT_ARRAY || obj.via.array.size < 2 ||
+            !isUint(obj.via.array.ptr[0])) {
+            failed = true;
+            return;
+        }
+
+        const msgpack_object *f = obj.via.array.ptr;
+        u32 size = obj.via.array.size;
+        auto kind = (CHeaderRecording::Kind)f[0].via.u64;
+        switch (kind) {
+        case CHeaderRecording::Declaration: {
+            auto node = decodeDeclaration(f[1]);
+            if (node == nullptr || failed)
+                break;
+            recording->items.push_back({.kind = kind, .node = node});
+            return;
+        }
+        case CHeaderRecording::Macro:
+        case CHeaderRecording::QuietMacro: {
+            if (size != 5)
+                break;
+            auto loc = decodeLoc(f[1]);
+            auto body = decodeLiteral(f[4]);
+            cstring name = decodeString(f[3]);
+            if (failed || name == nullptr)
+                break;
+            auto macro = makeMacroDeclAstNode(
+                pool, &loc, decodeUint(f[2]), name, NULL, body, NULL);
+            recording->items.push_back({.kind = kind, .node = macro});
+            return;
+        }
+        case CHeaderRecording::MacroAlias: {
+            if (size != 4)
+                break;
+            auto loc = decodeLoc(f[1]);
+            cstring name = decodeString(f[2]), target = decodeString(f[3]);
+            if (failed || name == nullptr || target == nullptr)
+                break;
+            recording->items.push_back(
+                {.kind = kind, .loc = loc, .name = name, .target = target});
+            return;
+        }
+        default:
+            break;
+        }
+        failed = true;
+    }
+
+    MemPool *pool;
+    StrPool *strings;
+    TypeTable *table;
+    const msgpack_object_array &types;
+    CHeaderRecording *recording{nullptr};
+    std::unordered_map<std::string, cstring> anonymous{};
+    bool failed{false};
+};
+
+static void packString(msgpack_packer *packer, const std::string &str)
+{
+    msgpack_pack_str(packer, str.size());
+    msgpack_pack_str_body(packer, str.data(), str.size());
+}
+
+static bool isString(const msgpack_object &obj, const std::string &str)
+{
+    return obj.type == MSGPACK_OBJECT_STR && obj.via.str.size == str.size() &&
+           memcmp(obj.via.str.ptr, str.data(), str.size()) == 0;
+}
+
+bool cHeaderEncodeItems(msgpack_packer *packer,
+                        const CHeaderRecording &recording)
+{
+    CHeaderEncoder encoder;
+    if (!encoder.encode(recording))
+        return false;
+    encoder.write(packer);
+    return true;
+}
+
+bool cHeaderDecodeItems(MemPool *pool,
+                        StrPool *strings,
+                        TypeTable *table,
+                        const msgpack_object &types,
+                        const msgpack_object &items,
+                        CHeaderRecording &recording)
+{
+    if (types.type != MSGPACK_OBJECT_ARRAY ||
+        items.type != MSGPACK_OBJECT_ARRAY)
+        return false;
+    CHeaderDecoder decoder(pool, strings, table, types.via.array);
+    return decoder.decode(items.via.array, recording);
+}
+
+static cstring decodeCachedPath(CompilerDriver *driver,
+                                const msgpack_object &obj)
+{
+    if (obj.type != MSGPACK_OBJECT_STR)
+        return nullptr;
+    return makeStringSized(driver->strings, obj.via.str.ptr, obj.via.str.size);
+}
+
+static AstNode *buildCachedModules(CompilerDriver *driver,
+                                   const CHeaderRecording &recording,
+                                   const msgpack_object_array &paths,
+                                   const msgpack_object_array &includes,
+                                   cstring mainPath)
+{
+    std::unordered_map<std::string, AstNodeList> modules;
+    for (auto &item : recording.items) {
+        if (item.kind == CHeaderRecording::Declaration)
+            insertAstNode(
+                &modules[item.node->loc.fileName ?: "__c_builtins.cxy"],
+                item.node);
+    }
+
+    AstNode *mainModule = nullptr;
+    for (u32 i = 0; i < paths.size; i++) {
+        cstring path = decodeCachedPath(driver, paths.ptr[i]);
+        if (path == nullptr)
+            return nullptr;
+        auto nodes = modules.find(path);
+        auto program = buildCModule(
+            driver,
+            path,
+            nodes == modules.end() ? nullptr : nodes->second.first);
+        if (strcmp(path, mainPath) == 0)
+            mainModule = program;
+    }
+    if (mainModule == nullptr)
+        mainModule = buildCModule(driver, mainPath, nullptr);
+
+    for (u32 i = 0; i < includes.size; i++) {
+        const msgpack_object &entry = includes.ptr[i];
+        if (entry.type != MSGPACK_OBJECT_ARRAY || entry.via.array.size != 2 ||
+            entry.via.array.ptr[1].type != MSGPACK_OBJECT_ARRAY)
+            continue;
+        cstring path = decodeCachedPath(driver, entry.via.array.ptr[0]);
+        const msgpack_object_array &deps = entry.via.array.ptr[1].via.array;
+        std::vector<std::string> depPaths;
+        for (u32 j = 0; j < deps.size; j++) {
+            if (cstring dep = decodeCachedPath(driver, deps.ptr[j]))
+                depPaths.push_back(dep);
+        }
+        if (path)
+            linkCModuleIncludes(driver, path, depPaths);
+    }
+    return mainModule;
+}
+
+// A `[path, digest]` pair of the entered and reused arrays
+static bool isFileDigest(const msgpack_object &obj)
+{
+    return obj.type == MSGPACK_OBJECT_ARRAY && obj.via.array.size == 2 &&
+           obj.via.array.ptr[0].type == MSGPACK_OBJECT_STR &&
+           obj.via.array.ptr[1].type == MSGPACK_OBJECT_POSITIVE_INTEGER;
+}
+
+static void packFileDigests(msgpack_packer *packer,
+                            const std::vector<std::string> &paths,
+                            const CHeaderRecording &recording)
+{
+    msgpack_pack_array(packer, paths.size());
+    for (auto &path : paths) {
+        auto digest = recording.digests.find(path);
+        msgpack_pack_array(packer, 2);
+        packString(packer, path);
+        msgpack_pack_uint64(
+            packer, digest == recording.digests.end() ? 0 : digest->second);
+    }
+}
+
+std::vector<std::string> cHeaderCacheKey(CompilerDriver *driver,
+                                         const AstNode *node)
+{
+    if (driver->moduleCacheKey == 0)
+        return {};
+
+    auto &options = driver->options;
+    auto importer = (CImporter *)driver->cImporter;
+    std::vector<std::string> key = {
+        node->stringLiteral.value,
+        fs::path(node->loc.fileName).parent_path().string(),
+        importer->isAlpine ? "alpine" : "",
+        // clang can be upgraded without relinking the compiler, the
+        // predefined macros come with it
+        clang::getClangFullVersion(),
+        llvm::sys::getDefaultTargetTriple()};
+    auto append = [&key](const char *kind, DynArray &values) {
+        for (u64 i = 0; i < values.size; i++)
+            key.push_back(std::string(kind) +
+                          dynArrayAt(cstring *, &values, i));
+    };
+    append("cflag:", options.cflags);
+    append("include:", options.importSearchPaths);
+    append("framework:", options.frameworkSearchPaths);
+    append("define:", options.cDefines);
+    return key;
+}
+
+static AstNode *loadCachedHeader(CompilerDriver *driver,
+                                 const std::vector<std::string> &key,
+                                 const char *data,
+                                 size_t size)
+{
+    auto importer = (CImporter *)driver->cImporter;
+    size_t offset = 0;
+    AstNode *program = nullptr;
+    msgpack_unpacked msg;
+    msgpack_unpacked_init(&msg);
+
+    if (msgpack_unpack_next(&msg, data, size, &offset) !=
+            MSGPACK_UNPACK_SUCCESS ||
+        msg.data.type != MSGPACK_OBJECT_ARRAY || msg.data.via.array.size != 13)
+        goto loadCachedHeaderDone;
+
+    {
+        const msgpack_object *entry = msg.data.via.array.ptr;
+        if (!isString(entry[0], C_HEADER_CACHE_MAGIC) ||
+            entry[1].type != MSGPACK_OBJECT_POSITIVE_INTEGER ||
+            entry[1].via.u64 != driver->moduleCacheKey ||
+            entry[2].type != MSGPACK_OBJECT_ARRAY ||
+            entry[2].via.array.size != key.size() ||
+            entry[3].type != MSGPACK_OBJECT_STR)
+            goto loadCachedHeaderDone;
+        for (u32 i = 4; i < 13; i++) {
+            if (entry[i].type != MSGPACK_OBJECT_ARRAY)
+                goto loadCachedHeaderDone;
+        }
+
+        for (u32 i = 0; i < key.size(); i++) {
+            if (!isString(entry[2].via.array.ptr[i], key[i]))
+                goto loadCachedHeaderDone;
+        }
+
+        const msgpack_object_array &deps = entry[4].via.array;
+        for (u32 i = 0; i < deps.size; i++) {
+            if (!moduleCacheIsDependencyUnchanged(driver, &deps.ptr[i]))
+                goto loadCachedHeaderDone;
+        }
+
+        // A header created where clang looked for one before can shadow the
+        // file an include resolved to or flip a `__has_include`
+        const msgpack_object_array &missing = entry[12].via.array;
+        for (u32 i = 0; i < missing.size; i++) {
+            std::error_code error;
+            if (missing.ptr[i].type != MSGPACK_OBJECT_STR ||
+                fs::exists(fs::path(std::string(missing.ptr[i].via.str.ptr,
+                                                missing.ptr[i].via.str.size)),
+                           error))
+                goto loadCachedHeaderDone;
+        }
+
+        cstring mainPath = makeStringSized(driver->strings,
+                                           entry[3].via.str.ptr,
+                                           entry[3].via.str.size);
+        if ((program = importer->find(mainPath)))
+            goto loadCachedHeaderDone;
+
+        // Declarations of files the importer already had were not
+        // converted, they must still be and the others must not
+        const msgpack_object_array &lookups = entry[5].via.array;
+        for (u32 i = 0; i < lookups.size; i++) {
+            const msgpack_object &lookup = lookups.ptr[i];
+            if (lookup.type != MSGPACK_OBJECT_ARRAY ||
+                lookup.via.array.size != 2 ||
+                lookup.via.array.ptr[0].type != MSGPACK_OBJECT_STR ||
+                lookup.via.array.ptr[1].type != MSGPACK_OBJECT_BOOLEAN)
+                goto loadCachedHeaderDone;
+            auto path = std::string(lookup.via.array.ptr[0].via.str.ptr,
+                                    lookup.via.array.ptr[0].via.str.size);
+            if ((importer->find(path) != nullptr) !=
+                lookup.via.array.ptr[1].via.boolean)
+                goto loadCachedHeaderDone;
+        }
+
+        // Headers the conversion skipped because an earlier import of the
+        // same clang session had converted them must have been again, and
+        // left the macros the header saw
+        const msgpack_object_array &reused = entry[11].via.array;
+        for (u32 i = 0; i < reused.size; i++) {
+            if (!isFileDigest(reused.ptr[i]))
+                goto loadCachedHeaderDone;
+            const msgpack_object *file = reused.ptr[i].via.array.ptr;
+            auto digest = importer->findConverted(
+                llvm::StringRef(file[0].via.str.ptr, file[0].via.str.size));
+            if (digest == nullptr || *digest != file[1].via.u64)
+                goto loadCachedHeaderDone;
+        }
+
+        // Macros are only defined once the whole entry decoded, otherwise
+        // clang would define them again when converting the header
+        CHeaderRecording recording;
+        if (!cHeaderDecodeItems(driver->pool,
+                                driver->strings,
+                                driver->types,
+                                entry[6],
+                                entry[7],
+                                recording))
+            goto loadCachedHeaderDone;
+
+        printStatus(driver->L, cWHT "Loading cached %s..." cDEF, mainPath);
+        program = buildCachedModules(driver,
+                                     recording,
+                                     entry[8].via.array,
+                                     entry[9].via.array,
+                                     mainPath);
+        if (program == nullptr)
+            goto loadCachedHeaderDone;
+        defineCHeaderMacros(driver, recording);
+
+        const msgpack_object_array &entered = entry[10].via.array;
+        for (u32 i = 0; i < entered.size; i++) {
+            if (!isFileDigest(entered.ptr[i]))
+                continue;
+            const msgpack_object *file = entered.ptr[i].via.array.ptr;
+            importer->addConverted(
+                llvm::StringRef(file[0].via.str.ptr, file[0].via.str.size),
+                file[1].via.u64);
+        }
+    }
+
+loadCachedHeaderDone:
+    msgpack_unpacked_destroy(&msg);
+    return program;
+}
+
+AstNode *cHeaderCacheLoad(CompilerDriver *driver,
+                          const std::vector<std::string> &key)
+{
+    char cachePath[PATH_MAX];
+    size_t size = 0;
+
+    if (key.empty())
+        return nullptr;
+
+    getCachedHeaderPath(driver, cachePath, key);
+    char *data = readFile(cachePath, &size);
+    AstNode *program =
+        data ? loadCachedHeader(driver, key, data, size) : nullptr;
+    free(data);
+
+    if (program)
+        driver->stats.cHeaderCache.hits++;
+    else
+        driver->stats.cHeaderCache.misses++;
+    return program;
+}
+
+void cHeaderCacheStore(CompilerDriver *driver,
+                       const std::vector<std::string> &key,
+                       const CHeaderRecording &recording,
+                       cstring mainPath)
+{
+    char cachePath[PATH_MAX];
+    msgpack_sbuffer sbuf;
+    msgpack_packer packer;
+
+    if (key.empty() || driver->L->errorCount != recording.errors)
+        return;
+
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&packer, &sbuf, msgpack_sbuffer_write);
+    msgpack_pack_array(&packer, 13);
+    packString(&packer, C_HEADER_CACHE_MAGIC);
+    msgpack_pack_uint64(&packer, driver->moduleCacheKey);
+    msgpack_pack_array(&packer, key.size());
+    for (auto &part : key)
+        packString(&packer, part);
+    packString(&packer, mainPath);
+
+    msgpack_pack_array(&packer, recording.files.size());
+    for (auto &file : recording.files) {
+        if (!moduleCachePackDependency(&packer, file.c_str()))
+            goto cHeaderCacheStoreDone;
+    }
+
+    msgpack_pack_array(&packer, recording.lookups.size());
+    for (auto &[path, found] : recording.lookups) {
+        msgpack_pack_array(&packer, 2);
+        packString(&packer, path);
+        if (found)
+            msgpack_pack_true(&packer);
+        else
+            msgpack_pack_false(&packer);
+    }
+
+    if (!cHeaderEncodeItems(&packer, recording))
+        goto cHeaderCacheStoreDone;
+
+    msgpack_pack_array(&packer, recording.modules.size());
+    for (auto &path : recording.modules)
+        packString(&packer, path);
+
+    msgpack_pack_array(&packer, recording.includes.size());
+    for (auto &[path, includes] : recording.includes) {
+        msgpack_pack_array(&packer, 2);
+        packString(&packer, path);
+        msgpack_pack_array(&packer, includes.size());
+        for (auto &include : includes)
+            packString(&packer, include);
+    }
+
+    packFileDigests(&packer, recording.entered, recording);
+    packFileDigests(&packer, recording.reused, recording);
+    msgpack_pack_array(&packer, recording.missing.size());
+    for (auto &path : recording.missing)
+        packString(&packer, path);
+
+    getCachedHeaderPath(driver, cachePath, key);
+    moduleCacheWriteEntry(cachePath, sbuf.data, sbuf.size);
+
+cHeaderCacheStoreDone:
+    msgpack_sbuffer_destroy(&sbuf);
+}
+
+} // namespace cxy
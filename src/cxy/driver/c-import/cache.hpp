@@ -0,0 +1,116 @@
+#pragma once
+
+#include "driver/driver.h"
+
+#include "msgpack.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace cxy {
+
+/**
+ * Everything converting a C header produced and depended on, in the order
+ * it happened. Recorded by the importer while clang runs and stored in the
+ * build directory so that an unchanged header can be imported again by
+ * replaying it, without invoking clang.
+ */
+struct CHeaderRecording {
+    enum Kind {
+        Declaration, // added to the module of its file
+        Macro,       // defined, warning if it overrides another macro
+        QuietMacro,  // defined, silently overriding (unnamed enum constants)
+        MacroAlias,  // `#define name target`, resolved when replayed
+    };
+
+    struct Item {
+        Kind kind;
+        AstNode *node;
+        FileLoc loc;
+        cstring name;
+        cstring target;
+    };
+
+    u64 errors{0};
+    std::vector<Item> items{};
+    // Whether the importer already had a module for a file when the
+    // converter checked, declarations of imported files are skipped
+    std::map<std::string, bool> lookups{};
+    std::vector<std::string> files{};
+    // Names of the files clang entered, and of those it skipped because an
+    // earlier import sharing the clang session had already converted them
+    std::vector<std::string> entered{};
+    std::vector<std::string> reused{};
+    // Digests of the macros each entered or reused file left (see
+    // `CMacroEffects`), the macros of a reused file are those the header
+    // saw, they must not have changed when the entry is replayed
+    std::map<std::string, u64> digests{};
+    std::vector<std::string> modules{};
+    std::map<std::string, std::vector<std::string>> includes{};
+    // Paths clang looked for and did not find (search directories tried
+    // before the one an include resolved to, `__has_include` targets), a
+    // file created at any of them can change how the header is parsed
+    std::vector<std::string> missing{};
+};
+
+/**
+ * Defines the macros of the recording, in the order the header defined
+ * them
+ */
+void defineCHeaderMacros(CompilerDriver *driver,
+                         const CHeaderRecording &recording);
+
+/**
+ * Identifies the conversion of the given `import "header.h"` statement,
+ * it covers everything that can change which file the header resolves to
+ * and how clang preprocesses it (importer directory, search paths, cflags
+ * and defines, and the clang version and target which decide the
+ * predefined macros).
+ *
+ * @return The key, empty if the cache is disabled
+ */
+std::vector<std::string> cHeaderCacheKey(CompilerDriver *driver,
+                                         const AstNode *node);
+
+/**
+ * Imports the header from the cache if none of the files it included
+ * changed, none of the files it looked for appeared and the headers it
+ * reused from earlier imports still leave the same macros.
+ *
+ * @return The main module of the header, or NULL if there is no valid
+ *      entry for it
+ */
+AstNode *cHeaderCacheLoad(CompilerDriver *driver,
+                          const std::vector<std::string> &key);
+
+/**
+ * Writes the declarations and macros of the recording as the types and the
+ * items arrays of a cache entry.
+ *
+ * @return false if one of them cannot be cached
+ */
+bool cHeaderEncodeItems(msgpack_packer *packer,
+                        const CHeaderRecording &recording);
+
+/**
+ * Reads the arrays written by `cHeaderEncodeItems` back into the items of
+ * `recording`, creating the types they use in `table`. Nothing is defined
+ * or added to a module, the caller replays the items once all of them
+ * decoded.
+ *
+ * @return false if the arrays are malformed
+ */
+bool cHeaderDecodeItems(MemPool *pool,
+                        StrPool *strings,
+                        TypeTable *table,
+                        const msgpack_object &types,
+                        const msgpack_object &items,
+                        CHeaderRecording &recording);
+
+void cHeaderCacheStore(CompilerDriver *driver,
+                       const std::vector<std::string> &key,
+                       const CHeaderRecording &recording,
+                       cstring mainPath);
+
+} // namespace cxy
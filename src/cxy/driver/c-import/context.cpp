@@ -5,9 +5,15 @@
 #include "context.hpp"
 #include "import.hpp"
 
+#include "lang/frontend/defines.h"
 #include "lang/frontend/flag.h"
 #include "lang/frontend/ttable.h"
 
+#include <clang/Lex/HeaderSearch.h>
+#include <clang/Lex/MacroInfo.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/xxhash.h>
+
 #include <filesystem>
 
 namespace fs = std::filesystem;
@@ -16,11 +22,23 @@ namespace cxy {
 
 IncludeContext::IncludeContext(CompilerDriver *driver,
                                clang::CompilerInstance &ci)
-    : L{driver->L}, pool{driver->pool}, strings{driver->strings},
+    : driver{driver}, L{driver->L}, pool{driver->pool},
+      strings{driver->strings},
       types{driver->types}, preprocessor{&driver->preprocessor},
       target{ci.getTarget()}, SM{ci.getSourceManager()}, Ci{ci},
       importer{*((cxy::CImporter *)driver->cImporter)}
 {
+    recording.errors = L->errorCount;
+}
+
+void IncludeContext::reset()
+{
+    modules.clear();
+    recordsStack = {};
+    typeDeclName = nullptr;
+    incs.clear();
+    recording = {};
+    recording.errors = L->errorCount;
 }
 
 AstNodeList *IncludeContext::enterFile(clang::StringRef path)
@@ -43,70 +61,358 @@ void IncludeContext::addDeclaration(AstNode *node)
     auto path = clang::StringRef(node->loc.fileName ?: "__c_builtins.cxy");
     if (auto module = enterFile(path)) {
         insertAstNode(module, node);
+        recording.items.push_back({.kind = CHeaderRecording::Declaration,
+                                   .node = node});
     }
 }
 
+void IncludeContext::addMacro(AstNode *node, bool quiet)
+{
+    recording.items.push_back(
+        {.kind = quiet ? CHeaderRecording::QuietMacro : CHeaderRecording::Macro,
+         .node = node});
+}
+
+void IncludeContext::addMacroAlias(const FileLoc &loc,
+                                   cstring name,
+                                   cstring target)
+{
+    recording.items.push_back({.kind = CHeaderRecording::MacroAlias,
+                               .loc = loc,
+                               .name = name,
+                               .target = target});
+}
+
+void IncludeContext::addFile(clang::FileID fid, u64 digest)
+{
+    llvm::SmallString<1024> path;
+    auto name = SM.getFilename(SM.getLocForStartOfFile(fid));
+    if (name.empty())
+        return;
+    recording.entered.push_back(name.str());
+    recording.digests[name.str()] = digest;
+    if (!llvm::sys::fs::real_path(name, path))
+        recording.files.push_back(path.str().str());
+}
+
+void IncludeContext::addReusedFile(clang::FileID fid, u64 digest)
+{
+    auto name = SM.getFilename(SM.getLocForStartOfFile(fid));
+    if (name.empty())
+        return;
+    recording.reused.push_back(name.str());
+    recording.digests[name.str()] = digest;
+}
+
+bool IncludeContext::isImported(llvm::StringRef path)
+{
+    bool found = importer.find(path) != nullptr;
+    recording.lookups.emplace(path.str(), found);
+    return found;
+}
+
 AstNode *IncludeContext::buildModules(llvm::StringRef mainModulePath)
 {
     AstNode *mainModule = nullptr;
     for (auto &[path, nodes] : modules) {
-        auto program = buildModule(path, nodes);
+        auto program = buildCModule(driver, path, nodes.first);
+        recording.modules.push_back(path.str());
         if (path == mainModulePath)
             mainModule = program;
     }
-    if (mainModule == nullptr) {
-        AstNodeList decls = {nullptr};
-        mainModule = buildModule(mainModulePath, decls);
-    }
+    if (mainModule == nullptr)
+        mainModule = buildCModule(driver, mainModulePath, nullptr);
+
     // build dependency graph
     for (auto &[fid, deps] : incs) {
-        auto modulePathRef = SM.getFilename(SM.getLocForStartOfFile(fid));
-        auto module = importer.find(modulePathRef);
-        if (module == nullptr || module->type == NULL)
-            continue;
-        std::vector<const Type *> dependencyModules(deps.size());
-        for (auto &dep : deps) {
-            auto pathRef = SM.getFilename(SM.getLocForStartOfFile(dep));
-            if (auto depModule = importer.find(pathRef)) {
-                dependencyModules.push_back(depModule->type);
-            }
-        }
-        const Type **items = static_cast<const Type **>(allocFromMemPool(
-            pool, sizeof(const Type *) * dependencyModules.size()));
-        memcpy(items,
-               dependencyModules.data(),
-               sizeof(Type *) * dependencyModules.size());
-        Type *type = const_cast<Type *>(module->type);
-        type->module._incs.items = items;
-        type->module._incs.count = dependencyModules.size();
+        auto modulePath =
+            SM.getFilename(SM.getLocForStartOfFile(fid)).str();
+        auto &includes = recording.includes[modulePath];
+        for (auto &dep : deps)
+            includes.push_back(
+                SM.getFilename(SM.getLocForStartOfFile(dep)).str());
+        linkCModuleIncludes(driver, modulePath, includes);
     }
+    defineCHeaderMacros(driver, recording);
+
+    for (auto &name : recording.entered)
+        importer.addConverted(name, recording.digests[name]);
     return mainModule;
 }
 
-AstNode *IncludeContext::buildModule(llvm::StringRef path, AstNodeList &nodes)
+// The definition of a macro as hashed into digests, "" when undefined
+static std::string spellCMacro(clang::Preprocessor &pp,
+                               const clang::MacroInfo *info)
+{
+    if (info == nullptr)
+        return "";
+
+    std::string spelling = "#define";
+    if (info->isFunctionLike()) {
+        spelling += '(';
+        for (auto *param : info->params()) {
+            spelling += param->getName();
+            spelling += ',';
+        }
+        spelling += info->isVariadic() ? "...)" : ")";
+    }
+    for (auto &token : info->tokens()) {
+        spelling += ' ';
+        spelling += pp.getSpelling(token);
+    }
+    return spelling;
+}
+
+static void setCMacro(clang::Preprocessor &pp,
+                      clang::IdentifierInfo *name,
+                      clang::MacroInfo *info,
+                      clang::SourceLocation loc)
+{
+    if (info)
+        pp.appendDefMacroDirective(name, info, loc);
+    else
+        pp.appendMacroDirective(name, pp.AllocateUndefMacroDirective(loc));
+}
+
+void CMacroEffects::define(llvm::StringRef name, clang::MacroInfo *info)
+{
+    defines[name.str()] = info;
+}
+
+void CMacroEffects::test(llvm::StringRef name, clang::MacroInfo *info)
+{
+    auto key = name.str();
+    if (defines.find(key) == defines.end())
+        tested.emplace(key, info);
+}
+
+void CMacroEffects::include(const CMacroEffects &effects)
+{
+    for (auto &[name, info] : effects.tested)
+        test(name, info);
+    for (auto &[name, info] : effects.defines)
+        defines[name] = info;
+}
+
+u64 CMacroEffects::digest(clang::Preprocessor &pp) const
+{
+    std::string spelling;
+    for (auto &[name, info] : defines)
+        spelling += name + spellCMacro(pp, info) + '\n';
+    spelling += '\n';
+    for (auto &[name, info] : tested)
+        spelling += name + spellCMacro(pp, info) + '\n';
+    return llvm::xxh3_64bits(spelling);
+}
+
+void CHeaderMacros::enterFile(clang::FileID fid)
+{
+    frames.push_back({fid});
+    if (auto file = pp.getSourceManager().getFileEntryRefForID(fid)) {
+        auto it = entered.try_emplace(file->getUID(), Entered{*file, 0}).first;
+        it->second.count++;
+    }
+}
+
+u64 CHeaderMacros::exitFile(clang::FileID fid)
 {
-    FileLoc moduleLoc = {.fileName =
-                             makeStringSized(strings, path.data(), path.size()),
-                         .begin = {.row = 1, .col = 1, .byteOffset = 0},
-                         .end = {.row = 1, .col = 1, .byteOffset = 0}};
-    auto name = fs::path(path.data()).stem().string();
+    if (frames.size() < 2 || frames.back().fid != fid)
+        return 0;
+
+    auto frame = std::move(frames.back());
+    frames.pop_back();
+    frames.back().effects.include(frame.effects);
+    auto file = pp.getSourceManager().getFileEntryRefForID(fid);
+    if (!file)
+        return 0;
+    auto &fileEffects = effects[file->getUID()];
+    fileEffects = std::move(frame.effects);
+    return fileEffects.digest(pp);
+}
+
+u64 CHeaderMacros::replayFile(clang::FileEntryRef file,
+                              clang::SourceLocation loc)
+{
+    auto uid = file.getUID();
+    auto it = effects.find(uid);
+    if (it == effects.end() || includeOnce.find(uid) == includeOnce.end() ||
+        !replayed.insert(uid).second)
+        return 0;
+
+    auto &replay = it->second;
+    for (auto &[name, info] : replay.tested) {
+        auto current = pp.getMacroInfo(pp.getIdentifierInfo(name));
+        if (current != info &&
+            (current == nullptr || info == nullptr ||
+             !current->isIdenticalTo(*info, pp, true)))
+            stale = true;
+    }
+    for (auto &[name, info] : replay.defines) {
+        auto identifier = pp.getIdentifierInfo(name);
+        auto current = pp.getMacroInfo(identifier);
+        if (current == info)
+            continue;
+        save(identifier, current);
+        setCMacro(pp, identifier, info, loc);
+    }
+    frames.back().effects.include(replay);
+    return replay.digest(pp);
+}
+
+void CHeaderMacros::define(const clang::Token &name,
+                           clang::MacroInfo *previous,
+                           clang::MacroInfo *info)
+{
+    auto identifier = name.getIdentifierInfo();
+    save(identifier, previous);
+    frames.back().effects.define(identifier->getName(), info);
+}
+
+void CHeaderMacros::test(const clang::Token &name, clang::MacroInfo *info)
+{
+    frames.back().effects.test(name.getIdentifierInfo()->getName(), info);
+}
+
+void CHeaderMacros::endImport(clang::SourceLocation loc)
+{
+    for (auto &[identifier, previous] : saved) {
+        if (pp.getMacroInfo(identifier) != previous)
+            setCMacro(pp, identifier, previous, loc);
+    }
+
+    // A file entered more than once by an import is meant to be included
+    // again (e.g. assert.h), the next imports enter it again too
+    auto &headerSearch = pp.getHeaderSearchInfo();
+    for (auto &[uid, file] : entered) {
+        if (file.count == 1 && includeOnce.insert(uid).second)
+            headerSearch.MarkFileIncludeOnce(file.file);
+    }
+
+    frames.back().effects = {};
+    saved.clear();
+    entered.clear();
+    replayed.clear();
+    stale = false;
+}
+
+void CHeaderMacros::save(clang::IdentifierInfo *name,
+                         clang::MacroInfo *previous)
+{
+    saved.emplace(name, previous);
+}
+
+AstNode *buildCModule(CompilerDriver *driver,
+                      llvm::StringRef path,
+                      AstNode *decls)
+{
+    auto &importer = *((cxy::CImporter *)driver->cImporter);
+    FileLoc moduleLoc = {
+        .fileName = makeStringSized(driver->strings, path.data(), path.size()),
+        .begin = {.row = 1, .col = 1, .byteOffset = 0},
+        .end = {.row = 1, .col = 1, .byteOffset = 0}};
+    auto name = fs::path(path.str()).stem().string();
     auto program = makeProgramAstNode(
-        pool,
+        driver->pool,
         &moduleLoc,
         flgImportedModule | flgExtern,
-        makeModuleAstNode(pool,
-                          &loc,
-                          flgExtern,
-                          makeStringSized(strings, name.data(), name.size()),
-                          nullptr,
-                          nullptr),
+        makeModuleAstNode(
+            driver->pool,
+            &moduleLoc,
+            flgExtern,
+            makeStringSized(driver->strings, name.data(), name.size()),
+            nullptr,
+            nullptr),
         NULL,
-        nodes.first,
+        decls,
         NULL);
 
-    buildModuleType(types, program, false);
-    importer.add(path, program);
+    buildModuleType(driver->types, program, false);
+    importer.add(moduleLoc.fileName, program);
     return program;
 }
 
+void linkCModuleIncludes(CompilerDriver *driver,
+                         llvm::StringRef path,
+                         const std::vector<std::string> &includes)
+{
+    auto &importer = *((cxy::CImporter *)driver->cImporter);
+    auto module = importer.find(path);
+    if (module == nullptr || module->type == NULL)
+        return;
+
+    std::vector<const Type *> dependencyModules;
+    dependencyModules.reserve(includes.size());
+    for (auto &include : includes) {
+        if (auto depModule = importer.find(include))
+            dependencyModules.push_back(depModule->type);
+    }
+    const Type **items = static_cast<const Type **>(allocFromMemPool(
+        driver->pool, sizeof(const Type *) * dependencyModules.size()));
+    memcpy(items,
+           dependencyModules.data(),
+           sizeof(Type *) * dependencyModules.size());
+    Type *type = const_cast<Type *>(module->type);
+    type->module._incs.items = items;
+    type->module._incs.count = dependencyModules.size();
+}
+
+void defineCMacro(CompilerDriver *driver, AstNode *node, bool quiet)
+{
+    AstNode *previous = NULL;
+    if (preprocessorOverrideDefinedMacro(&driver->preprocessor,
+                                         node->macroDecl.name,
+                                         node,
+                                         &previous) ||
+        quiet) {
+        return;
+    }
+
+    if (isWarningEnabled(driver->L, CMacroRedefine)) {
+        logWarning(driver->L,
+                   &node->loc,
+                   "overriding macro with name '{s}' which was already defined",
+                   (FormatArg[]){{.s = node->macroDecl.name}});
+        if (previous && previous->loc.fileName != NULL) {
+            logNote(driver->L,
+                    &previous->loc,
+                    "macro previously declared here",
+                    NULL);
+        }
+    }
+}
+
+void defineCHeaderMacros(CompilerDriver *driver,
+                         const CHeaderRecording &recording)
+{
+    for (auto &item : recording.items) {
+        switch (item.kind) {
+        case CHeaderRecording::Macro:
+        case CHeaderRecording::QuietMacro:
+            defineCMacro(
+                driver, item.node, item.kind == CHeaderRecording::QuietMacro);
+            break;
+        case CHeaderRecording::MacroAlias:
+            aliasCMacro(driver, item.loc, item.name, item.target);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void aliasCMacro(CompilerDriver *driver,
+                 const FileLoc &loc,
+                 cstring name,
+                 cstring target)
+{
+    AstNode *value{nullptr};
+    if (!preprocessorHasMacro(&driver->preprocessor, target, &value))
+        return;
+
+    auto body = deepCloneAstNode(driver->pool, value->macroDecl.body);
+    auto macro = makeMacroDeclAstNode(
+        driver->pool, &loc, flgPublic | flgExtern, name, NULL, body, NULL);
+    defineCMacro(driver, macro, false);
+}
+
 } // namespace cxy
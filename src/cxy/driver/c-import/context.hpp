@@ -4,12 +4,21 @@
 
 #pragma once
 
+#include "cache.hpp"
+
 #include "driver/driver.h"
 
 #include <clang/Frontend/CompilerInstance.h>
+#include <clang/Lex/Preprocessor.h>
 #include <llvm/ADT/StringRef.h>
+#include <map>
+#include <set>
 #include <stack>
 
+namespace clang {
+class Parser;
+}
+
 namespace cxy {
 class CImporter;
 
@@ -21,8 +30,15 @@ struct IncludeContext {
     IncludeContext(CompilerDriver *driver, clang::CompilerInstance &ci);
 
     void addDeclaration(AstNode *node);
+    void addMacro(AstNode *node, bool quiet = false);
+    void addMacroAlias(const FileLoc &loc, cstring name, cstring target);
+    void addFile(clang::FileID fid, u64 digest);
+    void addReusedFile(clang::FileID fid, u64 digest);
+    bool isImported(llvm::StringRef path);
     AstNode *buildModules(llvm::StringRef mainModulePath);
+    void reset();
 
+    CompilerDriver *driver{nullptr};
     Log *L{nullptr};
     MemPool *pool{nullptr};
     StrPool *strings{nullptr};
@@ -37,9 +53,105 @@ struct IncludeContext {
     std::stack<CurrentRecord> recordsStack{};
     cstring typeDeclName{nullptr};
     std::map<clang::FileID, std::set<clang::FileID>> incs{};
+    CHeaderRecording recording{};
 
 private:
-    AstNode *buildModule(llvm::StringRef path, AstNodeList &nodes);
     AstNodeList *enterFile(clang::StringRef path);
 };
+
+/**
+ * The macros a C file, with the files it includes, leaves defined (NULL when
+ * it undefines them), and those it tests without having defined them with
+ * their definition on entry
+ */
+struct CMacroEffects {
+    std::map<std::string, clang::MacroInfo *> defines{};
+    std::map<std::string, clang::MacroInfo *> tested{};
+
+    void define(llvm::StringRef name, clang::MacroInfo *info);
+    void test(llvm::StringRef name, clang::MacroInfo *info);
+    // Adds the effects of a file included after everything recorded so far
+    void include(const CMacroEffects &effects);
+    // Hash of the spelling of the macros, stable across compilations
+    u64 digest(clang::Preprocessor &pp) const;
+};
+
+/**
+ * Keeps the imports parsed by a clang session from seeing each other's
+ * macros. Every import starts from the predefined macros, whatever it
+ * defines or undefines is reverted once it is parsed. The files it entered
+ * once are marked include-once since their include guards are reverted
+ * too, when a later import skips one of them the macros it left are defined
+ * again as if it had been parsed.
+ */
+class CHeaderMacros {
+public:
+    explicit CHeaderMacros(clang::Preprocessor &pp) : pp{pp} {}
+
+    void enterFile(clang::FileID fid);
+    /**
+     * @return The digest of the macros left by the file, 0 if it is not a
+     *      file on disk
+     */
+    u64 exitFile(clang::FileID fid);
+    /**
+     * Defines again the macros left by a file an earlier import entered
+     *
+     * @return The digest of the macros, 0 if the file was skipped because
+     *      of its include guard or was already replayed by this import
+     */
+    u64 replayFile(clang::FileEntryRef file, clang::SourceLocation loc);
+    void define(const clang::Token &name,
+                clang::MacroInfo *previous,
+                clang::MacroInfo *info);
+    void test(const clang::Token &name, clang::MacroInfo *info);
+    // Reverts the macros of the import and marks the files it entered once
+    void endImport(clang::SourceLocation loc);
+
+    // A replayed file tested a macro that did not have the same definition
+    // as when it was parsed, the import must be parsed again in a new session
+    bool stale{false};
+
+private:
+    struct Frame {
+        clang::FileID fid;
+        CMacroEffects effects{};
+    };
+    struct Entered {
+        clang::FileEntryRef file;
+        u32 count;
+    };
+
+    void save(clang::IdentifierInfo *name, clang::MacroInfo *previous);
+
+    clang::Preprocessor &pp;
+    std::vector<Frame> frames{};
+    // Effects of the files of the session, by file UID
+    std::map<unsigned, CMacroEffects> effects{};
+    std::set<unsigned> includeOnce{};
+    // Definitions the macros touched by the current import had before it
+    std::map<clang::IdentifierInfo *, clang::MacroInfo *> saved{};
+    std::map<unsigned, Entered> entered{};
+    std::set<unsigned> replayed{};
+};
+
+/**
+ * A clang instance parsing the C headers imported by the modules of a
+ * directory into the same translation unit, one `#include` at a time.
+ * Headers shared by several imports (e.g. stddef.h) are only parsed by the
+ * first one, the others skip them and only get their macros back.
+ */
+struct CHeaderSession {
+    CHeaderSession(CompilerDriver *driver, llvm::StringRef dir);
+    ~CHeaderSession();
+
+    // Paths the file manager looked up and did not find, it remembers the
+    // failures so every import depends on all of them
+    std::set<std::string> missing{};
+    clang::CompilerInstance ci{};
+    std::unique_ptr<IncludeContext> context{};
+    std::unique_ptr<CHeaderMacros> macros{};
+    std::unique_ptr<clang::Parser> parser{};
+    u32 inputs{0};
+};
 } // namespace cxy
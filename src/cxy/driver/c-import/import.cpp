@@ -3,6 +3,7 @@
 //
 
 #include "import.hpp"
+#include "cache.hpp"
 #include "context.hpp"
 
 #include "core/alloc.h"
@@ -24,14 +25,17 @@
 #include <clang/Basic/TargetInfo.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Lex/HeaderSearch.h>
+#include <clang/Lex/MacroInfo.h>
 #include <clang/Lex/Preprocessor.h>
 #include <clang/Lex/PreprocessorOptions.h>
 #include <clang/Parse/ParseAST.h>
+#include <clang/Parse/Parser.h>
 #include <clang/Sema/Sema.h>
 #include <llvm/ADT/StringRef.h>
 #include <llvm/Support/ErrorHandling.h>
 #include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Path.h>
+#include <llvm/Support/VirtualFileSystem.h>
 #include <llvm/TargetParser/Host.h>
 #pragma warning(pop)
 
@@ -564,8 +568,7 @@ void unnamedEnumToCxy(IncludeContext &ctx,
                                           NULL,
                                           expr,
                                           NULL);
-        preprocessorOverrideDefinedMacro(
-            ctx.preprocessor, memberName, macro, NULL);
+        ctx.addMacro(macro, true);
     }
 }
 
@@ -634,7 +637,7 @@ struct CToCxyConverter : clang::ASTConsumer {
     {
         for (clang::Decl *decl : declGroup) {
             auto loc = ctx.SM.getPresumedLoc(decl->getLocation());
-            if (ctx.importer.find(loc.getFilename()))
+            if (ctx.isImported(loc.getFilename()))
                 continue;
 
             switch (decl->getKind()) {
@@ -670,20 +673,46 @@ private:
     IncludeContext &ctx;
 };
 
+// The definition a macro directive leaves, NULL if undefined
+static clang::MacroInfo *definedBy(const clang::MacroDirective *directive)
+{
+    if (directive == nullptr)
+        return nullptr;
+    auto definition = directive->getDefinition();
+    if (!definition.isValid() || definition.isUndefined())
+        return nullptr;
+    return definition.getDirective()->getInfo();
+}
+
 struct MacroImporter : clang::PPCallbacks {
     MacroImporter(IncludeContext &ctx,
+                  CHeaderMacros &macros,
                   clang::CompilerInstance &compilerInstance)
-        : ctx(ctx), compilerInstance(compilerInstance)
+        : ctx(ctx), macros(macros), compilerInstance(compilerInstance)
     {
     }
 
+    using clang::PPCallbacks::Elifdef;
+    using clang::PPCallbacks::Elifndef;
+
     void LexedFileChanged(clang::FileID FID,
                           LexedFileChangeReason Reason,
                           clang::SrcMgr::CharacteristicKind FileType,
                           clang::FileID PrevFID,
                           clang::SourceLocation Loc) override
     {
-        if (Reason == LexedFileChangeReason::EnterFile && PrevFID.isValid()) {
+        if (Reason == LexedFileChangeReason::ExitFile) {
+            ctx.addFile(PrevFID, macros.exitFile(PrevFID));
+            return;
+        }
+
+        macros.enterFile(FID);
+        if (auto file = ctx.SM.getFileEntryRefForID(FID)) {
+            ctx.driver->stats.cHeaders.parsedFiles++;
+            ctx.driver->stats.cHeaders.parsedBytes += file->getSize();
+        }
+        // headers are included from memory buffers by the session
+        if (PrevFID.isValid() && ctx.SM.getFileEntryRefForID(PrevFID)) {
             if (ctx.incs.find(PrevFID) == ctx.incs.end()) {
                 ctx.incs[PrevFID] = {};
             }
@@ -693,13 +722,33 @@ struct MacroImporter : clang::PPCallbacks {
         }
     }
 
+    void FileSkipped(const clang::FileEntryRef &file,
+                     const clang::Token &fileNameToken,
+                     clang::SrcMgr::CharacteristicKind FileType) override
+    {
+        auto FID = ctx.SM.translateFile(file);
+        if (FID.isInvalid())
+            return;
+
+        if (auto digest = macros.replayFile(file, fileNameToken.getLocation())) {
+            ctx.addReusedFile(FID, digest);
+            ctx.driver->stats.cHeaders.reusedFiles++;
+            ctx.driver->stats.cHeaders.reusedBytes += file.getSize();
+        }
+        auto includer = ctx.SM.getFileID(
+            ctx.SM.getExpansionLoc(fileNameToken.getLocation()));
+        if (ctx.SM.getFileEntryRefForID(includer))
+            ctx.incs[includer].insert(FID);
+    }
+
     void MacroDefined(const clang::Token &name,
                       const clang::MacroDirective *macro) final override
     {
+        addDefinition(name, definedBy(macro->getPrevious()), definedBy(macro));
         if (macro->getMacroInfo()->getNumTokens() != 1)
             return;
         auto loc = ctx.SM.getPresumedLoc(name.getLocation());
-        if (ctx.importer.find(loc.getFilename()))
+        if (ctx.isImported(loc.getFilename()))
             return;
 
         auto &token = macro->getMacroInfo()->getReplacementToken(0);
@@ -725,28 +774,83 @@ struct MacroImporter : clang::PPCallbacks {
         }
     }
 
+    void MacroUndefined(const clang::Token &name,
+                        const clang::MacroDefinition &macro,
+                        const clang::MacroDirective *) override
+    {
+        addDefinition(name, macro.getMacroInfo(), nullptr);
+    }
+
+    // A file replayed into a later import must see the macros it tests and
+    // expands as they were when it was parsed
+    void MacroExpands(const clang::Token &name,
+                      const clang::MacroDefinition &macro,
+                      clang::SourceRange,
+                      const clang::MacroArgs *) override
+    {
+        macros.test(name, macro.getMacroInfo());
+    }
+
+    void Defined(const clang::Token &name,
+                 const clang::MacroDefinition &macro,
+                 clang::SourceRange) override
+    {
+        macros.test(name, macro.getMacroInfo());
+    }
+
+    void Ifdef(clang::SourceLocation,
+               const clang::Token &name,
+               const clang::MacroDefinition &macro) override
+    {
+        macros.test(name, macro.getMacroInfo());
+    }
+
+    void Ifndef(clang::SourceLocation,
+                const clang::Token &name,
+                const clang::MacroDefinition &macro) override
+    {
+        macros.test(name, macro.getMacroInfo());
+    }
+
+    void Elifdef(clang::SourceLocation,
+                 const clang::Token &name,
+                 const clang::MacroDefinition &macro) override
+    {
+        macros.test(name, macro.getMacroInfo());
+    }
+
+    void Elifndef(clang::SourceLocation,
+                  const clang::Token &name,
+                  const clang::MacroDefinition &macro) override
+    {
+        macros.test(name, macro.getMacroInfo());
+    }
+
 private:
+    // Predefined macros are the state every import starts from
+    void addDefinition(const clang::Token &name,
+                       clang::MacroInfo *previous,
+                       clang::MacroInfo *info)
+    {
+        auto &pp = compilerInstance.getPreprocessor();
+        if (ctx.SM.getFileID(ctx.SM.getExpansionLoc(name.getLocation())) !=
+            pp.getPredefinesFileID())
+            macros.define(name, previous, info);
+    }
+
     void importMacroCall(llvm::StringRef name,
                          const clang::Token &token,
                          FilePos start)
     {
-        AstNode *value{nullptr};
         auto identifier = token.getIdentifierInfo()->getName();
-        auto variable =
-            makeStringSized(ctx.strings, identifier.data(), identifier.size());
-        if (preprocessorHasMacro(ctx.preprocessor, variable, &value)) {
-            auto loc = toCxy(ctx, token);
-            loc.begin = start;
-            auto macro = makeMacroDeclAstNode(
-                ctx.pool,
-                &loc,
-                flgPublic | flgExtern,
-                makeStringSized(ctx.strings, name.data(), name.size()),
-                NULL,
-                deepCloneAstNode(ctx.pool, value->macroDecl.body),
-                NULL);
-            defineMacro(macro);
-        }
+        auto loc = toCxy(ctx, token);
+        loc.begin = start;
+        // Recorded even if the target is not defined, it is looked up again
+        // when the header is imported from the cache
+        ctx.addMacroAlias(
+            loc,
+            makeStringSized(ctx.strings, name.data(), name.size()),
+            makeStringSized(ctx.strings, identifier.data(), identifier.size()));
     }
 
     void importMacroConstant(llvm::StringRef name,
@@ -773,7 +877,7 @@ private:
                 makeIntegerLiteral(
                     ctx.pool, &valueLoc, value.getSExtValue(), NULL, type),
                 NULL);
-            defineMacro(macro);
+            ctx.addMacro(macro);
         }
         else if (auto *floatLiteral =
                      llvm::dyn_cast<clang::FloatingLiteral>(parsed)) {
@@ -788,7 +892,7 @@ private:
                 makeFloatLiteral(
                     ctx.pool, &valueLoc, value.convertToDouble(), NULL, type),
                 NULL);
-            defineMacro(macro);
+            ctx.addMacro(macro);
         }
     }
 
@@ -816,36 +920,13 @@ private:
                 NULL,
                 makeStringLiteral(ctx.pool, &valueLoc, value, NULL, type),
                 NULL);
-            defineMacro(macro);
-        }
-    }
-
-    void defineMacro(AstNode *node)
-    {
-        AstNode *previous = NULL;
-        if (preprocessorOverrideDefinedMacro(
-                ctx.preprocessor, node->macroDecl.name, node, &previous)) //
-        {
-            return;
-        }
-
-        if (isWarningEnabled(ctx.L, CMacroRedefine)) {
-            logWarning(
-                ctx.L,
-                &node->loc,
-                "overriding macro with name '{s}' which was already defined",
-                (FormatArg[]){{.s = node->macroDecl.name}});
-            if (previous && previous->loc.fileName != NULL) {
-                logNote(ctx.L,
-                        &previous->loc,
-                        "macro previously declared here",
-                        NULL);
-            }
+            ctx.addMacro(macro);
         }
     }
 
 private:
     IncludeContext &ctx;
+    CHeaderMacros &macros;
     clang::CompilerInstance &compilerInstance;
 };
 
@@ -889,14 +970,59 @@ static std::string removeSDKVersion(clang::StringRef path)
     return str;
 }
 
-AstNode *importCHeader(CompilerDriver *driver, const AstNode *node)
+namespace {
+/**
+ * Records the paths the file manager fails to find while clang looks for
+ * headers, the cache entries of the imports depend on them not existing
+ */
+class MissingFilesRecorder : public llvm::vfs::ProxyFileSystem {
+public:
+    MissingFilesRecorder(llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs,
+                         std::set<std::string> &missing)
+        : ProxyFileSystem(std::move(fs)), missing(missing)
+    {
+    }
+
+    llvm::ErrorOr<llvm::vfs::Status> status(const llvm::Twine &path) override
+    {
+        auto result = ProxyFileSystem::status(path);
+        if (!result)
+            addMissing(path, result.getError());
+        return result;
+    }
+
+    llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead(
+        const llvm::Twine &path) override
+    {
+        auto result = ProxyFileSystem::openFileForRead(path);
+        if (!result)
+            addMissing(path, result.getError());
+        return result;
+    }
+
+private:
+    void addMissing(const llvm::Twine &path, std::error_code error)
+    {
+        if (error != std::errc::no_such_file_or_directory &&
+            error != std::errc::not_a_directory)
+            return;
+        llvm::SmallString<1024> absolute;
+        path.toVector(absolute);
+        llvm::sys::fs::make_absolute(absolute);
+        missing.emplace(absolute.str().str());
+    }
+
+    std::set<std::string> &missing;
+};
+} // namespace
+
+cxy::CHeaderSession::CHeaderSession(CompilerDriver *driver,
+                                    llvm::StringRef dir)
 {
     auto importer = (cxy::CImporter *)driver->cImporter;
-    cstring importerPath = node->loc.fileName;
-    cstring headerName = node->stringLiteral.value;
     auto &options = driver->options;
-    clang::CompilerInstance ci;
-    ci.createFileManager();
+    ci.createFileManager(llvm::makeIntrusiveRefCnt<MissingFilesRecorder>(
+        llvm::vfs::getRealFileSystem(), missing));
     ci.createDiagnostics(ci.getFileManager().getVirtualFileSystem());
     auto args =
         map<cstring, cstring>(options.cflags, [](auto cflag) { return cflag; });
@@ -910,28 +1036,23 @@ AstNode *importCHeader(CompilerDriver *driver, const AstNode *node)
         clang::TargetInfo::CreateTargetInfo(ci.getDiagnostics(), *pto);
     ci.setTarget(targetInfo);
     ci.createSourceManager(ci.getFileManager());
-    ci.getHeaderSearchOpts().AddPath(llvm::sys::path::parent_path(importerPath),
-                                     clang::frontend::Quoted,
-                                     false,
-                                     true);
-
-    cxy::IncludeContext context(driver, ci);
+    ci.getHeaderSearchOpts().AddPath(dir, clang::frontend::Quoted, false, true);
 
-    for_each<cstring>(options.importSearchPaths, [&ci](auto path) {
+    for_each<cstring>(options.importSearchPaths, [this](auto path) {
         ci.getHeaderSearchOpts().AddPath(
             path, clang::frontend::System, false, true);
         ci.getHeaderSearchOpts().AddPath(
             path, clang::frontend::System, false, false);
     });
 
-    for_each<cstring>(options.frameworkSearchPaths, [&ci](auto path) {
+    for_each<cstring>(options.frameworkSearchPaths, [this](auto path) {
         ci.getHeaderSearchOpts().AddPath(
             path, clang::frontend::System, true, true);
         ci.getHeaderSearchOpts().AddPath(
             path, clang::frontend::System, true, false);
     });
 
-    for_each<cstring>(options.cDefines, [&ci](auto define) {
+    for_each<cstring>(options.cDefines, [this](auto define) {
         ci.getPreprocessorOpts().addMacroDef(&define[2]);
     });
 
@@ -950,26 +1071,88 @@ AstNode *importCHeader(CompilerDriver *driver, const AstNode *node)
     // prevent a warning that comes when importing C headers
     ci.getPreprocessorOpts().addMacroDef("__GNUC__=4");
 
-    ci.createPreprocessor(clang::TU_Complete);
+    ci.createPreprocessor(clang::TU_Incremental);
     auto &pp = ci.getPreprocessor();
+    pp.enableIncrementalProcessing();
     pp.getBuiltinInfo().initializeBuiltins(pp.getIdentifierTable(),
                                            pp.getLangOpts());
 
-    clang::HeaderSearch &headerSearch =
-        ci.getPreprocessor().getHeaderSearchInfo();
-    auto fileEntry = headerSearch.LookupFile(headerName,
-                                             {},
-                                             false,
-                                             nullptr,
-                                             nullptr,
-                                             {},
-                                             nullptr,
-                                             nullptr,
-                                             nullptr,
-                                             nullptr,
-                                             nullptr,
-                                             nullptr);
+    context = std::make_unique<IncludeContext>(driver, ci);
+    macros = std::make_unique<CHeaderMacros>(pp);
+    ci.setASTConsumer(std::make_unique<CToCxyConverter>(*context));
+    ci.createASTContext();
+    ci.createSema(clang::TU_Incremental, nullptr);
+    pp.addPPCallbacks(std::make_unique<MacroImporter>(*context, *macros, ci));
+
+    // The translation unit starts empty, each imported header is included
+    // into it from a buffer of its own
+    auto &SM = ci.getSourceManager();
+    SM.setMainFileID(SM.createFileID(
+        llvm::MemoryBuffer::getMemBufferCopy("", "<c imports>")));
+    ci.getDiagnosticClient().BeginSourceFile(ci.getLangOpts(), &pp);
+    parser = std::make_unique<clang::Parser>(pp, ci.getSema(), false);
+    pp.EnterMainSourceFile();
+    parser->Initialize();
+    ci.getASTConsumer().Initialize(ci.getASTContext());
+
+    // builtin macros are defined as the predefines get parsed, they are
+    // recorded by the first import and reused by the others
+    for (auto &name : context->recording.entered)
+        importer->addConverted(name, context->recording.digests[name]);
+}
+
+cxy::CHeaderSession::~CHeaderSession()
+{
+    parser.reset();
+    ci.getDiagnosticClient().EndSourceFile();
+    ci.getDiagnosticClient().finish();
+}
+
+cxy::CImporter::CImporter(bool isAlpine) : isAlpine(isAlpine) {}
+
+cxy::CImporter::~CImporter() = default;
+
+static clang::OptionalFileEntryRef findCHeader(clang::CompilerInstance &ci,
+                                               cstring headerName)
+{
+    return ci.getPreprocessor().getHeaderSearchInfo().LookupFile(headerName,
+                                                                 {},
+                                                                 false,
+                                                                 nullptr,
+                                                                 nullptr,
+                                                                 {},
+                                                                 nullptr,
+                                                                 nullptr,
+                                                                 nullptr,
+                                                                 nullptr,
+                                                                 nullptr,
+                                                                 nullptr);
+}
+
+static AstNode *parseCHeader(CompilerDriver *driver,
+                             const AstNode *node,
+                             const std::vector<std::string> &cacheKey)
+{
+    auto importer = (cxy::CImporter *)driver->cImporter;
+    cstring importerPath = node->loc.fileName;
+    cstring headerName = node->stringLiteral.value;
+    auto dir = llvm::sys::path::parent_path(importerPath).str();
+    auto &slot = importer->sessions[dir];
+    bool isNewSession = slot == nullptr;
+    if (isNewSession)
+        slot = std::make_unique<cxy::CHeaderSession>(driver, dir);
+    auto &session = *slot;
+    auto &ci = session.ci;
+    auto &pp = ci.getPreprocessor();
+    auto &context = *session.context;
+    if (!isNewSession) {
+        context.reset();
+        context.addReusedFile(pp.getPredefinesFileID(), 0);
+    }
+
+    auto fileEntry = findCHeader(ci, headerName);
     if (!fileEntry) {
+        clang::HeaderSearch &headerSearch = pp.getHeaderSearchInfo();
         std::string searchDirs;
         for (auto searchDir = headerSearch.search_dir_begin(),
                   end = headerSearch.search_dir_end();
@@ -995,30 +1178,66 @@ AstNode *importCHeader(CompilerDriver *driver, const AstNode *node)
     if (auto module = importer->find(requestPath))
         return module;
 
-    ci.setASTConsumer(std::make_unique<cxy::CToCxyConverter>(context));
-    ci.createASTContext();
-    ci.createSema(clang::TU_Complete, nullptr);
-    pp.addPPCallbacks(std::make_unique<cxy::MacroImporter>(context, ci));
-
-    auto fileID = ci.getSourceManager().createFileID(
-        *fileEntry, clang::SourceLocation(), clang::SrcMgr::C_System);
-    ci.getSourceManager().setMainFileID(fileID);
-    ci.getDiagnosticClient().BeginSourceFile(ci.getLangOpts(),
-                                             &ci.getPreprocessor());
-    clang::ParseAST(
-        ci.getPreprocessor(), &ci.getASTConsumer(), ci.getASTContext());
-    ci.getDiagnosticClient().EndSourceFile();
-    ci.getDiagnosticClient().finish();
+    // Include the header into the session's translation unit, files shared
+    // with previous imports are skipped and only their macros replayed
+    auto &SM = ci.getSourceManager();
+    auto errors = ci.getDiagnosticClient().getNumErrors();
+    auto input = "#include \"" + fileEntry->getName().str() + "\"\n";
+    auto loc = SM.getLocForStartOfFile(SM.getMainFileID())
+                   .getLocWithOffset(++session.inputs);
+    auto fileID = SM.createFileID(
+        llvm::MemoryBuffer::getMemBufferCopy(
+            input, std::string("<import ") + headerName + ">"),
+        clang::SrcMgr::C_User,
+        0,
+        0,
+        loc);
+    pp.EnterSourceFile(fileID, nullptr, loc);
+
+    auto &parser = *session.parser;
+    if (parser.getCurToken().is(clang::tok::annot_repl_input_end))
+        parser.ConsumeAnyToken();
+    clang::Parser::DeclGroupPtrTy decls;
+    clang::Sema::ModuleImportState importState;
+    for (bool atEnd = parser.ParseFirstTopLevelDecl(decls, importState);
+         !atEnd;
+         atEnd = parser.ParseTopLevelDecl(decls, importState)) {
+        if (decls)
+            ci.getASTConsumer().HandleTopLevelDecl(decls.get());
+    }
 
-    if (ci.getDiagnosticClient().getNumErrors() > 0) {
+    if (ci.getDiagnosticClient().getNumErrors() > errors) {
+        // the translation unit is left broken, start over on the next import
+        importer->sessions.erase(dir);
         return NULL;
     }
 
+    bool stale = session.macros->stale;
+    session.macros->endImport(loc);
+    if (stale) {
+        // A file shared with an earlier import was parsed with other
+        // feature macros, the header needs a session of its own
+        importer->sessions.erase(dir);
+        return parseCHeader(driver, node, cacheKey);
+    }
+
     auto program = context.buildModules(requestPath);
     csAssert(program != nullptr, "Something broken with c importer");
+    context.recording.missing.assign(session.missing.begin(),
+                                     session.missing.end());
+    cxy::cHeaderCacheStore(
+        driver, cacheKey, context.recording, program->loc.fileName);
     return program;
 }
 
+AstNode *importCHeader(CompilerDriver *driver, const AstNode *node)
+{
+    auto cacheKey = cxy::cHeaderCacheKey(driver, node);
+    if (auto program = cxy::cHeaderCacheLoad(driver, cacheKey))
+        return program;
+    return parseCHeader(driver, node, cacheKey);
+}
+
 bool isCHeaderFile(cstring filePath)
 {
     return fs::path(filePath).extension() == ".h";
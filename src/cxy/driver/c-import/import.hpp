@@ -9,14 +9,20 @@
 #include <clang/Basic/TargetInfo.h>
 #include <llvm/ADT/DenseMap.h>
 
-#include <set>
+#include <map>
+#include <memory>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 namespace cxy {
+struct CHeaderSession;
+
 class CImporter {
 public:
     const bool isAlpine{false};
-    CImporter(bool isAlpine = false) : isAlpine(isAlpine) {}
+    CImporter(bool isAlpine = false);
+    ~CImporter();
 
     AstNode *find(clang::StringRef path)
     {
@@ -29,7 +35,55 @@ public:
         modules.try_emplace(path, module);
     }
 
+    /**
+     * The digest of the macros left by the given file (see `CMacroEffects`)
+     * if its contents (macros included) were already converted during this
+     * compilation, either by clang or from the cache, NULL otherwise
+     */
+    const u64 *findConverted(clang::StringRef path) const
+    {
+        auto file = converted.find(path.str());
+        return file == converted.end() ? nullptr : &file->second;
+    }
+
+    void addConverted(clang::StringRef path, u64 digest)
+    {
+        converted.emplace(path.str(), digest);
+    }
+
+    // One per directory of the modules importing C headers, it is searched
+    // first for quoted includes. Created on the first header of the
+    // directory that has to be parsed, shared by the headers parsed after it
+    std::map<std::string, std::unique_ptr<CHeaderSession>> sessions;
+
 private:
     std::unordered_map<std::string_view, AstNode *> modules{};
+    std::map<std::string, u64> converted{};
 };
+
+/**
+ * Wraps the declarations converted from the header at `path` into an
+ * imported module and registers it with the importer
+ */
+AstNode *buildCModule(CompilerDriver *driver,
+                      clang::StringRef path,
+                      AstNode *decls);
+
+/**
+ * Makes lookups in the module of the header at `path` fall through to the
+ * modules of the headers it includes
+ */
+void linkCModuleIncludes(CompilerDriver *driver,
+                         clang::StringRef path,
+                         const std::vector<std::string> &includes);
+
+void defineCMacro(CompilerDriver *driver, AstNode *node, bool quiet);
+
+/**
+ * Imports `#define name target` as a copy of the `target` macro, if defined
+ */
+void aliasCMacro(CompilerDriver *driver,
+                 const FileLoc &loc,
+                 cstring name,
+                 cstring target);
 } // namespace cxy
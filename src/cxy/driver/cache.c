@@ -0,0 +1,609 @@
+#include "cache.h"
+#include "cc.h"
+
+#include "core/log.h"
+#include "core/utils.h"
+
+#include "lang/frontend/codec.h"
+#include "lang/frontend/defines.h"
+#include "lang/frontend/flag.h"
+
+#include "msgpack.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bump whenever the layout of a cache entry or the AST encoding changes
+#define MODULE_CACHE_MAGIC "cxy-ast-1"
+
+typedef enum {
+    mceInclude,
+    mceNativeSource,
+    mceLinkLibrary,
+    mceMacroQuery,
+    mceImport,
+} ModuleCacheEventKind;
+
+typedef struct {
+    ModuleCacheEventKind kind;
+    cstring name;
+    cstring value;
+    u64 row;
+    u64 col;
+    HashCode hash;
+    bool flag;
+} ModuleCacheEvent;
+
+/**
+ * A cached module is replayed in phases so that nothing observable happens
+ * before the entry is known to be valid, a stale entry falls back to a
+ * fresh parse which must not find the entry's side effects applied.
+ */
+typedef enum {
+    // validate the event, evaluate macro queries
+    mrpCheck,
+    // validate the event only, a macro query preceded by an import depends
+    // on the macros that import defines
+    mrpValidate,
+    // compile nested imports, evaluate the macro queries that follow them
+    mrpImport,
+    // add native sources and link libraries
+    mrpApply,
+} ModuleReplayPhase;
+
+static bool compareDependencies(const void *lhs, const void *rhs)
+{
+    return strcmp(*((cstring *)lhs), *((cstring *)rhs)) == 0;
+}
+
+static void getCachedAstPath(CompilerDriver *driver,
+                             char *buf,
+                             cstring path,
+                             bool testMode)
+{
+    snprintf(buf,
+             PATH_MAX,
+             "%s/cache/%08x%s.ast",
+             driver->options.buildDir,
+             hashStr(hashInit(), path),
+             testMode ? "-test" : "");
+}
+
+static bool hashFileContents(cstring path, HashCode *hash)
+{
+    size_t size = 0;
+    char *data = readFile(path, &size);
+    if (data == NULL)
+        return false;
+    *hash = hashRawBytes(hashInit(), data, size);
+    free(data);
+    return true;
+}
+
+static bool hashAstNode(const AstNode *node, HashCode *hash)
+{
+    if (node == NULL) {
+        *hash = 0;
+        return true;
+    }
+
+    msgpack_sbuffer sbuf;
+    msgpack_sbuffer_init(&sbuf);
+    bool status = binaryEncodeAstNode(&sbuf, node, NULL);
+    if (status)
+        *hash = hashRawBytes(hashInit(), sbuf.data, sbuf.size);
+    msgpack_sbuffer_destroy(&sbuf);
+    return status;
+}
+
+static inline bool isModuleCacheEnabled(const CompilerDriver *driver)
+{
+    return driver->moduleCacheKey != 0;
+}
+
+static void pushModuleCacheEvent(CompilerDriver *driver,
+                                 const ModuleCacheEvent *event)
+{
+    ModuleCacheRecorder *recorder = driver->moduleRecorder;
+    if (recorder == NULL || recorder->uncacheable)
+        return;
+    pushOnDynArray(&recorder->events, event);
+}
+
+void initModuleCache(CompilerDriver *driver)
+{
+    const Options *options = &driver->options;
+    char path[PATH_MAX];
+    struct stat st;
+
+    driver->moduleCacheKey = 0;
+    if (options->noModuleCache || options->buildDir == NULL ||
+        options->buildDir[0] == '\0')
+        return;
+
+    snprintf(path, sizeof(path), "%s/cache", options->buildDir);
+    if (!makeDirectory(path, true))
+        return;
+
+    // Entries written by a different compiler binary are never reused
+    HashCode hash = hashStr(hashInit(), CXY_VERSION " " CXY_BUILD_ID);
+    if (stat(driver->cxyBinaryPath, &st) == 0) {
+        hash = hashUint64(hash, st.st_mtim.tv_sec);
+        hash = hashUint64(hash, st.st_mtim.tv_nsec);
+        hash = hashUint64(hash, st.st_size);
+    }
+    driver->moduleCacheKey = hash ?: 1;
+}
+
+ModuleCacheRecorder *moduleCacheSetRecorder(CompilerDriver *driver,
+                                            ModuleCacheRecorder *recorder)
+{
+    ModuleCacheRecorder *previous = driver->moduleRecorder;
+    driver->moduleRecorder = recorder;
+    driver->preprocessor.recorder = recorder;
+    return previous;
+}
+
+void moduleCacheRecordInclude(CompilerDriver *driver, cstring path)
+{
+    pushModuleCacheEvent(driver,
+                         &(ModuleCacheEvent){.kind = mceInclude, .name = path});
+}
+
+void moduleCacheRecordImport(CompilerDriver *driver,
+                             const AstNode *source,
+                             bool testMode)
+{
+    pushModuleCacheEvent(
+        driver,
+        &(ModuleCacheEvent){.kind = mceImport,
+                            .name = source->stringLiteral.value,
+                            .value = source->loc.fileName,
+                            .row = source->loc.begin.row,
+                            .col = source->loc.begin.col,
+                            .flag = testMode});
+}
+
+void moduleCacheRecordNativeSource(CompilerDriver *driver,
+                                   cstring cxySource,
+                                   cstring source)
+{
+    pushModuleCacheEvent(driver,
+                         &(ModuleCacheEvent){.kind = mceNativeSource,
+                                             .name = cxySource,
+                                             .value = source});
+}
+
+void moduleCacheRecordLinkLibrary(CompilerDriver *driver, cstring library)
+{
+    pushModuleCacheEvent(
+        driver, &(ModuleCacheEvent){.kind = mceLinkLibrary, .name = library});
+}
+
+void moduleCacheRecordMacroQuery(ModuleCacheRecorder *recorder,
+                                 cstring name,
+                                 bool defined,
+                                 const AstNode *value)
+{
+    if (recorder == NULL || recorder->uncacheable)
+        return;
+
+    HashCode hash = 0;
+    if (!hashAstNode(value, &hash)) {
+        recorder->uncacheable = true;
+        return;
+    }
+
+    pushOnDynArray(&recorder->events,
+                   &(ModuleCacheEvent){.kind = mceMacroQuery,
+                                       .name = name,
+                                       .hash = hash,
+                                       .flag = defined});
+}
+
+void moduleCacheBeginRecording(CompilerDriver *driver,
+                               ModuleCacheRecorder *recorder,
+                               cstring path,
+                               bool testMode)
+{
+    *recorder = (ModuleCacheRecorder){
+        .path = path,
+        .testMode = testMode,
+        .uncacheable = !isModuleCacheEnabled(driver),
+        .errors = driver->L->errorCount,
+        .events = newDynArray(sizeof(ModuleCacheEvent))};
+    recorder->parent = moduleCacheSetRecorder(driver, recorder);
+}
+
+static void addDependency(HashTable *seen, DynArray *deps, cstring path)
+{
+    if (path == NULL || path[0] != '/')
+        return;
+
+    if (!insertInHashTable(seen,
+                           &path,
+                           hashStr(hashInit(), path),
+                           sizeof(cstring),
+                           compareDependencies))
+        return;
+    pushOnDynArray(deps, &path);
+}
+
+static inline void packString(msgpack_packer *packer, cstring str)
+{
+    if (str == NULL) {
+        msgpack_pack_nil(packer);
+        return;
+    }
+    size_t len = strlen(str);
+    msgpack_pack_str(packer, len);
+    msgpack_pack_str_body(packer, str, len);
+}
+
+bool moduleCachePackDependency(msgpack_packer *packer, cstring path)
+{
+    struct stat st;
+    HashCode hash;
+    if (stat(path, &st) != 0 || !hashFileContents(path, &hash))
+        return false;
+
+    msgpack_pack_array(packer, 5);
+    packString(packer, path);
+    msgpack_pack_int64(packer, st.st_mtim.tv_sec);
+    msgpack_pack_int64(packer, st.st_mtim.tv_nsec);
+    msgpack_pack_uint64(packer, st.st_size);
+    msgpack_pack_uint64(packer, hash);
+    return true;
+}
+
+bool moduleCacheWriteEntry(cstring path, const void *data, size_t size)
+{
+    char tmpPath[PATH_MAX + 32];
+    // Write to a temporary file first so that concurrent compilations never
+    // observe a partially written entry
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int)getpid());
+    if (writeToFile(tmpPath, data, size) && rename(tmpPath, path) == 0)
+        return true;
+    unlink(tmpPath);
+    return false;
+}
+
+static void packEvent(msgpack_packer *packer, const ModuleCacheEvent *event)
+{
+    switch (event->kind) {
+    case mceInclude:
+    case mceLinkLibrary:
+        msgpack_pack_array(packer, 2);
+        msgpack_pack_uint64(packer, event->kind);
+        packString(packer, event->name);
+        break;
+    case mceNativeSource:
+        msgpack_pack_array(packer, 3);
+        msgpack_pack_uint64(packer, event->kind);
+        packString(packer, event->name);
+        packString(packer, event->value);
+        break;
+    case mceMacroQuery:
+        msgpack_pack_array(packer, 4);
+        msgpack_pack_uint64(packer, event->kind);
+        packString(packer, event->name);
+        msgpack_pack_uint64(packer, event->flag);
+        msgpack_pack_uint64(packer, event->hash);
+        break;
+    case mceImport:
+        msgpack_pack_array(packer, 6);
+        msgpack_pack_uint64(packer, event->kind);
+        packString(packer, event->name);
+        packString(packer, event->value);
+        msgpack_pack_uint64(packer, event->row);
+        msgpack_pack_uint64(packer, event->col);
+        msgpack_pack_uint64(packer, event->flag);
+        break;
+    }
+}
+
+static void storeModule(CompilerDriver *driver,
+                        const ModuleCacheRecorder *recorder,
+                        const AstNode *program)
+{
+    char cachePath[PATH_MAX];
+    msgpack_sbuffer sbuf, ast;
+    msgpack_packer packer;
+    DynArray fileNames = newDynArray(sizeof(cstring)),
+             deps = newDynArray(sizeof(cstring));
+    HashTable seen = newTempHashTable(sizeof(cstring));
+
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_sbuffer_init(&ast);
+    if (!binaryEncodeAstNode(&ast, program, &fileNames))
+        goto storeModuleDone;
+
+    addDependency(&seen, &deps, recorder->path);
+    for (u64 i = 0; i < recorder->events.size; i++) {
+        const ModuleCacheEvent *event =
+            &dynArrayAt(ModuleCacheEvent *, &recorder->events, i);
+        if (event->kind == mceInclude)
+            addDependency(&seen, &deps, event->name);
+    }
+    for (u64 i = 0; i < fileNames.size; i++)
+        addDependency(&seen, &deps, dynArrayAt(cstring *, &fileNames, i));
+
+    msgpack_packer_init(&packer, &sbuf, msgpack_sbuffer_write);
+    msgpack_pack_array(&packer, 6);
+    packString(&packer, MODULE_CACHE_MAGIC);
+    msgpack_pack_uint64(&packer, driver->moduleCacheKey);
+    packString(&packer, recorder->path);
+    msgpack_pack_uint64(&packer, recorder->testMode);
+
+    msgpack_pack_array(&packer, deps.size);
+    for (u64 i = 0; i < deps.size; i++) {
+        if (!moduleCachePackDependency(&packer,
+                                       dynArrayAt(cstring *, &deps, i)))
+            goto storeModuleDone;
+    }
+
+    msgpack_pack_array(&packer, recorder->events.size);
+    for (u64 i = 0; i < recorder->events.size; i++)
+        packEvent(&packer,
+                  &dynArrayAt(ModuleCacheEvent *, &recorder->events, i));
+
+    msgpack_sbuffer_write(&sbuf, ast.data, ast.size);
+
+    getCachedAstPath(driver, cachePath, recorder->path, recorder->testMode);
+    moduleCacheWriteEntry(cachePath, sbuf.data, sbuf.size);
+
+storeModuleDone:
+    msgpack_sbuffer_destroy(&ast);
+    msgpack_sbuffer_destroy(&sbuf);
+    freeHashTable(&seen);
+    freeDynArray(&deps);
+    freeDynArray(&fileNames);
+}
+
+void moduleCacheEndRecording(CompilerDriver *driver,
+                             ModuleCacheRecorder *recorder,
+                             const AstNode *program)
+{
+    moduleCacheSetRecorder(driver, recorder->parent);
+    if (program != NULL && program->program.module != NULL &&
+        !recorder->uncacheable && driver->L->errorCount == recorder->errors) {
+        storeModule(driver, recorder, program);
+    }
+    freeDynArray(&recorder->events);
+}
+
+static inline bool isString(const msgpack_object *obj, cstring str)
+{
+    size_t len = strlen(str);
+    return obj->type == MSGPACK_OBJECT_STR && obj->via.str.size == len &&
+           memcmp(obj->via.str.ptr, str, len) == 0;
+}
+
+static inline bool isUint(const msgpack_object *obj)
+{
+    return obj->type == MSGPACK_OBJECT_POSITIVE_INTEGER;
+}
+
+static inline bool isInt(const msgpack_object *obj)
+{
+    return obj->type == MSGPACK_OBJECT_POSITIVE_INTEGER ||
+           obj->type == MSGPACK_OBJECT_NEGATIVE_INTEGER;
+}
+
+static cstring unpackString(CompilerDriver *driver, const msgpack_object *obj)
+{
+    if (obj->type != MSGPACK_OBJECT_STR)
+        return NULL;
+    return makeStringSized(
+        driver->strings, obj->via.str.ptr, obj->via.str.size);
+}
+
+bool moduleCacheIsDependencyUnchanged(CompilerDriver *driver,
+                                      const msgpack_object *obj)
+{
+    struct stat st;
+    if (obj->type != MSGPACK_OBJECT_ARRAY || obj->via.array.size != 5)
+        return false;
+
+    const msgpack_object *fields = obj->via.array.ptr;
+    cstring path = unpackString(driver, &fields[0]);
+    if (path == NULL || !isInt(&fields[1]) || !isInt(&fields[2]) ||
+        !isUint(&fields[3]) || !isUint(&fields[4]))
+        return false;
+
+    if (stat(path, &st) != 0 || st.st_size != fields[3].via.u64)
+        return false;
+
+    if (st.st_mtim.tv_sec == fields[1].via.i64 &&
+        st.st_mtim.tv_nsec == fields[2].via.i64)
+        return true;
+
+    // Touched (e.g. by a checkout) but possibly unchanged
+    HashCode hash;
+    return hashFileContents(path, &hash) && hash == fields[4].via.u64;
+}
+
+static bool replayEvent(CompilerDriver *driver,
+                        const msgpack_object *obj,
+                        ModuleReplayPhase phase,
+                        bool *failed)
+{
+    if (obj->type != MSGPACK_OBJECT_ARRAY || obj->via.array.size < 2 ||
+        !isUint(&obj->via.array.ptr[0]))
+        return false;
+
+    const msgpack_object *fields = obj->via.array.ptr;
+    u32 size = obj->via.array.size;
+    cstring name = unpackString(driver, &fields[1]);
+    if (name == NULL)
+        return false;
+
+    switch (fields[0].via.u64) {
+    case mceInclude:
+        return true;
+    case mceNativeSource: {
+        cstring source = size == 3 ? unpackString(driver, &fields[2]) : NULL;
+        if (source == NULL)
+            return false;
+        if (phase == mrpApply)
+            addNativeSourceFile(driver, name, source);
+        return true;
+    }
+    case mceLinkLibrary:
+        if (phase == mrpApply)
+            addLinkLibrary(driver, name);
+        return true;
+    case mceMacroQuery: {
+        AstNode *value = NULL;
+        HashCode hash = 0;
+        if (size != 4 || !isUint(&fields[2]) || !isUint(&fields[3]))
+            return false;
+        if (phase == mrpValidate || phase == mrpApply)
+            return true;
+        bool defined =
+            preprocessorHasMacro(&driver->preprocessor, name, &value);
+        return defined == fields[2].via.u64 && hashAstNode(value, &hash) &&
+               hash == fields[3].via.u64;
+    }
+    case mceImport: {
+        cstring importer = size == 6 ? unpackString(driver, &fields[2]) : NULL;
+        if (importer == NULL || !isUint(&fields[3]) || !isUint(&fields[4]) ||
+            !isUint(&fields[5]))
+            return false;
+        if (phase != mrpImport)
+            return true;
+
+        FilePos pos = {.row = fields[3].via.u64, .col = fields[4].via.u64};
+        AstNode source = {.tag = astStringLit,
+                          .loc = {.fileName = importer, .begin = pos, .end = pos},
+                          .stringLiteral.value = name};
+        if (compileModule(driver, &source, NULL, NULL, fields[5].via.u64) ==
+            NULL) {
+            *failed = true;
+            return false;
+        }
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+static AstNode *loadCachedModule(CompilerDriver *driver,
+                                 cstring path,
+                                 bool testMode,
+                                 const char *data,
+                                 size_t size,
+                                 bool *failed)
+{
+    size_t offset = 0;
+    AstNode *program = NULL;
+    msgpack_unpacked msg;
+    msgpack_unpacked_init(&msg);
+
+    if (msgpack_unpack_next(&msg, data, size, &offset) !=
+            MSGPACK_UNPACK_SUCCESS ||
+        msg.data.type != MSGPACK_OBJECT_ARRAY || msg.data.via.array.size != 6)
+        goto loadCachedModuleDone;
+
+    const msgpack_object *header = msg.data.via.array.ptr;
+    if (!isString(&header[0], MODULE_CACHE_MAGIC) || !isUint(&header[1]) ||
+        header[1].via.u64 != driver->moduleCacheKey ||
+        !isString(&header[2], path) || !isUint(&header[3]) ||
+        header[3].via.u64 != testMode ||
+        header[4].type != MSGPACK_OBJECT_ARRAY ||
+        header[5].type != MSGPACK_OBJECT_ARRAY)
+        goto loadCachedModuleDone;
+
+    const msgpack_object_array *deps = &header[4].via.array;
+    for (u32 i = 0; i < deps->size; i++) {
+        if (!moduleCacheIsDependencyUnchanged(driver, &deps->ptr[i]))
+            goto loadCachedModuleDone;
+    }
+
+    AstNode *decoded = binaryDecodeAstNode(
+        data + offset, size - offset, driver->pool, driver->strings);
+    if (!nodeIs(decoded, Program) || decoded->program.module == NULL)
+        goto loadCachedModuleDone;
+
+    const msgpack_object_array *events = &header[5].via.array;
+    bool hasImports = false;
+    for (u32 i = 0; i < events->size; i++) {
+        const msgpack_object *event = &events->ptr[i];
+        if (!replayEvent(driver,
+                         event,
+                         hasImports ? mrpValidate : mrpCheck,
+                         failed))
+            goto loadCachedModuleDone;
+        if (event->via.array.ptr[0].via.u64 == mceImport)
+            hasImports = true;
+    }
+
+    for (u32 i = 0; hasImports && i < events->size; i++) {
+        if (!replayEvent(driver, &events->ptr[i], mrpImport, failed))
+            goto loadCachedModuleDone;
+    }
+
+    for (u32 i = 0; i < events->size; i++)
+        replayEvent(driver, &events->ptr[i], mrpApply, failed);
+
+    // Nested modules are now loaded, bind the import declarations to them
+    for (AstNode *node = decoded->program.top; node; node = node->next) {
+        if (!nodeIs(node, ImportDecl))
+            continue;
+        node->type = compileModule(driver,
+                                   node->import.module,
+                                   node->import.entities,
+                                   node->import.alias,
+                                   false);
+        if (node->type == NULL) {
+            *failed = true;
+            goto loadCachedModuleDone;
+        }
+    }
+
+    program = decoded;
+
+loadCachedModuleDone:
+    msgpack_unpacked_destroy(&msg);
+    return program;
+}
+
+AstNode *moduleCacheLoad(CompilerDriver *driver,
+                         cstring path,
+                         bool testMode,
+                         bool *failed)
+{
+    char cachePath[PATH_MAX];
+    size_t size = 0;
+
+    *failed = false;
+    if (!isModuleCacheEnabled(driver))
+        return NULL;
+
+    getCachedAstPath(driver, cachePath, path, testMode);
+    char *data = readFile(cachePath, &size);
+    if (data == NULL) {
+        driver->stats.moduleCache.misses++;
+        return NULL;
+    }
+
+    printStatus(driver->L, cWHT "Loading cached %s..." cDEF, path);
+    // The side effects being replayed belong to the cached module, not to
+    // the module currently being parsed
+    ModuleCacheRecorder *active = moduleCacheSetRecorder(driver, NULL);
+    AstNode *program =
+        loadCachedModule(driver, path, testMode, data, size, failed);
+    moduleCacheSetRecorder(driver, active);
+    free(data);
+
+    if (program)
+        driver->stats.moduleCache.hits++;
+    else
+        driver->stats.moduleCache.misses++;
+
+    return program;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "driver.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct msgpack_packer;
+struct msgpack_object;
+
+/**
+ * Persistent cache of parsed imported modules.
+ *
+ * When a build directory is configured, every imported module that parses
+ * successfully is serialized to `{buildDir}/cache/` together with everything
+ * its parse depended on or did to the driver (included files, preprocessor
+ * macro lookups, `@__cc` sources/libraries and nested imports). On the next
+ * compilation the entry is reused if none of its dependencies changed, and
+ * the recorded side effects are replayed in their original order.
+ */
+typedef struct ModuleCacheRecorder {
+    struct ModuleCacheRecorder *parent;
+    cstring path;
+    bool testMode;
+    bool uncacheable;
+    u64 errors;
+    DynArray events;
+} ModuleCacheRecorder;
+
+void initModuleCache(CompilerDriver *driver);
+
+/**
+ * Loads the module at the given path from the persistent cache
+ *
+ * @param failed Set to true if the entry was valid but replaying it failed
+ *      (e.g. a nested import failed to compile), errors have been reported
+ *
+ * @return The parsed program with all its parse-time side effects replayed,
+ *      or NULL if there is no valid cache entry for the module
+ */
+AstNode *moduleCacheLoad(CompilerDriver *driver,
+                         cstring path,
+                         bool testMode,
+                         bool *failed);
+
+void moduleCacheBeginRecording(CompilerDriver *driver,
+                               ModuleCacheRecorder *recorder,
+                               cstring path,
+                               bool testMode);
+void moduleCacheEndRecording(CompilerDriver *driver,
+                             ModuleCacheRecorder *recorder,
+                             const AstNode *program);
+
+/**
+ * Replaces the active recorder, used to suspend recording while an imported
+ * module runs through the compiler stages.
+ *
+ * @return The previously active recorder
+ */
+ModuleCacheRecorder *moduleCacheSetRecorder(CompilerDriver *driver,
+                                            ModuleCacheRecorder *recorder);
+
+void moduleCacheRecordInclude(CompilerDriver *driver, cstring path);
+void moduleCacheRecordImport(CompilerDriver *driver,
+                             const AstNode *source,
+                             bool testMode);
+void moduleCacheRecordNativeSource(CompilerDriver *driver,
+                                   cstring cxySource,
+                                   cstring source);
+void moduleCacheRecordLinkLibrary(CompilerDriver *driver, cstring library);
+void moduleCacheRecordMacroQuery(ModuleCacheRecorder *recorder,
+                                 cstring name,
+                                 bool defined,
+                                 const AstNode *value);
+
+/**
+ * Appends the `[path, mtime, size, contents hash]` record of a file a cache
+ * entry depends on
+ *
+ * @return false if the file cannot be read
+ */
+bool moduleCachePackDependency(struct msgpack_packer *packer, cstring path);
+
+/**
+ * Checks a record appended by `moduleCachePackDependency`, a file whose
+ * timestamp changed is still considered unchanged if its contents did not
+ */
+bool moduleCacheIsDependencyUnchanged(CompilerDriver *driver,
+                                      const struct msgpack_object *obj);
+
+/**
+ * Atomically replaces the cache entry at the given path
+ */
+bool moduleCacheWriteEntry(cstring path, const void *data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
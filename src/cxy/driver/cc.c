@@ -9,6 +9,7 @@
  */
 
 #include "cc.h"
+#include "cache.h"
 
 #include <string.h>
 
@@ -39,6 +40,7 @@ void addNativeSourceFile(CompilerDriver *driver,
                          cstring cxySource,
                          cstring source)
 {
+    moduleCacheRecordNativeSource(driver, cxySource, source);
     source =
         getFilePathAsRelativeToCxySource(driver->strings, cxySource, source);
     insertInHashTable(&driver->nativeSources,
@@ -50,6 +52,7 @@ void addNativeSourceFile(CompilerDriver *driver,
 
 void addLinkLibrary(CompilerDriver *driver, cstring lib)
 {
+    moduleCacheRecordLinkLibrary(driver, lib);
     insertInHashTable(&driver->linkLibraries,
                       &lib,
                       hashStr(hashInit(), lib),
@@ -0,0 +1,472 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // struct ucred
+#endif
+
+#include "daemon.h"
+#include "options.h"
+
+#include "core/alloc.h"
+#include "core/log.h"
+#include "core/utils.h"
+
+#include "lang/frontend/ast.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define CXY_DAEMON_MAGIC 0x43585944 // "CXYD"
+
+typedef enum { dmnSuccess, dmnFailure, dmnDeclined } DaemonStatus;
+
+typedef struct {
+    u32 magic;
+    u32 size; // size of the payload following the header
+} DaemonRequestHeader;
+
+typedef struct {
+    cstring path;
+    struct timespec mtime;
+} WarmFile;
+
+typedef union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int[2]))];
+} DaemonFdsControl;
+
+static bool readFully(int fd, void *buf, size_t size)
+{
+    for (size_t n = 0; n < size;) {
+        ssize_t rc = read(fd, (char *)buf + n, size - n);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return false;
+        n += rc;
+    }
+    return true;
+}
+
+static bool writeFully(int fd, const void *buf, size_t size)
+{
+    for (size_t n = 0; n < size;) {
+        ssize_t rc = send(fd, (const char *)buf + n, size - n, MSG_NOSIGNAL);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return false;
+        n += rc;
+    }
+    return true;
+}
+
+static bool replyStatus(int conn, DaemonStatus status)
+{
+    i32 value = status;
+    return writeFully(conn, &value, sizeof(value));
+}
+
+static HashCode hashPath(HashCode hash, cstring dir, cstring path)
+{
+    char buf[PATH_MAX];
+    if (path != NULL && path[0] != '/') {
+        snprintf(buf, sizeof(buf), "%s/%s", dir, path);
+        path = buf;
+    }
+    return hashStr(hash, path ?: "");
+}
+
+static HashCode hashStringArray(HashCode hash, const DynArray *array)
+{
+    for (u64 i = 0; i < array->size; i++)
+        hash = hashStr(hash, dynArrayAt(cstring *, array, i));
+    return hashUint64(hash, array->size);
+}
+
+/// Hashes the options that shape the state warmed up by the daemon
+static HashCode hashWarmOptions(const Options *options, cstring currentDir)
+{
+    cstring buildDir = options->buildDir;
+    HashCode hash = hashUint64(hashInit(), options->cmd);
+    hash = hashUint64(hash, options->optimizationLevel);
+    hash = hashUint64(hash, options->debug);
+    hash = hashUint64(hash, options->withoutBuiltins);
+    hash = hashUint64(hash, options->withMemoryManager);
+    hash = hashUint64(hash, options->noRcElision);
+    hash = hashUint64(hash, options->noModuleCache);
+    hash = hashPath(
+        hash, currentDir, buildDir && buildDir[0] != '\0' ? buildDir : ".");
+    hash = hashPath(hash, currentDir, options->libDir);
+    hash = hashPath(hash, currentDir, options->pluginsDir);
+    hash = hashPath(hash, currentDir, options->depsDir);
+    for (u64 i = 0; i < options->defines.size; i++) {
+        const CompilerDefine *define =
+            &dynArrayAt(CompilerDefine *, &options->defines, i);
+        hash = hashStr(hash, define->name);
+        hash = hashStr(hash, define->value ?: "");
+    }
+    hash = hashStringArray(hash, &options->cDefines);
+    hash = hashStringArray(hash, &options->cflags);
+    return hashStringArray(hash, &options->importSearchPaths);
+}
+
+static void snapshotWarmFiles(CompilerDriver *driver, DynArray *files)
+{
+    struct stat st;
+    HashtableIt it = newHashTableIt(&driver->moduleCache, sizeof(CachedModule));
+    while (hashTableItHasNext(&it)) {
+        CachedModule *module = hashTableItNext(&it);
+        if (stat(module->path, &st) == 0) {
+            pushOnDynArray(
+                files, &(WarmFile){.path = module->path, .mtime = st.st_mtim});
+        }
+    }
+
+    if (stat(driver->cxyBinaryPath, &st) == 0) {
+        pushOnDynArray(
+            files,
+            &(WarmFile){.path = driver->cxyBinaryPath, .mtime = st.st_mtim});
+    }
+}
+
+static bool hasStaleWarmFiles(const DynArray *files)
+{
+    struct stat st;
+    for (u64 i = 0; i < files->size; i++) {
+        const WarmFile *file = &dynArrayAt(WarmFile *, files, i);
+        if (stat(file->path, &st) != 0 ||
+            st.st_mtim.tv_sec != file->mtime.tv_sec ||
+            st.st_mtim.tv_nsec != file->mtime.tv_nsec)
+            return true;
+    }
+    return false;
+}
+
+static bool preloadModules(CompilerDriver *driver)
+{
+    // Relative module paths are resolved from the daemon's working directory
+    FileLoc loc = {
+        .fileName = joinPath(driver->strings, driver->currentDir, "daemon")};
+    bool status = true;
+    dynArrayFor(module, cstring, &driver->options.sources)
+    {
+        AstNode *source = makeAstNode(
+            driver->pool,
+            &loc,
+            &(AstNode){.tag = astStringLit, .stringLiteral.value = *module});
+        status &= compileModule(driver, source, NULL, NULL, false) != NULL;
+    }
+    return status;
+}
+
+/**
+ * Whether the process on the other end of the given Unix socket runs as the
+ * same user as this process. The daemon compiles and runs code as its owner,
+ * so it must never serve anyone else.
+ */
+static bool isPeerTrusted(int fd)
+{
+#ifdef __APPLE__
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) != 0)
+        return false;
+#else
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 ||
+        len != sizeof(cred))
+        return false;
+    uid_t uid = cred.uid;
+#endif
+    return uid == geteuid();
+}
+
+static int listenOnSocket(Log *L, cstring path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        logError(L,
+                 NULL,
+                 "daemon socket path '{s}' is too long",
+                 (FormatArg[]){{.s = path}});
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        goto listenOnSocketError;
+    // Do not leak the listener into compiler sub-processes or a restart
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    unlink(path);
+    // Only the owner may connect, create the socket file without any group
+    // or other permissions so there is no window where it is reachable
+    mode_t mask = umask(S_IRWXG | S_IRWXO | S_IXUSR);
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (bound != 0 || chmod(path, S_IRUSR | S_IWUSR) != 0 ||
+        listen(fd, SOMAXCONN) != 0)
+        goto listenOnSocketError;
+    return fd;
+
+listenOnSocketError:
+    logError(L,
+             NULL,
+             "listening on daemon socket '{s}' failed: {s}",
+             (FormatArg[]){{.s = path}, {.s = strerror(errno)}});
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+static bool sendRequest(int fd, const char *payload, u32 size)
+{
+    DaemonRequestHeader header = {.magic = CXY_DAEMON_MAGIC, .size = size};
+    int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+    DaemonFdsControl control;
+    struct iovec iov = {.iov_base = &header, .iov_len = sizeof(header)};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buf,
+                         .msg_controllen = sizeof(control.buf)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(header))
+        return false;
+    return writeFully(fd, payload, size);
+}
+
+static char *receiveRequest(int conn, int fds[2], u32 *size)
+{
+    DaemonRequestHeader header = {};
+    DaemonFdsControl control;
+    struct iovec iov = {.iov_base = &header, .iov_len = sizeof(header)};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buf,
+                         .msg_controllen = sizeof(control.buf)};
+    if (recvmsg(conn, &msg, 0) != sizeof(header) ||
+        header.magic != CXY_DAEMON_MAGIC)
+        return NULL;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int[2])))
+        return NULL;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int[2]));
+
+    char *payload = mallocOrDie(header.size + 1);
+    payload[header.size] = '\0';
+    if (!readFully(conn, payload, header.size)) {
+        free(payload);
+        return NULL;
+    }
+    *size = header.size;
+    return payload;
+}
+
+static DaemonStatus serveRequest(CompilerDriver *driver,
+                                 HashCode warmOptions,
+                                 int conn)
+{
+    int fds[2];
+    u32 size = 0;
+    char *payload = receiveRequest(conn, fds, &size);
+    if (payload == NULL)
+        return dmnDeclined;
+
+    // The client's working directory followed by its command line
+    DynArray args = newDynArray(sizeof(char *));
+    for (u32 i = 0; i < size; i += strlen(&payload[i]) + 1) {
+        char *arg = &payload[i];
+        pushOnDynArray(&args, &arg);
+    }
+    if (args.size < 2 || chdir(payload) != 0)
+        return dmnDeclined;
+
+    char tmp[PATH_MAX];
+    Options options = {.strings = driver->strings};
+    int argc = (int)args.size - 1;
+    char **argv = &dynArrayAt(char **, &args, 1);
+    cstring currentDir = makeString(driver->strings, getcwd(tmp, PATH_MAX));
+    if (!parseCommandLineOptions(
+            &argc, argv, driver->strings, &options, driver->L) ||
+        (options.cmd != cmdBuild && options.cmd != cmdTest) ||
+        options.buildPlugin ||
+        hashWarmOptions(&options, currentDir) != warmOptions)
+        return dmnDeclined;
+
+    // From here on the request is ours, report to the client's terminal
+    dup2(fds[0], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+
+    options.withMemoryTrace = driver->options.withMemoryTrace;
+    driver->options = options;
+    driver->currentDir = currentDir;
+    driver->currentDirLen = strlen(currentDir);
+    if (!compilerBackendRetarget(driver))
+        return dmnFailure;
+
+    bool status = true;
+    dynArrayFor(source, cstring, &driver->options.sources)
+    {
+        status &= compileFile(*source, driver);
+    }
+    return status ? dmnSuccess : dmnFailure;
+}
+
+bool runCompilerDaemon(CompilerDriver *driver,
+                       MemPool *pool,
+                       StrPool *strings,
+                       Log *log,
+                       int argc,
+                       char **argv)
+{
+    Options *options = &driver->options;
+    // Warm up the driver exactly as the commands it serves would
+    options->cmd = options->daemon.test ? cmdTest : cmdBuild;
+    options->jobs = 0;
+    if (!initCompilerDriver(driver, pool, strings, log, argc, argv) ||
+        !preloadModules(driver))
+        return false;
+
+    cstring socketPath = options->daemon.socket;
+    if (socketPath == NULL) {
+        socketPath = joinPath(strings,
+                              options->buildDir ?: driver->currentDir,
+                              "cxy-daemon.sock");
+    }
+    int listener = listenOnSocket(log, socketPath);
+    if (listener < 0)
+        return false;
+
+    HashCode warmOptions = hashWarmOptions(options, driver->currentDir);
+    DynArray warmFiles = newDynArray(sizeof(WarmFile));
+    snapshotWarmFiles(driver, &warmFiles);
+
+    // Requests are served by forked children, let the system reap them
+    signal(SIGCHLD, SIG_IGN);
+    printStatusAlways(log,
+                      cBGRN "\xE2\x9C\x93" cBWHT
+                            " Compile daemon listening on %s\n" cDEF,
+                      socketPath);
+
+    while (true) {
+        int conn = accept(listener, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR)
+                continue;
+            logError(log,
+                     NULL,
+                     "accepting daemon connection failed: {s}",
+                     (FormatArg[]){{.s = strerror(errno)}});
+            break;
+        }
+
+        if (!isPeerTrusted(conn)) {
+            logWarning(log,
+                       NULL,
+                       "rejected daemon connection from another user",
+                       NULL);
+            close(conn);
+            continue;
+        }
+
+        if (hasStaleWarmFiles(&warmFiles)) {
+            // The client builds locally while the daemon restarts with
+            // fresh state
+            replyStatus(conn, dmnDeclined);
+            close(conn);
+            close(listener);
+            printStatusAlways(log,
+                              cBWHT "Warm modules changed, restarting "
+                                    "compile daemon\n" cDEF);
+            fflush(NULL);
+            execv(driver->cxyBinaryPath, argv);
+            logError(log,
+                     NULL,
+                     "restarting compile daemon failed: {s}",
+                     (FormatArg[]){{.s = strerror(errno)}});
+            freeDynArray(&warmFiles);
+            return false;
+        }
+
+        // Nothing buffered must be written twice by the children
+        fflush(NULL);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(listener);
+            signal(SIGCHLD, SIG_DFL);
+            DaemonStatus status = serveRequest(driver, warmOptions, conn);
+            fflush(NULL);
+            replyStatus(conn, status);
+            _exit(EXIT_SUCCESS);
+        }
+        else if (pid < 0) {
+            replyStatus(conn, dmnDeclined);
+        }
+        close(conn);
+    }
+
+    close(listener);
+    freeDynArray(&warmFiles);
+    return false;
+}
+
+int forwardToCompilerDaemon(cstring socketPath, int argc, char **argv)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (socketPath == NULL || socketPath[0] == '\0' ||
+        strlen(socketPath) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, socketPath);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    // Our stdout/stderr are handed over, never to someone else's daemon
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        !isPeerTrusted(fd)) {
+        close(fd);
+        return -1;
+    }
+
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = strlen(cwd) + 1;
+    for (int i = 0; i < argc; i++)
+        size += strlen(argv[i]) + 1;
+    char *payload = mallocOrDie(size), *it = payload;
+    it = stpcpy(it, cwd) + 1;
+    for (int i = 0; i < argc; i++)
+        it = stpcpy(it, argv[i]) + 1;
+
+    i32 status = dmnDeclined;
+    fflush(NULL);
+    if (!sendRequest(fd, payload, (u32)size) ||
+        !readFully(fd, &status, sizeof(status)))
+        status = dmnDeclined;
+    free(payload);
+    close(fd);
+
+    if (status == dmnDeclined)
+        return -1;
+    return status == dmnSuccess ? 0 : 1;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "driver.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Compile server for `cxy build` and `cxy test`.
+ *
+ * The daemon initializes a driver once (builtins type-checked and generated,
+ * plus any preloaded modules) and serves every request from a forked copy of
+ * that warm driver. A request carries the client's working directory, its
+ * command line and its standard output/error, so diagnostics go straight to
+ * the client's terminal. Requests whose options would change the warm state
+ * (defines, optimization level, search paths...) are declined and the client
+ * compiles locally. The daemon restarts itself when any of its warm modules
+ * or the compiler binary changes on disk.
+ *
+ * @param argv The unparsed command line, used to restart the daemon
+ */
+bool runCompilerDaemon(CompilerDriver *driver,
+                       MemPool *pool,
+                       StrPool *strings,
+                       Log *log,
+                       int argc,
+                       char **argv);
+
+/**
+ * Sends the given (unparsed) command line to the daemon listening on the
+ * given socket.
+ *
+ * @return -1 if there is no daemon or it declined the request, otherwise 0
+ *      if the compilation succeeded and 1 if it failed
+ */
+int forwardToCompilerDaemon(cstring socketPath, int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,4 +1,5 @@
 #include "driver.h"
+#include "cache.h"
 #include "options.h"
 #include "stages.h"
 #include "profiling.h"
@@ -28,11 +29,6 @@
 #include <time.h>
 #include <unistd.h>
 
-typedef struct CachedModule {
-    cstring path;
-    AstNode *program;
-} CachedModule;
-
 typedef struct ResolvedModulePath {
     cstring dir;
     cstring importPath;
@@ -92,18 +88,6 @@ static void addCachedModule(CompilerDriver *driver,
     csAssert0(status);
 }
 
-attr(always_inline) static char *getCachedAstPath(Options *options,
-                                                  const char *fileName)
-{
-    FormatState state = newFormatState("", true);
-    format(&state,
-           "{s}/cache/{s}",
-           (FormatArg[]){{.s = options->buildDir}, {.s = fileName}});
-    char *path = formatStateToString(&state);
-    freeFormatState(&state);
-    return path;
-}
-
 static AstNode *parseFile(CompilerDriver *driver,
                           const char *fileName,
                           bool testMode)
@@ -327,6 +311,7 @@ bool initCompilerDriver(CompilerDriver *compiler,
         compiler->backend = initCompilerBackend(compiler, argc, argv);
         csAssert0(compiler->backend);
         initCompilerPreprocessor(compiler);
+        initModuleCache(compiler);
         initCImporter(compiler);
         initializeBuiltins(compiler->L, compiler->pool);
         pluginInit(compiler);
@@ -355,6 +340,7 @@ void deinitCompilerDriver(CompilerDriver *driver)
         freeTypeTable(driver->types);
     }
     
+    freeDynArray(&driver->stats.rcElision.functions);
     profileDeinitContext(&driver->profiling);
     deinitCommandLineOptions(&driver->options);
 }
@@ -593,6 +579,7 @@ const Type *compileModule(CompilerDriver *driver,
     AstNode *program = NULL;
     bool cached = true;
     cstring path = source->stringLiteral.value;
+    moduleCacheRecordImport(driver, source, testMode);
     ///
     if (!isImportModuleACHeader(source->stringLiteral.value)) {
         path = getModuleLocation(driver, source, false);
@@ -623,7 +610,14 @@ const Type *compileModule(CompilerDriver *driver,
             profileParsePause(&driver->profiling);
             profileStartFile(&driver->profiling, path);
 
-            program = parseFile(driver, path, testMode);
+            bool loadFailed = false;
+            program = moduleCacheLoad(driver, path, testMode, &loadFailed);
+            if (program == NULL && !loadFailed) {
+                ModuleCacheRecorder recorder;
+                moduleCacheBeginRecording(driver, &recorder, path, testMode);
+                program = parseFile(driver, path, testMode);
+                moduleCacheEndRecording(driver, &recorder, program);
+            }
             if (program == NULL) {
                 profileEndFile(&driver->profiling);
                 driver->profiling.activeFile = parentFile;
@@ -643,7 +637,11 @@ const Type *compileModule(CompilerDriver *driver,
             }
 
             program->flags |= flgImportedModule;
+            // The stages are not part of the importing module's parse
+            ModuleCacheRecorder *importer =
+                moduleCacheSetRecorder(driver, NULL);
             bool compileOk = compileProgram(driver, program, path, false);
+            moduleCacheSetRecorder(driver, importer);
             if (!compileOk) {
                 profileEndFile(&driver->profiling);
                 driver->profiling.activeFile = parentFile;
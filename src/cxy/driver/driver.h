@@ -12,10 +12,12 @@ extern "C" {
 #endif
 
 struct MirContext;
+struct ModuleCacheRecorder;
 
 typedef struct CompilerPreprocessor {
     MemPool *pool;
     HashTable symbols;
+    struct ModuleCacheRecorder *recorder;
 } CompilerPreprocessor;
 
 typedef struct {
@@ -41,11 +43,18 @@ typedef struct {
     HashTable binaries;
 } CxyPackage;
 
+typedef struct CachedModule {
+    cstring path;
+    AstNode *program;
+} CachedModule;
+
 typedef struct CompilerDriver {
     Options options;
     MemPool *pool;
     StrPool *strings;
     HashTable moduleCache;
+    struct ModuleCacheRecorder *moduleRecorder;
+    HashCode moduleCacheKey; // 0 when the persistent module cache is disabled
     HashTable nativeSources;
     HashTable linkLibraries;
     cstring currentDir; // Directory that cxy was executed from
@@ -118,6 +127,11 @@ cstring getIncludeFileLocation(CompilerDriver *driver,
 void *initCompilerBackend(CompilerDriver *driver, int argc, char **argv);
 void deinitCompilerBackend(CompilerDriver *driver);
 bool compilerBackendMakeExecutable(CompilerDriver *driver);
+/**
+ * Moves the code generated so far into the output file configured by the
+ * current options and continues generating code there.
+ */
+bool compilerBackendRetarget(CompilerDriver *driver);
 bool compilerBackendExecuteTestCase(CompilerDriver *driver);
 void initCompilerPreprocessor(struct CompilerDriver *driver);
 void deinitCompilerPreprocessor(struct CompilerDriver *driver);
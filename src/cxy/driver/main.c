@@ -1,5 +1,6 @@
 #include "core/log.h"
 #include "core/utils.h"
+#include "driver/daemon.h"
 #include "driver/driver.h"
 #include "driver/options.h"
 #include "package/commands/commands.h"
@@ -7,6 +8,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+static char **copyCommandLine(MemPool *pool, int argc, char **argv)
+{
+    char **copy = allocFromMemPool(pool, sizeof(char *) * (argc + 1));
+    for (int i = 0; i < argc; i++) {
+        size_t len = strlen(argv[i]) + 1;
+        copy[i] = memcpy(allocFromMemPool(pool, len), argv[i], len);
+    }
+    copy[argc] = NULL;
+    return copy;
+}
 
 int main(int argc, char **argv)
 {
@@ -18,6 +31,10 @@ int main(int argc, char **argv)
     driver.options.strings = &strings;
 
     bool status = true;
+    // The options parser rewrites the command line in place, keep a copy to
+    // hand over to the compile daemon
+    int originalArgc = argc;
+    char **originalArgv = copyCommandLine(&pool, argc, argv);
 
     if (!parseCommandLineOptions(
             &argc, argv, &strings, &driver.options, &log)) {
@@ -32,6 +49,21 @@ int main(int argc, char **argv)
     case cmdUtils:
         status = dispatchUtilsCommand(&driver.options, &strings, &log);
         goto exit;
+    case cmdDaemon:
+        status = runCompilerDaemon(
+            &driver, &pool, &strings, &log, originalArgc, originalArgv);
+        goto exit;
+    case cmdBuild:
+    case cmdTest:
+        if (!driver.options.buildPlugin) {
+            int rc = forwardToCompilerDaemon(
+                driver.options.daemonSocket, originalArgc, originalArgv);
+            if (rc >= 0) {
+                status = rc == 0;
+                goto exit;
+            }
+        }
+        break;
     case _cmdHelp:
     case _cmdCompletion:
         goto exit;
@@ -453,7 +453,13 @@ Command(build,
         Opt(Name("plugin"),
             Sf('p'),
             Help("Build a plugin for the given file"),
-            Def("false")));
+            Def("false")),
+        Int(Name("jobs"),
+            Sf('j'),
+            Help("Generate one C translation unit per module and compile them "
+                 "with up to the given number of parallel jobs (0 generates "
+                 "a single C file)"),
+            Def("0")));
 
 Command(test,
         "Runs unit tests declared on the given source files",
@@ -468,7 +474,33 @@ Command(test,
         Str(Name("output"),
             Sf('o'),
             Help("output file for the compiled binary (default: app)"),
-            Def("app")));
+            Def("app")),
+        Int(Name("jobs"),
+            Sf('j'),
+            Help("Generate one C translation unit per module and compile them "
+                 "with up to the given number of parallel jobs (0 generates "
+                 "a single C file)"),
+            Def("0")));
+
+Command(daemon,
+        "Runs a compile server that keeps the builtins (and the given "
+        "modules) type-checked in memory",
+        Positionals(Use(cmdArrayArgument,
+                        Name("modules"),
+                        Help("Modules to preload and keep warm, e.g "
+                             "stdlib/vector.cxy"),
+                        Many())),
+        Str(Name("socket"),
+            Help("path of the Unix socket to listen on (default: "
+                 "{build-dir}/cxy-daemon.sock)"),
+            Def("")),
+        Str(Name("build-dir"),
+            Help("the build directory, used as the working directory for the "
+                 "compiler"),
+            Def("")),
+        Opt(Name("test"),
+            Help("Serve 'cxy test' requests instead of 'cxy build' requests"),
+            Def("false")));
 
 Command(package,
         "Package management commands (create, add, install, etc.)",
@@ -485,6 +517,7 @@ Command(utils,
     f(dev)                                                                     \
     f(build)                                                                   \
     f(test)                                                                    \
+    f(daemon)                                                                  \
     f(package)                                                                 \
     f(utils)
 
@@ -505,10 +538,17 @@ Command(utils,
     f(output, Local, String, 0, ## __VA_ARGS__)                                 \
     f(buildDir, Local, String, 1, ## __VA_ARGS__)                               \
     f(build.plugin, Local, Option, 2, ## __VA_ARGS__)                           \
+    f(jobs, Local, Int, 3, ## __VA_ARGS__)                                      \
 
 #define TEST_CMD_LAYOUT(f, ...)                                                \
     f(buildDir, Local, String, 0, ## __VA_ARGS__)                              \
-    f(output, Local, String, 1, ## __VA_ARGS__)
+    f(output, Local, String, 1, ## __VA_ARGS__)                                \
+    f(jobs, Local, Int, 2, ## __VA_ARGS__)
+
+#define DAEMON_CMD_LAYOUT(f, ...)                                              \
+    f(daemon.socket, Local, String, 0, ## __VA_ARGS__)                         \
+    f(buildDir, Local, String, 1, ## __VA_ARGS__)                              \
+    f(daemon.test, Local, Option, 2, ## __VA_ARGS__)
 
 #define PACKAGE_CMD_LAYOUT(f, ...)                                             \
     f(package.cxyfile, Global, String, 0, ## __VA_ARGS__)                       \
@@ -585,7 +625,8 @@ Command(utils,
 #define PKG_TEST_CMD_LAYOUT(f, ...)                                            \
     f(package.buildDir, Local, String, 0, ## __VA_ARGS__)                      \
     f(package.filter, Local, String, 1, ## __VA_ARGS__)                        \
-    f(package.parallel, Local, Int, 2, ## __VA_ARGS__)
+    f(package.jobs, Local, Int, 2, ## __VA_ARGS__)                          \
+    f(package.parallel, Local, Int, 3, ## __VA_ARGS__)
 
 #define PKG_PUBLISH_CMD_LAYOUT(f, ...)                                         \
     f(package.bump, Local, String, 0, ## __VA_ARGS__)                          \
@@ -762,6 +803,11 @@ static void initializeOptions(StrPool *strings, Options *options)
     pushStringOnDynArray(&options->cDefines, "-D_XOPEN_SOURCE=1");
     pushStringOnDynArray(&options->cDefines, "-D_DEFAULT_SOURCE");
     pushOnDynArray(&options->defines, &(CompilerDefine){"UNIX", "1"});
+#ifdef CXY_IO_URING
+    // Build the io_uring backend into the stdlib event loop, each loop still
+    // falls back to epoll when the kernel does not support it
+    pushStringOnDynArray(&options->cDefines, "-DAE_IO_URING");
+#endif
     if (options->operatingSystem != NULL) {
         pushOnDynArray(&options->defines,
                        &(CompilerDefine){options->operatingSystem, "1"});
@@ -928,10 +974,14 @@ static int parsePackageCommand(
             Help("Build directory for test binaries"),
             Def(".cxy/build")),
         Str(Name("filter"), Help("Run only tests matching pattern"), Def("")),
-        Int(Name("parallel"),
+        Int(Name("jobs"),
             Sf('j'),
-            Help("Run tests in parallel"),
-            Def("1")));
+            Help("Compile and run up to the given number of test files in "
+                 "parallel"),
+            Def("1")),
+        Int(Name("parallel"),
+            Help("Deprecated alias of --jobs"),
+            Def("0")));
 
     Command(
         publish,
@@ -1099,6 +1149,14 @@ static int parsePackageCommand(
             options->package.rest = getPositionalArray(cmd, 1);
         }
         UnloadCmd(cmd, options, PKG_TEST_CMD_LAYOUT);
+        if (options->package.parallel > 0) {
+            logWarning(log,
+                       NULL,
+                       "--parallel is deprecated, use --jobs instead",
+                       NULL);
+            if (options->package.jobs <= 1)
+                options->package.jobs = options->package.parallel;
+        }
     }
     else if (cmd->id == CMD_build) {
         options->package.subcmd = pkgSubBuild;
@@ -1467,7 +1525,17 @@ bool parseCommandLineOptions(
             Def("./plugins")),
         Str(Name("deps-dir"),
             Help("Directory containing installed package dependencies"),
-            Def(".cxy/packages")));
+            Def(".cxy/packages")),
+        Opt(Name("no-module-cache"),
+            Help("Do not reuse or store parsed imported modules and converted "
+                 "C headers in the build directory cache")),
+        Str(Name("daemon"),
+            Help("Forward build and test commands to the compile daemon "
+                 "listening on the given socket (default: $CXY_DAEMON_SOCKET)"),
+            Def("")),
+        Opt(Name("no-rc-elision"),
+            Help("Keep every reference count operation inserted by the "
+                 "memory manager")));
 
     P->ctx = options;
     P->strdup = cmdStrdup;
@@ -1528,6 +1596,13 @@ bool parseCommandLineOptions(
         options->sources = getPositionalArray(cmd, 0);
         UnloadCmd(cmd, options, TEST_CMD_LAYOUT);
     }
+    else if (cmd->id == CMD_daemon) {
+        options->cmd = cmdDaemon;
+        options->sources = getPositionalArray(cmd, 0);
+        UnloadCmd(cmd, options, DAEMON_CMD_LAYOUT);
+        // Keep the daemon's generated code away from regular builds
+        options->output = makeString(strings, "cxy-daemon");
+    }
     else if (cmd->id == CMD_package) {
         // This should not be reached due to early interception
         logError(
@@ -1557,6 +1632,12 @@ bool parseCommandLineOptions(
     options->libDir = getGlobalString(cmd, 20);
     options->pluginsDir = getGlobalString(cmd, 21);
     options->depsDir = getGlobalString(cmd, 22);
+    options->noModuleCache = getGlobalOption(cmd, 23);
+    options->daemonSocket = getGlobalString(cmd, 24);
+    options->noRcElision = getGlobalOption(cmd, 25);
+    if (options->daemonSocket == NULL)
+        options->daemonSocket =
+            makeString(strings, getenv("CXY_DAEMON_SOCKET"));
 
     if (options->libDir == NULL) {
         options->libDir = makeString(strings, getenv("CXY_STDLIB_DIR"));
@@ -1578,7 +1659,7 @@ bool parseCommandLineOptions(
 
     file_count = *argc - 1;
 
-    if (dynArrayEmpty(&options->sources)) {
+    if (options->cmd != cmdDaemon && dynArrayEmpty(&options->sources)) {
         logError(log,
                  NULL,
                  "no input file, run with '--help' to display usage",
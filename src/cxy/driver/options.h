@@ -17,6 +17,7 @@ typedef enum {
     cmdDev,
     cmdBuild,
     cmdTest,
+    cmdDaemon,
     cmdPackage,
     cmdUtils
 } Command;
@@ -125,6 +126,7 @@ typedef struct Options {
     bool withoutBuiltins;
     bool noPIE;
     bool withMemoryManager;
+    bool noRcElision;
     bool withMemoryTrace;
     bool debug;
     OptimizationLevel optimizationLevel;
@@ -134,6 +136,13 @@ typedef struct Options {
     DumpStatsMode dsmMode;
     cstring operatingSystem;
     bool buildPlugin;
+    bool noModuleCache;
+    u32 jobs; // > 0 compiles one C translation unit per module in parallel
+    cstring daemonSocket; // forward build/test commands to a compile daemon
+    struct {
+        cstring socket;
+        bool test;
+    } daemon;
     union {
         struct {
             bool printIR;
@@ -198,7 +207,8 @@ typedef struct Options {
             // test subcommand
             const char *buildDir; // Build directory for test binaries
             const char *filter;   // Run only tests matching pattern
-            int parallel;         // Run tests in parallel
+            int jobs;             // Number of test files to run in parallel
+            int parallel;         // Deprecated alias of jobs
             DynArray testFiles;   // Specific test files to run
             // publish subcommand
             const char *bump;    // Version bump: major, minor, patch
@@ -251,6 +251,28 @@ static AstNode *executeMemoryManagement(CompilerDriver *driver, AstNode *node)
     return node;
 }
 
+static AstNode *executeRcElision(CompilerDriver *driver, AstNode *node)
+{
+    csAssert0(nodeIs(node, Metadata));
+    if (!driver->options.withMemoryManager || driver->options.noRcElision)
+        return node;
+    if (!(node->metadata.stages & BIT(ccsMemoryMgmt))) {
+        logError(driver->L,
+                 builtinLoc(),
+                 "reference counts can only be elided after memory management",
+                 NULL);
+        return NULL;
+    }
+
+    node->metadata.node = elideRcAst(driver, node->metadata.node);
+
+    if (hasErrors(driver->L))
+        return NULL;
+
+    node->metadata.stages |= BIT(ccsRcElision);
+    return node;
+}
+
 static AstNode *executeGenerateCode(CompilerDriver *driver, AstNode *node)
 {
     csAssert0(nodeIs(node, Metadata));
@@ -396,6 +418,7 @@ static CompilerStageExecutor compilerStageExecutors[ccsCOUNT] = {
     [ccsSimplify] = executeSimplify,
     //[ccsLower] = executeLower,
     [ccsMemoryMgmt] = executeMemoryManagement,
+    [ccsRcElision] = executeRcElision,
     [ccsCodegen] = executeGenerateCode,
     // TODO causing issues
     // [ccsCollect] = executeCollect,
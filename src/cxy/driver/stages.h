@@ -27,6 +27,7 @@ struct CompilerDriver;
     f(TypeCheck,        "Type Check")                  \
     f(Simplify,         "Simplify")                    \
     f(MemoryMgmt,       "Memory Mgmt")                 \
+    f(RcElision,        "RC Elision")                  \
     f(Lower,            "Lower")                       \
     f(Finalize,         "Finalize")                    \
     f(Codegen,          "Code Gen")                    \
@@ -6,6 +6,8 @@
 
 #include "driver.h"
 
+#include "lang/frontend/ttable.h"
+
 #include <inttypes.h>
 
 #define BYTES_1KB 1000.0
@@ -78,6 +80,36 @@ void compilerStatsRecord(CompilerDriver *driver, CompilerStage stage)
     driver->stats.stages[stage].captured = true;
 }
 
+void compilerStatsRecordRcElision(struct CompilerDriver *driver,
+                                  cstring name,
+                                  u64 removed)
+{
+    DynArray *functions = &driver->stats.rcElision.functions;
+    if (functions->elemSize == 0)
+        *functions = newDynArray(sizeof(RcElisionStats));
+    pushOnDynArray(functions,
+                   &(RcElisionStats){.name = name, .removed = removed});
+    driver->stats.rcElision.removed += removed;
+}
+
+static void compilerPrintRcElision(const CompilerStats *stats)
+{
+    // clang-format off
+    printf("+---------------------------------------+-----------------------+\n");
+    printf("| Function                              | RC ops removed        |\n");
+    // clang-format on
+    dynArrayFor(func, RcElisionStats, &stats->rcElision.functions)
+    {
+        // clang-format off
+        printf("|---------------------------------------+-----------------------|\n");
+        // clang-format on
+        printf("| %-38s|%22" PRIu64 " |\n", func->name, func->removed);
+    }
+    // clang-format off
+    printf("+---------------------------------------+-----------------------+\n");
+    // clang-format on
+}
+
 void compilerStatsPrint(const struct CompilerDriver *driver)
 {
     const Options *options = &driver->options;
@@ -120,6 +152,8 @@ void compilerStatsPrint(const struct CompilerDriver *driver)
         // clang-format off
         printf("+---------------+-------------+----------------+----------------+\n");
         // clang-format on
+        if (driver->stats.rcElision.removed)
+            compilerPrintRcElision(&driver->stats);
         printf(cDEF);
     }
     else {
@@ -127,6 +161,53 @@ void compilerStatsPrint(const struct CompilerDriver *driver)
         printf("   memory: ");
         compilerPrintSummarySize(&driver->stats);
         printf("\n   duration: %" PRIu64 " ms\n", driver->stats.duration);
+        if (driver->stats.moduleCache.hits || driver->stats.moduleCache.misses)
+            printf("   module cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+                   driver->stats.moduleCache.hits,
+                   driver->stats.moduleCache.misses);
+        if (driver->stats.cHeaderCache.hits ||
+            driver->stats.cHeaderCache.misses)
+            printf("   C header cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+                   driver->stats.cHeaderCache.hits,
+                   driver->stats.cHeaderCache.misses);
+        if (driver->stats.cHeaders.parsedFiles ||
+            driver->stats.cHeaders.reusedFiles)
+            printf("   C headers: %" PRIu64 " parsed (%g KB), %" PRIu64
+                   " reused (%g KB)\n",
+                   driver->stats.cHeaders.parsedFiles,
+                   BYTES_TO_KB(driver->stats.cHeaders.parsedBytes),
+                   driver->stats.cHeaders.reusedFiles,
+                   BYTES_TO_KB(driver->stats.cHeaders.reusedBytes));
+        if (driver->stats.objectCache.hits || driver->stats.objectCache.misses)
+            printf("   object cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+                   driver->stats.objectCache.hits,
+                   driver->stats.objectCache.misses);
+        if (driver->stats.unitCache.hits || driver->stats.unitCache.misses)
+            printf("   unit cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+                   driver->stats.unitCache.hits,
+                   driver->stats.unitCache.misses);
+        if (driver->stats.objectCache.evicted)
+            printf("   evicted objects: %" PRIu64 "\n",
+                   driver->stats.objectCache.evicted);
+        if (driver->types && driver->types->stats.lookups)
+            printf("   type table: %zu types, %" PRIu64
+                   " lookups (%.1f%% hits)\n",
+                   driver->types->types.size,
+                   driver->types->stats.lookups,
+                   100.0 * (double)driver->types->stats.hits /
+                       (double)driver->types->stats.lookups);
+        if (driver->types && driver->types->stats.instantiations)
+            printf("   generics: %" PRIu64 " instantiated, %" PRIu64
+                   " reused (%.1f%%)\n",
+                   driver->types->stats.instantiations,
+                   driver->types->stats.reusedInstantiations,
+                   100.0 * (double)driver->types->stats.reusedInstantiations /
+                       (double)(driver->types->stats.instantiations +
+                                driver->types->stats.reusedInstantiations));
+        if (driver->stats.rcElision.removed)
+            printf("   rc elision: %" PRIu64 " ops removed in %zu functions\n",
+                   driver->stats.rcElision.removed,
+                   driver->stats.rcElision.functions.size);
         printf(cDEF);
     }
 }
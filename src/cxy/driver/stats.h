@@ -17,12 +17,45 @@ typedef struct {
     MemPoolStats poolStats;
 } StatsSnapshot;
 
+typedef struct {
+    cstring name;
+    u64 removed;
+} RcElisionStats;
+
 typedef struct CompilerStats {
     struct {
         bool captured;
         MemPoolStats pool;
     } stages[ccsCOUNT];
     StatsSnapshot snapshot;
+    struct {
+        u64 hits;
+        u64 misses;
+    } moduleCache;
+    struct {
+        u64 hits;
+        u64 misses;
+    } cHeaderCache;
+    struct {
+        u64 parsedFiles;
+        u64 parsedBytes;
+        u64 reusedFiles;
+        u64 reusedBytes;
+    } cHeaders;
+    struct {
+        u64 hits;
+        u64 misses;
+        // stale objects removed from the cache after the build
+        u64 evicted;
+    } objectCache;
+    struct {
+        u64 hits;
+        u64 misses;
+    } unitCache;
+    struct {
+        u64 removed;
+        DynArray functions;
+    } rcElision;
     struct timespec start;
     u64 duration;
 } CompilerStats;
@@ -32,6 +65,9 @@ void stopCompilerStats(struct CompilerDriver *driver);
 void compilerStatsSnapshot(struct CompilerDriver *driver);
 void compilerStatsRecord(struct CompilerDriver *driver, CompilerStage stage);
 void compilerStatsPrint(const struct CompilerDriver *driver);
+void compilerStatsRecordRcElision(struct CompilerDriver *driver,
+                                  cstring name,
+                                  u64 removed);
 
 
 
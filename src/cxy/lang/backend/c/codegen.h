@@ -9,9 +9,16 @@
 typedef struct TypeGraph TypeGraph;
 
 typedef struct CBackend {
+    // The generated C file, or the header shared by all the translation units
+    // when generating one translation unit per module
     cstring filename;
     FILE *output;
     bool testMode;
+    bool splitUnits;
+    // Declarations of all the functions and variables (split units only)
+    FormatState decls;
+    // Paths of the generated translation units (split units only)
+    DynArray units;
 } CBackend;
 
 typedef struct CodegenContext {
@@ -34,3 +41,18 @@ typedef struct CodegenContext {
 
 void preCodeGen(TypeGraph *g, const AstNode *node);
 
+/**
+ * Index of the declarations in the header shared by the translation units,
+ * used to key a unit's object on the part of the header it depends on: the
+ * prefix (the prologue) and the declarations the unit names, transitively,
+ * whatever their order in the header.
+ */
+typedef struct SharedHeader SharedHeader;
+
+SharedHeader *newSharedHeader(const char *text, size_t size, size_t prefixSize);
+void freeSharedHeader(SharedHeader *header);
+void hashUnitDependencies(SharedHeader *header,
+                          const char *unit,
+                          size_t size,
+                          HashCode *lo,
+                          HashCode *hi);
@@ -16,13 +16,30 @@
 #include "codegen.h"
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #define getState(ctx) &(ctx)->state
 #define typeState(ctx) &(ctx)->types
 
+// The shared header starts with the pragma and the prologue, which are the
+// same for every build made by this compiler
+#define SPLIT_UNITS_HEADER_PRAGMA "#pragma once\n\n"
+#define SPLIT_UNITS_HEADER_PREFIX_SIZE                                         \
+    (sizeof(SPLIT_UNITS_HEADER_PRAGMA) - 1 + CXY_PROLOGUE_SOURCE_SIZE - 1)
+
+// Bounds of the object cache shared by the native sources and the units
+#define OBJECT_CACHE_MAX_AGE (14 * 24 * 60 * 60)
+#define OBJECT_CACHE_MAX_SIZE (1024ull << 20)
+#define OBJECT_CACHE_TMP_MAX_AGE (60 * 60)
+
 static void generateType(CodegenContext *ctx, const Type *type);
 static void generateTypeName(CodegenContext *ctx,
                              FormatState *state,
@@ -1930,12 +1947,58 @@ static void visitFuncParamDecl(ConstAstVisitor *visitor, const AstNode *node)
     }
 }
 
+static void swapDeclarationsState(CodegenContext *ctx)
+{
+    // Redirects the output to (or back from) the declarations shared by all
+    // the translation units
+    FormatState state = ctx->state;
+    ctx->state = ctx->backend->decls;
+    ctx->backend->decls = state;
+}
+
+static void generateFunctionSignature(ConstAstVisitor *visitor,
+                                      const AstNode *node)
+{
+    CodegenContext *ctx = getConstAstVisitorContext(visitor);
+    generateTypeName(ctx, getState(ctx), node->type->func.retType);
+    format(getState(ctx), " ", NULL);
+    generateFunctionName(getState(ctx), node);
+    generateMany(visitor, node->funcDecl.signature->params, "(", ", ", ")");
+}
+
+static void generateGlobalVariableDecl(CodegenContext *ctx,
+                                       const AstNode *node)
+{
+    if (hasFlag(node, Comptime) || hasFlag(node, Extern))
+        return;
+
+    format(getState(ctx), "extern ", NULL);
+    if (findAttribute(node, S_volatile))
+        format(getState(ctx), "volatile ", NULL);
+    if (findAttribute(node, S_thread))
+        format(getState(ctx), "__thread ", NULL);
+    generateTypeName(ctx, getState(ctx), unwrapType(node->type, NULL));
+    format(getState(ctx), " ", NULL);
+    generateVariableName(getState(ctx), node);
+    format(getState(ctx), ";\n", NULL);
+}
+
 static void visitExternDecl(ConstAstVisitor *visitor, const AstNode *node)
 {
     CodegenContext *ctx = getConstAstVisitorContext(visitor);
     AstNode *decl = node->externDecl.func;
     if (decl->codegen)
         return;
+
+    bool shared = ctx->backend->splitUnits;
+    if (shared) {
+        // Functions defined by the program are declared in the shared header
+        // alongside their definition
+        if (!hasFlag(decl, Extern))
+            return;
+        swapDeclarationsState(ctx);
+    }
+
     if (nodeIs(decl, FuncDecl)) {
         if (hasFlag(decl, Extern))
             decl->codegen = (void *)true;
@@ -1957,6 +2020,9 @@ static void visitExternDecl(ConstAstVisitor *visitor, const AstNode *node)
         generateVariableName(getState(ctx), decl);
     }
     format(getState(ctx), ";\n", NULL);
+
+    if (shared)
+        swapDeclarationsState(ctx);
 }
 
 static void visitFuncDecl(ConstAstVisitor *visitor, const AstNode *node)
@@ -1965,6 +2031,23 @@ static void visitFuncDecl(ConstAstVisitor *visitor, const AstNode *node)
     ((AstNode *)node)->codegen = (void *)true;
     if (hasFlag(node, Abstract))
         return;
+
+    bool shared = ctx->backend->splitUnits;
+    if (shared) {
+        // Every function gets external linkage and is declared in the
+        // header shared by all the translation units
+        if (hasFlag(node, Extern) && findAttribute(node, S_hint))
+            return;
+        swapDeclarationsState(ctx);
+        if (hasFlag(node, Extern))
+            format(getState(ctx), "extern ", NULL);
+        generateFunctionSignature(visitor, node);
+        format(getState(ctx), ";\n", NULL);
+        swapDeclarationsState(ctx);
+        if (hasFlag(node, Extern))
+            return;
+    }
+
     if (!hasFlag(node, Extern)) {
         if (hasFlag(node, Constructor))
             format(getState(ctx), "__attribute__((constructor))\n", NULL);
@@ -1979,17 +2062,14 @@ static void visitFuncDecl(ConstAstVisitor *visitor, const AstNode *node)
                    " __attribute__((optnone))",
                    (FormatArg[]){{.u128 = value->intLiteral.uValue}});
         }
-        format(getState(ctx), "\nstatic ", NULL);
+        format(getState(ctx), shared ? "\n" : "\nstatic ", NULL);
     }
     else {
         if (findAttribute(node, S_hint))
             return;
         format(getState(ctx), "extern ", NULL);
     }
-    generateTypeName(ctx, getState(ctx), node->type->func.retType);
-    format(getState(ctx), " ", NULL);
-    generateFunctionName(getState(ctx), node);
-    generateMany(visitor, node->funcDecl.signature->params, "(", ", ", ")");
+    generateFunctionSignature(visitor, node);
     if (hasFlag(node, Extern)) {
         format(getState(ctx), ";", NULL);
     }
@@ -2077,6 +2157,16 @@ static void visitProgram(ConstAstVisitor *visitor, const AstNode *node)
         freeTypeGraph(&g);
     }
 
+    if (ctx->backend->splitUnits) {
+        swapDeclarationsState(ctx);
+        for (const AstNode *decl = node->program.decls; decl;
+             decl = decl->next) {
+            if (nodeIs(decl, VarDecl))
+                generateGlobalVariableDecl(ctx, decl);
+        }
+        swapDeclarationsState(ctx);
+    }
+
     generateMany(visitor, node->program.decls, NULL, NULL, NULL);
     cstring moduleName =
         node->program.module ? node->program.module->moduleDecl.name : NULL;
@@ -2085,6 +2175,42 @@ static void visitProgram(ConstAstVisitor *visitor, const AstNode *node)
         generateTestMainFunction(ctx, node->loc.fileName, moduleName);
 }
 
+static bool generateTranslationUnit(CompilerDriver *driver,
+                                    const FormatState *code)
+{
+    CBackend *backend = driver->backend;
+    char path[PATH_MAX];
+    cstring ext = strrchr(backend->filename, '.');
+    snprintf(path,
+             sizeof(path),
+             "%.*s.%zu.c",
+             (int)(ext - backend->filename),
+             backend->filename,
+             backend->units.size);
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        logError(driver->L,
+                 NULL,
+                 "creating output file '{s}' failed: '{s}'",
+                 (FormatArg[]){{.s = path}, {.s = strerror(errno)}});
+        return false;
+    }
+
+    // Units are generated next to the header
+    cstring header = strrchr(backend->filename, '/');
+    fprintf(f, "#include \"%s\"\n\n", header ? header + 1 : backend->filename);
+    writeFormatState(code, f);
+    // Provides main for the main module and the helpers declared in the
+    // prologue to every unit
+    fwrite(CXY_EPILOGUE_SOURCE, 1, CXY_EPILOGUE_SOURCE_SIZE - 1, f);
+    fclose(f);
+
+    cstring unit = makeString(driver->strings, path);
+    pushOnDynArray(&backend->units, &unit);
+    return true;
+}
+
 AstNode *generateCode(CompilerDriver *driver, AstNode *node)
 {
     CBackend *backend = driver->backend;
@@ -2160,7 +2286,14 @@ AstNode *generateCode(CompilerDriver *driver, AstNode *node)
 
     astConstVisit(&visitor, node->metadata.node);
     writeFormatState(&context.types, backend->output);
-    writeFormatState(&context.state, backend->output);
+    if (backend->splitUnits) {
+        if (!generateTranslationUnit(driver, &context.state)) {
+            node = NULL;
+        }
+    }
+    else {
+        writeFormatState(&context.state, backend->output);
+    }
     freeFormatState(&context.state);
     freeFormatState(&context.types);
     return node;
@@ -2219,24 +2352,33 @@ static void generateCodeEpilogue(FILE *f)
     appendCode(f, "\n");
 }
 
-void *initCompilerBackend(CompilerDriver *driver, int argc, char **argv)
+static cstring getBackendFilename(CompilerDriver *driver, bool splitUnits)
 {
-    csAssert0(driver->backend == NULL);
     Options *options = &driver->options;
-    cstring filename = NULL;
+    cstring ext = splitUnits ? ".h" : ".c";
     if (options->output == NULL) {
-        filename =
-            joinPath(driver->strings, options->buildDir ?: "./", "app.c");
+        return joinPath(driver->strings,
+                        options->buildDir ?: "./",
+                        makeStringConcat(driver->strings, "app", ext));
     }
     else if (options->output[0] == '/') {
-        filename = makeStringConcat(driver->strings, options->output, ".c");
+        return makeStringConcat(driver->strings, options->output, ext);
     }
     else {
-        filename =
-            joinPath(driver->strings,
-                     options->buildDir ?: "./",
-                     makeStringConcat(driver->strings, options->output, ".c"));
+        return joinPath(
+            driver->strings,
+            options->buildDir ?: "./",
+            makeStringConcat(driver->strings, options->output, ext));
     }
+}
+
+void *initCompilerBackend(CompilerDriver *driver, int argc, char **argv)
+{
+    csAssert0(driver->backend == NULL);
+    Options *options = &driver->options;
+    bool splitUnits = options->jobs > 0 &&
+                      (options->cmd == cmdBuild || options->cmd == cmdTest);
+    cstring filename = getBackendFilename(driver, splitUnits);
 
     struct stat st;
     if (stat(filename, &st) == 0) {
@@ -2257,39 +2399,103 @@ void *initCompilerBackend(CompilerDriver *driver, int argc, char **argv)
     backend->output = f;
     backend->filename = filename;
     backend->testMode = options->cmd == cmdTest;
+    backend->splitUnits = splitUnits;
+    if (splitUnits) {
+        backend->decls = newFormatState("  ", true);
+        backend->units = newDynArray(sizeof(cstring));
+        fputs(SPLIT_UNITS_HEADER_PRAGMA, f);
+    }
     fwrite(CXY_PROLOGUE_SOURCE, 1, CXY_PROLOGUE_SOURCE_SIZE - 1, f);
     return backend;
 }
 
+bool compilerBackendRetarget(CompilerDriver *driver)
+{
+    CBackend *backend = (CBackend *)driver->backend;
+    if (backend == NULL || backend->splitUnits || backend->output == NULL)
+        return false;
+
+    cstring filename = getBackendFilename(driver, false);
+    if (strcmp(filename, backend->filename) == 0) {
+        logError(driver->L,
+                 NULL,
+                 "output file '{s}' is already used by the compiler",
+                 (FormatArg[]){{.s = filename}});
+        return false;
+    }
+
+    FILE *f = fopen(filename, "w+");
+    if (f == NULL) {
+        logError(driver->L,
+                 NULL,
+                 "creating output file '{s}' failed: '{s}'",
+                 (FormatArg[]){{.s = filename}, {.s = strerror(errno)}});
+        return false;
+    }
+
+    // The file offset is shared with the process that generated the code so
+    // far, read it without moving it
+    char buf[BUFSIZ];
+    ssize_t n;
+    off_t offset = 0;
+    int fd = fileno(backend->output);
+    fflush(backend->output);
+    while ((n = pread(fd, buf, sizeof(buf), offset)) > 0) {
+        fwrite(buf, 1, n, f);
+        offset += n;
+    }
+
+    fclose(backend->output);
+    backend->output = f;
+    backend->filename = filename;
+    backend->testMode = driver->options.cmd == cmdTest;
+    if (n < 0) {
+        logError(driver->L,
+                 NULL,
+                 "copying generated code to '{s}' failed: '{s}'",
+                 (FormatArg[]){{.s = filename}, {.s = strerror(errno)}});
+        return false;
+    }
+    return true;
+}
+
+static void closeSplitUnitsHeader(CBackend *backend)
+{
+    // Declarations go last as they depend on all the generated types
+    if (backend->output) {
+        writeFormatState(&backend->decls, backend->output);
+        fclose(backend->output);
+        backend->output = NULL;
+    }
+}
+
 void deinitCompilerBackend(CompilerDriver *driver)
 {
     if (driver->backend == NULL)
         return;
     CBackend *backend = (CBackend *)driver->backend;
     driver->backend = NULL;
-    if (backend->output) {
+    if (backend->splitUnits) {
+        closeSplitUnitsHeader(backend);
+        freeFormatState(&backend->decls);
+        freeDynArray(&backend->units);
+    }
+    else if (backend->output) {
         fwrite(
             CXY_EPILOGUE_SOURCE, 1, CXY_EPILOGUE_SOURCE_SIZE, backend->output);
         fclose(backend->output);
     }
 }
 
-bool compilerBackendMakeExecutable(CompilerDriver *driver)
+static void appendCompileFlags(FormatState *cmd, const Options *opts)
 {
-    if (driver->backend == NULL)
-        return false;
-    CBackend *backend = (CBackend *)driver->backend;
-    // compile the source file
-    Options *opts = &driver->options;
-    FormatState cmd = newFormatState("\t", true);
-    appendString(&cmd, "clang");
     if (opts->debug)
-        appendString(&cmd, " -g");
+        appendString(cmd, " -g");
     if (opts->optimizationLevel != O0)
-        format(&cmd, " -O{c}", (FormatArg[]){{.c = opts->optimizationLevel}});
+        format(cmd, " -O{c}", (FormatArg[]){{.c = opts->optimizationLevel}});
 
     for (int i = 0; i < opts->cDefines.size; i++) {
-        format(&cmd,
+        format(cmd,
                " {s}",
                (FormatArg[]){
                    {.s = dynArrayAt(const char **, &opts->cDefines, i)}});
@@ -2297,56 +2503,499 @@ bool compilerBackendMakeExecutable(CompilerDriver *driver)
 
     for (int i = 0; i < opts->cflags.size; i++) {
         format(
-            &cmd,
+            cmd,
             " {s}",
             (FormatArg[]){{.s = dynArrayAt(const char **, &opts->cflags, i)}});
     }
 
+    for (int i = 0; i < opts->frameworkSearchPaths.size; i++) {
+        format(cmd,
+               " -I{s}",
+               (FormatArg[]){{.s = dynArrayAt(const char **,
+                                              &opts->frameworkSearchPaths,
+                                              i)}});
+    }
+
+    for (int i = 0; i < opts->importSearchPaths.size; i++) {
+        format(
+            cmd,
+            " -I{s}",
+            (FormatArg[]){
+                {.s = dynArrayAt(const char **, &opts->importSearchPaths, i)}});
+    }
+}
+
+static void appendLibraryFlags(FormatState *cmd, const Options *opts)
+{
     for (int i = 0; i < opts->librarySearchPaths.size; i++) {
         format(
-            &cmd,
+            cmd,
             " -L{s}",
             (FormatArg[]){{.s = dynArrayAt(
                                const char **, &opts->librarySearchPaths, i)}});
     }
 
     for (int i = 0; i < opts->libraries.size; i++) {
-        format(&cmd,
+        format(cmd,
                " -l{s}",
                (FormatArg[]){
                    {.s = dynArrayAt(const char **, &opts->libraries, i)}});
     }
+}
 
-    for (int i = 0; i < opts->frameworkSearchPaths.size; i++) {
-        format(&cmd,
-               " -I{s}",
-               (FormatArg[]){{.s = dynArrayAt(const char **,
-                                              &opts->frameworkSearchPaths,
-                                              i)}});
+static void appendLinkLibraries(FormatState *cmd, CompilerDriver *driver)
+{
+    HashtableIt it = newHashTableIt(&driver->linkLibraries, sizeof(cstring));
+    while (hashTableItHasNext(&it)) {
+        cstring *lib = hashTableItNext(&it);
+        format(cmd, " -l{s}", (FormatArg[]){{.s = *lib}});
     }
+}
 
-    for (int i = 0; i < opts->importSearchPaths.size; i++) {
-        format(
-            &cmd,
-            " -I{s}",
-            (FormatArg[]){
-                {.s = dynArrayAt(const char **, &opts->importSearchPaths, i)}});
+static inline bool isPrebuiltNativeSource(cstring source)
+{
+    cstring ext = strrchr(source, '.');
+    return ext != NULL &&
+           (strcmp(ext, ".o") == 0 || strcmp(ext, ".a") == 0 ||
+            strcmp(ext, ".so") == 0 || strcmp(ext, ".dylib") == 0);
+}
+
+static char *makeCompileCommand(cstring flags, cstring source, cstring object)
+{
+    FormatState cmd = newFormatState("\t", true);
+    format(&cmd,
+           "clang{s} -c {s} -o {s}",
+           (FormatArg[]){{.s = flags}, {.s = source}, {.s = object}});
+    char *command = formatStateToString(&cmd);
+    freeFormatState(&cmd);
+    return command;
+}
+
+static bool isNativeObjectFresh(cstring object)
+{
+    char path[PATH_MAX];
+    struct stat objectStat, depStat;
+    size_t size = 0;
+
+    if (stat(object, &objectStat) != 0)
+        return false;
+    snprintf(path, sizeof(path), "%s.d", object);
+    char *deps = readFile(path, &size);
+    if (deps == NULL)
+        return false;
+
+    // Make style dependency list written by the compiler, the first token is
+    // the target, all the others are the source and the headers it included
+    bool fresh = true;
+    char *save = NULL;
+    char *dep = strtok_r(deps, " \t\r\n\\", &save);
+    while (fresh && (dep = strtok_r(NULL, " \t\r\n\\", &save)) != NULL) {
+        fresh = stat(dep, &depStat) == 0 &&
+                (depStat.st_mtim.tv_sec < objectStat.st_mtim.tv_sec ||
+                 (depStat.st_mtim.tv_sec == objectStat.st_mtim.tv_sec &&
+                  depStat.st_mtim.tv_nsec <= objectStat.st_mtim.tv_nsec));
+    }
+    free(deps);
+    return fresh;
+}
+
+static cstring getNativeObjectPath(CompilerDriver *driver,
+                                   cstring cacheDir,
+                                   cstring flags,
+                                   cstring source)
+{
+    size_t size = 0;
+    char *data = readFile(source, &size);
+    if (data == NULL)
+        return NULL;
+
+    // Two differently seeded hashes make up a 64-bit content address
+    HashCode lo = hashStr(hashStr(hashInit(), flags), source),
+             hi = hashStr(hashStr(0x9E3779B9u, source), flags);
+    lo = hashRawBytes(lo, data, size);
+    hi = hashRawBytes(hi, data, size);
+    free(data);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%08x%08x.o", cacheDir, hi, lo);
+    return makeString(driver->strings, path);
+}
+
+static cstring getObjectCacheDir(CompilerDriver *driver)
+{
+    Options *opts = &driver->options;
+    char path[PATH_MAX];
+    if (opts->buildDir == NULL || opts->buildDir[0] == '\0')
+        return NULL;
+
+    snprintf(path, sizeof(path), "%s/cache/objects", opts->buildDir);
+    if (!makeDirectory(path, true))
+        return NULL;
+    return makeString(driver->strings, path);
+}
+
+typedef struct {
+    cstring path;
+    time_t mtime;
+    off_t size;
+} CachedObject;
+
+static int compareCachedObjects(const void *lhs, const void *rhs)
+{
+    const CachedObject *a = lhs, *b = rhs;
+    return a->mtime < b->mtime ? -1 : (a->mtime > b->mtime ? 1 : 0);
+}
+
+static void markCachedObjectUsed(cstring object)
+{
+    // Eviction goes by modification time, reused entries are the youngest
+    utimensat(AT_FDCWD, object, NULL, 0);
+}
+
+static void removeCachedObject(cstring object)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.d", object);
+    unlink(object);
+    unlink(path);
+}
+
+/**
+ * Evicts the objects of `{buildDir}/cache/objects` that no build used for
+ * OBJECT_CACHE_MAX_AGE, then the least recently used ones until the cache
+ * fits in OBJECT_CACHE_MAX_SIZE. Objects used by the current build (since
+ * `started`) are always kept, as well as the temporary files of compilations
+ * that might still be running.
+ */
+static void pruneObjectCache(CompilerDriver *driver, time_t started)
+{
+    cstring cacheDir = getObjectCacheDir(driver);
+    DIR *dir = cacheDir != NULL ? opendir(cacheDir) : NULL;
+    if (dir == NULL)
+        return;
+
+    time_t now = time(NULL);
+    DynArray objects = newDynArray(sizeof(CachedObject));
+    u64 total = 0;
+    char path[PATH_MAX];
+    struct dirent *entry;
+    struct stat st;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        snprintf(path, sizeof(path), "%s/%s", cacheDir, entry->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        if (len > 4 && strcmp(entry->d_name + len - 4, ".tmp") == 0) {
+            // left behind by an interrupted compilation
+            if (st.st_mtime + OBJECT_CACHE_TMP_MAX_AGE < now)
+                unlink(path);
+        }
+        else if (len > 2 && strcmp(entry->d_name + len - 2, ".o") == 0) {
+            total += st.st_size;
+            CachedObject object = {.path = makeString(driver->strings, path),
+                                   .mtime = st.st_mtime,
+                                   .size = st.st_size};
+            pushOnDynArray(&objects, &object);
+        }
+    }
+    closedir(dir);
+
+    qsort(objects.elems,
+          objects.size,
+          sizeof(CachedObject),
+          compareCachedObjects);
+    for (u64 i = 0; i < objects.size; i++) {
+        CachedObject *object = &dynArrayAt(CachedObject *, &objects, i);
+        if (object->mtime >= started)
+            break;
+        if (object->mtime + OBJECT_CACHE_MAX_AGE >= now &&
+            total <= OBJECT_CACHE_MAX_SIZE)
+            break;
+        removeCachedObject(object->path);
+        total -= MIN(total, (u64)object->size);
+        driver->stats.objectCache.evicted++;
     }
+    freeDynArray(&objects);
+}
+
+static char *makeCachedCompileCommand(cstring flags,
+                                      cstring source,
+                                      cstring object,
+                                      bool deps)
+{
+    // Build into a temporary file so that an interrupted compilation never
+    // leaves a truncated entry behind
+    FormatState cmd = newFormatState("\t", true);
+    format(&cmd, "clang{s}", (FormatArg[]){{.s = flags}});
+    if (deps)
+        format(&cmd, " -MMD -MF {s}.d", (FormatArg[]){{.s = object}});
+    format(&cmd,
+           " -c {s} -o {s}.{u}.tmp && mv -f {s}.{u}.tmp {s}",
+           (FormatArg[]){{.s = source},
+                         {.s = object},
+                         {.u = getpid()},
+                         {.s = object},
+                         {.u = getpid()},
+                         {.s = object}});
+    char *command = formatStateToString(&cmd);
+    freeFormatState(&cmd);
+    return command;
+}
+
+/**
+ * Resolves the object file to link for a generated translation unit. The
+ * object is content addressed by the compile flags, the unit and the part of
+ * the shared header the unit depends on (the prologue and the declarations
+ * it names, directly or through other declarations). Adding or changing a
+ * module therefore only recompiles the units that use what changed, the
+ * others, including the generic instantiations they host, keep their
+ * objects. Units only include the shared header and the system headers
+ * pulled in by the prologue, hence an entry never goes stale.
+ */
+static cstring getUnitObjectPath(CompilerDriver *driver,
+                                 cstring cacheDir,
+                                 cstring flags,
+                                 SharedHeader *header,
+                                 cstring unit)
+{
+    size_t size = 0;
+    char *data = readFile(unit, &size);
+    if (data == NULL)
+        return NULL;
 
+    HashCode lo = hashStr(hashStr(hashInit(), flags), unit),
+             hi = hashStr(hashStr(0x9E3779B9u, unit), flags);
+    hashUnitDependencies(header, data, size, &lo, &hi);
+    free(data);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/unit-%08x%08x.o", cacheDir, hi, lo);
+    return makeString(driver->strings, path);
+}
+
+/**
+ * Resolves the object file to link for each native source added with
+ * `@__cc`. Sources are compiled into a content addressed cache under
+ * `{buildDir}/cache/objects/` keyed on the source contents and the compile
+ * flags (defines, optimization level and cflags), an entry is reused as long
+ * as none of the headers it included changed. Without a build directory the
+ * objects are written next to the generated code and always rebuilt.
+ */
+static void collectNativeObjects(CompilerDriver *driver,
+                                 CBackend *backend,
+                                 cstring flags,
+                                 DynArray *objects,
+                                 DynArray *commands)
+{
+    cstring cacheDir = getObjectCacheDir(driver);
+    char path[PATH_MAX];
+
+    cstring ext = strrchr(backend->filename, '.');
+    int baseLen = (int)(ext - backend->filename);
     HashtableIt it = newHashTableIt(&driver->nativeSources, sizeof(cstring));
-    while (hashTableItHasNext(&it)) {
-        cstring *src = hashTableItNext(&it);
-        format(&cmd, " {s}", (FormatArg[]){{.s = *src}});
+    for (u64 i = 0; hashTableItHasNext(&it); i++) {
+        cstring source = *((cstring *)hashTableItNext(&it));
+        if (isPrebuiltNativeSource(source)) {
+            pushOnDynArray(objects, &source);
+            continue;
+        }
+
+        cstring object = NULL;
+        if (cacheDir != NULL)
+            object = getNativeObjectPath(driver, cacheDir, flags, source);
+        if (object == NULL) {
+            snprintf(path,
+                     sizeof(path),
+                     "%.*s.native.%" PRIu64 ".o",
+                     baseLen,
+                     backend->filename,
+                     i);
+            object = makeString(driver->strings, path);
+            char *command = makeCompileCommand(flags, source, object);
+            pushOnDynArray(commands, &command);
+        }
+        else if (isNativeObjectFresh(object)) {
+            markCachedObjectUsed(object);
+            driver->stats.objectCache.hits++;
+        }
+        else {
+            char *command =
+                makeCachedCompileCommand(flags, source, object, true);
+            pushOnDynArray(commands, &command);
+            driver->stats.objectCache.misses++;
+        }
+        pushOnDynArray(objects, &object);
     }
+}
 
-    format(&cmd, " {s}", (FormatArg[]){{.s = backend->filename}});
+static bool makeExecutableFromUnits(CompilerDriver *driver, CBackend *backend)
+{
+    Options *opts = &driver->options;
+    time_t started = time(NULL);
+    closeSplitUnitsHeader(backend);
+
+    FormatState state = newFormatState("\t", true);
+    appendCompileFlags(&state, opts);
+    char *flags = formatStateToString(&state);
+    freeFormatState(&state);
+
+    DynArray commands = newDynArray(sizeof(char *)),
+             objects = newDynArray(sizeof(cstring));
+    u64 unitsCount = backend->units.size;
+    char path[PATH_MAX];
+    size_t headerSize = 0;
+    cstring cacheDir = getObjectCacheDir(driver);
+    char *text =
+        cacheDir != NULL ? readFile(backend->filename, &headerSize) : NULL;
+    SharedHeader *header =
+        text != NULL
+            ? newSharedHeader(text, headerSize, SPLIT_UNITS_HEADER_PREFIX_SIZE)
+            : NULL;
+
+    for (u64 i = 0; i < unitsCount; i++) {
+        cstring unit = dynArrayAt(cstring *, &backend->units, i);
+        cstring object = NULL;
+        if (header != NULL)
+            object = getUnitObjectPath(driver, cacheDir, flags, header, unit);
+
+        char *command = NULL;
+        if (object == NULL) {
+            snprintf(
+                path, sizeof(path), "%.*s.o", (int)strlen(unit) - 2, unit);
+            object = makeString(driver->strings, path);
+            command = makeCompileCommand(flags, unit, object);
+        }
+        else if (access(object, F_OK) == 0) {
+            markCachedObjectUsed(object);
+            driver->stats.unitCache.hits++;
+        }
+        else {
+            command = makeCachedCompileCommand(flags, unit, object, false);
+            driver->stats.unitCache.misses++;
+        }
+        if (command != NULL)
+            pushOnDynArray(&commands, &command);
+        pushOnDynArray(&objects, &object);
+    }
+    freeSharedHeader(header);
+    free(text);
+    collectNativeObjects(driver, backend, flags, &objects, &commands);
+    free(flags);
+
+    u32 jobs = MIN(opts->jobs, commands.size);
+    printStatus(driver->L,
+                cWHT "Compiling %zu translation units (%zu modules) using "
+                     "%u jobs" cDEF,
+                commands.size,
+                unitsCount,
+                jobs);
+    i64 failed = execParallel(
+        (const char *const *)commands.elems, commands.size, jobs);
+    if (failed >= 0) {
+        logError(driver->L,
+                 builtinLoc(),
+                 "compile command failed: {s}",
+                 (FormatArg[]){{.s = dynArrayAt(char **, &commands, failed)}});
+    }
+
+    for (u64 i = 0; i < commands.size; i++)
+        free(dynArrayAt(char **, &commands, i));
+    freeDynArray(&commands);
+
+    bool status = failed < 0;
+    if (status) {
+        FormatState cmd = newFormatState("\t", true);
+        appendString(&cmd, "clang");
+        if (opts->debug)
+            appendString(&cmd, " -g");
+        for (int i = 0; i < opts->cflags.size; i++) {
+            format(&cmd,
+                   " {s}",
+                   (FormatArg[]){
+                       {.s = dynArrayAt(const char **, &opts->cflags, i)}});
+        }
+        for (u64 i = 0; i < objects.size; i++) {
+            format(&cmd,
+                   " {s}",
+                   (FormatArg[]){{.s = dynArrayAt(cstring *, &objects, i)}});
+        }
+        appendLibraryFlags(&cmd, opts);
+        appendLinkLibraries(&cmd, driver);
+        appendString(&cmd, " -o ");
+        getOutputPath(&cmd, driver->strings, opts, "");
+
+        char *command = formatStateToString(&cmd);
+        freeFormatState(&cmd);
+        if (system(command) != 0) {
+            logError(driver->L,
+                     builtinLoc(),
+                     "link command failed: {s}",
+                     (FormatArg[]){{.s = command}});
+            status = false;
+        }
+        free(command);
+    }
 
-    it = newHashTableIt(&driver->linkLibraries, sizeof(cstring));
-    while (hashTableItHasNext(&it)) {
-        cstring *lib = hashTableItNext(&it);
-        format(&cmd, " -l{s}", (FormatArg[]){{.s = *lib}});
+    freeDynArray(&objects);
+    if (status)
+        pruneObjectCache(driver, started);
+    return status;
+}
+
+bool compilerBackendMakeExecutable(CompilerDriver *driver)
+{
+    if (driver->backend == NULL)
+        return false;
+    CBackend *backend = (CBackend *)driver->backend;
+    if (backend->splitUnits)
+        return makeExecutableFromUnits(driver, backend);
+
+    // build the native sources that are not up to date in the object cache
+    Options *opts = &driver->options;
+    time_t started = time(NULL);
+    FormatState cmd = newFormatState("\t", true);
+    appendCompileFlags(&cmd, opts);
+    char *flags = formatStateToString(&cmd);
+    freeFormatState(&cmd);
+
+    DynArray commands = newDynArray(sizeof(char *)),
+             objects = newDynArray(sizeof(cstring));
+    collectNativeObjects(driver, backend, flags, &objects, &commands);
+    i64 failed = execParallel(
+        (const char *const *)commands.elems, commands.size, opts->jobs);
+    if (failed >= 0) {
+        logError(driver->L,
+                 builtinLoc(),
+                 "compile command failed: {s}",
+                 (FormatArg[]){{.s = dynArrayAt(char **, &commands, failed)}});
+    }
+    for (u64 i = 0; i < commands.size; i++)
+        free(dynArrayAt(char **, &commands, i));
+    freeDynArray(&commands);
+
+    if (failed >= 0) {
+        freeDynArray(&objects);
+        free(flags);
+        return false;
     }
 
+    // compile the source file
+    cmd = newFormatState("\t", true);
+    format(&cmd, "clang{s}", (FormatArg[]){{.s = flags}});
+    appendLibraryFlags(&cmd, opts);
+    free(flags);
+
+    for (u64 i = 0; i < objects.size; i++) {
+        format(&cmd,
+               " {s}",
+               (FormatArg[]){{.s = dynArrayAt(cstring *, &objects, i)}});
+    }
+    freeDynArray(&objects);
+
+    format(&cmd, " {s}", (FormatArg[]){{.s = backend->filename}});
+    appendLinkLibraries(&cmd, driver);
+
     appendString(&cmd, " -o ");
     getOutputPath(&cmd, driver->strings, opts, "");
 
@@ -2372,6 +3021,7 @@ bool compilerBackendMakeExecutable(CompilerDriver *driver)
     }
 
     free((void *)command);
+    pruneObjectCache(driver, started);
     return true;
 }
 
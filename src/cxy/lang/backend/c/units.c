@@ -0,0 +1,385 @@
+#include "codegen.h"
+
+#include "core/htable.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    const char *s;
+    u32 len;
+    bool ident;
+} HeaderToken;
+
+// A top level declaration in the generated part of the shared header
+typedef struct {
+    u32 first;
+    u32 count;
+    // hash of the declaration's tokens, comments and spacing left out
+    u64 digest;
+} HeaderDecl;
+
+// Maps a name to the declarations defining it, chained through `defs`
+typedef struct {
+    const char *s;
+    u32 len;
+    u32 head;
+} HeaderName;
+
+typedef struct {
+    u32 decl;
+    u32 next;
+} HeaderDef;
+
+struct SharedHeader {
+    const char *prefix;
+    size_t prefixSize;
+    DynArray tokens;
+    DynArray decls;
+    DynArray defs;
+    // Declarations nothing could be attributed to, every unit depends on them
+    DynArray always;
+    HashTable names;
+};
+
+#define NO_DEF UINT32_MAX
+
+static inline bool isIdentStart(char c) { return isalpha(c) || c == '_'; }
+
+static inline bool isIdentChar(char c) { return isalnum(c) || c == '_'; }
+
+/**
+ * Returns the next token of generated C code, comments are skipped and
+ * literals returned as a single token so that the words they contain are
+ * never mistaken for names.
+ */
+static bool nextToken(const char **pos, const char *end, HeaderToken *token)
+{
+    const char *p = *pos;
+    for (;;) {
+        while (p < end && isspace(*p))
+            p++;
+        if (p + 1 < end && p[0] == '/' && p[1] == '*') {
+            p += 2;
+            while (p + 1 < end && !(p[0] == '*' && p[1] == '/'))
+                p++;
+            p = p + 2 < end ? p + 2 : end;
+            continue;
+        }
+        if (p + 1 < end && p[0] == '/' && p[1] == '/') {
+            while (p < end && *p != '\n')
+                p++;
+            continue;
+        }
+        break;
+    }
+    if (p >= end)
+        return false;
+
+    const char *start = p;
+    token->ident = isIdentStart(*p);
+    if (token->ident || isdigit(*p)) {
+        // identifiers and numbers with their suffixes
+        while (p < end && (isIdentChar(*p) || *p == '.'))
+            p++;
+    }
+    else if (*p == '"' || *p == '\'') {
+        char quote = *p++;
+        while (p < end && *p != quote) {
+            if (*p == '\\' && p + 1 < end)
+                p++;
+            p++;
+        }
+        p = p < end ? p + 1 : end;
+    }
+    else {
+        p++;
+    }
+    token->s = start;
+    token->len = (u32)(p - start);
+    *pos = p;
+    return true;
+}
+
+static inline bool isToken(const HeaderToken *token, const char *s)
+{
+    return token->len == strlen(s) && memcmp(token->s, s, token->len) == 0;
+}
+
+static bool compareHeaderNames(const void *lhs, const void *rhs)
+{
+    const HeaderName *a = lhs, *b = rhs;
+    return a->len == b->len && memcmp(a->s, b->s, a->len) == 0;
+}
+
+static HeaderName *findHeaderName(const SharedHeader *header,
+                                  const HeaderToken *token)
+{
+    HeaderName name = {.s = token->s, .len = token->len};
+    return findInHashTable(&header->names,
+                           &name,
+                           hashRawBytes(hashInit(), name.s, name.len),
+                           sizeof(HeaderName),
+                           compareHeaderNames);
+}
+
+static void defineHeaderName(SharedHeader *header,
+                             const HeaderToken *token,
+                             u32 decl)
+{
+    HeaderName *name = findHeaderName(header, token);
+    HeaderDef def = {.decl = decl, .next = NO_DEF};
+    u32 index = (u32)header->defs.size;
+    if (name != NULL) {
+        def.next = name->head;
+        name->head = index;
+    }
+    else {
+        insertInHashTable(&header->names,
+                          &(HeaderName){.s = token->s,
+                                        .len = token->len,
+                                        .head = index},
+                          hashRawBytes(hashInit(), token->s, token->len),
+                          sizeof(HeaderName),
+                          compareHeaderNames);
+    }
+    pushOnDynArray(&header->defs, &def);
+}
+
+static u64 digestHeaderDecl(const SharedHeader *header, const HeaderDecl *decl)
+{
+    HashCode lo = hashInit(), hi = 0x9E3779B9u;
+    for (u32 i = 0; i < decl->count; i++) {
+        const HeaderToken *token =
+            &dynArrayAt(HeaderToken *, &header->tokens, decl->first + i);
+        lo = hashUint8(hashRawBytes(lo, token->s, token->len), ' ');
+        hi = hashUint8(hashRawBytes(hi, token->s, token->len), ' ');
+    }
+    return ((u64)hi << 32) | lo;
+}
+
+/**
+ * Records the names a declaration defines. The generated header only holds
+ * type definitions, typedefs, enums and the declarations of functions and
+ * global variables, a declaration that does not match any of those shapes
+ * is reported so that every unit depends on it.
+ */
+static bool defineDeclNames(SharedHeader *header, u32 index)
+{
+    HeaderDecl *decl = &dynArrayAt(HeaderDecl *, &header->decls, index);
+    HeaderToken *tokens =
+        &dynArrayAt(HeaderToken *, &header->tokens, decl->first);
+    u32 count = decl->count;
+    bool isTypedef = isToken(&tokens[0], "typedef");
+
+    // enum { Name_A = 0, Name_B, ... }; defines its options
+    for (u32 i = 0; i + 1 < count; i++) {
+        if (isToken(&tokens[i], "enum") && isToken(&tokens[i + 1], "{")) {
+            bool found = false;
+            for (u32 j = i + 2; j < count && !isToken(&tokens[j], "}"); j++) {
+                if (tokens[j].ident) {
+                    defineHeaderName(header, &tokens[j], index);
+                    found = true;
+                }
+            }
+            if (!isTypedef)
+                return found;
+            break;
+        }
+    }
+
+    // struct Name { ... }; or union Name { ... };
+    if (!isTypedef &&
+        (isToken(&tokens[0], "struct") || isToken(&tokens[0], "union"))) {
+        for (u32 i = 1; i < count; i++) {
+            if (isToken(&tokens[i], "__attribute__")) {
+                // skip the attribute's arguments
+                u32 depth = 0;
+                for (i++; i < count; i++) {
+                    if (isToken(&tokens[i], "("))
+                        depth++;
+                    else if (isToken(&tokens[i], ")") && --depth == 0)
+                        break;
+                }
+                continue;
+            }
+            if (tokens[i].ident) {
+                defineHeaderName(header, &tokens[i], index);
+                return true;
+            }
+            break;
+        }
+        return false;
+    }
+
+    // The declarator of a function, a function pointer typedef or a
+    // variable, at the top level of the declaration
+    const HeaderToken *name = NULL;
+    u32 depth = 0;
+    for (u32 i = 0; i < count; i++) {
+        const HeaderToken *token = &tokens[i];
+        if (isToken(token, "(") && depth == 0) {
+            if (i + 2 < count && isToken(&tokens[i + 1], "*") &&
+                tokens[i + 2].ident)
+                name = &tokens[i + 2];
+            else if (i > 0 && tokens[i - 1].ident)
+                name = &tokens[i - 1];
+            break;
+        }
+        if (isToken(token, "(") || isToken(token, "{") || isToken(token, "["))
+            depth++;
+        else if (isToken(token, ")") || isToken(token, "}") ||
+                 isToken(token, "]"))
+            depth--;
+        else if (depth == 0 && token->ident)
+            name = token;
+    }
+    if (name == NULL)
+        return false;
+    defineHeaderName(header, name, index);
+    return true;
+}
+
+SharedHeader *newSharedHeader(const char *text, size_t size, size_t prefixSize)
+{
+    SharedHeader *header = calloc(1, sizeof(SharedHeader));
+    header->prefix = text;
+    header->prefixSize = MIN(prefixSize, size);
+    header->tokens = newDynArray(sizeof(HeaderToken));
+    header->decls = newDynArray(sizeof(HeaderDecl));
+    header->defs = newDynArray(sizeof(HeaderDef));
+    header->always = newDynArray(sizeof(u32));
+    header->names = newTempHashTable(sizeof(HeaderName));
+
+    const char *pos = text + header->prefixSize, *end = text + size;
+    HeaderToken token;
+    HeaderDecl decl = {.first = 0, .count = 0};
+    i32 depth = 0;
+    while (nextToken(&pos, end, &token)) {
+        pushOnDynArray(&header->tokens, &token);
+        decl.count++;
+        if (isToken(&token, "(") || isToken(&token, "{") ||
+            isToken(&token, "["))
+            depth++;
+        else if (isToken(&token, ")") || isToken(&token, "}") ||
+                 isToken(&token, "]"))
+            depth--;
+        else if (depth == 0 && isToken(&token, ";")) {
+            if (decl.count > 1) {
+                u32 index = (u32)header->decls.size;
+                decl.digest = digestHeaderDecl(header, &decl);
+                pushOnDynArray(&header->decls, &decl);
+                if (!defineDeclNames(header, index))
+                    pushOnDynArray(&header->always, &index);
+            }
+            decl.first = (u32)header->tokens.size;
+            decl.count = 0;
+        }
+    }
+    if (decl.count != 0) {
+        // unterminated, keep it on every unit's key
+        u32 index = (u32)header->decls.size;
+        decl.digest = digestHeaderDecl(header, &decl);
+        pushOnDynArray(&header->decls, &decl);
+        pushOnDynArray(&header->always, &index);
+    }
+    return header;
+}
+
+void freeSharedHeader(SharedHeader *header)
+{
+    if (header == NULL)
+        return;
+    freeDynArray(&header->tokens);
+    freeDynArray(&header->decls);
+    freeDynArray(&header->defs);
+    freeDynArray(&header->always);
+    freeHashTable(&header->names);
+    free(header);
+}
+
+static void useHeaderDecl(bool *used, DynArray *pending, u32 decl)
+{
+    if (!used[decl]) {
+        used[decl] = true;
+        pushOnDynArray(pending, &decl);
+    }
+}
+
+static void useHeaderName(SharedHeader *header,
+                          bool *used,
+                          DynArray *pending,
+                          const HeaderToken *token)
+{
+    HeaderName *name = findHeaderName(header, token);
+    if (name == NULL)
+        return;
+    for (u32 def = name->head; def != NO_DEF;) {
+        HeaderDef *it = &dynArrayAt(HeaderDef *, &header->defs, def);
+        useHeaderDecl(used, pending, it->decl);
+        def = it->next;
+    }
+}
+
+static int compareDigests(const void *lhs, const void *rhs)
+{
+    u64 a = *((const u64 *)lhs), b = *((const u64 *)rhs);
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+void hashUnitDependencies(SharedHeader *header,
+                          const char *unit,
+                          size_t size,
+                          HashCode *lo,
+                          HashCode *hi)
+{
+    u32 declsCount = (u32)header->decls.size;
+    bool *used = calloc(declsCount + 1, sizeof(bool));
+    DynArray pending = newDynArray(sizeof(u32));
+
+    for (u32 i = 0; i < header->always.size; i++)
+        useHeaderDecl(used, &pending, dynArrayAt(u32 *, &header->always, i));
+
+    // The declarations named by the unit and, transitively, the ones they
+    // name themselves
+    const char *pos = unit, *end = unit + size;
+    HeaderToken token;
+    while (nextToken(&pos, end, &token)) {
+        if (token.ident)
+            useHeaderName(header, used, &pending, &token);
+    }
+    while (pending.size != 0) {
+        u32 index = *((u32 *)popDynArray(&pending));
+        HeaderDecl *decl = &dynArrayAt(HeaderDecl *, &header->decls, index);
+        for (u32 i = 0; i < decl->count; i++) {
+            HeaderToken *it =
+                &dynArrayAt(HeaderToken *, &header->tokens, decl->first + i);
+            if (it->ident)
+                useHeaderName(header, used, &pending, it);
+        }
+    }
+    freeDynArray(&pending);
+
+    // The order in which types are emitted to the header varies from one
+    // build to the other, the declarations are hashed in a stable order
+    DynArray digests = newDynArray(sizeof(u64));
+    for (u32 i = 0; i < declsCount; i++) {
+        if (used[i]) {
+            pushOnDynArray(&digests,
+                           &dynArrayAt(HeaderDecl *, &header->decls, i).digest);
+        }
+    }
+    free(used);
+    qsort(digests.elems, digests.size, sizeof(u64), compareDigests);
+
+    // the two halves of the key go over the parts in reverse order
+    HashCode l = hashRawBytes(*lo, header->prefix, header->prefixSize),
+             h = hashRawBytes(*hi, unit, size);
+    l = hashRawBytes(l, digests.elems, digests.size * sizeof(u64));
+    h = hashRawBytes(h, digests.elems, digests.size * sizeof(u64));
+    freeDynArray(&digests);
+
+    *lo = hashRawBytes(l, unit, size);
+    *hi = hashRawBytes(h, header->prefix, header->prefixSize);
+}
@@ -11,12 +11,37 @@ extern "C" {
 #endif
 
 struct msgpack_sbuffer;
+struct StrPool;
 
+/**
+ * Appends the binary (msgpack) encoding of the given node, including its
+ * `next` siblings, to the given buffer. The encoding covers every node kind
+ * the parser produces; nodes that are only created by later stages are
+ * rejected.
+ *
+ * @param sbuf The buffer to append to, must already be initialized
+ * @param node The node to encode
+ * @param fileNames If not NULL, receives (cstring) every distinct file name
+ *      referenced by the encoded nodes' locations
+ *
+ * @return true if the node was fully encoded, false if it contains a node
+ *      that cannot be serialized (in which case the buffer contents must be
+ *      discarded)
+ */
 bool binaryEncodeAstNode(struct msgpack_sbuffer *sbuf,
-                         MemPool *pool,
-                         const AstNode *node);
+                         const AstNode *node,
+                         DynArray *fileNames);
 
-AstNode *binaryDecodeAstNode(const void *encoded, size_t size);
+/**
+ * Decodes a node previously encoded with `binaryEncodeAstNode`.
+ *
+ * @return The decoded node (with its siblings), or NULL if the buffer is
+ *      malformed
+ */
+AstNode *binaryDecodeAstNode(const void *encoded,
+                             size_t size,
+                             MemPool *pool,
+                             struct StrPool *strings);
 
 #ifdef __cplusplus
 }
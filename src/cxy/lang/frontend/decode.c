@@ -10,63 +10,91 @@
 typedef struct {
     size_t off, size;
     const void *packed;
-    const char *fname;
     msgpack_unpacked msg;
     StrPool *strPool;
     MemPool *pool;
+    DynArray nodes;
+    DynArray files;
+    bool failed;
 } AstNodeUnpackContext;
 
 static AstNode *unpackManyNodes(AstNodeUnpackContext *ctx, u64 *len);
 
-static AstNode *unpackNode(AstNodeUnpackContext *ctx);
-
-#define unpackPositiveInteger(msg, NAME)                                       \
-    ({                                                                         \
-        csAssert0((msg)->data.type == MSGPACK_OBJECT_POSITIVE_INTEGER);        \
-        (msg)->data.via.NAME;                                                  \
-    })
-
-attr(always_inline) static u64 unpackU64(AstNodeUnpackContext *ctx)
+static bool unpackNext(AstNodeUnpackContext *ctx)
 {
-    msgpack_unpack_next(&ctx->msg, ctx->packed, ctx->size, &ctx->off);
-    csAssert0(ctx->msg.data.type == MSGPACK_OBJECT_POSITIVE_INTEGER);
-    return ctx->msg.data.via.u64;
+    if (ctx->failed)
+        return false;
+    msgpack_unpack_return status =
+        msgpack_unpack_next(&ctx->msg, ctx->packed, ctx->size, &ctx->off);
+    if (status != MSGPACK_UNPACK_SUCCESS) {
+        ctx->failed = true;
+        return false;
+    }
+    return true;
 }
 
-attr(always_inline) static f64 unpackFloat(AstNodeUnpackContext *ctx)
+static u64 unpackU64(AstNodeUnpackContext *ctx)
 {
-    msgpack_unpack_next(&ctx->msg, ctx->packed, ctx->size, &ctx->off);
-    csAssert0(ctx->msg.data.type == MSGPACK_OBJECT_FLOAT);
-    return ctx->msg.data.via.f64;
+    if (!unpackNext(ctx))
+        return 0;
+    if (ctx->msg.data.type != MSGPACK_OBJECT_POSITIVE_INTEGER) {
+        ctx->failed = true;
+        return 0;
+    }
+    return ctx->msg.data.via.u64;
 }
 
-attr(always_inline) static u64 unpackI64(AstNodeUnpackContext *ctx)
+static i64 unpackI64(AstNodeUnpackContext *ctx)
 {
-    msgpack_unpack_next(&ctx->msg, ctx->packed, ctx->size, &ctx->off);
-    csAssert0(ctx->msg.data.type == MSGPACK_OBJECT_NEGATIVE_INTEGER);
+    if (!unpackNext(ctx))
+        return 0;
+    if (ctx->msg.data.type == MSGPACK_OBJECT_POSITIVE_INTEGER)
+        return (i64)ctx->msg.data.via.u64;
+    if (ctx->msg.data.type != MSGPACK_OBJECT_NEGATIVE_INTEGER) {
+        ctx->failed = true;
+        return 0;
+    }
     return ctx->msg.data.via.i64;
 }
 
-attr(always_inline) static bool unpackBool(AstNodeUnpackContext *ctx)
+static cstring unpackString(AstNodeUnpackContext *ctx)
 {
-    msgpack_unpack_next(&ctx->msg, ctx->packed, ctx->size, &ctx->off);
-    csAssert0(ctx->msg.data.type == MSGPACK_OBJECT_BOOLEAN);
-    return ctx->msg.data.via.boolean;
-}
+    if (!unpackNext(ctx))
+        return NULL;
+    if (ctx->msg.data.type == MSGPACK_OBJECT_NIL)
+        return NULL;
+    if (ctx->msg.data.type != MSGPACK_OBJECT_STR) {
+        ctx->failed = true;
+        return NULL;
+    }
 
-attr(always_inline) static void unpackNull(AstNodeUnpackContext *ctx)
-{
-    msgpack_unpack_next(&ctx->msg, ctx->packed, ctx->size, &ctx->off);
-    csAssert0(ctx->msg.data.type == MSGPACK_OBJECT_NIL);
+    return makeStringSized(
+        ctx->strPool, ctx->msg.data.via.str.ptr, ctx->msg.data.via.str.size);
 }
 
-attr(always_inline) static const char *unpackString(AstNodeUnpackContext *ctx)
+static cstring unpackFileName(AstNodeUnpackContext *ctx)
 {
-    msgpack_unpack_next(&ctx->msg, ctx->packed, ctx->size, &ctx->off);
-    csAssert0(ctx->msg.data.type == MSGPACK_OBJECT_STR);
-
-    return makeStringSized(
-        ctx->strPool, ctx->msg.data.via.str.ptr, ctx->msg.data.via.str.size);
+    if (!unpackNext(ctx))
+        return NULL;
+    switch (ctx->msg.data.type) {
+    case MSGPACK_OBJECT_NIL:
+        return NULL;
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+        if (ctx->msg.data.via.u64 < ctx->files.size)
+            return dynArrayAt(cstring *, &ctx->files, ctx->msg.data.via.u64);
+        break;
+    case MSGPACK_OBJECT_STR: {
+        cstring fileName = makeStringSized(ctx->strPool,
+                                           ctx->msg.data.via.str.ptr,
+                                           ctx->msg.data.via.str.size);
+        pushOnDynArray(&ctx->files, &fileName);
+        return fileName;
+    }
+    default:
+        break;
+    }
+    ctx->failed = true;
+    return NULL;
 }
 
 static void unpackPosition(AstNodeUnpackContext *ctx, FilePos *loc)
@@ -76,280 +104,425 @@ static void unpackPosition(AstNodeUnpackContext *ctx, FilePos *loc)
     loc->byteOffset = unpackU64(ctx);
 }
 
-static void unpackNodeBody(AstNodeUnpackContext *ctx, AstNode *node)
+static void unpackLocation(AstNodeUnpackContext *ctx, FileLoc *loc)
 {
+    loc->fileName = unpackFileName(ctx);
+    unpackPosition(ctx, &loc->begin);
+    unpackPosition(ctx, &loc->end);
+}
 
-    u64 len = 0;
+static void unpackNodeBody(AstNodeUnpackContext *ctx, AstNode *node)
+{
+    u64 lo, hi;
     switch (node->tag) {
     case astNoop:
-    case astStringType:
+    case astVoidType:
     case astAutoType:
-    case astContinueStmt:
-    case astBreakStmt:
-        break;
+    case astStringType:
     case astNullLit:
-        unpackNull(ctx);
-        break;
-    case astBoolLit:
-        node->boolLiteral.value = unpackBool(ctx);
-        break;
-    case astCharLit:
-        node->charLiteral.value = unpackU64(ctx);
+    case astBreakStmt:
+    case astContinueStmt:
         break;
-    case astIntegerLit:
-        node->intLiteral.isNegative = unpackBool(ctx);
-        node->intLiteral.uValue = unpackU64(ctx);
+    case astError:
+        node->error.message = unpackString(ctx);
+        node->error.original = unpackManyNodes(ctx, NULL);
         break;
-    case astFloatLit:
-        node->floatLiteral.value = unpackFloat(ctx);
+    case astProgram:
+        node->program.path = unpackString(ctx);
+        node->program.module = unpackManyNodes(ctx, NULL);
+        node->program.top = unpackManyNodes(ctx, NULL);
+        node->program.decls = unpackManyNodes(ctx, NULL);
         break;
-    case astStringLit:
-        node->stringLiteral.value = unpackString(ctx);
+    case astCCode:
+        node->cCode.kind = unpackU64(ctx);
+        node->cCode.what = unpackManyNodes(ctx, NULL);
         break;
-    case astError:
-        node->error.message = unpackString(ctx);
+    case astDefine:
+        node->define.names = unpackManyNodes(ctx, NULL);
+        node->define.type = unpackManyNodes(ctx, NULL);
+        node->define.container = unpackManyNodes(ctx, NULL);
         break;
     case astAttr:
         node->attr.name = unpackString(ctx);
         node->attr.args = unpackManyNodes(ctx, NULL);
+        node->attr.count = unpackU64(ctx);
+        node->attr.kvpArgs = unpackU64(ctx);
         break;
-    case astDefine:
-        node->define.names = unpackManyNodes(ctx, NULL);
-        node->define.type = unpackNode(ctx);
-        node->define.container = unpackNode(ctx);
+    case astAnnotation:
+        node->annotation.name = unpackString(ctx);
+        node->annotation.value = unpackManyNodes(ctx, NULL);
         break;
-    case astImportDecl:
-        node->import.alias = unpackNode(ctx);
-        node->import.module = unpackNode(ctx);
-        node->import.entities = unpackNode(ctx);
+    case astPath:
+        node->path.elements = unpackManyNodes(ctx, NULL);
+        node->path.isType = unpackU64(ctx);
+        node->path.inheritanceDepth = unpackU64(ctx);
         break;
-    case astImportEntity:
-        node->importEntity.name = unpackString(ctx);
-        node->importEntity.alias = unpackString(ctx);
+    case astPathElem:
+        node->pathElement.name = unpackString(ctx);
+        node->pathElement.alt = unpackString(ctx);
+        node->pathElement.args = unpackManyNodes(ctx, NULL);
+        node->pathElement.index = unpackU64(ctx);
+        node->pathElement.super = unpackU64(ctx);
+        node->pathElement.isKeyword = unpackU64(ctx);
         break;
-    case astModuleDecl:
-        node->moduleDecl.name = unpackString(ctx);
+    case astGenericParam:
+        node->genericParam.name = unpackString(ctx);
+        node->genericParam.defaultValue = unpackManyNodes(ctx, NULL);
+        node->genericParam.constraints = unpackManyNodes(ctx, NULL);
+        node->genericParam.inferIndex = unpackU64(ctx);
+        node->genericParam.innerType = unpackU64(ctx);
         break;
     case astIdentifier:
         node->ident.value = unpackString(ctx);
         node->ident.alias = unpackString(ctx);
+        node->ident.super = unpackU64(ctx);
+        break;
+    case astImportEntity:
+        node->importEntity.name = unpackString(ctx);
+        node->importEntity.alias = unpackString(ctx);
         break;
     case astTupleType:
+        node->tupleType.len = unpackU64(ctx);
+        node->tupleType.elements = unpackManyNodes(ctx, NULL);
+        break;
     case astTupleExpr:
-        node->tupleType.elements = unpackManyNodes(ctx, &len);
-        node->tupleType.len = len;
+        node->tupleExpr.len = unpackU64(ctx);
+        node->tupleExpr.elements = unpackManyNodes(ctx, NULL);
+        node->tupleExpr.isLiteral = unpackU64(ctx);
         break;
     case astArrayType:
-        node->arrayType.elementType = unpackNode(ctx);
-        node->arrayType.dim = unpackNode(ctx);
-        break;
-    case astFuncType:
-        node->funcType.ret = unpackNode(ctx);
-        node->funcType.params = unpackManyNodes(ctx, NULL);
-        break;
-    case astOptionalType:
-        node->optionalType.type = unpackNode(ctx);
-        break;
-    case astPrimitiveType:
-        node->primitiveType.id = unpackU64(ctx);
+        node->arrayType.elementType = unpackManyNodes(ctx, NULL);
+        node->arrayType.dim = unpackManyNodes(ctx, NULL);
         break;
     case astPointerType:
-        node->pointerType.pointed = unpackNode(ctx);
+        node->pointerType.pointed = unpackManyNodes(ctx, NULL);
         break;
     case astReferenceType:
-        node->referenceType.referred = unpackNode(ctx);
-        break;
-    case astArrayExpr:
-        node->arrayExpr.elements = unpackManyNodes(ctx, &len);
-        node->arrayExpr.len = len;
-        break;
-    case astMemberExpr:
-        node->memberExpr.target = unpackNode(ctx);
-        node->memberExpr.member = unpackNode(ctx);
-        break;
-    case astRangeExpr:
-        node->rangeExpr.start = unpackNode(ctx);
-        node->rangeExpr.end = unpackNode(ctx);
-        node->rangeExpr.step = unpackNode(ctx);
+        node->referenceType.referred = unpackManyNodes(ctx, NULL);
         break;
-    case astNewExpr:
-        node->newExpr.allocator = unpackNode(ctx);
-        node->newExpr.expr = unpackNode(ctx);
-        break;
-    case astCastExpr:
-        node->castExpr.to = unpackNode(ctx);
-        node->castExpr.expr = unpackNode(ctx);
-        break;
-    case astIndexExpr:
-        node->indexExpr.target = unpackNode(ctx);
-        node->indexExpr.index = unpackNode(ctx);
+    case astFuncType:
+        node->funcType.params = unpackManyNodes(ctx, NULL);
+        node->funcType.ret = unpackManyNodes(ctx, NULL);
         break;
-    case astGenericParam:
-        node->genericParam.name = unpackString(ctx);
-        node->genericParam.constraints = unpackManyNodes(ctx, NULL);
+    case astPrimitiveType:
+        node->primitiveType.id = unpackU64(ctx);
         break;
-    case astGenericDecl:
-        node->genericDecl.decl = unpackNode(ctx);
-        node->genericDecl.params = unpackManyNodes(ctx, NULL);
-    case astPathElem:
-        node->pathElement.args = unpackManyNodes(ctx, NULL);
-        node->pathElement.name = unpackString(ctx);
-        node->pathElement.alt = unpackString(ctx);
-        node->pathElement.index = unpackU64(ctx);
+    case astOptionalType:
+        node->optionalType.type = unpackManyNodes(ctx, NULL);
         break;
-    case astPath:
-        node->path.elements = unpackManyNodes(ctx, NULL);
-        node->path.isType = unpackBool(ctx);
+    case astResultType:
+        node->resultType.target = unpackManyNodes(ctx, NULL);
         break;
-    case astFuncDecl:
-        node->funcDecl.operatorOverload = unpackU64(ctx);
-        node->funcDecl.index = unpackU64(ctx);
-        node->funcDecl.name = unpackString(ctx);
-        node->funcDecl.signature = makeFunctionSignature(
-            ctx->pool,
-            &(FunctionSignature){.params = unpackManyNodes(ctx, NULL),
-                                 .ret = unpackNode(ctx)});
-        node->funcDecl.body = unpackNode(ctx);
+    case astBoolLit:
+        node->boolLiteral.value = unpackU64(ctx);
         break;
-    case astMacroDecl:
-        node->macroDecl.name = unpackString(ctx);
-        node->macroDecl.params = unpackManyNodes(ctx, NULL);
-        node->macroDecl.body = unpackNode(ctx);
+    case astCharLit:
+        node->charLiteral.value = unpackU64(ctx);
         break;
-    case astFuncParamDecl:
-        node->funcParam.name = unpackString(ctx);
-        node->funcParam.type = unpackNode(ctx);
-        node->funcParam.def = unpackNode(ctx);
+    case astIntegerLit:
+        lo = unpackU64(ctx);
+        hi = unpackU64(ctx);
+        node->intLiteral.uValue = ((__uint128_t)hi << 64) | lo;
+        node->intLiteral.isNegative = unpackU64(ctx);
         break;
-    case astVarDecl:
-        node->varDecl.names = unpackManyNodes(ctx, NULL);
-        node->varDecl.type = unpackNode(ctx);
-        node->varDecl.init = unpackNode(ctx);
+    case astFloatLit:
+        node->floatLiteral._bits = unpackU64(ctx);
         break;
-    case astTypeDecl:
-        node->typeDecl.name = unpackString(ctx);
-        node->typeDecl.aliased = unpackNode(ctx);
+    case astStringLit:
+        node->stringLiteral.value = unpackString(ctx);
         break;
-    case astUnionDecl:
-        node->unionDecl.members = unpackManyNodes(ctx, NULL);
+    case astAsm:
+        node->inlineAssembly.text = unpackString(ctx);
+        node->inlineAssembly.outputs = unpackManyNodes(ctx, NULL);
+        node->inlineAssembly.inputs = unpackManyNodes(ctx, NULL);
+        node->inlineAssembly.clobbers = unpackManyNodes(ctx, NULL);
+        node->inlineAssembly.flags = unpackManyNodes(ctx, NULL);
         break;
-    case astEnumOptionDecl:
-        node->enumOption.name = unpackString(ctx);
-        node->enumOption.value = unpackNode(ctx);
+    case astAsmOperand:
+        node->asmOperand.constraint = unpackString(ctx);
+        node->asmOperand.operand = unpackManyNodes(ctx, NULL);
         break;
-    case astEnumDecl:
-        node->enumDecl.name = unpackString(ctx);
-        node->enumDecl.base = unpackNode(ctx);
-        node->enumDecl.options = unpackManyNodes(ctx, &len);
-        node->enumDecl.len = len;
+    case astException:
+        node->exception.name = unpackString(ctx);
+        node->exception.params = unpackManyNodes(ctx, NULL);
+        node->exception.body = unpackManyNodes(ctx, NULL);
         break;
-    case astFieldDecl:
-        node->structField.name = unpackString(ctx);
-        node->structField.type = unpackNode(ctx);
-        node->structField.value = unpackNode(ctx);
+    case astTupleXform:
+        node->xForm.target = unpackManyNodes(ctx, NULL);
+        node->xForm.args = unpackManyNodes(ctx, NULL);
+        node->xForm.cond = unpackManyNodes(ctx, NULL);
+        node->xForm.xForm = unpackManyNodes(ctx, NULL);
         break;
-    case astStructDecl:
-        node->structDecl.name = unpackString(ctx);
-        node->structDecl.members = unpackManyNodes(ctx, NULL);
+    case astGroupExpr:
+    case astExprStmt:
+    case astSpreadExpr:
+        node->exprStmt.expr = unpackManyNodes(ctx, NULL);
         break;
-    case astClassDecl:
-        node->classDecl.name = unpackString(ctx);
-        node->classDecl.base = unpackNode(ctx);
-        node->classDecl.members = unpackManyNodes(ctx, NULL);
-        node->classDecl.implements = unpackManyNodes(ctx, NULL);
+    case astUnaryExpr:
+    case astPointerOf:
+    case astReferenceOf:
+        node->unaryExpr.op = unpackU64(ctx);
+        node->unaryExpr.isPrefix = unpackU64(ctx);
+        node->unaryExpr.operand = unpackManyNodes(ctx, NULL);
         break;
     case astBinaryExpr:
+    case astAssignExpr:
         node->binaryExpr.op = unpackU64(ctx);
-        node->binaryExpr.lhs = unpackNode(ctx);
-        node->binaryExpr.lhs = unpackNode(ctx);
-        break;
-    case astUnaryExpr:
-        node->unaryExpr.isPrefix = unpackU64(ctx);
-        node->unaryExpr.op = unpackU64(ctx);
-        node->unaryExpr.operand = unpackNode(ctx);
+        node->binaryExpr.lhs = unpackManyNodes(ctx, NULL);
+        node->binaryExpr.rhs = unpackManyNodes(ctx, NULL);
         break;
     case astTernaryExpr:
     case astIfStmt:
-        node->ternaryExpr.cond = unpackNode(ctx);
-        node->ternaryExpr.body = unpackNode(ctx);
-        node->ternaryExpr.otherwise = unpackNode(ctx);
+        node->ternaryExpr.cond = unpackManyNodes(ctx, NULL);
+        node->ternaryExpr.body = unpackManyNodes(ctx, NULL);
+        node->ternaryExpr.otherwise = unpackManyNodes(ctx, NULL);
+        node->ternaryExpr.isTernary = unpackU64(ctx);
         break;
     case astStmtExpr:
-        node->stmtExpr.stmt = unpackNode(ctx);
+        node->stmtExpr.stmt = unpackManyNodes(ctx, NULL);
+        break;
+    case astStringExpr:
+        node->stringExpr.parts = unpackManyNodes(ctx, NULL);
         break;
     case astTypedExpr:
-        node->typedExpr.type = unpackNode(ctx);
-        node->typedExpr.expr = unpackNode(ctx);
+        node->typedExpr.idx = unpackU64(ctx);
+        node->typedExpr.expr = unpackManyNodes(ctx, NULL);
+        node->typedExpr.type = unpackManyNodes(ctx, NULL);
+        break;
+    case astCastExpr:
+        node->castExpr.idx = unpackU64(ctx);
+        node->castExpr.expr = unpackManyNodes(ctx, NULL);
+        node->castExpr.to = unpackManyNodes(ctx, NULL);
         break;
     case astCallExpr:
-        node->callExpr.overload = unpackU64(ctx);
-        node->callExpr.callee = unpackNode(ctx);
+    case astMacroCallExpr:
+        node->callExpr.callee = unpackManyNodes(ctx, NULL);
         node->callExpr.args = unpackManyNodes(ctx, NULL);
+        node->callExpr.overload = unpackU64(ctx);
         break;
     case astClosureExpr:
-        node->closureExpr.ret = unpackNode(ctx);
         node->closureExpr.params = unpackManyNodes(ctx, NULL);
-        node->closureExpr.body = unpackNode(ctx);
+        node->closureExpr.ret = unpackManyNodes(ctx, NULL);
+        node->closureExpr.body = unpackManyNodes(ctx, NULL);
+        break;
+    case astArrayExpr:
+        node->arrayExpr.len = unpackU64(ctx);
+        node->arrayExpr.elements = unpackManyNodes(ctx, NULL);
+        node->arrayExpr.isLiteral = unpackU64(ctx);
+        break;
+    case astIndexExpr:
+        node->indexExpr.target = unpackManyNodes(ctx, NULL);
+        node->indexExpr.index = unpackManyNodes(ctx, NULL);
         break;
     case astFieldExpr:
         node->fieldExpr.name = unpackString(ctx);
-        node->fieldExpr.value = unpackNode(ctx);
+        node->fieldExpr.index = unpackU64(ctx);
+        node->fieldExpr.value = unpackManyNodes(ctx, NULL);
         break;
     case astStructExpr:
-        node->structExpr.left = unpackNode(ctx);
+        node->structExpr.left = unpackManyNodes(ctx, NULL);
         node->structExpr.fields = unpackManyNodes(ctx, NULL);
+        node->structExpr.isLiteral = unpackU64(ctx);
+        break;
+    case astMemberExpr:
+        node->memberExpr.target = unpackManyNodes(ctx, NULL);
+        node->memberExpr.member = unpackManyNodes(ctx, NULL);
+        break;
+    case astRangeExpr:
+        node->rangeExpr.start = unpackManyNodes(ctx, NULL);
+        node->rangeExpr.end = unpackManyNodes(ctx, NULL);
+        node->rangeExpr.step = unpackManyNodes(ctx, NULL);
+        node->rangeExpr.down = unpackU64(ctx);
+        break;
+    case astNewExpr:
+        node->newExpr.expr = unpackManyNodes(ctx, NULL);
+        node->newExpr.allocator = unpackManyNodes(ctx, NULL);
+        break;
+    case astAliasExpr:
+        node->aliasExpr.name = unpackString(ctx);
+        node->aliasExpr.expr = unpackManyNodes(ctx, NULL);
         break;
-    case astExprStmt:
     case astDeferStmt:
-    case astGroupExpr:
-        node->exprStmt.expr = unpackNode(ctx);
+        node->deferStmt.stmt = unpackManyNodes(ctx, NULL);
+        node->deferStmt.block = unpackManyNodes(ctx, NULL);
         break;
     case astReturnStmt:
-        node->returnStmt.expr = unpackNode(ctx);
+        node->returnStmt.expr = unpackManyNodes(ctx, NULL);
+        node->returnStmt.isRaise = unpackU64(ctx);
+        break;
+    case astYieldStmt:
+        node->yieldStmt.expr = unpackManyNodes(ctx, NULL);
         break;
     case astBlockStmt:
+        node->blockStmt.name = unpackString(ctx);
         node->blockStmt.stmts = unpackManyNodes(ctx, NULL);
-        node->blockStmt.last = getLastAstNode(node->blockStmt.last);
         break;
     case astForStmt:
-        node->forStmt.var = unpackNode(ctx);
-        node->forStmt.range = unpackNode(ctx);
-        node->forStmt.body = unpackNode(ctx);
+        node->forStmt.var = unpackManyNodes(ctx, NULL);
+        node->forStmt.range = unpackManyNodes(ctx, NULL);
+        node->forStmt.cond = unpackManyNodes(ctx, NULL);
+        node->forStmt.body = unpackManyNodes(ctx, NULL);
         break;
     case astWhileStmt:
-        node->whileStmt.cond = unpackNode(ctx);
-        node->whileStmt.body = unpackNode(ctx);
+        node->whileStmt.cond = unpackManyNodes(ctx, NULL);
+        node->whileStmt.body = unpackManyNodes(ctx, NULL);
+        node->whileStmt.update = unpackManyNodes(ctx, NULL);
         break;
     case astSwitchStmt:
-        node->switchStmt.cond = unpackNode(ctx);
-        node->switchStmt.cases = unpackNode(ctx);
+        node->switchStmt.index = unpackU64(ctx);
+        node->switchStmt.cond = unpackManyNodes(ctx, NULL);
+        node->switchStmt.cases = unpackManyNodes(ctx, NULL);
+        node->switchStmt.defaultCase = unpackManyNodes(ctx, NULL);
+        break;
+    case astMatchStmt:
+        node->matchStmt.index = unpackU64(ctx);
+        node->matchStmt.expr = unpackManyNodes(ctx, NULL);
+        node->matchStmt.cases = unpackManyNodes(ctx, NULL);
+        node->matchStmt.defaultCase = unpackManyNodes(ctx, NULL);
         break;
     case astCaseStmt:
-        node->caseStmt.match = unpackNode(ctx);
-        node->caseStmt.body = unpackNode(ctx);
+        node->caseStmt.match = unpackManyNodes(ctx, NULL);
+        node->caseStmt.body = unpackManyNodes(ctx, NULL);
+        node->caseStmt.alias = unpackManyNodes(ctx, NULL);
+        node->caseStmt.idx = unpackU64(ctx);
+        break;
+    case astFuncDecl:
+        node->funcDecl.name = unpackString(ctx);
+        node->funcDecl.operatorOverload = unpackU64(ctx);
+        node->funcDecl.index = unpackU64(ctx);
+        node->funcDecl.requiredParamsCount = unpackU64(ctx);
+        node->funcDecl.paramsCount = unpackU64(ctx);
+        if (unpackU64(ctx)) {
+            FunctionSignature signature = {};
+            signature.params = unpackManyNodes(ctx, NULL);
+            signature.ret = unpackManyNodes(ctx, NULL);
+            signature.typeParams = unpackManyNodes(ctx, NULL);
+            node->funcDecl.signature =
+                makeFunctionSignature(ctx->pool, &signature);
+        }
+        node->funcDecl.opaqueParams = unpackManyNodes(ctx, NULL);
+        node->funcDecl.body = unpackManyNodes(ctx, NULL);
+        break;
+    case astMacroDecl:
+        node->macroDecl.name = unpackString(ctx);
+        node->macroDecl.params = unpackManyNodes(ctx, NULL);
+        node->macroDecl.body = unpackManyNodes(ctx, NULL);
+        break;
+    case astVarDecl:
+        node->varDecl.name = unpackString(ctx);
+        node->varDecl.idx = unpackU64(ctx);
+        node->varDecl.names = unpackManyNodes(ctx, NULL);
+        node->varDecl.type = unpackManyNodes(ctx, NULL);
+        node->varDecl.init = unpackManyNodes(ctx, NULL);
+        break;
+    case astTypeDecl:
+        node->typeDecl.name = unpackString(ctx);
+        node->typeDecl.typeParams = unpackManyNodes(ctx, NULL);
+        node->typeDecl.aliased = unpackManyNodes(ctx, NULL);
+        break;
+    case astUnionDecl:
+        node->unionDecl.members = unpackManyNodes(ctx, NULL);
+        node->unionDecl.typeParams = unpackManyNodes(ctx, NULL);
+        node->unionDecl.isResult = unpackU64(ctx);
+        break;
+    case astStructDecl:
+    case astClassDecl:
+        node->structDecl.name = unpackString(ctx);
+        node->structDecl.members = unpackManyNodes(ctx, NULL);
+        node->structDecl.typeParams = unpackManyNodes(ctx, NULL);
+        node->structDecl.base = unpackManyNodes(ctx, NULL);
+        node->structDecl.annotations = unpackManyNodes(ctx, NULL);
+        if (nodeIs(node, ClassDecl))
+            node->classDecl.implements = unpackManyNodes(ctx, NULL);
+        break;
+    case astInterfaceDecl:
+        node->interfaceDecl.name = unpackString(ctx);
+        node->interfaceDecl.members = unpackManyNodes(ctx, NULL);
+        node->interfaceDecl.typeParams = unpackManyNodes(ctx, NULL);
+        break;
+    case astModuleDecl:
+        node->moduleDecl.name = unpackString(ctx);
+        node->moduleDecl.isPackage = unpackU64(ctx);
+        break;
+    case astImportDecl:
+        node->import.kind = unpackU64(ctx);
+        node->import.module = unpackManyNodes(ctx, NULL);
+        node->import.exports = unpackManyNodes(ctx, NULL);
+        node->import.alias = unpackManyNodes(ctx, NULL);
+        node->import.entities = unpackManyNodes(ctx, NULL);
+        break;
+    case astEnumDecl:
+        node->enumDecl.name = unpackString(ctx);
+        node->enumDecl.len = unpackU64(ctx);
+        node->enumDecl.base = unpackManyNodes(ctx, NULL);
+        node->enumDecl.options = unpackManyNodes(ctx, NULL);
+        break;
+    case astFieldDecl:
+        node->structField.name = unpackString(ctx);
+        node->structField.index = unpackU64(ctx);
+        node->structField.bits = unpackU64(ctx);
+        node->structField.type = unpackManyNodes(ctx, NULL);
+        node->structField.value = unpackManyNodes(ctx, NULL);
+        break;
+    case astExternDecl:
+        node->externDecl.func = unpackManyNodes(ctx, NULL);
+        break;
+    case astGenericDecl:
+        node->genericDecl.name = unpackString(ctx);
+        node->genericDecl.paramsCount = unpackU64(ctx);
+        node->genericDecl.inferrable = unpackI64(ctx);
+        node->genericDecl.params = unpackManyNodes(ctx, NULL);
+        node->genericDecl.decl = unpackManyNodes(ctx, NULL);
+        break;
+    case astFuncParamDecl:
+        node->funcParam.name = unpackString(ctx);
+        node->funcParam.idx = unpackU64(ctx);
+        node->funcParam.index = unpackU64(ctx);
+        node->funcParam.type = unpackManyNodes(ctx, NULL);
+        node->funcParam.def = unpackManyNodes(ctx, NULL);
+        break;
+    case astEnumOptionDecl:
+        node->enumOption.name = unpackString(ctx);
+        node->enumOption.index = unpackU64(ctx);
+        node->enumOption.value = unpackManyNodes(ctx, NULL);
+        break;
+    case astTestDecl:
+        node->testDecl.name = unpackString(ctx);
+        node->testDecl.body = unpackManyNodes(ctx, NULL);
         break;
     default:
-        unreachable("UNKNOWN NODE ast%s", getAstNodeName(node));
+        ctx->failed = true;
+        break;
     }
 }
 
 static AstNode *unpackNode(AstNodeUnpackContext *ctx)
 {
+    if (!unpackNext(ctx))
+        return NULL;
 
-    msgpack_unpack_return status =
-        msgpack_unpack_next(&ctx->msg, ctx->packed, ctx->size, &ctx->off);
-    csAssert0(status == MSGPACK_UNPACK_SUCCESS);
+    if (ctx->msg.data.type == MSGPACK_OBJECT_NEGATIVE_INTEGER) {
+        // Back reference to a node shared by multiple parents
+        u64 id = (u64)(-(ctx->msg.data.via.i64 + 1));
+        if (id < ctx->nodes.size)
+            return dynArrayAt(AstNode **, &ctx->nodes, id);
+        ctx->failed = true;
+        return NULL;
+    }
 
-    if (ctx->msg.data.type == MSGPACK_OBJECT_NIL)
+    if (ctx->msg.data.type != MSGPACK_OBJECT_POSITIVE_INTEGER ||
+        ctx->msg.data.via.u64 >= astCOUNT) {
+        ctx->failed = true;
         return NULL;
-    AstNode *node = allocFromMemPool(ctx->pool, sizeof(AstNode));
-    node->tag = unpackPositiveInteger(&ctx->msg, u64);
-    node->flags = unpackU64(ctx);
+    }
 
-    node->loc.fileName = ctx->fname;
-    unpackPosition(ctx, &node->loc.begin);
-    unpackPosition(ctx, &node->loc.end);
+    AstNode *node = allocFromMemPool(ctx->pool, sizeof(AstNode));
+    memset(node, 0, sizeof(AstNode));
+    node->tag = ctx->msg.data.via.u64;
+    pushOnDynArray(&ctx->nodes, &node);
 
+    node->flags = unpackU64(ctx);
+    unpackLocation(ctx, &node->loc);
     node->attrs = unpackManyNodes(ctx, NULL);
 
     unpackNodeBody(ctx, node);
@@ -359,13 +532,19 @@ static AstNode *unpackNode(AstNodeUnpackContext *ctx)
 
 static AstNode *unpackManyNodes(AstNodeUnpackContext *ctx, u64 *len)
 {
-    msgpack_unpack_next(&ctx->msg, ctx->packed, ctx->size, &ctx->off);
-    csAssert0(ctx->msg.data.type == MSGPACK_OBJECT_POSITIVE_INTEGER);
-    u64 count = ctx->msg.data.via.u64;
+    if (!unpackNext(ctx))
+        return NULL;
+    if (ctx->msg.data.type != MSGPACK_OBJECT_ARRAY) {
+        ctx->failed = true;
+        return NULL;
+    }
+    u64 count = ctx->msg.data.via.array.size;
 
     AstNode *node = NULL, *it = NULL;
-    for (u64 i = 0; i < count; i++) {
+    for (u64 i = 0; i < count && !ctx->failed; i++) {
         AstNode *next = unpackNode(ctx);
+        if (next == NULL)
+            break;
         if (node == NULL) {
             node = it = next;
         }
@@ -379,15 +558,24 @@ static AstNode *unpackManyNodes(AstNodeUnpackContext *ctx, u64 *len)
     return node;
 }
 
-AstNode *binaryDecodeAstNode(const void *encoded, size_t size)
+AstNode *binaryDecodeAstNode(const void *encoded,
+                             size_t size,
+                             MemPool *pool,
+                             StrPool *strings)
 {
-    AstNodeUnpackContext context = {.packed = encoded, .size = size};
+    AstNodeUnpackContext context = {.packed = encoded,
+                                     .size = size,
+                                     .pool = pool,
+                                     .strPool = strings,
+                                     .nodes = newDynArray(sizeof(AstNode *)),
+                                     .files = newDynArray(sizeof(cstring))};
 
     msgpack_unpacked_init(&context.msg);
-
-    context.fname = unpackString(&context);
-    AstNode *node = unpackNode(&context);
+    AstNode *node = unpackManyNodes(&context, NULL);
     msgpack_unpacked_destroy(&context.msg);
 
-    return node;
+    freeDynArray(&context.nodes);
+    freeDynArray(&context.files);
+
+    return context.failed ? NULL : node;
 }
@@ -4,6 +4,7 @@
 #include "defines.h"
 
 #include "core/strpool.h"
+#include "driver/cache.h"
 #include "driver/driver.h"
 #include <string.h>
 
@@ -60,6 +61,10 @@ bool preprocessorHasMacro(struct CompilerPreprocessor *preprocessor,
                         hash,
                         sizeof(PreprocessorMacro),
                         comparePreprocessorMacro);
+    moduleCacheRecordMacroQuery(preprocessor->recorder,
+                                variable,
+                                definition != NULL,
+                                definition ? definition->value : NULL);
     if (definition) {
         if (value)
             *value = definition->value;
@@ -73,6 +78,7 @@ void initCompilerPreprocessor(struct CompilerDriver *driver)
     Options *options = &driver->options;
     driver->preprocessor.symbols = newTempHashTable(sizeof(PreprocessorMacro));
     driver->preprocessor.pool = driver->pool;
+    driver->preprocessor.recorder = NULL;
     if (options->optimizationLevel > O0) {
         preprocessorDefineMacro(&driver->preprocessor,
                                 makeString(driver->strings, "DISABLE_ASSERT"),
@@ -3,644 +3,524 @@
 //
 
 #include "codec.h"
-#include "visitor.h"
+
+#include "core/htable.h"
 
 #include "msgpack.h"
 
+#include <string.h>
+
+typedef struct {
+    const AstNode *node;
+    u64 id;
+} AstNodeId;
+
 typedef struct {
-    msgpack_sbuffer *buffer;
     msgpack_packer packer;
-} AstNodeUnpackContext;
+    HashTable ids;
+    DynArray *fileNames;
+    DynArray files;
+    u64 count;
+    bool failed;
+} AstNodePackContext;
 
-attr(always_inline) static void packString(msgpack_packer *packer, cstring str)
-{
-    size_t len = strlen(str);
-    msgpack_pack_str(packer, len);
-    msgpack_pack_str_body(packer, str, len);
-}
+static void packManyNodes(AstNodePackContext *ctx, const AstNode *node);
 
-attr(always_inline) static void nodeToBinary(ConstAstVisitor *visitor,
-                                             const AstNode *node)
+static bool compareAstNodeIds(const void *lhs, const void *rhs)
 {
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    if (node)
-        astConstVisit(visitor, node);
-    else
-        msgpack_pack_nil(&ctx->packer);
+    return ((AstNodeId *)lhs)->node == ((AstNodeId *)rhs)->node;
 }
 
-static void manyNodesToBinary(ConstAstVisitor *visitor, const AstNode *node)
+attr(always_inline) static void packU64(AstNodePackContext *ctx, u64 value)
 {
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    u64 count = countAstNodes(node);
-    msgpack_pack_array(&ctx->packer, count);
-    for (const AstNode *it = node; it; it = it->next)
-        astConstVisit(visitor, it);
+    msgpack_pack_uint64(&ctx->packer, value);
 }
 
-static void nodePopulateFilePos(msgpack_packer *packer, const FilePos *pos)
+attr(always_inline) static void packI64(AstNodePackContext *ctx, i64 value)
 {
-    msgpack_pack_uint32(packer, pos->row);
-    msgpack_pack_uint32(packer, pos->col);
-    msgpack_pack_uint64(packer, pos->byteOffset);
+    msgpack_pack_int64(&ctx->packer, value);
 }
 
-static void nodePopulateLocation(msgpack_packer *packer, const FileLoc *loc)
+static void packString(AstNodePackContext *ctx, cstring str)
 {
-    nodePopulateFilePos(packer, &loc->begin);
-    nodePopulateFilePos(packer, &loc->end);
+    if (str == NULL) {
+        msgpack_pack_nil(&ctx->packer);
+        return;
+    }
+    size_t len = strlen(str);
+    msgpack_pack_str(&ctx->packer, len);
+    msgpack_pack_str_body(&ctx->packer, str, len);
 }
 
-static void nodePackHeader(ConstAstVisitor *visitor, const AstNode *node)
+static void packFileName(AstNodePackContext *ctx, cstring fileName)
 {
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    msgpack_pack_uint32(&ctx->packer, node->tag);
-    msgpack_pack_uint64(&ctx->packer, node->flags);
-    nodePopulateLocation(&ctx->packer, &node->loc);
-    manyNodesToBinary(visitor, node->attrs);
-}
+    if (fileName == NULL) {
+        msgpack_pack_nil(&ctx->packer);
+        return;
+    }
 
-static void visitProgram(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-    nodeToBinary(visitor, node->program.module);
-    manyNodesToBinary(visitor, node->program.top);
-    manyNodesToBinary(visitor, node->program.decls);
+    // File names are written once, subsequent references use the index
+    for (u64 i = 0; i < ctx->files.size; i++) {
+        if (dynArrayAt(cstring *, &ctx->files, i) == fileName) {
+            packU64(ctx, i);
+            return;
+        }
+    }
+
+    pushOnDynArray(&ctx->files, &fileName);
+    if (ctx->fileNames)
+        pushOnDynArray(ctx->fileNames, &fileName);
+    packString(ctx, fileName);
 }
 
-static void visitError(ConstAstVisitor *visitor, const AstNode *node)
+static void packFilePos(AstNodePackContext *ctx, const FilePos *pos)
 {
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-    packString(&ctx->packer, node->error.message);
+    packU64(ctx, pos->row);
+    packU64(ctx, pos->col);
+    packU64(ctx, pos->byteOffset);
 }
 
-static void visitNoop(ConstAstVisitor *visitor, const AstNode *node)
+static void packLocation(AstNodePackContext *ctx, const FileLoc *loc)
 {
-    nodePackHeader(visitor, node);
+    packFileName(ctx, loc->fileName);
+    packFilePos(ctx, &loc->begin);
+    packFilePos(ctx, &loc->end);
 }
 
-static void visitLiteral(ConstAstVisitor *visitor, const AstNode *node)
+static void packNodeBody(AstNodePackContext *ctx, const AstNode *node)
 {
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
     switch (node->tag) {
+    case astNoop:
+    case astVoidType:
+    case astAutoType:
+    case astStringType:
     case astNullLit:
+    case astBreakStmt:
+    case astContinueStmt:
+        break;
+    case astError:
+        packString(ctx, node->error.message);
+        packManyNodes(ctx, node->error.original);
+        break;
+    case astProgram:
+        packString(ctx, node->program.path);
+        packManyNodes(ctx, node->program.module);
+        packManyNodes(ctx, node->program.top);
+        packManyNodes(ctx, node->program.decls);
+        break;
+    case astCCode:
+        packU64(ctx, node->cCode.kind);
+        packManyNodes(ctx, node->cCode.what);
+        break;
+    case astDefine:
+        packManyNodes(ctx, node->define.names);
+        packManyNodes(ctx, node->define.type);
+        packManyNodes(ctx, node->define.container);
+        break;
+    case astAttr:
+        packString(ctx, node->attr.name);
+        packManyNodes(ctx, node->attr.args);
+        packU64(ctx, node->attr.count);
+        packU64(ctx, node->attr.kvpArgs);
+        break;
+    case astAnnotation:
+        packString(ctx, node->annotation.name);
+        packManyNodes(ctx, node->annotation.value);
+        break;
+    case astPath:
+        packManyNodes(ctx, node->path.elements);
+        packU64(ctx, node->path.isType);
+        packU64(ctx, node->path.inheritanceDepth);
+        break;
+    case astPathElem:
+        packString(ctx, node->pathElement.name);
+        packString(ctx, node->pathElement.alt);
+        packManyNodes(ctx, node->pathElement.args);
+        packU64(ctx, node->pathElement.index);
+        packU64(ctx, node->pathElement.super);
+        packU64(ctx, node->pathElement.isKeyword);
+        break;
+    case astGenericParam:
+        packString(ctx, node->genericParam.name);
+        packManyNodes(ctx, node->genericParam.defaultValue);
+        packManyNodes(ctx, node->genericParam.constraints);
+        packU64(ctx, node->genericParam.inferIndex);
+        packU64(ctx, node->genericParam.innerType);
+        break;
+    case astIdentifier:
+        packString(ctx, node->ident.value);
+        packString(ctx, node->ident.alias);
+        packU64(ctx, node->ident.super);
+        break;
+    case astImportEntity:
+        packString(ctx, node->importEntity.name);
+        packString(ctx, node->importEntity.alias);
+        break;
+    case astTupleType:
+        packU64(ctx, node->tupleType.len);
+        packManyNodes(ctx, node->tupleType.elements);
+        break;
+    case astTupleExpr:
+        packU64(ctx, node->tupleExpr.len);
+        packManyNodes(ctx, node->tupleExpr.elements);
+        packU64(ctx, node->tupleExpr.isLiteral);
+        break;
+    case astArrayType:
+        packManyNodes(ctx, node->arrayType.elementType);
+        packManyNodes(ctx, node->arrayType.dim);
+        break;
+    case astPointerType:
+        packManyNodes(ctx, node->pointerType.pointed);
+        break;
+    case astReferenceType:
+        packManyNodes(ctx, node->referenceType.referred);
+        break;
+    case astFuncType:
+        packManyNodes(ctx, node->funcType.params);
+        packManyNodes(ctx, node->funcType.ret);
+        break;
+    case astPrimitiveType:
+        packU64(ctx, node->primitiveType.id);
+        break;
+    case astOptionalType:
+        packManyNodes(ctx, node->optionalType.type);
+        break;
+    case astResultType:
+        packManyNodes(ctx, node->resultType.target);
         break;
     case astBoolLit:
-        msgpack_pack_uint8(&ctx->packer, node->boolLiteral.value);
+        packU64(ctx, node->boolLiteral.value);
         break;
     case astCharLit:
-        msgpack_pack_uint32(&ctx->packer, node->charLiteral.value);
+        packU64(ctx, node->charLiteral.value);
         break;
     case astIntegerLit:
-        msgpack_pack_uint8(&ctx->packer, node->intLiteral.isNegative);
-        msgpack_pack_uint64(&ctx->packer, node->intLiteral.uValue);
+        packU64(ctx, (u64)node->intLiteral.uValue);
+        packU64(ctx, (u64)(node->intLiteral.uValue >> 64));
+        packU64(ctx, node->intLiteral.isNegative);
         break;
     case astFloatLit:
-        msgpack_pack_double(&ctx->packer, node->floatLiteral.value);
+        packU64(ctx, node->floatLiteral._bits);
         break;
     case astStringLit:
-        packString(&ctx->packer, node->stringLiteral.value);
+        packString(ctx, node->stringLiteral.value);
+        break;
+    case astAsm:
+        packString(ctx, node->inlineAssembly.text);
+        packManyNodes(ctx, node->inlineAssembly.outputs);
+        packManyNodes(ctx, node->inlineAssembly.inputs);
+        packManyNodes(ctx, node->inlineAssembly.clobbers);
+        packManyNodes(ctx, node->inlineAssembly.flags);
+        break;
+    case astAsmOperand:
+        packString(ctx, node->asmOperand.constraint);
+        packManyNodes(ctx, node->asmOperand.operand);
+        break;
+    case astException:
+        packString(ctx, node->exception.name);
+        packManyNodes(ctx, node->exception.params);
+        packManyNodes(ctx, node->exception.body);
+        break;
+    case astTupleXform:
+        packManyNodes(ctx, node->xForm.target);
+        packManyNodes(ctx, node->xForm.args);
+        packManyNodes(ctx, node->xForm.cond);
+        packManyNodes(ctx, node->xForm.xForm);
+        break;
+    case astGroupExpr:
+    case astExprStmt:
+    case astSpreadExpr:
+        packManyNodes(ctx, node->exprStmt.expr);
+        break;
+    case astUnaryExpr:
+    case astPointerOf:
+    case astReferenceOf:
+        packU64(ctx, node->unaryExpr.op);
+        packU64(ctx, node->unaryExpr.isPrefix);
+        packManyNodes(ctx, node->unaryExpr.operand);
+        break;
+    case astBinaryExpr:
+    case astAssignExpr:
+        packU64(ctx, node->binaryExpr.op);
+        packManyNodes(ctx, node->binaryExpr.lhs);
+        packManyNodes(ctx, node->binaryExpr.rhs);
+        break;
+    case astTernaryExpr:
+    case astIfStmt:
+        packManyNodes(ctx, node->ternaryExpr.cond);
+        packManyNodes(ctx, node->ternaryExpr.body);
+        packManyNodes(ctx, node->ternaryExpr.otherwise);
+        packU64(ctx, node->ternaryExpr.isTernary);
+        break;
+    case astStmtExpr:
+        packManyNodes(ctx, node->stmtExpr.stmt);
+        break;
+    case astStringExpr:
+        packManyNodes(ctx, node->stringExpr.parts);
+        break;
+    case astTypedExpr:
+        packU64(ctx, node->typedExpr.idx);
+        packManyNodes(ctx, node->typedExpr.expr);
+        packManyNodes(ctx, node->typedExpr.type);
+        break;
+    case astCastExpr:
+        packU64(ctx, node->castExpr.idx);
+        packManyNodes(ctx, node->castExpr.expr);
+        packManyNodes(ctx, node->castExpr.to);
+        break;
+    case astCallExpr:
+    case astMacroCallExpr:
+        if (node->callExpr.evaluator != NULL) {
+            // function pointers cannot be persisted
+            ctx->failed = true;
+            break;
+        }
+        packManyNodes(ctx, node->callExpr.callee);
+        packManyNodes(ctx, node->callExpr.args);
+        packU64(ctx, node->callExpr.overload);
+        break;
+    case astClosureExpr:
+        packManyNodes(ctx, node->closureExpr.params);
+        packManyNodes(ctx, node->closureExpr.ret);
+        packManyNodes(ctx, node->closureExpr.body);
+        break;
+    case astArrayExpr:
+        packU64(ctx, node->arrayExpr.len);
+        packManyNodes(ctx, node->arrayExpr.elements);
+        packU64(ctx, node->arrayExpr.isLiteral);
+        break;
+    case astIndexExpr:
+        packManyNodes(ctx, node->indexExpr.target);
+        packManyNodes(ctx, node->indexExpr.index);
+        break;
+    case astFieldExpr:
+        packString(ctx, node->fieldExpr.name);
+        packU64(ctx, node->fieldExpr.index);
+        packManyNodes(ctx, node->fieldExpr.value);
+        break;
+    case astStructExpr:
+        packManyNodes(ctx, node->structExpr.left);
+        packManyNodes(ctx, node->structExpr.fields);
+        packU64(ctx, node->structExpr.isLiteral);
+        break;
+    case astMemberExpr:
+        packManyNodes(ctx, node->memberExpr.target);
+        packManyNodes(ctx, node->memberExpr.member);
+        break;
+    case astRangeExpr:
+        packManyNodes(ctx, node->rangeExpr.start);
+        packManyNodes(ctx, node->rangeExpr.end);
+        packManyNodes(ctx, node->rangeExpr.step);
+        packU64(ctx, node->rangeExpr.down);
+        break;
+    case astNewExpr:
+        packManyNodes(ctx, node->newExpr.expr);
+        packManyNodes(ctx, node->newExpr.allocator);
+        break;
+    case astAliasExpr:
+        packString(ctx, node->aliasExpr.name);
+        packManyNodes(ctx, node->aliasExpr.expr);
+        break;
+    case astDeferStmt:
+        packManyNodes(ctx, node->deferStmt.stmt);
+        packManyNodes(ctx, node->deferStmt.block);
+        break;
+    case astReturnStmt:
+        packManyNodes(ctx, node->returnStmt.expr);
+        packU64(ctx, node->returnStmt.isRaise);
+        break;
+    case astYieldStmt:
+        packManyNodes(ctx, node->yieldStmt.expr);
+        break;
+    case astBlockStmt:
+        packString(ctx, node->blockStmt.name);
+        packManyNodes(ctx, node->blockStmt.stmts);
+        break;
+    case astForStmt:
+        packManyNodes(ctx, node->forStmt.var);
+        packManyNodes(ctx, node->forStmt.range);
+        packManyNodes(ctx, node->forStmt.cond);
+        packManyNodes(ctx, node->forStmt.body);
+        break;
+    case astWhileStmt:
+        packManyNodes(ctx, node->whileStmt.cond);
+        packManyNodes(ctx, node->whileStmt.body);
+        packManyNodes(ctx, node->whileStmt.update);
+        break;
+    case astSwitchStmt:
+        packU64(ctx, node->switchStmt.index);
+        packManyNodes(ctx, node->switchStmt.cond);
+        packManyNodes(ctx, node->switchStmt.cases);
+        packManyNodes(ctx, node->switchStmt.defaultCase);
+        break;
+    case astMatchStmt:
+        packU64(ctx, node->matchStmt.index);
+        packManyNodes(ctx, node->matchStmt.expr);
+        packManyNodes(ctx, node->matchStmt.cases);
+        packManyNodes(ctx, node->matchStmt.defaultCase);
+        break;
+    case astCaseStmt:
+        packManyNodes(ctx, node->caseStmt.match);
+        packManyNodes(ctx, node->caseStmt.body);
+        packManyNodes(ctx, node->caseStmt.alias);
+        packU64(ctx, node->caseStmt.idx);
+        break;
+    case astFuncDecl:
+        packString(ctx, node->funcDecl.name);
+        packU64(ctx, node->funcDecl.operatorOverload);
+        packU64(ctx, node->funcDecl.index);
+        packU64(ctx, node->funcDecl.requiredParamsCount);
+        packU64(ctx, node->funcDecl.paramsCount);
+        packU64(ctx, node->funcDecl.signature != NULL);
+        if (node->funcDecl.signature) {
+            packManyNodes(ctx, node->funcDecl.signature->params);
+            packManyNodes(ctx, node->funcDecl.signature->ret);
+            packManyNodes(ctx, node->funcDecl.signature->typeParams);
+        }
+        packManyNodes(ctx, node->funcDecl.opaqueParams);
+        packManyNodes(ctx, node->funcDecl.body);
+        break;
+    case astMacroDecl:
+        packString(ctx, node->macroDecl.name);
+        packManyNodes(ctx, node->macroDecl.params);
+        packManyNodes(ctx, node->macroDecl.body);
+        break;
+    case astVarDecl:
+        packString(ctx, node->varDecl.name);
+        packU64(ctx, node->varDecl.idx);
+        packManyNodes(ctx, node->varDecl.names);
+        packManyNodes(ctx, node->varDecl.type);
+        packManyNodes(ctx, node->varDecl.init);
+        break;
+    case astTypeDecl:
+        packString(ctx, node->typeDecl.name);
+        packManyNodes(ctx, node->typeDecl.typeParams);
+        packManyNodes(ctx, node->typeDecl.aliased);
+        break;
+    case astUnionDecl:
+        packManyNodes(ctx, node->unionDecl.members);
+        packManyNodes(ctx, node->unionDecl.typeParams);
+        packU64(ctx, node->unionDecl.isResult);
+        break;
+    case astStructDecl:
+    case astClassDecl:
+        packString(ctx, node->structDecl.name);
+        packManyNodes(ctx, node->structDecl.members);
+        packManyNodes(ctx, node->structDecl.typeParams);
+        packManyNodes(ctx, node->structDecl.base);
+        packManyNodes(ctx, node->structDecl.annotations);
+        if (nodeIs(node, ClassDecl))
+            packManyNodes(ctx, node->classDecl.implements);
+        break;
+    case astInterfaceDecl:
+        packString(ctx, node->interfaceDecl.name);
+        packManyNodes(ctx, node->interfaceDecl.members);
+        packManyNodes(ctx, node->interfaceDecl.typeParams);
+        break;
+    case astModuleDecl:
+        packString(ctx, node->moduleDecl.name);
+        packU64(ctx, node->moduleDecl.isPackage);
+        break;
+    case astImportDecl:
+        packU64(ctx, node->import.kind);
+        packManyNodes(ctx, node->import.module);
+        packManyNodes(ctx, node->import.exports);
+        packManyNodes(ctx, node->import.alias);
+        packManyNodes(ctx, node->import.entities);
+        break;
+    case astEnumDecl:
+        packString(ctx, node->enumDecl.name);
+        packU64(ctx, node->enumDecl.len);
+        packManyNodes(ctx, node->enumDecl.base);
+        packManyNodes(ctx, node->enumDecl.options);
+        break;
+    case astFieldDecl:
+        packString(ctx, node->structField.name);
+        packU64(ctx, node->structField.index);
+        packU64(ctx, node->structField.bits);
+        packManyNodes(ctx, node->structField.type);
+        packManyNodes(ctx, node->structField.value);
+        break;
+    case astExternDecl:
+        packManyNodes(ctx, node->externDecl.func);
+        break;
+    case astGenericDecl:
+        packString(ctx, node->genericDecl.name);
+        packU64(ctx, node->genericDecl.paramsCount);
+        packI64(ctx, node->genericDecl.inferrable);
+        packManyNodes(ctx, node->genericDecl.params);
+        packManyNodes(ctx, node->genericDecl.decl);
+        break;
+    case astFuncParamDecl:
+        packString(ctx, node->funcParam.name);
+        packU64(ctx, node->funcParam.idx);
+        packU64(ctx, node->funcParam.index);
+        packManyNodes(ctx, node->funcParam.type);
+        packManyNodes(ctx, node->funcParam.def);
+        break;
+    case astEnumOptionDecl:
+        packString(ctx, node->enumOption.name);
+        packU64(ctx, node->enumOption.index);
+        packManyNodes(ctx, node->enumOption.value);
+        break;
+    case astTestDecl:
+        packString(ctx, node->testDecl.name);
+        packManyNodes(ctx, node->testDecl.body);
         break;
     default:
-        csAssert0(false);
+        // Only nodes created by the parser can be persisted, anything else
+        // references compiler state (types, plugins, scopes...)
+        ctx->failed = true;
+        break;
     }
 }
 
-static void visitAttr(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    packString(&ctx->packer, node->attr.name);
-    manyNodesToBinary(visitor, node->attr.args);
-}
-
-static void visitStrExpr(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-    manyNodesToBinary(visitor, node->stringExpr.parts);
-}
-
-static void visitDefine(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    manyNodesToBinary(visitor, node->define.names);
-    nodeToBinary(visitor, node->define.type);
-    nodeToBinary(visitor, node->define.container);
-}
-
-static void visitImport(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-    nodeToBinary(visitor, node->import.alias);
-    nodeToBinary(visitor, node->import.module);
-    manyNodesToBinary(visitor, node->import.entities);
-}
-
-static void visitImportEntity(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    packString(&ctx->packer, node->importEntity.name);
-    packString(&ctx->packer, node->importEntity.alias);
-}
-
-static void visitModuleDecl(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    packString(&ctx->packer, node->moduleDecl.name);
-}
-
-static void visitIdentifier(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    packString(&ctx->packer, node->ident.value);
-    packString(&ctx->packer, node->ident.alias);
-}
-
-static void visitTuple(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    manyNodesToBinary(visitor, node->tupleType.elements);
-}
-
-static void visitArrayType(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->arrayType.elementType);
-    nodeToBinary(visitor, node->arrayType.dim);
-}
-
-static void visitFuncType(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->funcType.ret);
-    manyNodesToBinary(visitor, node->funcType.params);
-}
-
-static void visitOptionalType(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->optionalType.type);
-}
-
-static void visitPrimitiveType(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    msgpack_pack_uint8(&ctx->packer, node->primitiveType.id);
-}
-
-static void visitHeaderOnly(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-}
-
-static void visitPointerType(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->pointerType.pointed);
-}
-
-static void visitReferenceType(ConstAstVisitor *visitor, const AstNode *node)
+static void packNode(AstNodePackContext *ctx, const AstNode *node)
 {
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->referenceType.referred);
-}
-
-static void visitArrayExpr(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    manyNodesToBinary(visitor, node->arrayExpr.elements);
-}
-
-static void visitMemberExpr(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->memberExpr.target);
-    nodeToBinary(visitor, node->memberExpr.member);
-}
-
-static void visitRangeExpr(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->rangeExpr.start);
-    nodeToBinary(visitor, node->rangeExpr.end);
-    nodeToBinary(visitor, node->rangeExpr.step);
-}
-
-static void visitNewExpr(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->newExpr.allocator);
-    nodeToBinary(visitor, node->newExpr.expr);
-}
-
-static void visitCastExpr(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->castExpr.to);
-    nodeToBinary(visitor, node->castExpr.expr);
-}
-
-static void visitIndexExpr(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->indexExpr.target);
-    nodeToBinary(visitor, node->indexExpr.index);
-}
-
-static void visitGenericParam(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    packString(&ctx->packer, node->genericParam.name);
-    nodeToBinary(visitor, node->genericParam.constraints);
-}
-
-static void visitGenericDecl(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->genericDecl.decl);
-    manyNodesToBinary(visitor, node->genericDecl.params);
-}
-
-static void visitPathElement(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    manyNodesToBinary(visitor, node->pathElement.args);
-
-    packString(&ctx->packer, node->pathElement.name);
-    packString(&ctx->packer, node->pathElement.alt);
-    msgpack_pack_uint64(&ctx->packer, node->pathElement.index);
-}
-
-static void visitPath(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    manyNodesToBinary(visitor, node->path.elements);
-    msgpack_pack_uint8(&ctx->packer, node->path.isType);
-}
-
-static void visitFuncDecl(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    msgpack_pack_uint32(&ctx->packer, node->funcDecl.operatorOverload);
-    msgpack_pack_uint16(&ctx->packer, node->funcDecl.index);
-    packString(&ctx->packer, node->funcDecl.name);
-    manyNodesToBinary(visitor, node->funcDecl.signature->params);
-    nodeToBinary(visitor, node->funcDecl.signature->ret);
-    nodeToBinary(visitor, node->funcDecl.body);
-}
-
-static void visitMacroDecl(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    packString(&ctx->packer, node->macroDecl.name);
-    manyNodesToBinary(visitor, node->macroDecl.params);
-    nodeToBinary(visitor, node->macroDecl.body);
-}
-
-static void visitFuncParamDecl(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    packString(&ctx->packer, node->funcParam.name);
-
-    nodeToBinary(visitor, node->funcParam.type);
-    nodeToBinary(visitor, node->funcParam.def);
-}
-
-static void visitVarDecl(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    manyNodesToBinary(visitor, node->varDecl.names);
-    nodeToBinary(visitor, node->varDecl.type);
-    nodeToBinary(visitor, node->varDecl.init);
-}
-
-static void visitTypeDecl(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    packString(&ctx->packer, node->typeDecl.name);
-    nodeToBinary(visitor, node->typeDecl.aliased);
-}
-
-static void visitUnionDecl(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-    manyNodesToBinary(visitor, node->unionDecl.members);
-}
-
-static void visitEnumOptionDecl(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    packString(&ctx->packer, node->enumOption.name);
-    nodeToBinary(visitor, node->enumOption.value);
-}
-
-static void visitEnumDecl(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    packString(&ctx->packer, node->enumDecl.name);
-    nodeToBinary(visitor, node->enumDecl.base);
-    manyNodesToBinary(visitor, node->enumDecl.options);
-}
-
-static void visitFieldDecl(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    packString(&ctx->packer, node->structField.name);
-    nodeToBinary(visitor, node->structField.type);
-    nodeToBinary(visitor, node->structField.value);
-}
-
-static void visitClassOrStructDecl(ConstAstVisitor *visitor,
-                                   const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    packString(&ctx->packer, node->structDecl.name);
-    if (nodeIs(node, ClassDecl))
-        nodeToBinary(visitor, node->classDecl.base);
-    manyNodesToBinary(visitor, node->structDecl.members);
-    if (nodeIs(node, ClassDecl))
-        manyNodesToBinary(visitor, node->classDecl.implements);
-}
-
-static void visitBinaryExpr(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    msgpack_pack_uint8(&ctx->packer, node->binaryExpr.op);
-
-    nodeToBinary(visitor, node->binaryExpr.lhs);
-    nodeToBinary(visitor, node->binaryExpr.lhs);
-}
-
-static void visitUnaryExpr(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    msgpack_pack_uint8(&ctx->packer, node->unaryExpr.isPrefix);
-    msgpack_pack_uint8(&ctx->packer, node->unaryExpr.op);
-
-    nodeToBinary(visitor, node->unaryExpr.operand);
-}
-
-static void visitTernaryExpr(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->ternaryExpr.cond);
-    nodeToBinary(visitor, node->ternaryExpr.body);
-    nodeToBinary(visitor, node->ternaryExpr.otherwise);
-}
-
-static void visitStmtExpr(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->stmtExpr.stmt);
-}
-
-static void visitTypedExpr(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->typedExpr.type);
-    nodeToBinary(visitor, node->typedExpr.expr);
-}
-
-static void visitCallExpr(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    msgpack_pack_uint32(&ctx->packer, node->callExpr.overload);
-    nodeToBinary(visitor, node->callExpr.callee);
-    manyNodesToBinary(visitor, node->callExpr.args);
-}
-
-static void visitClosureExpr(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->closureExpr.ret);
-    manyNodesToBinary(visitor, node->closureExpr.params);
-    nodeToBinary(visitor, node->closureExpr.body);
-}
-
-static void visitFieldExpr(ConstAstVisitor *visitor, const AstNode *node)
-{
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-
-    packString(&ctx->packer, node->fieldExpr.name);
-    nodeToBinary(visitor, node->fieldExpr.value);
-}
-
-static void visitStructExpr(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->structExpr.left);
-    manyNodesToBinary(visitor, node->structExpr.fields);
-}
-
-static void visitExpressionStmt(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-    nodeToBinary(visitor, node->exprStmt.expr);
-}
-
-static void visitContinueStmt(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-}
-
-static void visitReturnStmt(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-    nodeToBinary(visitor, node->returnStmt.expr);
-}
-
-static void visitBlockStmt(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-    manyNodesToBinary(visitor, node->blockStmt.stmts);
-}
-
-static void visitForStmt(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->forStmt.var);
-    nodeToBinary(visitor, node->forStmt.range);
-    nodeToBinary(visitor, node->forStmt.body);
-}
-
-static void visitWhileStmt(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->whileStmt.cond);
-    nodeToBinary(visitor, node->whileStmt.body);
-}
-
-static void visitSwitchStmt(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
-
-    nodeToBinary(visitor, node->switchStmt.cond);
-    manyNodesToBinary(visitor, node->switchStmt.cases);
-}
+    HashCode hash = hashPtr(hashInit(), node);
+    AstNodeId *found = findInHashTable(&ctx->ids,
+                                       &(AstNodeId){.node = node},
+                                       hash,
+                                       sizeof(AstNodeId),
+                                       compareAstNodeIds);
+    if (found) {
+        // Shared node, encode a back reference
+        packI64(ctx, -(i64)(found->id + 1));
+        return;
+    }
 
-static void visitCaseStmt(ConstAstVisitor *visitor, const AstNode *node)
-{
-    nodePackHeader(visitor, node);
+    insertInHashTable(&ctx->ids,
+                      &(AstNodeId){.node = node, .id = ctx->count++},
+                      hash,
+                      sizeof(AstNodeId),
+                      compareAstNodeIds);
 
-    nodeToBinary(visitor, node->caseStmt.match);
-    manyNodesToBinary(visitor, node->caseStmt.body);
+    packU64(ctx, node->tag);
+    packU64(ctx, node->flags);
+    packLocation(ctx, &node->loc);
+    packManyNodes(ctx, node->attrs);
+    packNodeBody(ctx, node);
 }
 
-static void visitFallback(ConstAstVisitor *visitor, const AstNode *node)
+static void packManyNodes(AstNodePackContext *ctx, const AstNode *node)
 {
-    AstNodeUnpackContext *ctx = getConstAstVisitorContext(visitor);
-    nodePackHeader(visitor, node);
-    msgpack_pack_nil(&ctx->packer);
+    msgpack_pack_array(&ctx->packer, countAstNodes(node));
+    for (const AstNode *it = node; it && !ctx->failed; it = it->next)
+        packNode(ctx, it);
 }
 
 bool binaryEncodeAstNode(struct msgpack_sbuffer *sbuf,
-                         MemPool *pool,
-                         const AstNode *node)
+                         const AstNode *node,
+                         DynArray *fileNames)
 {
-    msgpack_sbuffer_init(sbuf);
-    AstNodeUnpackContext ctx = {.buffer = sbuf};
+    AstNodePackContext ctx = {.ids = newTempHashTable(sizeof(AstNodeId)),
+                              .files = newDynArray(sizeof(cstring)),
+                              .fileNames = fileNames};
     msgpack_packer_init(&ctx.packer, sbuf, msgpack_sbuffer_write);
-    packString(&ctx.packer, node->loc.fileName);
 
-    // clang-format off
-    ConstAstVisitor visitor = makeConstAstVisitor(&ctx, {
-        [astProgram] = visitProgram,
-        [astError] = visitError,
-        [astNoop] = visitNoop,
-        [astAttr] = visitAttr,
-        [astNullLit] = visitLiteral,
-        [astBoolLit] = visitLiteral,
-        [astCharLit] = visitLiteral,
-        [astIntegerLit] = visitLiteral,
-        [astFloatLit] = visitLiteral,
-        [astStringLit] = visitLiteral,
-        [astStringExpr] = visitStrExpr,
-        [astDefine] = visitDefine,
-        [astImportDecl] = visitImport,
-        [astImportEntity] = visitImportEntity,
-        [astModuleDecl] = visitModuleDecl,
-        [astIdentifier] = visitIdentifier,
-        [astTupleType] = visitTuple,
-        [astTupleExpr] = visitTuple,
-        [astArrayType] = visitArrayType,
-        [astFuncType] = visitFuncType,
-        [astOptionalType] = visitOptionalType,
-        [astStringType] = visitHeaderOnly,
-        [astAutoType] = visitHeaderOnly,
-        [astPrimitiveType] = visitPrimitiveType,
-        [astPointerType] = visitPointerType,
-        [astReferenceType] = visitReferenceType,
-        [astArrayExpr] = visitArrayExpr,
-        [astMemberExpr] = visitMemberExpr,
-        [astRangeExpr] = visitRangeExpr,
-        [astNewExpr] = visitNewExpr,
-        [astCastExpr] = visitCastExpr,
-        [astIndexExpr] = visitIndexExpr,
-        [astGenericParam] = visitGenericParam,
-        [astGenericDecl] = visitGenericDecl,
-        [astPathElem] = visitPathElement,
-        [astPath] = visitPath,
-        [astFuncDecl] = visitFuncDecl,
-        [astMacroDecl] = visitMacroDecl,
-        [astFuncParamDecl] = visitFuncParamDecl,
-        [astVarDecl] = visitVarDecl,
-        [astTypeDecl] = visitTypeDecl,
-        [astUnionDecl] = visitUnionDecl,
-        [astEnumOptionDecl] = visitEnumOptionDecl,
-        [astEnumDecl] = visitEnumDecl,
-        [astFieldDecl] = visitFieldDecl,
-        [astStructDecl] = visitClassOrStructDecl,
-        [astClassDecl] = visitClassOrStructDecl,
-        [astAssignExpr] = visitBinaryExpr,
-        [astBinaryExpr] = visitBinaryExpr,
-        [astUnaryExpr] = visitUnaryExpr,
-        [astTernaryExpr] = visitTernaryExpr,
-        [astIfStmt] = visitTernaryExpr,
-        [astStmtExpr] = visitStmtExpr,
-        [astTypedExpr] = visitTypedExpr,
-        [astCallExpr] = visitCallExpr,
-        [astMacroCallExpr] = visitCallExpr,
-        [astClosureExpr] = visitClosureExpr,
-        [astFieldExpr] = visitFieldExpr,
-        [astStructExpr] = visitStructExpr,
-        [astExprStmt] = visitExpressionStmt,
-        [astDeferStmt] = visitExpressionStmt,
-        [astGroupExpr] = visitExpressionStmt,
-        [astBreakStmt] = visitContinueStmt,
-        [astContinueStmt] = visitContinueStmt,
-        [astReturnStmt] = visitReturnStmt,
-        [astBlockStmt] = visitBlockStmt,
-        [astForStmt] = visitForStmt,
-        [astWhileStmt] = visitWhileStmt,
-        [astSwitchStmt] = visitSwitchStmt,
-        [astCaseStmt] = visitCaseStmt
-    }, .fallback = visitFallback);
+    packManyNodes(&ctx, node);
 
-    // clang-format on
-    astConstVisit(&visitor, node);
-
-    return true;
-}
\ No newline at end of file
+    freeDynArray(&ctx.files);
+    freeHashTable(&ctx.ids);
+    return !ctx.failed;
+}
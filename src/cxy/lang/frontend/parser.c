@@ -12,6 +12,7 @@
 #include "lexer.h"
 #include "strings.h"
 
+#include "driver/cache.h"
 #include "driver/cc.h"
 #include "driver/driver.h"
 #include "driver/plugin.h"
@@ -294,6 +295,7 @@ static inline Token advanceLexer_(Parser *P)
                    "include file '{s}' resolved to '{s}' does not exist",
                    (FormatArg[]){{.s = filename}, {.s = path}});
     }
+    moduleCacheRecordInclude(P->cc, path);
     lexerPush(P->lexer, path);
     return advanceLexer_(P);
 #else
@@ -1455,7 +1457,27 @@ static AstNode *launchExpression(Parser *P)
     if (callStyle)
         consume0(P, tokRParen);
 
-    body->next = makeReturnAstNode(
+    // The thread gives up ownership of the objects it allocated before it
+    // exits (see __mem in builtins)
+    AstNode *exitHook = makeExprStmt(
+        P->memPool,
+        builtinLoc(),
+        flgNone,
+        makeCallExpr(P->memPool,
+                     builtinLoc(),
+                     makePath(P->memPool,
+                              builtinLoc(),
+                              S_sptr_thread_exit,
+                              flgNone,
+                              NULL),
+                     NULL,
+                     flgNone,
+                     NULL,
+                     NULL),
+        NULL,
+        NULL);
+    body->next = exitHook;
+    exitHook->next = makeReturnAstNode(
         P->memPool,
         builtinLoc(),
         flgNone,
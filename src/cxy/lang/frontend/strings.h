@@ -137,6 +137,7 @@ extern "C" {
     ff(sptr_alloc_trace,    "__smart_ptr_alloc_trace") \
     ff(sptr_drop_trace,     "__smart_ptr_drop_trace")  \
     ff(sptr_get_trace,      "__smart_ptr_get_trace")   \
+    ff(sptr_thread_exit,    "__smart_ptr_thread_exit") \
     ff(copy,                "__copy")            \
     ff(AsmInputPrefix,      "\"r\"")             \
     ff(AsmOutputPrefix,     "\"=r\"")            \
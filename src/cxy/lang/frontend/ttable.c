@@ -15,10 +15,37 @@
 
 #include <memory.h>
 
+static HashCode hashTypeStructure(const Type *type);
+
+/**
+ * The structural hash of a type, interned types carry theirs so hashing a
+ * type only ever walks its own fields and not the whole tree below it
+ */
+static HashCode typeHash(const Type *type)
+{
+    // copies of an interned type (e.g `Type tmp = *type`) must be rehashed
+    if (type->_hashed == type)
+        return type->_hash;
+    return hashTypeStructure(type);
+}
+
+static HashCode memoizeTypeHash(Type *type)
+{
+    type->_hashed = NULL;
+    type->_hash = hashTypeStructure(type);
+    type->_hashed = type;
+    return type->_hash;
+}
+
+static inline HashCode hashType(HashCode hash, const Type *type)
+{
+    return hashUint32(hash, typeHash(type));
+}
+
 static HashCode hashTypes(HashCode hash, const Type **types, u64 count)
 {
     for (u64 i = 0; i < count; i++)
-        hash = hashUint64(hash, types[i]->tag);
+        hash = hashType(hash, types[i]);
     return hash;
 }
 
@@ -27,7 +54,7 @@ static HashCode hashUnionMembers(HashCode hash,
                                  u64 count)
 {
     for (u64 i = 0; i < count; i++)
-        hash = hashUint64(hash, types[i].type->tag);
+        hash = hashType(hash, types[i].type);
     return hash;
 }
 
@@ -60,9 +87,9 @@ static HashCode hashAstNode(HashCode hash, const AstNode *node)
     return hash;
 }
 
-static HashCode hashType(HashCode hash, const Type *type)
+static HashCode hashTypeStructure(const Type *type)
 {
-    hash = hashUint32(hash, type->tag);
+    HashCode hash = hashUint32(hashInit(), type->tag);
     if (!isClassOrStructType(type))
         hash = hashUint64(hash, (type->flags & flgTypeApplicable));
 
@@ -394,17 +421,22 @@ static bool compareTypesWrapper(const void *left, const void *right)
 
 static GetOrInset getOrInsertTypeScoped(TypeTable *table, const Type *type)
 {
-    u32 hash = hashType(hashInit(), type);
+    u32 hash = typeHash(type);
     const Type **found = findInHashTable(&table->types, //
                                          &type,
                                          hash,
                                          sizeof(Type *),
                                          compareTypesWrapper);
-    if (found)
+    table->stats.lookups++;
+    if (found) {
+        table->stats.hits++;
         return (GetOrInset){true, *found};
+    }
 
     Type *newType = __New(table->memPool, Type);
     memcpy(newType, type, sizeof(Type));
+    newType->_hash = hash;
+    newType->_hashed = newType;
 
     if (!insertInHashTable(
             &table->types, &newType, hash, sizeof(Type *), compareTypesWrapper))
@@ -416,7 +448,7 @@ static GetOrInset getOrInsertTypeScoped(TypeTable *table, const Type *type)
 
 static const Type *findTypeScoped(TypeTable *table, const Type *type)
 {
-    u32 hash = hashType(hashInit(), type);
+    u32 hash = typeHash(type);
     const Type **found = findInHashTable(&table->types, //
                                          &type,
                                          hash,
@@ -431,7 +463,7 @@ static Type *replaceTypeScoped(TypeTable *table,
                                const Type *type,
                                const Type *with)
 {
-    u32 hash = hashType(hashInit(), type);
+    u32 hash = typeHash(type);
     Type **found = findInHashTable(&table->types, //
                                    &type,
                                    hash,
@@ -451,7 +483,7 @@ static Type *replaceTypeScoped(TypeTable *table,
 
     if (!insertInHashTable(&table->types,
                            &newType,
-                           hashType(hashInit(), newType),
+                           memoizeTypeHash(newType),
                            sizeof(Type *),
                            compareTypesWrapper))
         csAssert0("failing to insert in type table");
@@ -530,7 +562,7 @@ void freeTypeTable(TypeTable *table)
 
 const Type *removeFromTypeTable(TypeTable *table, const Type *type)
 {
-    u32 hash = hashType(hashInit(), type);
+    u32 hash = typeHash(type);
     const Type **found = findInHashTable(&table->types, //
                                          &type,
                                          hash,
@@ -1095,7 +1127,11 @@ const Type *flattenWrappedType(const Type *type, u64 *flags)
 GetOrInset makeAppliedType(TypeTable *table, const Type *init)
 {
     GetOrInset ret = getOrInsertType(table, init);
-    if (!ret.f) {
+    if (ret.f) {
+        table->stats.reusedInstantiations++;
+    }
+    else {
+        table->stats.instantiations++;
         Type *applied = (Type *)ret.s;
         applied->applied.args = allocFromMemPool(
             table->memPool, sizeof(Type *) * init->applied.totalArgsCount);
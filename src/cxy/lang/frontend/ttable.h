@@ -31,6 +31,13 @@ typedef struct TypeTable {
     const Type *primitiveTypes[prtCOUNT];
     const Type *destructorType;
     const Type *optionalType;
+    struct {
+        u64 lookups;
+        u64 hits;
+        // generic instantiations created and reused through makeAppliedType
+        u64 instantiations;
+        u64 reusedInstantiations;
+    } stats;
 } TypeTable;
 
 typedef CxyPair(bool, const Type *) GetOrInset;
@@ -6,6 +6,7 @@
 
 #include "core/array.h"
 #include "core/format.h"
+#include "core/hash.h"
 #include "core/utils.h"
 
 #include <stdbool.h>
@@ -162,7 +163,10 @@ struct MirType;
             bool generating;                                                   \
         };                                                                     \
     };                                                                         \
-    const Type *retyped;
+    const Type *retyped;                                                       \
+    /* structural hash, memoized when the type is interned */                  \
+    HashCode _hash;                                                            \
+    const Type *_hashed;
 
 #ifdef __cpluplus
 
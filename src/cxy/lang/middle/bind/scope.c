@@ -12,9 +12,88 @@
 
 #include <string.h>
 
-static inline bool compareSymbols(const void *lhs, const void *rhs)
+typedef struct Binding {
+    const char *name;
+    Symbol *symbol;
+} Binding;
+
+static inline bool compareBindings(const void *lhs, const void *rhs)
+{
+    return ((const Binding *)lhs)->name == ((const Binding *)rhs)->name;
+}
+
+static Binding *findBinding(const Env *env, const char *name)
+{
+    return findInHashTable(&env->bindings,
+                           &(Binding){.name = name},
+                           hashPtr(hashInit(), name),
+                           sizeof(Binding),
+                           compareBindings);
+}
+
+static Binding *getOrInsertBinding(Env *env, const char *name)
+{
+    Binding binding = {.name = name};
+    u32 hash = hashPtr(hashInit(), name);
+    insertInHashTable(
+        &env->bindings, &binding, hash, sizeof(Binding), compareBindings);
+    return findInHashTable(
+        &env->bindings, &binding, hash, sizeof(Binding), compareBindings);
+}
+
+static Symbol *findSymbolInScope(const Env *env, const char *name)
+{
+    Binding *binding = findBinding(env, name);
+    if (binding && binding->symbol && binding->symbol->scope == env->scope)
+        return binding->symbol;
+    return NULL;
+}
+
+/**
+ * Binds the name to a new symbol in the current scope, the caller must
+ * have checked that the scope does not already define it
+ */
+static Symbol *bindSymbol(Env *env, const char *name, AstNode *node)
+{
+    Binding *binding = getOrInsertBinding(env, name);
+    Symbol *symbol = env->unused;
+    if (symbol)
+        env->unused = symbol->next;
+    else
+        symbol = mallocOrDie(sizeof(Symbol));
+
+    *symbol = (Symbol){.name = name,
+                       .node = node,
+                       .scope = env->scope,
+                       .shadowed = binding->symbol,
+                       .next = env->scope->symbols};
+    env->scope->symbols = symbol;
+    binding->symbol = symbol;
+    return symbol;
+}
+
+static void unbindSymbols(Env *env, Scope *scope)
+{
+    Symbol *symbol = scope->symbols;
+    while (symbol) {
+        Symbol *next = symbol->next;
+        Binding *binding = findBinding(env, symbol->name);
+        csAssert0(binding && binding->symbol == symbol);
+        binding->symbol = symbol->shadowed;
+        symbol->next = env->unused;
+        env->unused = symbol;
+        symbol = next;
+    }
+    scope->symbols = NULL;
+}
+
+static void freeSymbols(Symbol *symbol)
 {
-    return ((const Symbol *)lhs)->name == ((const Symbol *)rhs)->name;
+    while (symbol) {
+        Symbol *next = symbol->next;
+        free(symbol);
+        symbol = next;
+    }
 }
 
 static Scope *newScope(Scope *prev)
@@ -22,7 +101,7 @@ static Scope *newScope(Scope *prev)
     Scope *next = mallocOrDie(sizeof(Scope));
     next->prev = prev;
     next->next = NULL;
-    next->symbols = newTempHashTable(sizeof(Symbol));
+    next->symbols = NULL;
     if (prev) {
         next->level = prev->level + 1;
         prev->next = next;
@@ -34,7 +113,7 @@ static void freeScopes(Scope *scope)
 {
     while (scope) {
         Scope *next = scope->next;
-        freeHashTable(&scope->symbols);
+        freeSymbols(scope->symbols);
         memset(scope, 0, sizeof *scope);
         free(scope);
         scope = next;
@@ -74,7 +153,10 @@ static void blockScopeDeinitList(BlockScope *list)
     }
 }
 
-void suggestSimilarSymbol(const Env *env, Log *L, const char *name)
+static void suggestSimilarSymbolInScopes(const Scope *scope,
+                                         const Scope *last,
+                                         Log *L,
+                                         const char *name)
 {
     u64 minDist = 2;
 
@@ -83,16 +165,13 @@ void suggestSimilarSymbol(const Env *env, Log *L, const char *name)
 
     const char *similar = NULL;
     FileLoc loc = {};
-    for (Scope *scope = env->scope; scope; scope = scope->prev) {
-        Symbol *symbols = scope->symbols.elems;
-        for (u32 i = 0; i < scope->symbols.capacity; i++) {
-            if (!isBucketOccupied(&scope->symbols, i))
-                continue;
-            u64 dist = levenshteinDistance(name, symbols[i].name, minDist);
+    for (; scope; scope = scope == last ? NULL : scope->prev) {
+        for (Symbol *symbol = scope->symbols; symbol; symbol = symbol->next) {
+            u64 dist = levenshteinDistance(name, symbol->name, minDist);
             if (dist < minDist) {
                 minDist = dist;
-                similar = symbols[i].name;
-                loc = symbols[i].node->loc;
+                similar = symbol->name;
+                loc = symbol->node->loc;
             }
         }
     }
@@ -102,31 +181,32 @@ void suggestSimilarSymbol(const Env *env, Log *L, const char *name)
     }
 }
 
+void suggestSimilarSymbol(const Env *env, Log *L, const char *name)
+{
+    suggestSimilarSymbolInScopes(env->scope, NULL, L, name);
+}
+
 bool defineSymbol(Env *env, Log *L, const char *name, AstNode *node)
 {
     csAssert0(env->scope);
     if (isIgnoreVar(name))
         return false;
 
-    Symbol symbol = {.name = name, .node = node, .index = 0};
-    u32 hash = hashPtr(hashInit(), name);
-    bool wasInserted = insertInHashTable(
-        &env->scope->symbols, &symbol, hash, sizeof(Symbol), compareSymbols);
-    if (!wasInserted && L) {
+    const Symbol *prev = findSymbolInScope(env, name);
+    if (prev == NULL) {
+        bindSymbol(env, name, node);
+        return true;
+    }
+
+    if (L) {
         logError(L,
                  &node->loc,
                  "symbol '{s}' already defined in current scope",
                  (FormatArg[]){{.s = name}});
-        const Symbol *prev = findInHashTable(&env->scope->symbols,
-                                             &symbol,
-                                             hash,
-                                             sizeof(Symbol),
-                                             compareSymbols);
-        csAssert0(prev);
         logNote(L, &prev->node->loc, "previously declared here", NULL);
     }
 
-    return wasInserted;
+    return false;
 }
 
 bool defineForwardDeclarable(Env *env, Log *L, const char *name, AstNode *node)
@@ -135,30 +215,24 @@ bool defineForwardDeclarable(Env *env, Log *L, const char *name, AstNode *node)
     if (isIgnoreVar(name))
         return true;
 
-    Symbol symbol = {.name = name, .node = node};
-    u32 hash = hashPtr(hashInit(), name);
-    bool wasInserted = insertInHashTable(
-        &env->scope->symbols, &symbol, hash, sizeof(Symbol), compareSymbols);
-
-    if (!wasInserted) {
-        Symbol *prev = findInHashTable(&env->scope->symbols,
-                                       &symbol,
-                                       hash,
-                                       sizeof(Symbol),
-                                       compareSymbols);
-        if (!hasFlag(prev->node, ForwardDecl)) {
-            if (L) {
-                logError(L,
-                         &node->loc,
-                         "symbol '{s}' already defined in current scope",
-                         (FormatArg[]){{.s = name}});
-                logNote(L, &prev->node->loc, "previously declared here", NULL);
-            }
-            return false;
+    Symbol *prev = findSymbolInScope(env, name);
+    if (prev == NULL) {
+        bindSymbol(env, name, node);
+        return true;
+    }
+
+    if (!hasFlag(prev->node, ForwardDecl)) {
+        if (L) {
+            logError(L,
+                     &node->loc,
+                     "symbol '{s}' already defined in current scope",
+                     (FormatArg[]){{.s = name}});
+            logNote(L, &prev->node->loc, "previously declared here", NULL);
         }
-        setForwardDeclDefinition(prev->node, node);
-        prev->node = node;
+        return false;
     }
+    setForwardDeclDefinition(prev->node, node);
+    prev->node = node;
 
     return true;
 }
@@ -169,18 +243,11 @@ void updateSymbol(Env *env, const char *name, AstNode *node)
     if (isIgnoreVar(name))
         return;
 
-    Symbol symbol = {.name = name, .node = node};
-    u32 hash = hashPtr(hashInit(), name);
-    bool wasInserted = insertInHashTable(
-        &env->scope->symbols, &symbol, hash, sizeof(Symbol), compareSymbols);
-    if (!wasInserted) {
-        Symbol *prev = findInHashTable(&env->scope->symbols,
-                                       &symbol,
-                                       hash,
-                                       sizeof(Symbol),
-                                       compareSymbols);
+    Symbol *prev = findSymbolInScope(env, name);
+    if (prev == NULL)
+        bindSymbol(env, name, node);
+    else
         prev->node = node;
-    }
 }
 
 void defineFunctionDecl(Env *env, Log *L, const char *name, AstNode *node)
@@ -189,14 +256,10 @@ void defineFunctionDecl(Env *env, Log *L, const char *name, AstNode *node)
     if (isIgnoreVar(name))
         return;
 
-    Symbol symbol = {.name = name, .node = node};
-    u32 hash = hashPtr(hashInit(), name);
-    bool wasInserted = insertInHashTable(
-        &env->scope->symbols, &symbol, hash, sizeof(Symbol), compareSymbols);
-
-    Symbol *sym = findInHashTable(
-        &env->scope->symbols, &symbol, hash, sizeof(Symbol), compareSymbols);
-    csAssert0(sym);
+    Symbol *sym = findSymbolInScope(env, name);
+    bool wasInserted = sym == NULL;
+    if (wasInserted)
+        sym = bindSymbol(env, name, node);
 
     if (!wasInserted && L && !nodeIs(sym->node, FuncDecl)) {
         logError(L,
@@ -223,25 +286,20 @@ AstNode *findSymbolInRoot(const Env *env,
                           const char *name,
                           const FileLoc *loc)
 {
-    Scope *scope = env->first;
-    u32 hash = hashPtr(hashInit(), name);
-    Symbol *symbol = findInHashTable(&scope->symbols,
-                                     &(Symbol){.name = name},
-                                     hash,
-                                     sizeof(Symbol),
-                                     compareSymbols);
-    if (symbol)
-        return symbol->node;
+    Binding *binding = findBinding(env, name);
+    // the root scope's symbol is the outermost binding of the name
+    for (Symbol *symbol = binding ? binding->symbol : NULL; symbol;
+         symbol = symbol->shadowed) {
+        if (symbol->scope == env->first)
+            return symbol->node;
+    }
 
     if (L) {
         logError(L,
                  loc,
                  "undefined module symbol '{s}'",
                  (FormatArg[]){{.s = name}});
-        Scope tmp = *env->first;
-        tmp.next = NULL;
-        Env tmpEnv = {&tmp, &tmp};
-        suggestSimilarSymbol(&tmpEnv, L, name);
+        suggestSimilarSymbolInScopes(env->first, env->first, L, name);
     }
 
     return NULL;
@@ -252,16 +310,9 @@ AstNode *findSymbol(const Env *env,
                     const char *name,
                     const FileLoc *loc)
 {
-    u32 hash = hashPtr(hashInit(), name);
-    for (Scope *scope = env->scope; scope; scope = scope->prev) {
-        Symbol *symbol = findInHashTable(&scope->symbols,
-                                         &(Symbol){.name = name},
-                                         hash,
-                                         sizeof(Symbol),
-                                         compareSymbols);
-        if (symbol)
-            return symbol->node;
-    }
+    Binding *binding = findBinding(env, name);
+    if (binding && binding->symbol)
+        return binding->symbol->node;
 
     if (isBuiltinsInitialized()) {
         AstNode *node = findBuiltinDecl(name);
@@ -281,15 +332,13 @@ void environmentDump(const Env *env, const char *name)
 {
     if (env) {
         for (Scope *scope = env->scope; scope; scope = scope->prev) {
-            Symbol *symbols = scope->symbols.elems;
-            for (u32 i = 0; i < scope->symbols.capacity; i++) {
-                if (!isBucketOccupied(&scope->symbols, i))
-                    continue;
+            for (Symbol *symbol = scope->symbols; symbol;
+                 symbol = symbol->next) {
                 printf("%s %p[%p] -> %s\n",
                        name ?: "null",
                        env,
                        scope,
-                       symbols[i].name);
+                       symbol->name);
             }
         }
     }
@@ -446,29 +495,10 @@ void pushScope(Env *env, AstNode *node)
     env->scope->node = node;
 }
 
-void releaseScope(Env *env, Env *into)
-{
-    csAssert0(env->scope);
-    into->first = env->scope;
-    into->scope = env->scope;
-    if (env->first != env->scope) {
-        env->scope->prev->next = env->scope->next;
-        into->first->prev = NULL;
-        into->scope->next = NULL;
-        env->scope = env->scope->next;
-    }
-    else {
-        if (env->scope->next)
-            freeScopes(env->scope->next);
-        env->first = env->scope = NULL;
-        into->scope->next = NULL;
-    }
-}
-
 void popScope(Env *env)
 {
     csAssert0(env->scope);
-    clearHashTable(&env->scope->symbols);
+    unbindSymbols(env, env->scope);
     env->scope = env->scope->prev;
 }
 
@@ -476,13 +506,18 @@ void environmentInit(Env *env, AstNode *node)
 {
     env->first = newScope(NULL);
     env->scope = NULL;
+    env->bindings = newTempHashTable(sizeof(Binding));
+    env->unused = NULL;
     pushScope(env, node);
 }
 
 void environmentFree(Env *env)
 {
-    if (env)
+    if (env) {
         freeScopes(env->first);
+        freeSymbols(env->unused);
+        freeHashTable(&env->bindings);
+    }
 }
 
 void blockScopeContainerInit(BlockScopeContainer *container,
@@ -667,6 +667,139 @@ static AstNode *makeMemberOfNode(AstVisitor *visitor,
                            getPrimitiveType(ctx->types, prtBool));
 }
 
+#define PERFECT_HASH_MAX_BITS 16
+#define PERFECT_HASH_ATTEMPTS 4096
+
+// Must match `perfectHash` in runtime/builtins.cxy
+static u32 perfectHashSlot(u32 seed, u32 bits, cstring str)
+{
+    u32 h = seed;
+    for (const char *p = str; *p; p++)
+        h = (h ^ (u8)*p) * 0x01000193u;
+    return (h ^ (h >> 16)) & ((1u << bits) - 1);
+}
+
+static bool perfectHashFindSeed(cstring *keys, u64 count, u32 *seed, u32 *bits)
+{
+    u32 b = 1;
+    while ((1ull << b) < count)
+        b++;
+
+    u8 used[1u << PERFECT_HASH_MAX_BITS];
+    for (; b <= PERFECT_HASH_MAX_BITS; b++) {
+        for (u32 attempt = 0; attempt < PERFECT_HASH_ATTEMPTS; attempt++) {
+            u32 s = 0x811c9dc5u + attempt * 0x9E3779B9u;
+            memset(used, 0, 1u << b);
+            u64 i = 0;
+            for (; i < count; i++) {
+                u32 slot = perfectHashSlot(s, b, keys[i]);
+                if (used[slot])
+                    break;
+                used[slot] = 1;
+            }
+            if (i == count) {
+                *seed = s;
+                *bits = b;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * `perfect_hash!(keys)` picks a seed for which the strings in the comptime
+ * list `keys` all land in different slots and evaluates to the parameters
+ * to pass to `perfectHash` at runtime. `perfect_hash!(keys, key)` evaluates
+ * to the slot of `key`, so that a key can be dispatched with a single hash
+ * followed by a single string comparison.
+ */
+static AstNode *makePerfectHashNode(AstVisitor *visitor,
+                                    const AstNode *node,
+                                    AstNode *args)
+{
+    EvalContext *ctx = getAstVisitorContext(visitor);
+    if (!validateMacroArgumentLimit(ctx, &node->loc, args, 1, 2))
+        return NULL;
+
+    AstNode *list = args, *key = args->next;
+    AstNode *resolved = resolvePath(list);
+    if (!nodeIs(resolved, VarDecl) || !nodeIs(resolved->varDecl.init, List)) {
+        logError(ctx->L,
+                 &list->loc,
+                 "invalid argument passed to `perfect_hash!` expecting a "
+                 "list of string literals",
+                 NULL);
+        return NULL;
+    }
+
+    u64 count = countAstNodes(resolved->varDecl.init->nodesList.nodes.first);
+    if (count == 0)
+        count = 1;
+    cstring *keys = mallocOrDie(sizeof(cstring) * count);
+    keys[0] = "";
+    count = 0;
+    for (AstNode *it = resolved->varDecl.init->nodesList.nodes.first; it;
+         it = it->next) {
+        if (!nodeIs(it, StringLit) && !evaluate(visitor, it)) {
+            free(keys);
+            return NULL;
+        }
+        if (!nodeIs(it, StringLit)) {
+            logError(ctx->L,
+                     &it->loc,
+                     "`perfect_hash!` keys must be string literals",
+                     NULL);
+            free(keys);
+            return NULL;
+        }
+        for (u64 i = 0; i < count; i++) {
+            if (strcmp(keys[i], it->stringLiteral.value) == 0) {
+                logError(ctx->L,
+                         &it->loc,
+                         "duplicate `perfect_hash!` key '{s}'",
+                         (FormatArg[]){{.s = it->stringLiteral.value}});
+                free(keys);
+                return NULL;
+            }
+        }
+        keys[count++] = it->stringLiteral.value;
+    }
+
+    u32 seed = 0, bits = 0;
+    bool found = perfectHashFindSeed(keys, count, &seed, &bits);
+    free(keys);
+    if (!found) {
+        logError(ctx->L,
+                 &list->loc,
+                 "`perfect_hash!` could not find a perfect hash for {u64} keys",
+                 (FormatArg[]){{.u64 = count}});
+        return NULL;
+    }
+
+    u64 value = ((u64)seed << 8) | bits;
+    if (key != NULL) {
+        if (!evaluate(visitor, key))
+            return NULL;
+        if (!nodeIs(key, StringLit)) {
+            logError(ctx->L,
+                     &key->loc,
+                     "`perfect_hash!` key must be a string literal",
+                     NULL);
+            return NULL;
+        }
+        value = perfectHashSlot(seed, bits, key->stringLiteral.value);
+    }
+
+    args->next = NULL;
+    clearAstBody(args);
+    args->tag = astIntegerLit;
+    args->flags = flgNone;
+    args->intLiteral.uValue = value;
+    args->type = getPrimitiveType(ctx->types, key ? prtU32 : prtU64);
+    return args;
+}
+
 static AstNode *makeAstNodeList(AstVisitor *visitor,
                                 attr(unused) const AstNode *node,
                                 attr(unused) AstNode *args)
@@ -1781,6 +1914,7 @@ static const BuiltinMacro builtinMacros[] = {
     {.name = "mk_struct_expr", makeAstStructExprNode},
     {.name = "mk_tuple_expr", makeAstTupleExprNode},
     {.name = "offset", makeOffsetNumberNode},
+    {.name = "perfect_hash", makePerfectHashNode},
     {.name = "ptroff", makePointerOfNode},
     {.name = "require", makeRequireNode},
     {.name = "select", makeSelectNode},
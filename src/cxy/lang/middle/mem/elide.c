@@ -0,0 +1,701 @@
+#include "mem.h"
+
+#include "driver/driver.h"
+#include "lang/frontend/flag.h"
+#include "lang/frontend/visitor.h"
+
+#include <lang/frontend/strings.h>
+#include <lang/frontend/ttable.h>
+
+/*
+ * Reference count elision, runs on the AST produced by `manageMemory`.
+ *
+ * - Borrowed parameters: a by-value class parameter of a module private
+ *   function that is never assigned, moved or captured does not need the
+ *   reference its callers retain for it, provided every caller passes a
+ *   local it owns and does not touch for the duration of the function. The
+ *   callee stops dropping the parameter and the callers stop copying it.
+ * - Move on last use: a copy of a managed local that is its last reference
+ *   (outside of any loop the local does not live in) becomes a move, the
+ *   drop at scope exit finds the local moved.
+ * - Copy/drop pairing: `var y = x` on class locals where neither variable
+ *   is reassigned, moved or has its address taken makes `y` an unmanaged
+ *   alias of `x`, the copy and `y`'s drop cancel out.
+ *
+ * `&const` parameters are references and never managed, so they are
+ * borrowed already.
+ */
+
+typedef struct {
+    AstNode *variable;
+    AstNode *func;
+    AstNode *declare;
+    AstNode *lastCopy;
+    u64 lastStmt;
+    u32 stmtRefs;
+    u32 loops;
+    u32 lastLoops;
+    bool mutated;
+    bool addressed;
+    bool borrowed;
+} RcVariable;
+
+typedef struct {
+    AstNode *func;
+    u64 borrowed;
+    u64 removed;
+    bool candidate;
+    bool addressed;
+    bool hasDefer;
+} RcFunction;
+
+typedef struct {
+    AstNode *call;
+    AstNode *caller;
+} RcCall;
+
+typedef struct {
+    AstNode *variable;
+    AstNode *drop;
+} RcDrop;
+
+typedef struct RcContext {
+    CompilerDriver *cc;
+    Hmap variables;
+    Hmap functions;
+    Hmap generics;
+    DynArray calls;
+    DynArray drops;
+    AstNode *function;
+    u64 stmt;
+    u64 stmts;
+    u32 loops;
+} RcContext;
+
+static bool compareRcVariable(const void *lhs, const void *rhs)
+{
+    return ((RcVariable *)lhs)->variable == ((RcVariable *)rhs)->variable;
+}
+
+static HashCode hashRcVariable(const void *data)
+{
+    return hashPtr(hashInit(), ((RcVariable *)data)->variable);
+}
+
+static bool compareRcFunction(const void *lhs, const void *rhs)
+{
+    return ((RcFunction *)lhs)->func == ((RcFunction *)rhs)->func;
+}
+
+static HashCode hashRcFunction(const void *data)
+{
+    return hashPtr(hashInit(), ((RcFunction *)data)->func);
+}
+
+static bool compareName(const void *lhs, const void *rhs)
+{
+    return *((cstring *)lhs) == *((cstring *)rhs);
+}
+
+static HashCode hashName(const void *data)
+{
+    return hashPtr(hashInit(), *((cstring *)data));
+}
+
+static RcVariable *findVariable(RcContext *ctx, AstNode *node)
+{
+    if (node == NULL)
+        return NULL;
+    return hmapGet(&ctx->variables, &(RcVariable){.variable = node});
+}
+
+static void insertVariable(RcContext *ctx, AstNode *node)
+{
+    hmapPut(&ctx->variables,
+            &(RcVariable){.variable = node,
+                          .func = ctx->function,
+                          .loops = ctx->loops});
+}
+
+static RcFunction *getFunction(RcContext *ctx, AstNode *func)
+{
+    RcFunction *rf = hmapGet(&ctx->functions, &(RcFunction){.func = func});
+    if (rf == NULL) {
+        HmapStatus status =
+            hmapPut(&ctx->functions, &(RcFunction){.func = func});
+        rf = status.f;
+    }
+    return rf;
+}
+
+static AstNode *resolveCallee(AstNode *node)
+{
+    if (nodeIs(node, Identifier))
+        return node->ident.resolvesTo;
+    if (nodeIs(node, Path))
+        return getResolvedPath(node);
+    return NULL;
+}
+
+static bool isBorrowCandidate(const AstNode *node)
+{
+    return node->funcDecl.body != NULL &&
+           !hasFlags(node,
+                     flgPublic | flgExtern | flgMain | flgGenerated |
+                         flgClosure | flgAsync | flgVariadic | flgPure |
+                         flgTestContext | flgModuleInit | flgVirtual |
+                         flgConstructor) &&
+           findAttribute(node, S_linkage) == NULL &&
+           node->funcDecl.paramsCount <= 64;
+}
+
+static bool hasDropFlags(const RcVariable *rv)
+{
+    if (nodeIs(rv->variable, FuncParamDecl))
+        return rv->variable->funcParam.dropFlags != NULL;
+    return rv->declare->backendCallExpr.dropFlags != NULL ||
+           rv->declare->backendCallExpr.args->varDecl.dropFlags != NULL;
+}
+
+static void recordReference(RcContext *ctx, AstNode *node, AstNode *copy)
+{
+    RcVariable *rv = findVariable(ctx, node);
+    if (rv == NULL)
+        return;
+    if (rv->func != ctx->function)
+        rv->addressed = true;
+    rv->lastCopy = copy;
+    rv->lastLoops = ctx->loops;
+    if (rv->lastStmt == ctx->stmt) {
+        rv->stmtRefs++;
+    }
+    else {
+        rv->lastStmt = ctx->stmt;
+        rv->stmtRefs = 1;
+    }
+}
+
+static void markVariable(RcContext *ctx, AstNode *node, bool mutated)
+{
+    RcVariable *rv = findVariable(ctx, resolveIdentifier(node));
+    if (rv == NULL)
+        return;
+    if (mutated)
+        rv->mutated = true;
+    else
+        rv->addressed = true;
+}
+
+static void collectGenericName(AstVisitor *visitor, AstNode *node)
+{
+    RcContext *ctx = getAstVisitorContext(visitor);
+    hmapPut(&ctx->generics, &node->ident.value);
+}
+
+static void collectGenericPathName(AstVisitor *visitor, AstNode *node)
+{
+    RcContext *ctx = getAstVisitorContext(visitor);
+    AstNode *elem = node->path.elements;
+    for (; elem; elem = elem->next)
+        hmapPut(&ctx->generics, &elem->pathElement.name);
+    astVisitFallbackVisitAll(visitor, node);
+}
+
+static void visitGenericDecl(AstVisitor *visitor, AstNode *node)
+{
+    // Instances are type checked in whichever module instantiates them, a
+    // function they call cannot change its calling convention
+    RcContext *ctx = getAstVisitorContext(visitor);
+    // clang-format off
+    AstVisitor names = makeAstVisitor(ctx, {
+        [astIdentifier] = collectGenericName,
+        [astPath] = collectGenericPathName,
+    }, .fallback = astVisitFallbackVisitAll);
+    // clang-format on
+    astVisit(&names, node);
+}
+
+static void visitIdentifier(AstVisitor *visitor, AstNode *node)
+{
+    RcContext *ctx = getAstVisitorContext(visitor);
+    AstNode *target = node->ident.resolvesTo;
+    if (nodeIs(target, FuncDecl))
+        getFunction(ctx, target)->addressed = true;
+    else
+        recordReference(ctx, target, NULL);
+}
+
+static void visitPath(AstVisitor *visitor, AstNode *node)
+{
+    RcContext *ctx = getAstVisitorContext(visitor);
+    AstNode *target = getResolvedPath(node);
+    if (nodeIs(target, FuncDecl))
+        getFunction(ctx, target)->addressed = true;
+    recordReference(ctx, node->path.elements->pathElement.resolvesTo, NULL);
+    astVisitFallbackVisitAll(visitor, node);
+}
+
+static void visitCallExpr(AstVisitor *visitor, AstNode *node)
+{
+    RcContext *ctx = getAstVisitorContext(visitor);
+    AstNode *callee = resolveCallee(node->callExpr.callee);
+    if (!nodeIs(callee, FuncDecl)) {
+        astVisitFallbackVisitAll(visitor, node);
+        return;
+    }
+
+    pushOnDynArray(&ctx->calls,
+                   &(RcCall){.call = node, .caller = ctx->function});
+    astVisitManyNodes(visitor, node->callExpr.args);
+}
+
+static void visitBackendCallExpr(AstVisitor *visitor, AstNode *node)
+{
+    RcContext *ctx = getAstVisitorContext(visitor);
+    AstNode *args = node->backendCallExpr.args;
+    switch (node->backendCallExpr.func) {
+    case bfiDeclare:
+        if (nodeIs(args, VarDecl)) {
+            astVisit(visitor, args->varDecl.init);
+            insertVariable(ctx, node);
+            findVariable(ctx, node)->declare = node;
+        }
+        else if (nodeIs(args, FuncParamDecl) &&
+                 nodeIs(ctx->function, FuncDecl)) {
+            AstNode *param = nodeGetFuncParams(ctx->function);
+            for (; param; param = param->next) {
+                if (param->_name != args->_name)
+                    continue;
+                RcVariable *rv = findVariable(ctx, param);
+                if (rv)
+                    rv->declare = node;
+                break;
+            }
+        }
+        return;
+    case bfiCopy:
+        if (nodeIs(args, Identifier)) {
+            recordReference(ctx, args->ident.resolvesTo, node);
+            return;
+        }
+        break;
+    case bfiDrop:
+        if (hasFlag(node, Generated) && nodeIs(args, Identifier)) {
+            // a variable's own scope exit drop neither mutates nor uses it
+            pushOnDynArray(
+                &ctx->drops,
+                &(RcDrop){.variable = args->ident.resolvesTo, .drop = node});
+            return;
+        }
+        markVariable(ctx, args, true);
+        break;
+    case bfiMove:
+        markVariable(ctx, args, true);
+        break;
+    case bfiAssign:
+        markVariable(ctx, args->assignExpr.lhs, true);
+        break;
+    default:
+        break;
+    }
+    astVisitFallbackVisitAll(visitor, node);
+}
+
+static void visitAssignExpr(AstVisitor *visitor, AstNode *node)
+{
+    RcContext *ctx = getAstVisitorContext(visitor);
+    if (nodeIs(node->assignExpr.lhs, Identifier))
+        markVariable(ctx, node->assignExpr.lhs, true);
+    astVisitFallbackVisitAll(visitor, node);
+}
+
+static void visitUnaryExpr(AstVisitor *visitor, AstNode *node)
+{
+    RcContext *ctx = getAstVisitorContext(visitor);
+    switch (node->unaryExpr.op) {
+    case opMove:
+    case opDelete:
+        markVariable(ctx, node->unaryExpr.operand, true);
+        break;
+    case opPtrof:
+    case opRefof:
+        markVariable(ctx, node->unaryExpr.operand, false);
+        break;
+    default:
+        break;
+    }
+    astVisitFallbackVisitAll(visitor, node);
+}
+
+static void visitAddressOf(AstVisitor *visitor, AstNode *node)
+{
+    RcContext *ctx = getAstVisitorContext(visitor);
+    markVariable(ctx, node->unaryExpr.operand, false);
+    astVisitFallbackVisitAll(visitor, node);
+}
+
+static bool isStatementBlock(const AstNode *node)
+{
+    const AstNode *parent = node->parentScope;
+    if (hasFlag(node, BlockValue))
+        return false;
+    switch (parent ? parent->tag : astFuncDecl) {
+    case astFuncDecl:
+    case astClosureExpr:
+    case astBlockStmt:
+    case astIfStmt:
+    case astWhileStmt:
+    case astForStmt:
+    case astSwitchStmt:
+    case astMatchStmt:
+    case astCaseStmt:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void visitBlockStmt(AstVisitor *visitor, AstNode *node)
+{
+    RcContext *ctx = getAstVisitorContext(visitor);
+    if (!isStatementBlock(node)) {
+        // evaluated as part of the enclosing statement
+        astVisitFallbackVisitAll(visitor, node);
+        return;
+    }
+
+    u64 stmt = ctx->stmt;
+    AstNode *it = node->blockStmt.stmts;
+    for (; it; it = it->next) {
+        ctx->stmt = ++ctx->stmts;
+        astVisit(visitor, it);
+    }
+    ctx->stmt = stmt;
+}
+
+static void visitLoopStmt(AstVisitor *visitor, AstNode *node)
+{
+    RcContext *ctx = getAstVisitorContext(visitor);
+    ctx->loops++;
+    astVisitFallbackVisitAll(visitor, node);
+    ctx->loops--;
+}
+
+static void visitDeferStmt(AstVisitor *visitor, AstNode *node)
+{
+    RcContext *ctx = getAstVisitorContext(visitor);
+    if (ctx->function)
+        getFunction(ctx, ctx->function)->hasDefer = true;
+    astVisitFallbackVisitAll(visitor, node);
+}
+
+static void visitNestedBody(AstVisitor *visitor, AstNode *node, AstNode *body)
+{
+    RcContext *ctx = getAstVisitorContext(visitor);
+    AstNode *function = ctx->function;
+    u64 stmt = ctx->stmt;
+    u32 loops = ctx->loops;
+
+    ctx->function = node;
+    ctx->loops = 0;
+    astVisit(visitor, body);
+
+    ctx->function = function;
+    ctx->stmt = stmt;
+    ctx->loops = loops;
+}
+
+static void visitClosureExpr(AstVisitor *visitor, AstNode *node)
+{
+    visitNestedBody(visitor, node, node->closureExpr.body);
+}
+
+static void visitFuncDecl(AstVisitor *visitor, AstNode *node)
+{
+    RcContext *ctx = getAstVisitorContext(visitor);
+    if (node->funcDecl.body == NULL)
+        return;
+
+    getFunction(ctx, node);
+    AstNode *function = ctx->function;
+    ctx->function = node;
+    AstNode *param = nodeGetFuncParams(node);
+    for (; param; param = param->next)
+        insertVariable(ctx, param);
+    ctx->function = function;
+
+    visitNestedBody(visitor, node, node->funcDecl.body);
+}
+
+static void visitProgram(AstVisitor *visitor, AstNode *node)
+{
+    RcContext *ctx = getAstVisitorContext(visitor);
+    AstNode *decl = node->program.decls;
+    for (; decl; decl = decl->next) {
+        astVisit(visitor, decl);
+        if (nodeIs(decl, FuncDecl) && !hasFlag(node, BuiltinsModule) &&
+            isBorrowCandidate(decl))
+            getFunction(ctx, decl)->candidate = true;
+    }
+}
+
+static bool isOwnedArgument(RcContext *ctx, const AstNode *arg)
+{
+    if (!nodeIs(arg, BackendCall) || arg->backendCallExpr.func != bfiCopy ||
+        !nodeIs(arg->backendCallExpr.args, Identifier))
+        return false;
+
+    RcVariable *rv =
+        findVariable(ctx, arg->backendCallExpr.args->ident.resolvesTo);
+    return rv && rv->declare && !rv->mutated && !rv->addressed &&
+           isClassType(rv->variable->type);
+}
+
+static AstNode *findStatement(AstNode *block,
+                              const AstNode *expr,
+                              AstNode **prev)
+{
+    // Memory management wraps bodies in nested blocks, returns the block
+    // whose statement evaluates `expr`
+    AstNode *stmt = block->blockStmt.stmts, *last = NULL;
+    for (; stmt; last = stmt, stmt = stmt->next) {
+        if (nodeIs(stmt, ExprStmt) && stmt->exprStmt.expr == expr) {
+            *prev = last;
+            return block;
+        }
+        if (nodeIs(stmt, BlockStmt)) {
+            AstNode *found = findStatement(stmt, expr, prev);
+            if (found)
+                return found;
+        }
+    }
+    return NULL;
+}
+
+static bool unlinkStatement(AstNode *body, const AstNode *expr)
+{
+    AstNode *prev = NULL, *block = findStatement(body, expr, &prev);
+    if (block == NULL)
+        return false;
+
+    AstNode *stmt = prev ? prev->next : block->blockStmt.stmts;
+    if (prev)
+        prev->next = stmt->next;
+    else
+        block->blockStmt.stmts = stmt->next;
+    if (block->blockStmt.last == stmt)
+        block->blockStmt.last = prev;
+    return true;
+}
+
+static void stripCopy(AstNode *node)
+{
+    AstNode *next = node->next, *parent = node->parentScope;
+    *node = *node->backendCallExpr.args;
+    node->next = next;
+    node->parentScope = parent;
+}
+
+static void removeDrops(RcContext *ctx, const AstNode *variable)
+{
+    dynArrayFor(drop, RcDrop, &ctx->drops)
+    {
+        if (drop->variable != variable || drop->drop == NULL)
+            continue;
+        drop->drop->tag = astNoop;
+        clearAstBody(drop->drop);
+        drop->drop = NULL;
+    }
+}
+
+static void borrowParameters(RcContext *ctx)
+{
+    HmapIterator it = hmapIterator(&ctx->functions);
+    RcFunction *rf = NULL;
+    while ((rf = hmapNext(&it))) {
+        if (!rf->candidate || rf->addressed ||
+            hmapGet(&ctx->generics, &rf->func->funcDecl.name))
+            continue;
+        AstNode *param = nodeGetFuncParams(rf->func);
+        for (u32 i = 0; param; param = param->next, i++) {
+            RcVariable *rv = findVariable(ctx, param);
+            AstNode *prev = NULL;
+            // the parameter's drop must go away with the callers' copies
+            if (rv && rv->declare && !rv->mutated && !rv->addressed &&
+                !hasDropFlags(rv) && isClassType(param->type) &&
+                findStatement(rf->func->funcDecl.body, rv->declare, &prev))
+                rf->borrowed |= BIT(i);
+        }
+    }
+
+    dynArrayFor(call, RcCall, &ctx->calls)
+    {
+        AstNode *callee = resolveCallee(call->call->callExpr.callee);
+        rf = hmapGet(&ctx->functions, &(RcFunction){.func = callee});
+        if (rf == NULL || rf->borrowed == 0)
+            continue;
+        AstNode *arg = call->call->callExpr.args;
+        for (u32 i = 0; i < rf->func->funcDecl.paramsCount; i++) {
+            if ((rf->borrowed & BIT(i)) && !isOwnedArgument(ctx, arg))
+                rf->borrowed &= ~BIT(i);
+            arg = arg ? arg->next : NULL;
+        }
+    }
+
+    dynArrayFor(call, RcCall, &ctx->calls)
+    {
+        AstNode *callee = resolveCallee(call->call->callExpr.callee);
+        rf = hmapGet(&ctx->functions, &(RcFunction){.func = callee});
+        if (rf == NULL || rf->borrowed == 0)
+            continue;
+        u64 removed = 0;
+        AstNode *arg = call->call->callExpr.args;
+        for (u32 i = 0; arg; arg = arg->next, i++) {
+            if (rf->borrowed & BIT(i)) {
+                stripCopy(arg);
+                removed++;
+            }
+        }
+        getFunction(ctx, call->caller)->removed += removed;
+    }
+
+    it = hmapIterator(&ctx->functions);
+    while ((rf = hmapNext(&it))) {
+        if (rf->borrowed == 0)
+            continue;
+        AstNode *param = nodeGetFuncParams(rf->func);
+        for (u32 i = 0; param; param = param->next, i++) {
+            if (!(rf->borrowed & BIT(i)))
+                continue;
+            RcVariable *rv = findVariable(ctx, param);
+            bool unlinked =
+                unlinkStatement(rf->func->funcDecl.body, rv->declare);
+            csAssert0(unlinked);
+            removeDrops(ctx, param);
+            rv->declare = NULL;
+            rv->borrowed = true;
+            rf->removed++;
+        }
+    }
+}
+
+static void moveOnLastUse(RcContext *ctx)
+{
+    HmapIterator it = hmapIterator(&ctx->variables);
+    RcVariable *rv = NULL;
+    while ((rv = hmapNext(&it))) {
+        AstNode *copy = rv->lastCopy;
+        if (rv->declare == NULL || rv->addressed || rv->stmtRefs != 1 ||
+            rv->lastLoops != rv->loops || !nodeIs(copy, BackendCall) ||
+            copy->backendCallExpr.func != bfiCopy || hasDropFlags(rv))
+            continue;
+
+        RcFunction *rf = getFunction(ctx, rv->func);
+        if (rf->hasDefer)
+            continue;
+        // Only the copy goes, the drop at scope exit stays and finds the
+        // variable moved
+        copy->backendCallExpr.func = bfiMove;
+        rv->mutated = true;
+        rf->removed++;
+    }
+}
+
+static void pairCopyAndDrop(RcContext *ctx)
+{
+    HmapIterator it = hmapIterator(&ctx->variables);
+    RcVariable *rv = NULL;
+    while ((rv = hmapNext(&it))) {
+        AstNode *node = rv->variable;
+        if (rv->declare == NULL || !nodeIs(node, BackendCall) ||
+            rv->mutated || rv->addressed || hasDropFlags(rv) ||
+            !isClassType(node->type))
+            continue;
+
+        AstNode *decl = node->backendCallExpr.args, *init = decl->varDecl.init;
+        if (!nodeIs(init, BackendCall) ||
+            init->backendCallExpr.func != bfiCopy ||
+            !nodeIs(init->backendCallExpr.args, Identifier))
+            continue;
+
+        RcVariable *source =
+            findVariable(ctx, init->backendCallExpr.args->ident.resolvesTo);
+        if (source == NULL || source->func != rv->func || source->mutated ||
+            source->addressed || (!source->declare && !source->borrowed))
+            continue;
+
+        AstNode *next = node->next, *parent = node->parentScope;
+        *node = *decl;
+        node->next = next;
+        node->parentScope = parent;
+        node->varDecl.init = init->backendCallExpr.args;
+        removeDrops(ctx, node);
+        rv->declare = NULL;
+        getFunction(ctx, rv->func)->removed += 2;
+    }
+}
+
+static void recordElisionStats(RcContext *ctx)
+{
+    HmapIterator it = hmapIterator(&ctx->functions);
+    RcFunction *rf = NULL;
+    while ((rf = hmapNext(&it))) {
+        if (rf->removed == 0 || !nodeIs(rf->func, FuncDecl))
+            continue;
+        AstNode *parent = rf->func->parentScope;
+        cstring name = getDeclarationName(rf->func);
+        if (nodeIs(parent, StructDecl) || nodeIs(parent, ClassDecl))
+            name = makeStringConcat(
+                ctx->cc->strings, getDeclarationName(parent), ".", name);
+        compilerStatsRecordRcElision(ctx->cc, name, rf->removed);
+    }
+}
+
+void elideReferenceCounts(CompilerDriver *cc, AstNode *node)
+{
+    RcContext context = {
+        .cc = cc,
+        .variables =
+            hmapCreate(sizeof(RcVariable), hashRcVariable, compareRcVariable),
+        .functions =
+            hmapCreate(sizeof(RcFunction), hashRcFunction, compareRcFunction),
+        .generics = hmapCreate(sizeof(cstring), hashName, compareName),
+        .calls = newDynArray(sizeof(RcCall)),
+        .drops = newDynArray(sizeof(RcDrop))};
+
+    // clang-format off
+    AstVisitor visitor = makeAstVisitor(&context, {
+        [astProgram] = visitProgram,
+        [astFuncDecl] = visitFuncDecl,
+        [astClosureExpr] = visitClosureExpr,
+        [astBlockStmt] = visitBlockStmt,
+        [astWhileStmt] = visitLoopStmt,
+        [astForStmt] = visitLoopStmt,
+        [astDeferStmt] = visitDeferStmt,
+        [astIdentifier] = visitIdentifier,
+        [astPath] = visitPath,
+        [astCallExpr] = visitCallExpr,
+        [astBackendCall] = visitBackendCallExpr,
+        [astAssignExpr] = visitAssignExpr,
+        [astUnaryExpr] = visitUnaryExpr,
+        [astPointerOf] = visitAddressOf,
+        [astReferenceOf] = visitAddressOf,
+        [astGenericDecl] = visitGenericDecl,
+        [astExternDecl] = astVisitSkip,
+        [astMacroDecl] = astVisitSkip
+    }, .fallback = astVisitFallbackVisitAll);
+    // clang-format on
+
+    astVisit(&visitor, node);
+
+    borrowParameters(&context);
+    moveOnLastUse(&context);
+    pairCopyAndDrop(&context);
+    recordElisionStats(&context);
+
+    hmapDestroy(&context.variables);
+    hmapDestroy(&context.functions);
+    hmapDestroy(&context.generics);
+    freeDynArray(&context.calls);
+    freeDynArray(&context.drops);
+}
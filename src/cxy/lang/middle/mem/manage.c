@@ -270,7 +270,7 @@ static AstNode *makeDropVariable(MemContext *ctx,
     AstNode *drop = makeBackendCallExpr(
         ctx->pool,
         &var->loc,
-        flgNone,
+        flgGenerated,
         bfiDrop,
         makeResolvedIdentifier(
             ctx->pool, &var->loc, var->_name, 0, var, NULL, var->type),
@@ -299,7 +299,7 @@ static void transformToDropVariable(MemContext *ctx,
     AstNode *drop = makeBackendCallExpr(
         ctx->pool,
         &var->loc,
-        flgNone,
+        flgGenerated,
         bfiDrop,
         makeResolvedIdentifier(
             ctx->pool, &var->loc, var->_name, 0, var, NULL, var->type),
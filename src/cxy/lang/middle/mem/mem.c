@@ -15,4 +15,16 @@ AstNode *memoryManageAst(CompilerDriver *driver, AstNode *node)
         return NULL;
 
     return node;
-}
\ No newline at end of file
+}
+
+AstNode *elideRcAst(CompilerDriver *driver, AstNode *node)
+{
+    if (!isBuiltinsInitialized())
+        return node;
+
+    elideReferenceCounts(driver, node);
+    if (hasErrors(driver->L))
+        return NULL;
+
+    return node;
+}
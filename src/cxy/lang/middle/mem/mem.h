@@ -15,6 +15,7 @@ extern "C" {
 
 void manageMemory(CompilerDriver *cc, AstNode *node);
 void memoryFinalize(CompilerDriver *cc, AstNode *node);
+void elideReferenceCounts(CompilerDriver *cc, AstNode *node);
 
 #ifdef __cplusplus
 }
@@ -16,18 +16,31 @@ typedef struct Symbol {
     const char *name;
     AstNode *node;
     AstNode *last;
+    struct Scope *scope;
+    // binding of the same name in an enclosing scope
+    struct Symbol *shadowed;
+    // next symbol defined in the same scope
+    struct Symbol *next;
 } Symbol;
 
 typedef struct Scope {
-    HashTable symbols;
+    Symbol *symbols;
     AstNode *node;
     struct Scope *next, *prev;
     u64 level;
 } Scope;
 
+/**
+ * Symbols are looked up through `bindings`, which maps every name to the
+ * innermost symbol bound to it. Entering a scope pushes its symbols on top
+ * of the names' bindings and leaving it pops them, so a lookup costs a
+ * single probe however deep the scope is.
+ */
 typedef struct Env {
     Scope *scope;
     Scope *first;
+    HashTable bindings;
+    Symbol *unused;
 } Env;
 
 typedef struct BlockScope {
@@ -22,6 +22,7 @@ AstNode *preprocessAst(CompilerDriver *driver, AstNode *node);
 AstNode *bindAst(CompilerDriver *driver, AstNode *node);
 AstNode *checkAst(CompilerDriver *driver, AstNode *node);
 AstNode *memoryManageAst(CompilerDriver *driver, AstNode *node);
+AstNode *elideRcAst(CompilerDriver *driver, AstNode *node);
 AstNode *finalizeAst(CompilerDriver *driver, AstNode *node);
 AstNode *generateCode(CompilerDriver *driver, AstNode *node);
 AstNode *collectAst(CompilerDriver *driver, AstNode *node);
@@ -11,6 +11,7 @@
 #include "package/commands/commands.h"
 #include "package/cxyfile.h"
 #include "package/install_scripts.h"
+#include "core/alloc.h"
 #include "core/log.h"
 #include "core/format.h"
 #include "core/strpool.h"
@@ -19,7 +20,9 @@
 
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <errno.h>
 #include <glob.h>
 #include <dirent.h>
@@ -288,27 +291,16 @@ static bool collectTestFilesToRun(const Options *options,
 }
 
 /**
- * Run a test file using cxy test command
+ * Build the `cxy test` command for the given test file
  */
-static bool runTestFile(const char *testFile,
-                        const PackageTest *testConfig,
-                        const DynArray *restArgs,  // from options->package.rest (after --)
-                        const DynArray *installFlags, // from .install.yaml
-                        const char *buildDir,
-                        TestResult *result,
-                        StrPool *strings,
-                        Log *log,
-                        bool verbose)
+static char *makeTestCommand(const char *testFile,
+                             const PackageTest *testConfig,
+                             const DynArray *restArgs,  // from options->package.rest (after --)
+                             const DynArray *installFlags, // from .install.yaml
+                             const char *buildDir,
+                             const char *outputPath,
+                             Log *log)
 {
-    result->testFile = testFile;
-    result->passed = false;
-    result->exitCode = -1;
-    result->output = NULL;
-
-    // Generate unique output path in /tmp to avoid overwriting app binaries
-    char outputPath[2048];
-    snprintf(outputPath, sizeof(outputPath), "/tmp/cxy-test-%d", getpid());
-
     // Build command: cxy test <file> -o <unique-path>
     FormatState cmd = newFormatState(NULL, true);
     format(&cmd, "cxy test {s} -o {s}", (FormatArg[]){{.s = testFile}, {.s = outputPath}});
@@ -350,7 +342,7 @@ static bool runTestFile(const char *testFile,
                         "invalid argument '{s}': arguments must start with '-'",
                         (FormatArg[]){{.s = arg}});
                 freeFormatState(&cmd);
-                return false;
+                return NULL;
             }
 
             format(&cmd, " {s}", (FormatArg[]){{.s = arg}});
@@ -359,6 +351,54 @@ static bool runTestFile(const char *testFile,
 
     char *testCommand = formatStateToString(&cmd);
     freeFormatState(&cmd);
+    return testCommand;
+}
+
+/**
+ * Clean up all compiler-generated files (binary, .c, .o, etc.)
+ */
+static void cleanupTestArtifacts(const char *outputPath, Log *log)
+{
+    // Use a glob pattern to match <output-path>.*
+    FormatState cleanupCmd = newFormatState(NULL, true);
+    format(&cleanupCmd, "rm -f \"{s}\" \"{s}\".*", (FormatArg[]){{.s = outputPath}, {.s = outputPath}});
+    char *cleanupCmdStr = formatStateToString(&cleanupCmd);
+    freeFormatState(&cleanupCmd);
+
+    if (system(cleanupCmdStr) != 0) {
+        // Log warning but don't fail the test if cleanup fails
+        logWarning(log, NULL, "failed to clean up test artifacts", NULL);
+    }
+
+    free(cleanupCmdStr);
+}
+
+/**
+ * Run a test file using cxy test command
+ */
+static bool runTestFile(const char *testFile,
+                        const PackageTest *testConfig,
+                        const DynArray *restArgs,  // from options->package.rest (after --)
+                        const DynArray *installFlags, // from .install.yaml
+                        const char *buildDir,
+                        TestResult *result,
+                        StrPool *strings,
+                        Log *log,
+                        bool verbose)
+{
+    result->testFile = testFile;
+    result->passed = false;
+    result->exitCode = -1;
+    result->output = NULL;
+
+    // Generate unique output path in /tmp to avoid overwriting app binaries
+    char outputPath[2048];
+    snprintf(outputPath, sizeof(outputPath), "/tmp/cxy-test-%d", getpid());
+
+    char *testCommand = makeTestCommand(
+        testFile, testConfig, restArgs, installFlags, buildDir, outputPath, log);
+    if (testCommand == NULL)
+        return false;
 
     // Build header with formatted test path (cyan italic)
     char header[2048];
@@ -380,24 +420,213 @@ static bool runTestFile(const char *testFile,
     result->output = NULL;
 
     free(testCommand);
+    cleanupTestArtifacts(outputPath, log);
 
-    // Clean up all compiler-generated files (binary, .c, .o, etc.)
-    // Use a glob pattern to match <output-path>.*
-    FormatState cleanupCmd = newFormatState(NULL, true);
-    format(&cleanupCmd, "rm -f \"{s}\" \"{s}\".*", (FormatArg[]){{.s = outputPath}, {.s = outputPath}});
-    char *cleanupCmdStr = formatStateToString(&cleanupCmd);
-    freeFormatState(&cleanupCmd);
+    return true;
+}
 
-    if (system(cleanupCmdStr) != 0) {
-        // Log warning but don't fail the test if cleanup fails
-        logWarning(log, NULL, "failed to clean up test artifacts", NULL);
-    }
+/**
+ * Output path of the given test job, `<build-dir>/jobs/<index>/test`. The
+ * generated code, the test binary and its log land next to it.
+ */
+static bool makeJobOutputPath(char *path,
+                              size_t size,
+                              const char *buildDir,
+                              u32 index,
+                              Log *log)
+{
+    char jobDir[2048], resolved[PATH_MAX];
+    if (buildDir == NULL || buildDir[0] == '\0')
+        return false;
 
-    free(cleanupCmdStr);
+    snprintf(jobDir, sizeof(jobDir), "%s/jobs/%u", buildDir, index);
+    if (!makeDirectory(jobDir, true) || realpath(jobDir, resolved) == NULL) {
+        logWarning(log, NULL, "failed to create job output directory: {s}",
+                  (FormatArg[]){{.s = strerror(errno)}});
+        return false;
+    }
 
+    snprintf(path, size, "%s/test", resolved);
     return true;
 }
 
+typedef struct TestJob {
+    cstring testFile;
+    cstring outputPath;
+    char *command;
+    pid_t pid;
+    bool done;
+    TestResult result;
+} TestJob;
+
+/**
+ * Start a test job with its stdout/stderr captured into <output-path>.log
+ */
+static bool startTestJob(TestJob *job, StrPool *strings)
+{
+    cstring logPath = makeStringConcat(strings, job->outputPath, ".log");
+    int fd = open(logPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+        execl("/bin/sh", "sh", "-c", job->command, (char *)NULL);
+        _exit(127);
+    }
+
+    close(fd);
+    job->pid = pid;
+    return pid > 0;
+}
+
+static void finishTestJob(TestJob *job, int status, StrPool *strings, Log *log)
+{
+    cstring logPath = makeStringConcat(strings, job->outputPath, ".log");
+    size_t size = 0;
+    char *output = readFile(logPath, &size);
+
+    job->done = true;
+    job->result.exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    job->result.passed = job->result.exitCode == 0;
+    job->result.output = output ? makeStringSized(strings, output, size) : NULL;
+    free(output);
+    cleanupTestArtifacts(job->outputPath, log);
+}
+
+static void reportTestJob(const TestJob *job, bool verbose)
+{
+    if (job->result.passed)
+        printf(cBGRN " ✔ " cDEF "Running test " cCYN "\033[3m%s\033[0m\n", job->testFile);
+    else
+        printf(cBRED " ✗ " cDEF "Running test " cCYN "\033[3m%s\033[0m\n", job->testFile);
+
+    // Print the captured output indented under failed tests (or every test when verbose)
+    if ((verbose || !job->result.passed) && job->result.output != NULL) {
+        const char *line = job->result.output;
+        while (*line != '\0') {
+            const char *end = strchr(line, '\n');
+            int len = end ? (int)(end - line) : (int)strlen(line);
+            if (len > 0)
+                printf("  %.*s\n", len, line);
+            line += end ? len + 1 : len;
+        }
+    }
+    fflush(stdout);
+}
+
+/**
+ * Run the given test jobs keeping at most `jobs` of them running at any time.
+ * Results are reported in the order of the jobs as soon as all the previous
+ * ones completed, and a failing job never stops the remaining ones.
+ */
+static void runTestJobs(TestJob *testJobs,
+                        u32 count,
+                        u32 jobs,
+                        StrPool *strings,
+                        Log *log,
+                        bool verbose)
+{
+    u32 next = 0, running = 0, reported = 0;
+    pid_t *pids = callocOrDie(count ?: 1, sizeof(pid_t));
+
+    while (reported < count) {
+        for (; running < jobs && next < count; next++) {
+            TestJob *job = &testJobs[next];
+            if (startTestJob(job, strings)) {
+                running++;
+                continue;
+            }
+            // Report the failure and move on with the queue
+            logError(log, NULL, "failed to start test {s}: {s}",
+                    (FormatArg[]){{.s = job->testFile}, {.s = strerror(errno)}});
+            finishTestJob(job, -1, strings, log);
+        }
+
+        if (running > 0) {
+            // Only reap our own test processes
+            u32 waiting = 0;
+            for (u32 i = reported; i < next; i++) {
+                if (!testJobs[i].done)
+                    pids[waiting++] = testJobs[i].pid;
+            }
+            int status = 0;
+            pid_t pid = waitForAnyOf(pids, waiting, &status);
+            if (pid < 0)
+                break;
+            for (u32 i = reported; i < next; i++) {
+                if (!testJobs[i].done && testJobs[i].pid == pid) {
+                    finishTestJob(&testJobs[i], status, strings, log);
+                    running--;
+                    break;
+                }
+            }
+        }
+
+        while (reported < count && testJobs[reported].done)
+            reportTestJob(&testJobs[reported++], verbose);
+    }
+
+    free(pids);
+}
+
+/**
+ * Find the test configuration from Cxyfile for the given test file (for args)
+ */
+static const PackageTest *findTestConfig(const PackageMetadata *meta, cstring testFile)
+{
+    // Prioritize exact matches over pattern matches for specificity
+    // First pass: look for exact matches
+    for (u32 j = 0; j < meta->tests.size; j++) {
+        PackageTest *t = &((PackageTest *)meta->tests.elems)[j];
+
+        if (!t->isPattern && strcmp(t->file, testFile) == 0)
+            return t;
+    }
+
+    // Second pass: if no exact match, look for pattern matches
+    for (u32 j = 0; j < meta->tests.size; j++) {
+        PackageTest *t = &((PackageTest *)meta->tests.elems)[j];
+
+        if (t->isPattern) {
+            // For patterns, check if this file was expanded from this pattern
+            // by seeing if the pattern structure matches
+            if (strstr(t->file, "**") != NULL) {
+                // Extract filename from pattern (part after **/)
+                const char *patternFile = strrchr(t->file, '/');
+                if (patternFile) {
+                    patternFile++; // Skip the /
+                } else {
+                    patternFile = t->file;
+                }
+
+                // Extract filename from test file path
+                const char *testFileName = strrchr(testFile, '/');
+                if (testFileName) {
+                    testFileName++; // Skip the /
+                } else {
+                    testFileName = testFile;
+                }
+
+                // Check if filenames match using pattern matching
+                if (matchesPattern(testFileName, patternFile))
+                    return t;
+            } else {
+                // Non-** pattern - try basic glob matching
+                // For now, use simple string comparison as fallback
+                if (strcmp(t->file, testFile) == 0)
+                    return t;
+            }
+        }
+    }
+
+    return NULL;
+}
+
 /**
  * Package test command implementation
  */
@@ -405,7 +634,7 @@ bool packageTestCommand(const Options *options, StrPool *strings, Log *log)
 {
     const char *buildDir = options->package.buildDir;
     const char *filter = options->package.filter;
-    int parallel = options->package.parallel;
+    u32 jobs = options->package.jobs;
     bool verbose = options->package.verbose;
     const DynArray *specificTestFiles = &options->package.testFiles;
     const DynArray *restArgs = &options->package.rest;
@@ -476,14 +705,6 @@ bool packageTestCommand(const Options *options, StrPool *strings, Log *log)
 
     printStatusSticky(log, "Running tests for package '%s'...", meta.name);
 
-    // Handle parallel warning
-    if (parallel > 1) {
-        logWarning(log, NULL,
-                  "parallel test execution (--parallel/-j) not yet implemented, "
-                  "running tests sequentially",
-                  NULL);
-    }
-
     // Collect test files
     DynArray testFiles = newDynArray(sizeof(cstring));
     if (!collectTestFilesToRun(options, &meta, packageDir, &testFiles,
@@ -541,96 +762,63 @@ bool packageTestCommand(const Options *options, StrPool *strings, Log *log)
     u32 passedCount = 0;
     u32 failedCount = 0;
 
-    for (u32 i = 0; i < testFiles.size; i++) {
-        cstring testFile = ((cstring *)testFiles.elems)[i];
-
-        // Find corresponding test config from Cxyfile (for args)
-        // Prioritize exact matches over pattern matches for specificity
-        PackageTest *testConfig = NULL;
-        PackageTest *patternMatch = NULL;
-        
-        // First pass: look for exact matches
-        for (u32 j = 0; j < meta.tests.size; j++) {
-            PackageTest *t = &((PackageTest *)meta.tests.elems)[j];
-            
-            if (!t->isPattern && strcmp(t->file, testFile) == 0) {
-                testConfig = t;
-                break;
-            }
-        }
-        
-        // Second pass: if no exact match, look for pattern matches
-        if (!testConfig) {
-            for (u32 j = 0; j < meta.tests.size; j++) {
-                PackageTest *t = &((PackageTest *)meta.tests.elems)[j];
-                
-                if (t->isPattern) {
-                    // For patterns, check if this file was expanded from this pattern
-                    // by seeing if the pattern structure matches
-                    if (strstr(t->file, "**") != NULL) {
-                        // Extract filename from pattern (part after **/)
-                        const char *patternFile = strrchr(t->file, '/');
-                        if (patternFile) {
-                            patternFile++; // Skip the /
-                        } else {
-                            patternFile = t->file;
-                        }
-                        
-                        // Extract filename from test file path
-                        const char *testFileName = strrchr(testFile, '/');
-                        if (testFileName) {
-                            testFileName++; // Skip the /
-                        } else {
-                            testFileName = testFile;
-                        }
-                        
-                        // Check if filenames match using pattern matching
-                        if (matchesPattern(testFileName, patternFile)) {
-                            patternMatch = t;
-                            break;
-                        }
-                    } else {
-                        // Non-** pattern - try basic glob matching
-                        // For now, use simple string comparison as fallback
-                        if (strcmp(t->file, testFile) == 0) {
-                            patternMatch = t;
-                            break;
-                        }
-                    }
-                }
+    if (jobs > 1 && testFiles.size > 1) {
+        TestJob *testJobs = callocOrDie(testFiles.size, sizeof(TestJob));
+        u32 count = 0;
+        for (u32 i = 0; i < testFiles.size; i++) {
+            cstring testFile = ((cstring *)testFiles.elems)[i];
+            // Every job needs its own output directory as they all run at
+            // once, the build directory and its caches are shared
+            char outputPath[2048];
+            if (!makeJobOutputPath(outputPath, sizeof(outputPath), buildDir, i, log))
+                snprintf(outputPath, sizeof(outputPath), "/tmp/cxy-test-%d-%u", getpid(), i);
+
+            char *command = makeTestCommand(testFile, findTestConfig(&meta, testFile), restArgs,
+                                            &installFlags, buildDir, outputPath, log);
+            if (command == NULL) {
+                failedCount++;
+                continue;
             }
-            testConfig = patternMatch;
+            testJobs[count++] = (TestJob){.testFile = testFile,
+                                          .outputPath = makeString(strings, outputPath),
+                                          .command = command,
+                                          .result = {.testFile = testFile, .exitCode = -1}};
         }
 
-        // Default empty config if not found
-        PackageTest defaultConfig = {
-            .file = testFile,
-            .args = newDynArray(sizeof(cstring)),
-            .isPattern = false
-        };
-        if (!testConfig)
-            testConfig = &defaultConfig;
-
-        // Run test using cxy test command
-        TestResult result;
-        if (!runTestFile(testFile, testConfig, restArgs, &installFlags, buildDir,
-                        &result, strings, log, verbose)) {
-            failedCount++;
-            if (testConfig == &defaultConfig)
-                freeDynArray(&defaultConfig.args);
-            continue;
+        printStatusSticky(log, "Running %u test file(s) using %u jobs", count, MIN(jobs, count));
+        runTestJobs(testJobs, count, jobs, strings, log, verbose);
+
+        for (u32 i = 0; i < count; i++) {
+            pushOnDynArray(&results, &testJobs[i].result);
+            if (testJobs[i].result.passed) {
+                passedCount++;
+            } else {
+                failedCount++;
+            }
+            free(testJobs[i].command);
         }
+        free(testJobs);
+    }
+    else {
+        for (u32 i = 0; i < testFiles.size; i++) {
+            cstring testFile = ((cstring *)testFiles.elems)[i];
+
+            // Run test using cxy test command
+            TestResult result;
+            if (!runTestFile(testFile, findTestConfig(&meta, testFile), restArgs, &installFlags, buildDir,
+                            &result, strings, log, verbose)) {
+                failedCount++;
+                continue;
+            }
 
-        pushOnDynArray(&results, &result);
+            pushOnDynArray(&results, &result);
 
-        if (result.passed) {
-            passedCount++;
-        } else {
-            failedCount++;
+            if (result.passed) {
+                passedCount++;
+            } else {
+                failedCount++;
+            }
         }
-
-        if (testConfig == &defaultConfig)
-            freeDynArray(&defaultConfig.args);
     }
 
     // Restore directory
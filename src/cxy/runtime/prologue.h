@@ -143,6 +143,61 @@ static void builtins__ClosureTuple_cleanup(void *ptr);
     if (FLAGS)                                                                 \
     __VA_ARGS__
 
+// Shared reference counts (see __mem in builtins), fetch ops return the
+// previous value
+#define __cxy_atomic_fetch_add(PTR, VALUE)                                     \
+    __atomic_fetch_add((PTR), (VALUE), __ATOMIC_ACQ_REL)
+#define __cxy_atomic_fetch_add32(PTR, VALUE)                                   \
+    __atomic_fetch_add((PTR), (VALUE), __ATOMIC_ACQ_REL)
+#define __cxy_atomic_fetch_or32(PTR, VALUE)                                    \
+    __atomic_fetch_or((PTR), (VALUE), __ATOMIC_ACQ_REL)
+#define __cxy_atomic_load(PTR) __atomic_load_n((PTR), __ATOMIC_ACQUIRE)
+#define __cxy_atomic_exchange(PTR, VALUE)                                      \
+    __atomic_exchange_n((PTR), (VALUE), __ATOMIC_ACQ_REL)
+#define __cxy_atomic_cas(PTR, EXPECTED, DESIRED)                               \
+    __atomic_compare_exchange_n(                                               \
+        (PTR), (EXPECTED), (DESIRED), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define __cxy_atomic_load_ptr(PTR) __atomic_load_n((PTR), __ATOMIC_ACQUIRE)
+#define __cxy_atomic_store_ptr(PTR, VALUE)                                     \
+    __atomic_store_n((PTR), (VALUE), __ATOMIC_RELEASE)
+
+// Thread exit hook of the reference counting slots (see
+// __smart_ptr_thread_attach in builtins). The pthread functions are declared
+// weak under their own names so that the prologue neither conflicts with an
+// imported <pthread.h> nor requires -lpthread in single threaded programs
+#if defined(__APPLE__)
+typedef unsigned long __cxy_thread_key_t;
+#else
+typedef unsigned int __cxy_thread_key_t;
+#endif
+#define __CXY_STRINGIFY_(X) #X
+#define __CXY_STRINGIFY(X) __CXY_STRINGIFY_(X)
+#define __CXY_SYMBOL(NAME) __CXY_STRINGIFY(__USER_LABEL_PREFIX__) #NAME
+
+extern int __cxy_pthread_key_create(__cxy_thread_key_t *, void (*)(void *))
+    __asm__(__CXY_SYMBOL(pthread_key_create)) __attribute__((weak));
+extern int __cxy_pthread_setspecific(__cxy_thread_key_t, const void *)
+    __asm__(__CXY_SYMBOL(pthread_setspecific)) __attribute__((weak));
+
+__attribute__((weak)) void __cxy_thread_on_exit(void (*hook)(void *))
+{
+    // 0: no key yet, 1: creating it, 2: created, 3: unavailable
+    static int state = 0;
+    static __cxy_thread_key_t key;
+    int current = 0;
+    if (__cxy_pthread_key_create == nullptr)
+        return;
+    if (__atomic_compare_exchange_n(
+            &state, &current, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        current = __cxy_pthread_key_create(&key, hook) == 0 ? 2 : 3;
+        __atomic_store_n(&state, current, __ATOMIC_RELEASE);
+    }
+    while (current == 1)
+        current = __atomic_load_n(&state, __ATOMIC_ACQUIRE);
+    if (current == 2)
+        __cxy_pthread_setspecific(key, (void *)1);
+}
+
 // Print int128/uint128 macros
 #define INT128(h, l) ((__int128_t)(((__uint128_t)(h) << 64) | (uint64_t)(l)))
 #define UINT128(h, l) ((__uint128_t)(((__uint128_t)(h) << 64) | (uint64_t)(l)))
@@ -25,6 +25,11 @@ __thread static mach_timebase_info_data_t mill_mtid = {0};
 /* Test for polling API */
 #ifdef __linux__
 #define HAVE_EPOLL 1
+/* io_uring is opt-in at build time (AE_IO_URING) and probed when a loop is
+ * created, loops fall back to epoll on kernels or sandboxes without it */
+#ifdef AE_IO_URING
+#define HAVE_IO_URING 1
+#endif
 #endif
 
 #if (defined(__APPLE__) && defined(MAC_OS_X_VERSION_10_6)) ||                  \
@@ -340,14 +345,14 @@ static char *aeApiName(void) { return "evport"; }
 
 #include <sys/epoll.h>
 
-typedef struct aeApiState {
+typedef struct aeEpollState {
     int epfd;
     struct epoll_event *events;
-} aeApiState;
+} aeEpollState;
 
-static int aeApiCreate(aeEventLoop *eventLoop)
+static int aeEpollCreate(aeEventLoop *eventLoop)
 {
-    aeApiState *state = zmalloc(sizeof(aeApiState));
+    aeEpollState *state = zmalloc(sizeof(aeEpollState));
 
     if (!state)
         return -1;
@@ -366,27 +371,27 @@ static int aeApiCreate(aeEventLoop *eventLoop)
     return 0;
 }
 
-static int aeApiResize(aeEventLoop *eventLoop, int setsize)
+static int aeEpollResize(aeEventLoop *eventLoop, int setsize)
 {
-    aeApiState *state = eventLoop->apidata;
+    aeEpollState *state = eventLoop->apidata;
 
     state->events =
         zrealloc(state->events, sizeof(struct epoll_event) * setsize);
     return 0;
 }
 
-static void aeApiFree(aeEventLoop *eventLoop)
+static void aeEpollFree(aeEventLoop *eventLoop)
 {
-    aeApiState *state = eventLoop->apidata;
+    aeEpollState *state = eventLoop->apidata;
 
     close(state->epfd);
     zfree(state->events);
     zfree(state);
 }
 
-static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask)
+static int aeEpollAddEvent(aeEventLoop *eventLoop, int fd, int mask)
 {
-    aeApiState *state = eventLoop->apidata;
+    aeEpollState *state = eventLoop->apidata;
     struct epoll_event ee = {0}; /* avoid valgrind warning */
     /* If the fd was already monitored for some event, we need a MOD
      * operation. Otherwise we need an ADD operation. */
@@ -405,9 +410,9 @@ static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask)
     return 0;
 }
 
-static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask)
+static void aeEpollDelEvent(aeEventLoop *eventLoop, int fd, int delmask)
 {
-    aeApiState *state = eventLoop->apidata;
+    aeEpollState *state = eventLoop->apidata;
     struct epoll_event ee = {0}; /* avoid valgrind warning */
     int mask = eventLoop->events[fd].mask & (~delmask);
 
@@ -427,9 +432,9 @@ static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask)
     }
 }
 
-static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp)
+static int aeEpollPoll(aeEventLoop *eventLoop, struct timeval *tvp)
 {
-    aeApiState *state = eventLoop->apidata;
+    aeEpollState *state = eventLoop->apidata;
     int retval, numevents = 0;
 
     retval = epoll_wait(state->epfd,
@@ -459,8 +464,553 @@ static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp)
     return numevents;
 }
 
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define AE_URING_ENTRIES 1024
+
+/* user_data layout: the low 2 bits tag the completion, aeIoRequest
+ * pointers (tag 0) are at least 8 bytes aligned. Polls carry the fd,
+ * the direction and a generation to discard completions of polls that
+ * were removed before they fired. */
+#define AE_URING_TAG_IO 0
+#define AE_URING_TAG_POLL 1
+#define AE_URING_TAG_TIMEOUT 2
+#define AE_URING_TAG_IGNORE 3
+#define AE_URING_GEN(poll) (((poll) >> 1) & 0x1fffffff)
+#define AE_URING_POLL_DATA(fd, dir, gen)                                       \
+    (((uint64_t)(gen) << 35) | ((uint64_t)(uint32_t)(fd) << 3) |               \
+     ((uint64_t)(dir) << 2) | AE_URING_TAG_POLL)
+
+typedef struct aeUringState {
+    int ringfd;
+    unsigned entries;
+    /* Submission ring */
+    void *sqRing;
+    size_t sqRingSize;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned sqTailLocal;
+    unsigned pending;
+    /* Completion ring */
+    void *cqRing;
+    size_t cqRingSize;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    /* Per fd and direction poll state: armed bit + generation */
+    uint32_t *polls;
+    /* Poll timeout, at most one is kept armed */
+    struct __kernel_timespec ts;
+    uint64_t timeoutSeq;
+    int timeoutArmed;
+} aeUringState;
+
+static int aeUringEnter(aeUringState *state, unsigned wait)
+{
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+
+    __atomic_store_n(state->sqTail, state->sqTailLocal, __ATOMIC_RELEASE);
+    do {
+        ret = (int)syscall(
+            __NR_io_uring_enter, state->ringfd, state->pending, wait, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR && !wait);
+    if (ret > 0)
+        state->pending -= (unsigned)ret < state->pending ? (unsigned)ret
+                                                         : state->pending;
+    return ret;
+}
+
+static struct io_uring_sqe *aeUringGetSqe(aeUringState *state)
+{
+    unsigned head = __atomic_load_n(state->sqHead, __ATOMIC_ACQUIRE);
+    if (state->sqTailLocal - head >= state->entries) {
+        /* Ring full, flush the batch early */
+        if (aeUringEnter(state, 0) < 0)
+            return NULL;
+        head = __atomic_load_n(state->sqHead, __ATOMIC_ACQUIRE);
+        if (state->sqTailLocal - head >= state->entries)
+            return NULL;
+    }
+
+    unsigned idx = state->sqTailLocal & *state->sqMask;
+    struct io_uring_sqe *sqe = &state->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    state->sqArray[idx] = idx;
+    state->sqTailLocal++;
+    state->pending++;
+    return sqe;
+}
+
+static int aeUringArmPoll(aeUringState *state, int fd, int dir)
+{
+    uint32_t *poll = &state->polls[fd * 2 + dir];
+    if (*poll & 1)
+        return 0;
+
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+    if (sqe == NULL)
+        return -1;
+    *poll = (*poll + 2) | 1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll_events = dir ? POLLOUT : POLLIN;
+    sqe->user_data = AE_URING_POLL_DATA(fd, dir, AE_URING_GEN(*poll));
+    return 0;
+}
+
+static void aeUringDisarmPoll(aeUringState *state, int fd, int dir)
+{
+    uint32_t *poll = &state->polls[fd * 2 + dir];
+    if (!(*poll & 1))
+        return;
+
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+    if (sqe) {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = AE_URING_POLL_DATA(fd, dir, AE_URING_GEN(*poll));
+        sqe->user_data = AE_URING_TAG_IGNORE;
+    }
+    *poll &= ~1u;
+}
+
+/* Whether the kernel supports every operation the backend submits,
+ * e.g RECV/SEND need Linux 5.6 and SPLICE 5.7 */
+static int aeUringProbe(int ringfd)
+{
+    static const int ops[] = {IORING_OP_POLL_ADD,
+                              IORING_OP_POLL_REMOVE,
+                              IORING_OP_TIMEOUT,
+                              IORING_OP_TIMEOUT_REMOVE,
+                              IORING_OP_LINK_TIMEOUT,
+                              IORING_OP_READ,
+                              IORING_OP_WRITE,
+                              IORING_OP_RECV,
+                              IORING_OP_SEND,
+                              IORING_OP_ACCEPT,
+                              IORING_OP_SPLICE};
+    size_t size = sizeof(struct io_uring_probe) +
+                  256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int supported = 0;
+
+    if (probe == NULL)
+        return 0;
+    /* Kernels without IORING_REGISTER_PROBE (< 5.6) lack RECV/SEND too */
+    if (syscall(__NR_io_uring_register,
+                ringfd,
+                IORING_REGISTER_PROBE,
+                probe,
+                256) == 0) {
+        supported = 1;
+        for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+            if (ops[i] > probe->last_op ||
+                !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+                supported = 0;
+                break;
+            }
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+static int aeUringCreate(aeEventLoop *eventLoop)
+{
+    struct io_uring_params params;
+    aeUringState *state = zmalloc(sizeof(aeUringState));
+
+    if (!state)
+        return -1;
+    memset(state, 0, sizeof(*state));
+    memset(&params, 0, sizeof(params));
+    state->polls = calloc(eventLoop->setsize * 2, sizeof(uint32_t));
+    if (!state->polls) {
+        zfree(state);
+        return -1;
+    }
+
+    state->ringfd =
+        (int)syscall(__NR_io_uring_setup, AE_URING_ENTRIES, &params);
+    if (state->ringfd < 0 || !aeUringProbe(state->ringfd))
+        goto err;
+
+    state->entries = params.sq_entries;
+    state->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    state->cqRingSize =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cqRingSize > state->sqRingSize)
+            state->sqRingSize = state->cqRingSize;
+        state->cqRingSize = state->sqRingSize;
+    }
+
+    state->sqRing = mmap(NULL,
+                         state->sqRingSize,
+                         PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE,
+                         state->ringfd,
+                         IORING_OFF_SQ_RING);
+    if (state->sqRing == MAP_FAILED)
+        goto err;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        state->cqRing = state->sqRing;
+    else {
+        state->cqRing = mmap(NULL,
+                             state->cqRingSize,
+                             PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE,
+                             state->ringfd,
+                             IORING_OFF_CQ_RING);
+        if (state->cqRing == MAP_FAILED)
+            goto err;
+    }
+
+    state->sqes = mmap(NULL,
+                       params.sq_entries * sizeof(struct io_uring_sqe),
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE,
+                       state->ringfd,
+                       IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED)
+        goto err;
+
+    state->sqHead = (unsigned *)((char *)state->sqRing + params.sq_off.head);
+    state->sqTail = (unsigned *)((char *)state->sqRing + params.sq_off.tail);
+    state->sqMask = (unsigned *)((char *)state->sqRing + params.sq_off.ring_mask);
+    state->sqArray = (unsigned *)((char *)state->sqRing + params.sq_off.array);
+    state->sqTailLocal = *state->sqTail;
+    state->cqHead = (unsigned *)((char *)state->cqRing + params.cq_off.head);
+    state->cqTail = (unsigned *)((char *)state->cqRing + params.cq_off.tail);
+    state->cqMask = (unsigned *)((char *)state->cqRing + params.cq_off.ring_mask);
+    state->cqes =
+        (struct io_uring_cqe *)((char *)state->cqRing + params.cq_off.cqes);
+    eventLoop->apidata = state;
+    return 0;
+
+err:
+    if (state->sqRing && state->sqRing != MAP_FAILED)
+        munmap(state->sqRing, state->sqRingSize);
+    if (state->cqRing && state->cqRing != MAP_FAILED &&
+        state->cqRing != state->sqRing)
+        munmap(state->cqRing, state->cqRingSize);
+    if (state->ringfd >= 0)
+        close(state->ringfd);
+    free(state->polls);
+    zfree(state);
+    return -1;
+}
+
+static int aeUringResize(aeEventLoop *eventLoop, int setsize)
+{
+    aeUringState *state = eventLoop->apidata;
+    uint32_t *polls = realloc(state->polls, setsize * 2 * sizeof(uint32_t));
+
+    if (polls == NULL)
+        return -1;
+    if (setsize > eventLoop->setsize)
+        memset(&polls[eventLoop->setsize * 2],
+               0,
+               (setsize - eventLoop->setsize) * 2 * sizeof(uint32_t));
+    state->polls = polls;
+    return 0;
+}
+
+static void aeUringFree(aeEventLoop *eventLoop)
+{
+    aeUringState *state = eventLoop->apidata;
+
+    munmap(state->sqes, state->entries * sizeof(struct io_uring_sqe));
+    if (state->cqRing != state->sqRing)
+        munmap(state->cqRing, state->cqRingSize);
+    munmap(state->sqRing, state->sqRingSize);
+    close(state->ringfd);
+    free(state->polls);
+    zfree(state);
+}
+
+static int aeUringAddEvent(aeEventLoop *eventLoop, int fd, int mask)
+{
+    aeUringState *state = eventLoop->apidata;
+
+    if ((mask & AE_READABLE) && aeUringArmPoll(state, fd, 0) == -1)
+        return -1;
+    if ((mask & AE_WRITABLE) && aeUringArmPoll(state, fd, 1) == -1)
+        return -1;
+    return 0;
+}
+
+static void aeUringDelEvent(aeEventLoop *eventLoop, int fd, int delmask)
+{
+    aeUringState *state = eventLoop->apidata;
+
+    if (delmask & AE_READABLE)
+        aeUringDisarmPoll(state, fd, 0);
+    if (delmask & AE_WRITABLE)
+        aeUringDisarmPoll(state, fd, 1);
+}
+
+static int aeUringSubmitIo(aeEventLoop *eventLoop,
+                         aeIoRequest *req,
+                         uint64_t timeout)
+{
+    aeUringState *state = eventLoop->apidata;
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+    if (sqe == NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sqe->fd = req->fd;
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+    switch (req->op) {
+    case AE_IO_READ:
+    case AE_IO_WRITE:
+        sqe->opcode = req->op == AE_IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+        sqe->addr = (uint64_t)(uintptr_t)req->buf;
+        sqe->len = (uint32_t)req->len;
+        sqe->off = (uint64_t)req->offset;
+        break;
+    case AE_IO_RECV:
+    case AE_IO_SEND:
+        sqe->opcode = req->op == AE_IO_RECV ? IORING_OP_RECV : IORING_OP_SEND;
+        sqe->addr = (uint64_t)(uintptr_t)req->buf;
+        sqe->len = (uint32_t)req->len;
+        sqe->msg_flags = (uint32_t)req->flags;
+        break;
+    case AE_IO_ACCEPT:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->addr = (uint64_t)(uintptr_t)req->buf;
+        sqe->addr2 = (uint64_t)(uintptr_t)req->addrLen;
+        sqe->accept_flags = (uint32_t)req->flags;
+        break;
+    case AE_IO_SPLICE:
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = req->fd;
+        sqe->splice_off_in = (uint64_t)req->offset;
+        sqe->fd = req->fdOut;
+        sqe->off = (uint64_t)req->offsetOut;
+        sqe->len = (uint32_t)req->len;
+        sqe->splice_flags = (uint32_t)req->flags;
+        break;
+    }
+
+    if (timeout > 0) {
+        struct io_uring_sqe *linked;
+        req->timeout.tv_sec = (int64_t)(timeout / 1000);
+        req->timeout.tv_nsec = (long long)(timeout % 1000) * 1000000;
+        sqe->flags |= IOSQE_IO_LINK;
+        linked = aeUringGetSqe(state);
+        if (linked == NULL) {
+            /* The request is queued already, run it without a deadline */
+            sqe->flags &= ~IOSQE_IO_LINK;
+            return 0;
+        }
+        linked->opcode = IORING_OP_LINK_TIMEOUT;
+        linked->fd = -1;
+        linked->addr = (uint64_t)(uintptr_t)&req->timeout;
+        linked->len = 1;
+        linked->user_data = AE_URING_TAG_IGNORE;
+    }
+    return 0;
+}
+
+static int aeUringPoll(aeEventLoop *eventLoop, struct timeval *tvp)
+{
+    aeUringState *state = eventLoop->apidata;
+    int numevents = 0;
+    unsigned wait = 1;
+
+    if (tvp && tvp->tv_sec == 0 && tvp->tv_usec == 0)
+        wait = 0;
+    else if (tvp) {
+        struct io_uring_sqe *sqe;
+        if (state->timeoutArmed && (sqe = aeUringGetSqe(state))) {
+            sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = (state->timeoutSeq << 2) | AE_URING_TAG_TIMEOUT;
+            sqe->user_data = AE_URING_TAG_IGNORE;
+            state->timeoutArmed = 0;
+        }
+
+        if ((sqe = aeUringGetSqe(state))) {
+            state->ts.tv_sec = tvp->tv_sec;
+            state->ts.tv_nsec = (long long)tvp->tv_usec * 1000;
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t)(uintptr_t)&state->ts;
+            sqe->len = 1;
+            sqe->user_data = (++state->timeoutSeq << 2) | AE_URING_TAG_TIMEOUT;
+            state->timeoutArmed = 1;
+        }
+    }
+
+    /* Don't block if completions are already waiting to be reaped */
+    if (wait && __atomic_load_n(state->cqTail, __ATOMIC_ACQUIRE) != *state->cqHead)
+        wait = 0;
+
+    /* One system call submits the whole batch and waits for completions */
+    if (state->pending || wait) {
+        if (aeUringEnter(state, wait) < 0 && errno != EINTR && errno != ETIME)
+            return 0;
+    }
+
+    unsigned head = *state->cqHead;
+    unsigned tail = __atomic_load_n(state->cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail && numevents < eventLoop->setsize; head++) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cqMask];
+        uint64_t data = cqe->user_data;
+
+        switch (data & 3) {
+        case AE_URING_TAG_IO: {
+            aeIoRequest *req = (aeIoRequest *)(uintptr_t)data;
+            req->result = cqe->res;
+            eventLoop->ioInflight--;
+            req->proc(eventLoop, req, req->clientData);
+            break;
+        }
+        case AE_URING_TAG_POLL: {
+            int fd = (int)(uint32_t)(data >> 3);
+            int dir = (int)((data >> 2) & 1);
+            uint32_t *poll = &state->polls[fd * 2 + dir];
+            /* Ignore completions of polls removed or re-armed since */
+            if (!(*poll & 1) || (data >> 35) != AE_URING_GEN(*poll))
+                break;
+            *poll &= ~1u;
+            if (cqe->res < 0)
+                break;
+
+            int mask = dir ? AE_WRITABLE : AE_READABLE;
+            if (cqe->res & (POLLERR | POLLHUP))
+                mask |= AE_WRITABLE;
+            eventLoop->fired[numevents].fd = fd;
+            eventLoop->fired[numevents].mask = mask;
+            numevents++;
+            /* Poll requests are one shot, ae events are persistent */
+            if (eventLoop->events[fd].mask & (dir ? AE_WRITABLE : AE_READABLE))
+                aeUringArmPoll(state, fd, dir);
+            break;
+        }
+        case AE_URING_TAG_TIMEOUT:
+            if ((data >> 2) == state->timeoutSeq)
+                state->timeoutArmed = 0;
+            break;
+        default:
+            break;
+        }
+    }
+    __atomic_store_n(state->cqHead, head, __ATOMIC_RELEASE);
+    return numevents;
+}
+
+/* -1 until the first loop probed io_uring, then whether it is usable. A
+ * kernel that lacks it will not gain it, so later loops go straight to
+ * epoll */
+static int aeUringUsable = -1;
+
+static int aeApiCreate(aeEventLoop *eventLoop)
+{
+    if (__atomic_load_n(&aeUringUsable, __ATOMIC_RELAXED) != 0) {
+        int usable = aeUringCreate(eventLoop) == 0;
+        __atomic_store_n(&aeUringUsable, usable, __ATOMIC_RELAXED);
+        if (usable) {
+            eventLoop->ioUring = 1;
+            return 0;
+        }
+    }
+    return aeEpollCreate(eventLoop);
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize)
+{
+    return eventLoop->ioUring ? aeUringResize(eventLoop, setsize)
+                              : aeEpollResize(eventLoop, setsize);
+}
+
+static void aeApiFree(aeEventLoop *eventLoop)
+{
+    if (eventLoop->ioUring)
+        aeUringFree(eventLoop);
+    else
+        aeEpollFree(eventLoop);
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask)
+{
+    return eventLoop->ioUring ? aeUringAddEvent(eventLoop, fd, mask)
+                              : aeEpollAddEvent(eventLoop, fd, mask);
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask)
+{
+    if (eventLoop->ioUring)
+        aeUringDelEvent(eventLoop, fd, delmask);
+    else
+        aeEpollDelEvent(eventLoop, fd, delmask);
+}
+
+static int aeApiSubmitIo(aeEventLoop *eventLoop,
+                         aeIoRequest *req,
+                         uint64_t timeout)
+{
+    if (eventLoop->ioUring)
+        return aeUringSubmitIo(eventLoop, req, timeout);
+    errno = ENOTSUP;
+    return -1;
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp)
+{
+    return eventLoop->ioUring ? aeUringPoll(eventLoop, tvp)
+                              : aeEpollPoll(eventLoop, tvp);
+}
+
+static char *aeApiName(void)
+{
+    return __atomic_load_n(&aeUringUsable, __ATOMIC_RELAXED) == 1 ? "io_uring"
+                                                                  : "epoll";
+}
+
+#else
+
+static int aeApiCreate(aeEventLoop *eventLoop)
+{
+    return aeEpollCreate(eventLoop);
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize)
+{
+    return aeEpollResize(eventLoop, setsize);
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) { aeEpollFree(eventLoop); }
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask)
+{
+    return aeEpollAddEvent(eventLoop, fd, mask);
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask)
+{
+    aeEpollDelEvent(eventLoop, fd, delmask);
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp)
+{
+    return aeEpollPoll(eventLoop, tvp);
+}
+
 static char *aeApiName(void) { return "epoll"; }
 
+#endif
+
 #elif defined(HAVE_KQUEUE)
 
 #include <sys/event.h>
@@ -667,6 +1217,19 @@ static char *aeApiName(void) { return "select"; }
 
 #endif
 
+#ifndef HAVE_IO_URING
+static int aeApiSubmitIo(aeEventLoop *eventLoop,
+                         aeIoRequest *req,
+                         uint64_t timeout)
+{
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(req);
+    AE_NOTUSED(timeout);
+    errno = ENOTSUP;
+    return -1;
+}
+#endif
+
 static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms)
 {
     long cur_sec, cur_ms, when_sec, when_ms;
@@ -682,34 +1245,195 @@ static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms)
     *ms = when_ms;
 }
 
-static void aeAddTimeEvent(aeEventLoop *eventLoop,
-                           aeTimeEvent *te,
-                           long long milliseconds)
+/* Armed timers (time events and file event timeouts) are kept in a 4-ary
+ * min-heap ordered by expiry, the nearest timer is always at the root.
+ * Arming and disarming are O(log n), each timer tracks its own slot. */
+#define AE_TIMER_HEAP_ARITY 4
+
+static inline int aeTimerBefore(const aeTimeEvent *a, const aeTimeEvent *b)
+{
+    return a->when_sec < b->when_sec ||
+           (a->when_sec == b->when_sec && a->when_ms < b->when_ms);
+}
+
+static inline void aeTimerHeapSet(aeEventLoop *eventLoop,
+                                  int i,
+                                  aeTimeEvent *te)
+{
+    eventLoop->timers[i] = te;
+    te->heapSlot = i + 1;
+}
+
+static void aeTimerSiftUp(aeEventLoop *eventLoop, int i)
+{
+    aeTimeEvent *te = eventLoop->timers[i];
+    while (i > 0) {
+        int parent = (i - 1) / AE_TIMER_HEAP_ARITY;
+        if (!aeTimerBefore(te, eventLoop->timers[parent]))
+            break;
+        aeTimerHeapSet(eventLoop, i, eventLoop->timers[parent]);
+        i = parent;
+    }
+    aeTimerHeapSet(eventLoop, i, te);
+}
+
+static void aeTimerSiftDown(aeEventLoop *eventLoop, int i)
+{
+    aeTimeEvent *te = eventLoop->timers[i];
+    for (;;) {
+        int first = i * AE_TIMER_HEAP_ARITY + 1, best = first, j;
+        if (first >= eventLoop->timersCount)
+            break;
+
+        int last = first + AE_TIMER_HEAP_ARITY;
+        if (last > eventLoop->timersCount)
+            last = eventLoop->timersCount;
+        for (j = first + 1; j < last; j++) {
+            if (aeTimerBefore(eventLoop->timers[j], eventLoop->timers[best]))
+                best = j;
+        }
+        if (!aeTimerBefore(eventLoop->timers[best], te))
+            break;
+        aeTimerHeapSet(eventLoop, i, eventLoop->timers[best]);
+        i = best;
+    }
+    aeTimerHeapSet(eventLoop, i, te);
+}
+
+static int aeArmTimer(aeEventLoop *eventLoop,
+                      aeTimeEvent *te,
+                      long long milliseconds)
+{
+    if (eventLoop->timersCount == eventLoop->timersCapacity) {
+        int capacity = eventLoop->timersCapacity ? eventLoop->timersCapacity * 2
+                                                 : 64;
+        aeTimeEvent **timers =
+            zrealloc(eventLoop->timers, sizeof(aeTimeEvent *) * capacity);
+        if (timers == NULL)
+            return AE_ERR;
+        eventLoop->timers = timers;
+        eventLoop->timersCapacity = capacity;
+    }
+
+    aeAddMillisecondsToNow(milliseconds, &te->when_sec, &te->when_ms);
+    aeTimerHeapSet(eventLoop, eventLoop->timersCount++, te);
+    aeTimerSiftUp(eventLoop, eventLoop->timersCount - 1);
+    return AE_OK;
+}
+
+static int aeAddTimeEvent(aeEventLoop *eventLoop,
+                          aeTimeEvent *te,
+                          long long milliseconds)
 {
     long long id = eventLoop->timeEventNextId++;
     eventLoop->timeEventNextId = eventLoop->timeEventNextId ?: 1;
     te->id = id;
-    aeAddMillisecondsToNow(milliseconds, &te->when_sec, &te->when_ms);
-    te->prev = NULL;
-    te->next = eventLoop->timeEventHead;
-    if (te->next)
-        te->next->prev = te;
-    eventLoop->timeEventHead = te;
+    return aeArmTimer(eventLoop, te, milliseconds);
 }
 
 static void aeRemoveTimerEvent(aeEventLoop *eventLoop, aeTimeEvent *te)
 {
-    if (te->prev)
-        te->prev->next = te->next;
-    else
-        eventLoop->timeEventHead = te->next;
-    if (te->next)
-        te->next->prev = te->prev;
+    int i = te->heapSlot - 1;
+    aeTimeEvent *last = eventLoop->timers[--eventLoop->timersCount];
+
+    te->heapSlot = 0;
+    if (i != eventLoop->timersCount) {
+        aeTimerHeapSet(eventLoop, i, last);
+        aeTimerSiftUp(eventLoop, i);
+        aeTimerSiftDown(eventLoop, last->heapSlot - 1);
+    }
+}
+
+/* Time events are looked up by id when deleted, ids are kept in an open
+ * addressing table (linear probing, backward shift deletion). */
+static inline uint32_t aeTimeEventIdSlot(uint64_t id, uint32_t mask)
+{
+    return (uint32_t)((id * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+}
+
+static int aeFindTimeEventId(aeEventLoop *eventLoop, uint64_t id)
+{
+    if (eventLoop->timeEventIdsCapacity == 0)
+        return -1;
+
+    uint32_t mask = eventLoop->timeEventIdsCapacity - 1;
+    uint32_t i = aeTimeEventIdSlot(id, mask);
+    while (eventLoop->timeEventIds[i]) {
+        if (eventLoop->timeEventIds[i]->id == id)
+            return (int)i;
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+static void aeInsertTimeEventId(aeEventLoop *eventLoop, aeTimeEvent *te)
+{
+    uint32_t mask = eventLoop->timeEventIdsCapacity - 1;
+    uint32_t i = aeTimeEventIdSlot(te->id, mask);
+    while (eventLoop->timeEventIds[i])
+        i = (i + 1) & mask;
+    eventLoop->timeEventIds[i] = te;
+    eventLoop->timeEventIdsCount++;
+}
+
+static int aeAddTimeEventId(aeEventLoop *eventLoop, aeTimeEvent *te)
+{
+    if ((eventLoop->timeEventIdsCount + 1) * 2 >
+        eventLoop->timeEventIdsCapacity) {
+        int capacity = eventLoop->timeEventIdsCapacity
+                           ? eventLoop->timeEventIdsCapacity * 2
+                           : 64;
+        aeTimeEvent **old = eventLoop->timeEventIds;
+        int oldCapacity = eventLoop->timeEventIdsCapacity, i;
+
+        eventLoop->timeEventIds = calloc(capacity, sizeof(aeTimeEvent *));
+        if (eventLoop->timeEventIds == NULL) {
+            eventLoop->timeEventIds = old;
+            return AE_ERR;
+        }
+        eventLoop->timeEventIdsCapacity = capacity;
+        eventLoop->timeEventIdsCount = 0;
+        for (i = 0; i < oldCapacity; i++) {
+            if (old[i])
+                aeInsertTimeEventId(eventLoop, old[i]);
+        }
+        zfree(old);
+    }
+
+    aeInsertTimeEventId(eventLoop, te);
+    return AE_OK;
+}
+
+static void aeRemoveTimeEventId(aeEventLoop *eventLoop, int slot)
+{
+    uint32_t mask = eventLoop->timeEventIdsCapacity - 1;
+    uint32_t i = (uint32_t)slot, j = i;
+
+    eventLoop->timeEventIds[i] = NULL;
+    eventLoop->timeEventIdsCount--;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (eventLoop->timeEventIds[j] == NULL)
+            break;
+        uint32_t k = aeTimeEventIdSlot(eventLoop->timeEventIds[j]->id, mask);
+        /* Entry j stays if its home slot k lies cyclically in (i, j] */
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        eventLoop->timeEventIds[i] = eventLoop->timeEventIds[j];
+        eventLoop->timeEventIds[j] = NULL;
+        i = j;
+    }
+}
+
+static void aeFreeTimeEvent(aeEventLoop *eventLoop, aeTimeEvent *te)
+{
+    if (te->finalizerProc)
+        te->finalizerProc(eventLoop, te->clientData);
+    zfree(te);
 }
 
 static void aeFileEventTimeout(aeEventLoop *eventLoop, int fd, aeFileEvent *fe)
 {
-    fe->timer.when_ms = fe->timer.when_sec = 0;
     int mask = fe->mask;
     aeDeleteFileEvent(eventLoop, fd, fe->mask);
     if (mask & AE_READABLE)
@@ -731,19 +1455,26 @@ aeEventLoop *aeCreateEventLoop(void *context, int setsize)
         goto err;
     eventLoop->setsize = setsize;
     eventLoop->lastTime = time(NULL);
-    eventLoop->timeEventHead = NULL;
+    eventLoop->timers = NULL;
+    eventLoop->timersCount = eventLoop->timersCapacity = 0;
+    eventLoop->timeEventIds = NULL;
+    eventLoop->timeEventIdsCount = eventLoop->timeEventIdsCapacity = 0;
     eventLoop->timeEventNextId = 1;
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
     eventLoop->aftersleep = NULL;
+    eventLoop->ioInflight = 0;
+    eventLoop->ioUring = 0;
     eventLoop->context = context;
     if (aeApiCreate(eventLoop) == -1)
         goto err;
     /* Events with mask == AE_NONE are not set. So let's initialize the
      * vector with it. */
-    for (i = 0; i < setsize; i++)
+    for (i = 0; i < setsize; i++) {
         eventLoop->events[i].mask = AE_NONE;
+        eventLoop->events[i].timer.heapSlot = 0;
+    }
     return eventLoop;
 
 err:
@@ -767,7 +1498,7 @@ int aeGetSetSize(aeEventLoop *eventLoop) { return eventLoop->setsize; }
  * Otherwise AE_OK is returned and the operation is successful. */
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize)
 {
-    int i;
+    int i, oldSetsize = eventLoop->setsize;
 
     if (setsize == eventLoop->setsize)
         return AE_OK;
@@ -776,21 +1507,44 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize)
     if (aeApiResize(eventLoop, setsize) == -1)
         return AE_ERR;
 
+    /* The old vector is gone after the realloc, only its bounds are kept */
+    uintptr_t base = (uintptr_t)eventLoop->events,
+              end = base + sizeof(aeFileEvent) * oldSetsize;
     eventLoop->events =
         zrealloc(eventLoop->events, sizeof(aeFileEvent) * setsize);
+    if (base != (uintptr_t)eventLoop->events) {
+        /* File event timeouts in the heap point into the events vector */
+        for (i = 0; i < eventLoop->timersCount; i++) {
+            uintptr_t te = (uintptr_t)eventLoop->timers[i];
+            if (te >= base && te < end) {
+                eventLoop->timers[i] =
+                    (aeTimeEvent *)((uintptr_t)eventLoop->events + (te - base));
+            }
+        }
+    }
     eventLoop->fired =
         zrealloc(eventLoop->fired, sizeof(aeFiredEvent) * setsize);
     eventLoop->setsize = setsize;
 
     /* Make sure that if we created new slots, they are initialized with
      * an AE_NONE mask. */
-    for (i = eventLoop->maxfd + 1; i < setsize; i++)
+    for (i = eventLoop->maxfd + 1; i < setsize; i++) {
         eventLoop->events[i].mask = AE_NONE;
+        if (i >= oldSetsize)
+            eventLoop->events[i].timer.heapSlot = 0;
+    }
     return AE_OK;
 }
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop)
 {
+    int i;
+    for (i = 0; i < eventLoop->timeEventIdsCapacity; i++) {
+        if (eventLoop->timeEventIds[i])
+            zfree(eventLoop->timeEventIds[i]);
+    }
+    zfree(eventLoop->timeEventIds);
+    zfree(eventLoop->timers);
     aeApiFree(eventLoop);
     zfree(eventLoop->events);
     zfree(eventLoop->fired);
@@ -815,9 +1569,14 @@ enum Status aeCreateFileEvent(aeEventLoop *eventLoop,
     if (aeApiAddEvent(eventLoop, fd, mask) == -1)
         return AE_ERR;
 
+    if (fe->timer.heapSlot)
+        aeRemoveTimerEvent(eventLoop, (aeTimeEvent *)fe);
     if (timeout > 0) {
         fe->timer.fd = fd;
-        aeAddTimeEvent(eventLoop, (aeTimeEvent *)fe, timeout);
+        if (aeAddTimeEvent(eventLoop, (aeTimeEvent *)fe, timeout) == AE_ERR) {
+            aeApiDelEvent(eventLoop, fd, mask & ~fe->mask);
+            return AE_ERR;
+        }
     }
     else {
         // Zero the time
@@ -850,6 +1609,8 @@ void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, enum State mask)
 
     aeApiDelEvent(eventLoop, fd, mask);
     fe->mask = fe->mask & (~mask);
+    if (fe->mask == AE_NONE && fe->timer.heapSlot)
+        aeRemoveTimerEvent(eventLoop, (aeTimeEvent *)fe);
     if (fd == eventLoop->maxfd && fe->mask == AE_NONE) {
         /* Update the max fd */
         int j;
@@ -908,61 +1669,75 @@ enum Status aeCreateTimeEvent(aeEventLoop *eventLoop,
     aeTimeEvent *te;
 
     te = zmalloc(sizeof(*te));
-    te->fd = -1;
     if (te == NULL)
         return AE_ERR;
+    te->fd = -1;
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    aeAddTimeEvent(eventLoop, te, milliseconds);
+    te->heapSlot = 0;
+    if (aeAddTimeEvent(eventLoop, te, milliseconds) == AE_ERR ||
+        aeAddTimeEventId(eventLoop, te) == AE_ERR) {
+        if (te->heapSlot)
+            aeRemoveTimerEvent(eventLoop, te);
+        zfree(te);
+        return AE_ERR;
+    }
     return te->id;
 }
 
+enum Status aeSubmitIo(aeEventLoop *eventLoop,
+                       aeIoRequest *req,
+                       uint64_t timeout,
+                       aeIoProc *proc,
+                       void *clientData)
+{
+    req->proc = proc;
+    req->clientData = clientData;
+    req->result = 0;
+    if (aeApiSubmitIo(eventLoop, req, timeout) == -1) {
+        req->result = -errno;
+        return AE_ERR;
+    }
+    eventLoop->ioInflight++;
+    return AE_OK;
+}
+
+int aeCanSubmitIo(aeEventLoop *eventLoop) { return eventLoop->ioUring; }
+
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    while (te) {
-        if (te->id == id) {
-            te->id = AE_DELETED_EVENT_ID;
-            return AE_OK;
-        }
-        te = te->next;
+    int slot = aeFindTimeEventId(eventLoop, id);
+    if (slot < 0)
+        return AE_ERR; /* NO event with the specified ID found */
+
+    aeTimeEvent *te = eventLoop->timeEventIds[slot];
+    aeRemoveTimeEventId(eventLoop, slot);
+    if (te->heapSlot) {
+        aeRemoveTimerEvent(eventLoop, te);
+        aeFreeTimeEvent(eventLoop, te);
+    }
+    else {
+        /* The event is firing, processTimeEvents releases it */
+        te->id = AE_DELETED_EVENT_ID;
     }
-    return AE_ERR; /* NO event with the specified ID found */
+    return AE_OK;
 }
 
 /* Search the first timer to fire.
  * This operation is useful to know how many time the select can be
  * put in sleep without to delay any event.
- * If there are no timers NULL is returned.
- *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
- */
+ * If there are no timers NULL is returned. */
 static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
-
-    while (te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-            (te->when_sec == nearest->when_sec &&
-             te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
-    }
-    return nearest;
+    return eventLoop->timersCount ? eventLoop->timers[0] : NULL;
 }
 
 /* Process time events */
 static int processTimeEvents(aeEventLoop *eventLoop)
 {
-    int processed = 0;
+    int processed = 0, budget, i;
     aeTimeEvent *te;
-    long long maxId;
     time_t now = time(NULL);
 
     /* If the system clock is moved to the future, and then set back to the
@@ -974,67 +1749,41 @@ static int processTimeEvents(aeEventLoop *eventLoop)
      * processing events earlier is less dangerous than delaying them
      * indefinitely, and practice suggests it is. */
     if (now < eventLoop->lastTime) {
-        te = eventLoop->timeEventHead;
-        while (te) {
-            te->when_sec = 0;
-            te = te->next;
-        }
+        /* Equal keys keep the heap ordered */
+        for (i = 0; i < eventLoop->timersCount; i++)
+            eventLoop->timers[i]->when_sec = eventLoop->timers[i]->when_ms = 0;
     }
     eventLoop->lastTime = now;
 
-    te = eventLoop->timeEventHead;
-    maxId = eventLoop->timeEventNextId - 1;
-    while (te) {
+    /* Timers armed by the callbacks (or re-armed with a zero period) could
+     * otherwise keep this loop spinning, bound it to the timers armed now */
+    budget = eventLoop->timersCount;
+    while (budget-- > 0 && eventLoop->timersCount > 0) {
         long now_sec, now_ms;
-        long long id;
 
-        /* Remove events scheduled for deletion. */
-        if (te->id == AE_DELETED_EVENT_ID) {
-            aeTimeEvent *next = te->next;
-            if (te->prev)
-                te->prev->next = te->next;
-            else
-                eventLoop->timeEventHead = te->next;
-            if (te->next)
-                te->next->prev = te->prev;
-            if (te->finalizerProc)
-                te->finalizerProc(eventLoop, te->clientData);
-            zfree(te);
-            te = next;
+        te = eventLoop->timers[0];
+        aeGetTime(&now_sec, &now_ms);
+        if (now_sec < te->when_sec ||
+            (now_sec == te->when_sec && now_ms < te->when_ms))
+            break;
+
+        aeRemoveTimerEvent(eventLoop, te);
+        if (te->fd >= 0) {
+            aeFileEventTimeout(eventLoop, te->fd, (aeFileEvent *)te);
             continue;
         }
 
-        /* Make sure we don't process time events created by time events in
-         * this iteration. Note that this check is currently useless: we always
-         * add new timers on the head, however if we change the implementation
-         * detail, this check may be useful again: we keep it here for future
-         * defense. */
-        if (te->id > maxId) {
-            te = te->next;
-            continue;
+        int retval = te->timeProc(eventLoop, te->id, te->clientData);
+        processed++;
+        if (te->id == AE_DELETED_EVENT_ID) {
+            /* Deleted by its own callback */
+            aeFreeTimeEvent(eventLoop, te);
         }
-        aeGetTime(&now_sec, &now_ms);
-        if (now_sec > te->when_sec ||
-            (now_sec == te->when_sec && now_ms >= te->when_ms)) {
-            int retval;
-
-            if (te->fd < 0) {
-                id = te->id;
-                retval = te->timeProc(eventLoop, id, te->clientData);
-                processed++;
-                if (retval != AE_NO_MORE) {
-                    aeAddMillisecondsToNow(retval, &te->when_sec, &te->when_ms);
-                }
-                else {
-                    te->id = AE_DELETED_EVENT_ID;
-                }
-            }
-            else {
-                aeRemoveTimerEvent(eventLoop, te);
-                aeFileEventTimeout(eventLoop, te->fd, (aeFileEvent *)te);
-            }
+        else if (retval == AE_NO_MORE ||
+                 aeArmTimer(eventLoop, te, retval) == AE_ERR) {
+            aeRemoveTimeEventId(eventLoop, aeFindTimeEventId(eventLoop, te->id));
+            aeFreeTimeEvent(eventLoop, te);
         }
-        te = te->next;
     }
     return processed;
 }
@@ -1067,7 +1816,7 @@ int aeProcessEvents(aeEventLoop *eventLoop, enum Flags flags, int64_t timeout)
      * file events to process as long as we want to process time
      * events, in order to sleep until the next time event is ready
      * to fire. */
-    if (eventLoop->maxfd != -1 ||
+    if (eventLoop->maxfd != -1 || eventLoop->ioInflight > 0 ||
         ((flags & AE_TIME_EVENTS) && !(flags & AE_DONT_WAIT))) {
         int j;
         aeTimeEvent *shortest = NULL;
@@ -1142,7 +1891,7 @@ int aeProcessEvents(aeEventLoop *eventLoop, enum Flags flags, int64_t timeout)
             int invert = fe->mask & AE_BARRIER;
 
             aeTimeEvent *te = (aeTimeEvent *)fe;
-            if (te->when_sec > 0 || te->when_ms > 0)
+            if (te->heapSlot)
                 aeRemoveTimerEvent(eventLoop, te);
 
             /* Note the "fe->mask & mask & ..." code: maybe an already
@@ -54,18 +54,17 @@ typedef void aeEventFinalizerProc(struct aeEventLoop *eventLoop,
 
 typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
 
-#define AE_TIMER_BASE(T)                                                       \
+#define AE_TIMER_BASE                                                          \
     uint64_t id;   /* time event identifier. */                                \
     long when_sec; /* seconds */                                               \
     long when_ms;  /* milliseconds */                                          \
-    T *prev;                                                                   \
-    T *next;                                                                   \
+    int heapSlot;  /* index in the timer heap + 1, 0 when not armed */         \
     int fd;
 
 /* File event structure */
 typedef struct aeFileEvent {
     struct {
-        AE_TIMER_BASE(struct aeFileEvent)
+        AE_TIMER_BASE
     } timer;
     int mask; /* one of AE_(READABLE|WRITABLE|BARRIER) */
     aeFileProc *rfileProc;
@@ -75,7 +74,7 @@ typedef struct aeFileEvent {
 
 /* Time event structure */
 typedef struct aeTimeEvent {
-    AE_TIMER_BASE(struct aeTimeEvent);
+    AE_TIMER_BASE
     aeTimeProc *timeProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
@@ -83,6 +82,44 @@ typedef struct aeTimeEvent {
 
 #undef AE_TIMER_BASE
 
+/* Operations that can be submitted with aeSubmitIo */
+enum IoOp {
+    AE_IO_READ,
+    AE_IO_WRITE,
+    AE_IO_RECV,
+    AE_IO_SEND,
+    AE_IO_ACCEPT,
+    AE_IO_SPLICE
+};
+
+struct aeIoRequest;
+
+typedef void aeIoProc(struct aeEventLoop *eventLoop,
+                      struct aeIoRequest *req,
+                      void *clientData);
+
+/* An I/O operation executed by the kernel on behalf of the loop. The
+ * request (and the memory it points to) must stay valid until `proc`
+ * is invoked with the operation's result. */
+typedef struct aeIoRequest {
+    enum IoOp op;
+    int fd;
+    void *buf;     /* buffer for read/write/recv/send, address for accept */
+    uint64_t len;  /* buffer size, bytes to splice */
+    int64_t offset; /* file offset (-1 for current/none) */
+    int flags;     /* recv/send/accept/splice flags */
+    uint32_t *addrLen;
+    int fdOut; /* splice destination */
+    int64_t offsetOut;
+    int64_t result; /* bytes transferred/accepted fd or -errno */
+    aeIoProc *proc;
+    void *clientData;
+    struct {
+        int64_t tv_sec;
+        long long tv_nsec;
+    } timeout; /* Filled by aeSubmitIo, must outlive the submission */
+} aeIoRequest;
+
 /* A fired event */
 typedef struct aeFiredEvent {
     int fd;
@@ -97,12 +134,19 @@ typedef struct aeEventLoop {
     time_t lastTime;     /* Used to detect system clock skew */
     aeFileEvent *events; /* Registered events */
     aeFiredEvent *fired; /* Fired events */
-    aeTimeEvent *timeEventHead;
+    aeTimeEvent **timers; /* 4-ary min-heap of armed timers */
+    int timersCount;
+    int timersCapacity;
+    aeTimeEvent **timeEventIds; /* Time events by id (open addressing) */
+    int timeEventIdsCount;
+    int timeEventIdsCapacity;
     int stop;
     void *context;
     void *apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *beforesleep;
     aeBeforeSleepProc *aftersleep;
+    int ioInflight; /* Submitted I/O requests not completed yet */
+    int ioUring;    /* The loop runs on io_uring, see aeCanSubmitIo */
 } aeEventLoop;
 
 /* Prototypes */
@@ -131,6 +175,27 @@ enum Status aeCreateTimeEvent(aeEventLoop *eventLoop,
 
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id);
 
+/*
+ * Queues an I/O request, it is submitted in a batch with all the other
+ * requests queued before the next poll. If timeout is non zero, the
+ * request is cancelled (result -ECANCELED) after that many milliseconds.
+ *
+ * Returns AE_ERR with the request's result set to -ENOTSUP if the
+ * backend executes operations on readiness only (see aeCanSubmitIo).
+ */
+enum Status aeSubmitIo(aeEventLoop *eventLoop,
+                       aeIoRequest *req,
+                       uint64_t timeout,
+                       aeIoProc *proc,
+                       void *clientData);
+
+/*
+ * Whether the loop executes aeSubmitIo requests. This is only the case
+ * when built with AE_IO_URING and the kernel supports every operation,
+ * otherwise the loop falls back to readiness polling.
+ */
+int aeCanSubmitIo(aeEventLoop *eventLoop);
+
 int aeProcessEvents(aeEventLoop *eventLoop, enum Flags flags, int64_t timeout);
 
 int aeWait(int fd, enum Flags mask, long long milliseconds);
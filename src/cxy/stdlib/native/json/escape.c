@@ -0,0 +1,53 @@
+#include "escape.h"
+
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+static inline int needsEscape(uint8_t c)
+{
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+size_t json_escape_span(const char *s, size_t size)
+{
+    const uint8_t *in = (const uint8_t *)s;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\'),
+                  control = _mm_set1_epi8(0x1F);
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        // Bytes below 0x20 are the ones left unchanged by an unsigned min
+        __m128i matches =
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                      _mm_cmpeq_epi8(v, backslash)),
+                         _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));
+        int mask = _mm_movemask_epi8(matches);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#elif defined(__aarch64__)
+    const uint8x16_t quote = vdupq_n_u8('"'), backslash = vdupq_n_u8('\\'),
+                     control = vdupq_n_u8(0x20);
+    for (; i + 16 <= size; i += 16) {
+        uint8x16_t v = vld1q_u8(in + i);
+        uint8x16_t matches = vorrq_u8(
+            vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, backslash)),
+            vcltq_u8(v, control));
+        if (vmaxvq_u8(matches) != 0)
+            break;
+    }
+#endif
+
+    for (; i < size; i++) {
+        if (needsEscape(in[i]))
+            return i;
+    }
+    return size;
+}
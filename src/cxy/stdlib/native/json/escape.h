@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Length of the prefix of `s` that can be written into a JSON string as is,
+ * i.e. the offset of the first quote, backslash or control character, or
+ * `size` if there is none.
+ */
+size_t json_escape_span(const char *s, size_t size);
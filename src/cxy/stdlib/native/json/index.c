@@ -0,0 +1,179 @@
+#include "index.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/* Character classes of a 64-byte block, one bit per byte */
+typedef struct {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t op;
+    uint64_t space;
+} Block;
+
+#if defined(__SSE2__)
+
+static inline uint64_t mask16(__m128i matches, int i)
+{
+    return (uint64_t)(uint16_t)_mm_movemask_epi8(matches) << (i * 16);
+}
+
+static void classify(const uint8_t *in, Block *block)
+{
+    memset(block, 0, sizeof(*block));
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i * 16));
+#define EQ(C) _mm_cmpeq_epi8(v, _mm_set1_epi8(C))
+        block->quote |= mask16(EQ('"'), i);
+        block->backslash |= mask16(EQ('\\'), i);
+        block->op |= mask16(
+            _mm_or_si128(
+                _mm_or_si128(_mm_or_si128(EQ('{'), EQ('}')),
+                             _mm_or_si128(EQ('['), EQ(']'))),
+                _mm_or_si128(EQ(':'), EQ(','))),
+            i);
+        block->space |= mask16(_mm_or_si128(_mm_or_si128(EQ(' '), EQ('\t')),
+                                            _mm_or_si128(EQ('\n'), EQ('\r'))),
+                               i);
+#undef EQ
+    }
+}
+
+#elif defined(__aarch64__)
+
+static inline uint64_t mask16(uint8x16_t matches, int i)
+{
+    static const uint8_t bits[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t masked = vandq_u8(matches, vld1q_u8(bits));
+    uint64_t lo = vaddv_u8(vget_low_u8(masked)),
+             hi = vaddv_u8(vget_high_u8(masked));
+    return (lo | (hi << 8)) << (i * 16);
+}
+
+static void classify(const uint8_t *in, Block *block)
+{
+    memset(block, 0, sizeof(*block));
+    for (int i = 0; i < 4; i++) {
+        uint8x16_t v = vld1q_u8(in + i * 16);
+#define EQ(C) vceqq_u8(v, vdupq_n_u8(C))
+        block->quote |= mask16(EQ('"'), i);
+        block->backslash |= mask16(EQ('\\'), i);
+        block->op |= mask16(vorrq_u8(vorrq_u8(vorrq_u8(EQ('{'), EQ('}')),
+                                              vorrq_u8(EQ('['), EQ(']'))),
+                                     vorrq_u8(EQ(':'), EQ(','))),
+                            i);
+        block->space |= mask16(vorrq_u8(vorrq_u8(EQ(' '), EQ('\t')),
+                                        vorrq_u8(EQ('\n'), EQ('\r'))),
+                               i);
+#undef EQ
+    }
+}
+
+#else
+
+static void classify(const uint8_t *in, Block *block)
+{
+    memset(block, 0, sizeof(*block));
+    for (int i = 0; i < 64; i++) {
+        uint64_t bit = (uint64_t)1 << i;
+        switch (in[i]) {
+        case '"':
+            block->quote |= bit;
+            break;
+        case '\\':
+            block->backslash |= bit;
+            break;
+        case '{':
+        case '}':
+        case '[':
+        case ']':
+        case ':':
+        case ',':
+            block->op |= bit;
+            break;
+        case ' ':
+        case '\t':
+        case '\n':
+        case '\r':
+            block->space |= bit;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+#endif
+
+/* Bits of the characters escaped by an odd run of backslashes */
+static inline uint64_t escapedBits(uint64_t backslash, uint64_t *carry)
+{
+    const uint64_t even = 0x5555555555555555ULL;
+    backslash &= ~*carry;
+    uint64_t followsEscape = (backslash << 1) | *carry;
+    uint64_t oddStarts = backslash & ~even & ~followsEscape;
+    uint64_t evenRuns;
+    *carry = __builtin_add_overflow(oddStarts, backslash, &evenRuns);
+    return (even ^ (evenRuns << 1)) & followsEscape;
+}
+
+/* Bit i is the parity of the quotes at or before i */
+static inline uint64_t prefixXor(uint64_t bits)
+{
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+int64_t json_index(const char *input, size_t size, uint32_t *positions)
+{
+    const uint8_t *in = (const uint8_t *)input;
+    uint64_t escapeCarry = 0, inStringCarry = 0, scalarCarry = 0;
+    uint8_t tail[64];
+    int64_t count = 0;
+
+    if (size >= UINT32_MAX)
+        return -1;
+
+    for (size_t base = 0; base < size; base += 64) {
+        const uint8_t *chunk = in + base;
+        Block block;
+        if (size - base < 64) {
+            // Spaces are neither structural nor part of a scalar
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, chunk, size - base);
+            chunk = tail;
+        }
+        classify(chunk, &block);
+
+        uint64_t quote = block.quote & ~escapedBits(block.backslash, &escapeCarry);
+        uint64_t inString = prefixXor(quote) ^ inStringCarry;
+        inStringCarry = (uint64_t)((int64_t)inString >> 63);
+
+        uint64_t scalar = ~(block.op | block.space | quote);
+        uint64_t scalarStart = scalar & ~((scalar << 1) | scalarCarry);
+        scalarCarry = scalar >> 63;
+
+        uint64_t bits = ((block.op | scalarStart) & ~inString) | quote;
+        while (bits != 0) {
+            positions[count++] = (uint32_t)(base + __builtin_ctzll(bits));
+            bits &= bits - 1;
+        }
+    }
+
+    if (inStringCarry != 0)
+        return -1;
+
+    positions[count++] = (uint32_t)size;
+    return count;
+}
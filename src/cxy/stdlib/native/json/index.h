@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * First stage of the stdlib JSON parser. Records, in order, the offsets of
+ * the structural characters `{}[]:,` outside strings, of every unescaped
+ * quote (so strings come as opening/closing pairs) and of the first byte of
+ * each number or literal. `positions` must have room for `size + 1` entries,
+ * the last one written is `size` and marks the end of the input. Returns the
+ * number of entries, or -1 if a string is not terminated or the input does
+ * not fit 32-bit offsets.
+ */
+int64_t json_index(const char *input, size_t size, uint32_t *positions);
@@ -0,0 +1,325 @@
+#include "async.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_STAGING_SIZE 4096
+#define LOG_MAX_IOV 64
+
+typedef struct LogRing {
+    struct LogRing *next;
+    /* Set while a thread owns the ring, rings of exited threads are reused */
+    atomic_int owned;
+    size_t capacity;
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    char data[];
+} LogRing;
+
+typedef struct {
+    LogRing *ring;
+    size_t size;
+    size_t capacity;
+    char *data;
+} LogStaging;
+
+static struct {
+    _Atomic(LogRing *) rings;
+    atomic_bool running;
+    /* Set once the flusher wrote its last batch */
+    atomic_bool flushed;
+    /* Commits that saw the flusher running and are still publishing */
+    atomic_int committing;
+    atomic_uint_fast64_t dropped;
+    pthread_t flusher;
+    pthread_key_t key;
+    pthread_once_t once;
+    pthread_once_t exitOnce;
+    int fd;
+    size_t ringSize;
+    bool block;
+    uint32_t intervalUs;
+} Log = {.flushed = true,
+         .once = PTHREAD_ONCE_INIT,
+         .exitOnce = PTHREAD_ONCE_INIT};
+
+static _Thread_local LogStaging tlsStaging;
+
+static void releaseRing(void *arg)
+{
+    // The flusher drains what is left, the next thread claims the ring
+    LogRing *ring = arg;
+    free(tlsStaging.data);
+    tlsStaging = (LogStaging){0};
+    atomic_store_explicit(&ring->owned, 0, memory_order_release);
+}
+
+static void initKey(void) { pthread_key_create(&Log.key, releaseRing); }
+
+static LogRing *acquireRing(void)
+{
+    pthread_once(&Log.once, initKey);
+    for (LogRing *it = atomic_load_explicit(&Log.rings, memory_order_acquire);
+         it;
+         it = it->next) {
+        int expected = 0;
+        if (it->capacity == Log.ringSize &&
+            atomic_compare_exchange_strong(&it->owned, &expected, 1)) {
+            pthread_setspecific(Log.key, it);
+            return it;
+        }
+    }
+
+    LogRing *ring = malloc(sizeof(LogRing) + Log.ringSize);
+    if (ring == NULL)
+        return NULL;
+    ring->capacity = Log.ringSize;
+    atomic_init(&ring->owned, 1);
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->next = atomic_load_explicit(&Log.rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&Log.rings,
+                                                  &ring->next,
+                                                  ring,
+                                                  memory_order_release,
+                                                  memory_order_relaxed))
+        ;
+    pthread_setspecific(Log.key, ring);
+    return ring;
+}
+
+/* Writes the readable part of the rings, returns the number of bytes */
+static size_t drain(void)
+{
+    struct iovec iov[LOG_MAX_IOV];
+    LogRing *owners[LOG_MAX_IOV];
+    size_t count = 0, total = 0;
+
+    for (LogRing *it = atomic_load_explicit(&Log.rings, memory_order_acquire);
+         it && count + 2 <= LOG_MAX_IOV;
+         it = it->next) {
+        size_t head = atomic_load_explicit(&it->head, memory_order_relaxed),
+               tail = atomic_load_explicit(&it->tail, memory_order_acquire);
+        if (head == tail)
+            continue;
+
+        size_t start = head & (it->capacity - 1), size = tail - head;
+        size_t first = it->capacity - start < size ? it->capacity - start : size;
+        iov[count] = (struct iovec){.iov_base = it->data + start, .iov_len = first};
+        owners[count++] = it;
+        if (first < size) {
+            iov[count] = (struct iovec){.iov_base = it->data, .iov_len = size - first};
+            owners[count++] = it;
+        }
+        total += size;
+    }
+
+    size_t i = 0;
+    while (i < count) {
+        ssize_t written = writev(Log.fd, iov + i, (int)(count - i));
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            // Nowhere to write to, discard rather than wedge the producers
+            written = SSIZE_MAX;
+        }
+
+        size_t left = (size_t)written;
+        while (i < count && left > 0) {
+            size_t n = iov[i].iov_len < left ? iov[i].iov_len : left;
+            atomic_fetch_add_explicit(&owners[i]->head, n, memory_order_release);
+            iov[i].iov_base = (char *)iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+            left -= n;
+            if (iov[i].iov_len == 0)
+                i++;
+        }
+    }
+    return total;
+}
+
+static void *flusherMain(void *arg)
+{
+    (void)arg;
+    struct timespec interval = {.tv_sec = Log.intervalUs / 1000000,
+                                .tv_nsec = (Log.intervalUs % 1000000) * 1000};
+    while (atomic_load_explicit(&Log.running, memory_order_acquire)) {
+        if (drain() == 0)
+            nanosleep(&interval, NULL);
+    }
+    // Commits that saw the flusher running are written by it, later ones
+    // are written by the committing thread once the rings are empty. A
+    // commit still in flight when `committing` is read gets another drain
+    for (;;) {
+        int busy = atomic_load_explicit(&Log.committing, memory_order_seq_cst);
+        if (drain() == 0 && busy == 0)
+            break;
+    }
+    atomic_store_explicit(&Log.flushed, true, memory_order_release);
+    return NULL;
+}
+
+static void stopAtExit(void) { log_async_stop(); }
+
+static void registerAtExit(void) { atexit(stopAtExit); }
+
+bool log_async_start(int fd, size_t ringSize, bool block, uint32_t intervalUs)
+{
+    if (atomic_load(&Log.running))
+        return true;
+
+    size_t capacity = 4096;
+    while (capacity < ringSize)
+        capacity <<= 1;
+    Log.fd = fd;
+    Log.ringSize = capacity;
+    Log.block = block;
+    Log.intervalUs = intervalUs ? intervalUs : 1000;
+    // Records committed before the program exits are written out even if
+    // `log_async_stop` is never called (abort skips this)
+    pthread_once(&Log.exitOnce, registerAtExit);
+    atomic_store(&Log.flushed, false);
+    atomic_store(&Log.running, true);
+    if (pthread_create(&Log.flusher, NULL, flusherMain, NULL) != 0) {
+        atomic_store(&Log.running, false);
+        atomic_store(&Log.flushed, true);
+        return false;
+    }
+    return true;
+}
+
+void log_async_stop(void)
+{
+    if (!atomic_exchange(&Log.running, false))
+        return;
+    pthread_join(Log.flusher, NULL);
+}
+
+bool log_async_running(void)
+{
+    return atomic_load_explicit(&Log.running, memory_order_relaxed);
+}
+
+void log_async_append(const void *data, size_t size)
+{
+    LogStaging *staging = &tlsStaging;
+    if (staging->size + size > staging->capacity) {
+        size_t capacity = staging->capacity ? staging->capacity : LOG_STAGING_SIZE;
+        while (capacity < staging->size + size)
+            capacity <<= 1;
+        char *grown = realloc(staging->data, capacity);
+        if (grown == NULL)
+            return;
+        staging->data = grown;
+        staging->capacity = capacity;
+    }
+    memcpy(staging->data + staging->size, data, size);
+    staging->size += size;
+}
+
+/* Writes a record staged while the flusher was stopping, after its last
+ * batch so that the thread's records stay in order */
+static bool writeDirect(const char *data, size_t size)
+{
+    while (!atomic_load_explicit(&Log.flushed, memory_order_acquire))
+        sched_yield();
+    while (size > 0) {
+        ssize_t written = write(Log.fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+static bool publish(LogStaging *staging, size_t size)
+{
+    LogRing *ring = staging->ring;
+    if (ring == NULL && (ring = staging->ring = acquireRing()) == NULL)
+        goto dropped;
+    if (size > ring->capacity)
+        goto dropped;
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (;;) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (ring->capacity - (tail - head) >= size)
+            break;
+        if (!Log.block || !log_async_running())
+            goto dropped;
+        sched_yield();
+    }
+
+    size_t start = tail & (ring->capacity - 1);
+    size_t first = ring->capacity - start < size ? ring->capacity - start : size;
+    memcpy(ring->data + start, staging->data, first);
+    memcpy(ring->data, staging->data + first, size - first);
+    atomic_store_explicit(&ring->tail, tail + size, memory_order_release);
+    return true;
+
+dropped:
+    atomic_fetch_add_explicit(&Log.dropped, 1, memory_order_relaxed);
+    return false;
+}
+
+bool log_async_commit(void)
+{
+    LogStaging *staging = &tlsStaging;
+    size_t size = staging->size;
+    staging->size = 0;
+    if (size == 0)
+        return true;
+
+    // Pairs with the flusher waiting for `committing` after `running` is
+    // cleared, both sides need sequential consistency
+    atomic_fetch_add_explicit(&Log.committing, 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&Log.running, memory_order_seq_cst)) {
+        bool published = publish(staging, size);
+        atomic_fetch_sub_explicit(&Log.committing, 1, memory_order_release);
+        return published;
+    }
+    atomic_fetch_sub_explicit(&Log.committing, 1, memory_order_release);
+
+    if (writeDirect(staging->data, size))
+        return true;
+    atomic_fetch_add_explicit(&Log.dropped, 1, memory_order_relaxed);
+    return false;
+}
+
+uint64_t log_async_dropped(void)
+{
+    return atomic_load_explicit(&Log.dropped, memory_order_relaxed);
+}
+
+size_t log_timestamp(const char *fmt, char *out, size_t size)
+{
+    static _Thread_local time_t second = -1;
+    static _Thread_local const char *format = NULL;
+    static _Thread_local char cached[64];
+    static _Thread_local size_t length = 0;
+
+    time_t now = time(NULL);
+    if (now != second || fmt != format) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        length = strftime(cached, sizeof(cached), fmt, &tm);
+        second = now;
+        format = fmt;
+    }
+
+    size_t n = length < size ? length : size;
+    memcpy(out, cached, n);
+    return n;
+}
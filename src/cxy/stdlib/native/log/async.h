@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Asynchronous log sink. Each logging thread formats its records into a
+ * thread local staging buffer (`log_async_append`) and publishes complete
+ * records to its own single producer ring (`log_async_commit`), a flusher
+ * thread drains all the rings into `fd` with batched `writev`s. Producers
+ * never take a lock nor make a system call, unless the ring is full and
+ * `block` was requested.
+ */
+bool log_async_start(int fd, size_t ringSize, bool block, uint32_t intervalUs);
+
+/*
+ * Stops the flusher after writing everything that was committed, also runs
+ * at exit. Records committed afterwards are written synchronously.
+ */
+void log_async_stop(void);
+
+bool log_async_running(void);
+
+void log_async_append(const void *data, size_t size);
+
+/* Publishes the staged record, returns false if it was dropped */
+bool log_async_commit(void);
+
+/* Number of records dropped because a ring was full or a write failed */
+uint64_t log_async_dropped(void);
+
+/*
+ * Formats the current UTC time with `fmt` into `out`, the result is cached
+ * per thread and only formatted again when the second (or format) changes.
+ */
+size_t log_timestamp(const char *fmt, char *out, size_t size);
@@ -0,0 +1,79 @@
+#include "swiss.h"
+
+#define SWISS_EMPTY 0x80
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+uint32_t swiss_match(const uint8_t *group, uint8_t h2)
+{
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)h2)));
+}
+
+uint32_t swiss_match_empty(const uint8_t *group)
+{
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)SWISS_EMPTY)));
+}
+
+uint32_t swiss_match_free(const uint8_t *group)
+{
+    // Only free slots have the top bit set
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_loadu_si128((const __m128i *)group));
+}
+
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+
+static inline uint32_t toMask(uint8x16_t matches)
+{
+    static const uint8_t bits[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t masked = vandq_u8(matches, vld1q_u8(bits));
+    return (uint32_t)vaddv_u8(vget_low_u8(masked)) |
+           ((uint32_t)vaddv_u8(vget_high_u8(masked)) << 8);
+}
+
+uint32_t swiss_match(const uint8_t *group, uint8_t h2)
+{
+    return toMask(vceqq_u8(vld1q_u8(group), vdupq_n_u8(h2)));
+}
+
+uint32_t swiss_match_empty(const uint8_t *group)
+{
+    return toMask(vceqq_u8(vld1q_u8(group), vdupq_n_u8(SWISS_EMPTY)));
+}
+
+uint32_t swiss_match_free(const uint8_t *group)
+{
+    return toMask(vcltzq_s8(vreinterpretq_s8_u8(vld1q_u8(group))));
+}
+
+#else
+
+uint32_t swiss_match(const uint8_t *group, uint8_t h2)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < 16; i++)
+        mask |= (uint32_t)(group[i] == h2) << i;
+    return mask;
+}
+
+uint32_t swiss_match_empty(const uint8_t *group)
+{
+    return swiss_match(group, SWISS_EMPTY);
+}
+
+uint32_t swiss_match_free(const uint8_t *group)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < 16; i++)
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    return mask;
+}
+
+#endif
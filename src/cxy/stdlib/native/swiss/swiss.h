@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Control byte groups of the stdlib HashMap. A group holds 16 control bytes,
+ * full slots keep 7 bits of their hash (the top bit clear) and free slots
+ * are either empty (0x80) or deleted (0xFE). Each function returns a mask
+ * with bit i set when byte i of the group matches.
+ */
+uint32_t swiss_match(const uint8_t *group, uint8_t h2);
+uint32_t swiss_match_empty(const uint8_t *group);
+uint32_t swiss_match_free(const uint8_t *group);
@@ -0,0 +1,390 @@
+/**
+ * Parser Tests: C Header Cache Codec
+ *
+ * Tests that the declarations and macros converted from a C header survive
+ * a round trip through the encoding used by the C header cache, decoded
+ * into a fresh type table like a later compilation would.
+ */
+
+#include "doctest.h"
+#include "utils/ast.hpp"
+
+#include "driver/c-import/cache.hpp"
+#include "lang/frontend/flag.h"
+#include "lang/frontend/ttable.h"
+
+#include "msgpack.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace cxy::test;
+using cxy::CHeaderRecording;
+
+namespace {
+
+struct DemoHeader {
+    MemPool *pool;
+    StrPool *strings;
+    TypeTable *types;
+    FileLoc loc;
+    CHeaderRecording recording{};
+
+    DemoHeader(MemPool *pool, StrPool *strings, TypeTable *types)
+        : pool{pool}, strings{strings}, types{types},
+          loc{.fileName = makeString(strings, "/usr/include/demo.h"),
+              .begin = {.row = 3, .col = 1, .byteOffset = 40},
+              .end = {.row = 3, .col = 20, .byteOffset = 59}}
+    {
+    }
+
+    cstring str(const char *value) { return makeString(strings, value); }
+
+    AstNode *typeRef(const Type *type)
+    {
+        return makeTypeReferenceNode(pool, type, &loc);
+    }
+
+    void addDeclaration(AstNode *node)
+    {
+        recording.items.push_back(
+            {.kind = CHeaderRecording::Declaration, .node = node});
+    }
+
+    // struct point { int x; int y; }
+    const Type *addStruct()
+    {
+        auto flags = flgExtern | flgPublic;
+        auto i32 = getPrimitiveType(types, prtI32);
+        auto node = makeStructDecl(
+            pool, &loc, flags, str("point"), nullptr, nullptr, nullptr);
+        std::vector<NamedTypeMember> members;
+        for (auto name : {"x", "y"}) {
+            auto field = makeStructField(
+                pool, &loc, str(name), flgPublic, typeRef(i32), NULL, NULL);
+            field->type = i32;
+            field->structField.index = members.size();
+            field->parentScope = node;
+            members.push_back({.name = field->structField.name,
+                               .type = i32,
+                               .decl = field});
+        }
+        node->type = makeReplaceStructType(
+            types, str("point"), members.data(), members.size(), node, flags);
+        addDeclaration(node);
+        return node->type;
+    }
+
+    // int demo_add(const char *name, struct point *at, ...)
+    void addFunction(const Type *point)
+    {
+        auto i32 = getPrimitiveType(types, prtI32);
+        std::vector<const Type *> paramTypes = {
+            makePointerType(
+                types, getPrimitiveType(types, prtCChar), flgConst),
+            makePointerType(types, point, flgNone),
+            makeAutoType(types)};
+        AstNodeList params = {};
+        const char *names[] = {"name", "at", "_"};
+        for (size_t i = 0; i < paramTypes.size(); i++)
+            insertAstNode(&params,
+                          makeFunctionParam(pool,
+                                            &loc,
+                                            str(names[i]),
+                                            typeRef(paramTypes[i]),
+                                            NULL,
+                                            i == 2 ? flgVariadic : flgNone,
+                                            NULL));
+        auto node = makeFunctionDecl(pool,
+                                     &loc,
+                                     str("demo_add"),
+                                     params.first,
+                                     typeRef(i32),
+                                     NULL,
+                                     flgExtern | flgPublic | flgVariadic,
+                                     NULL,
+                                     NULL);
+        node->funcDecl.requiredParamsCount = 2;
+        Type func = {.tag = typFunc,
+                     .flags = flgExtern | flgPublic | flgVariadic,
+                     .name = node->funcDecl.name,
+                     .func = {.paramsCount = (u16)paramTypes.size(),
+                              .retType = i32,
+                              .params = paramTypes.data(),
+                              .decl = node}};
+        node->type = makeFuncType(types, &func);
+        addDeclaration(node);
+    }
+
+    // typedef struct point *point_ref; extern point_ref demo_origin;
+    void addAliasAndVariable(const Type *point)
+    {
+        auto flags = flgExtern | flgPublic;
+        auto pointer = makePointerType(types, point, flgNone);
+        auto alias = makeAliasType(types, pointer, str("point_ref"), flags);
+        addDeclaration(makeTypeDeclAstNode(
+            pool, &loc, flags, str("point_ref"), typeRef(pointer), NULL, alias));
+        addDeclaration(makeVarDecl(pool,
+                                   &loc,
+                                   flgPublic | flgExtern | flgTopLevelDecl,
+                                   str("demo_origin"),
+                                   typeRef(alias),
+                                   NULL,
+                                   NULL,
+                                   alias));
+    }
+
+    // enum color { RED, GREEN = 4 }
+    void addEnum()
+    {
+        auto base = getPrimitiveType(types, prtU32);
+        AstNodeList options = {};
+        std::vector<EnumOptionDecl> members;
+        for (auto [name, value] : {std::pair{"RED", 0}, std::pair{"GREEN", 4}}) {
+            insertAstNode(&options,
+                          makeEnumOptionAst(
+                              pool,
+                              &loc,
+                              flgNone,
+                              str(name),
+                              makeIntegerLiteral(pool, &loc, value, NULL, base),
+                              NULL,
+                              NULL));
+            members.push_back(
+                {.name = str(name), .value = value, .decl = options.last});
+        }
+        auto node = makeEnumAst(pool,
+                                &loc,
+                                flgPublic,
+                                str("color"),
+                                typeRef(base),
+                                options.first,
+                                NULL,
+                                NULL);
+        Type enum_ = {.tag = typEnum,
+                      .flags = flgExtern,
+                      .name = str("color"),
+                      .tEnum = {.base = base,
+                                .options = members.data(),
+                                .optionsCount = members.size(),
+                                .decl = node}};
+        node->type = makeEnum(types, &enum_);
+        addDeclaration(node);
+    }
+
+    void addMacro(CHeaderRecording::Kind kind, const char *name, AstNode *body)
+    {
+        recording.items.push_back(
+            {.kind = kind,
+             .node = makeMacroDeclAstNode(
+                 pool, &loc, flgPublic | flgExtern, str(name), NULL, body, NULL)});
+    }
+};
+
+void encode(msgpack_sbuffer *sbuf, const CHeaderRecording &recording)
+{
+    msgpack_packer packer;
+    msgpack_sbuffer_init(sbuf);
+    msgpack_packer_init(&packer, sbuf, msgpack_sbuffer_write);
+    REQUIRE(cxy::cHeaderEncodeItems(&packer, recording));
+}
+
+// Decodes the types and items arrays in `sbuf`, keeping only the first
+// `typesCount` types
+bool decode(const msgpack_sbuffer &sbuf,
+            MemPool *pool,
+            StrPool *strings,
+            TypeTable *types,
+            CHeaderRecording &recording,
+            u32 typesCount = UINT32_MAX)
+{
+    msgpack_unpacked typesMsg, itemsMsg;
+    msgpack_unpacked_init(&typesMsg);
+    msgpack_unpacked_init(&itemsMsg);
+    size_t offset = 0;
+    REQUIRE(msgpack_unpack_next(&typesMsg, sbuf.data, sbuf.size, &offset) ==
+            MSGPACK_UNPACK_SUCCESS);
+    REQUIRE(msgpack_unpack_next(&itemsMsg, sbuf.data, sbuf.size, &offset) ==
+            MSGPACK_UNPACK_SUCCESS);
+    REQUIRE(typesMsg.data.type == MSGPACK_OBJECT_ARRAY);
+    if (typesCount < typesMsg.data.via.array.size)
+        typesMsg.data.via.array.size = typesCount;
+    bool ok = cxy::cHeaderDecodeItems(
+        pool, strings, types, typesMsg.data, itemsMsg.data, recording);
+    msgpack_unpacked_destroy(&typesMsg);
+    msgpack_unpacked_destroy(&itemsMsg);
+    return ok;
+}
+
+std::string text(cstring value) { return value ? value : "<null>"; }
+
+} // namespace
+
+TEST_CASE("C header cache codec round trip")
+{
+    MemPoolWrapper pool;
+    StrPool strings = newStrPool(pool.get());
+    TypeTable *types = newTypeTable(pool.get(), &strings);
+    TypeTable *decodedTypes = newTypeTable(pool.get(), &strings);
+
+    DemoHeader header(pool.get(), &strings, types);
+    auto point = header.addStruct();
+    header.addFunction(point);
+    header.addAliasAndVariable(point);
+    header.addEnum();
+    header.addMacro(
+        CHeaderRecording::Macro,
+        "DEMO_MAX",
+        makeIntegerLiteral(
+            pool.get(), &header.loc, -42, NULL, getPrimitiveType(types, prtI64)));
+    header.addMacro(CHeaderRecording::Macro,
+                    "DEMO_SCALE",
+                    makeFloatLiteral(pool.get(),
+                                     &header.loc,
+                                     0.5,
+                                     NULL,
+                                     getPrimitiveType(types, prtF64)));
+    header.addMacro(CHeaderRecording::QuietMacro,
+                    "DEMO_NAME",
+                    makeStringLiteral(pool.get(),
+                                      &header.loc,
+                                      header.str("demo"),
+                                      NULL,
+                                      makeStringType(types)));
+    header.recording.items.push_back({.kind = CHeaderRecording::MacroAlias,
+                                      .loc = header.loc,
+                                      .name = header.str("DEMO_LIMIT"),
+                                      .target = header.str("DEMO_MAX")});
+
+    SUBCASE("Declarations and macros")
+    {
+        msgpack_sbuffer sbuf;
+        CHeaderRecording decoded;
+        encode(&sbuf, header.recording);
+        bool ok = decode(sbuf, pool.get(), &strings, decodedTypes, decoded);
+        msgpack_sbuffer_destroy(&sbuf);
+        REQUIRE(ok);
+        auto &items = decoded.items;
+        REQUIRE(items.size() == header.recording.items.size());
+        for (size_t i = 0; i < items.size(); i++)
+            CHECK(items[i].kind == header.recording.items[i].kind);
+
+        // struct point
+        auto structDecl = items[0].node;
+        REQUIRE(nodeIs(structDecl, StructDecl));
+        CHECK(text(structDecl->structDecl.name) == "point");
+        CHECK(text(structDecl->loc.fileName) == "/usr/include/demo.h");
+        CHECK(structDecl->loc.begin.row == 3);
+        CHECK(structDecl->loc.end.byteOffset == 59);
+        auto decodedPoint = structDecl->type;
+        REQUIRE(typeIs(decodedPoint, Struct));
+        CHECK(decodedPoint->tStruct.decl == structDecl);
+        REQUIRE(decodedPoint->tStruct.members->count == 2);
+        CHECK(text(decodedPoint->tStruct.members->members[1].name) == "y");
+        CHECK(decodedPoint->tStruct.members->members[1].type ==
+              getPrimitiveType(decodedTypes, prtI32));
+        CHECK(findStructType(decodedTypes,
+                             header.str("point"),
+                             flgExtern | flgPublic) == decodedPoint);
+
+        // int demo_add(const char *name, struct point *at, ...)
+        auto func = items[1].node;
+        REQUIRE(nodeIs(func, FuncDecl));
+        CHECK(text(func->funcDecl.name) == "demo_add");
+        CHECK(func->funcDecl.requiredParamsCount == 2);
+        REQUIRE(typeIs(func->type, Func));
+        CHECK(func->type->func.decl == func);
+        CHECK((func->type->flags & flgVariadic) != 0);
+        CHECK(func->type->func.retType ==
+              getPrimitiveType(decodedTypes, prtI32));
+        REQUIRE(func->type->func.paramsCount == 3);
+        auto name = func->type->func.params[0];
+        REQUIRE(typeIs(name, Pointer));
+        CHECK((name->flags & flgConst) != 0);
+        CHECK(name->pointer.pointed ==
+              getPrimitiveType(decodedTypes, prtCChar));
+        CHECK(func->type->func.params[1] ==
+              makePointerType(decodedTypes, decodedPoint, flgNone));
+        CHECK(func->type->func.params[2] == makeAutoType(decodedTypes));
+        CHECK(text(func->funcDecl.signature->params->funcParam.name) == "name");
+
+        // typedef struct point *point_ref; extern point_ref demo_origin;
+        auto alias = items[2].node;
+        REQUIRE(nodeIs(alias, TypeDecl));
+        REQUIRE(typeIs(alias->type, Alias));
+        CHECK(text(alias->type->name) == "point_ref");
+        CHECK(alias->type->alias.aliased ==
+              makePointerType(decodedTypes, decodedPoint, flgNone));
+        auto var = items[3].node;
+        REQUIRE(nodeIs(var, VarDecl));
+        CHECK(text(var->varDecl.name) == "demo_origin");
+        CHECK(var->type == alias->type);
+
+        // enum color { RED, GREEN = 4 }
+        auto enumDecl = items[4].node;
+        REQUIRE(nodeIs(enumDecl, EnumDecl));
+        REQUIRE(typeIs(enumDecl->type, Enum));
+        CHECK(enumDecl->type->tEnum.base ==
+              getPrimitiveType(decodedTypes, prtU32));
+        REQUIRE(enumDecl->type->tEnum.optionsCount == 2);
+        CHECK(text(enumDecl->type->tEnum.options[1].name) == "GREEN");
+        CHECK(enumDecl->type->tEnum.options[1].value == 4);
+
+        // Macros
+        auto max = items[5].node;
+        REQUIRE(nodeIs(max, MacroDecl));
+        CHECK(text(max->macroDecl.name) == "DEMO_MAX");
+        REQUIRE(nodeIs(max->macroDecl.body, IntegerLit));
+        CHECK(max->macroDecl.body->intLiteral.value == -42);
+        auto scale = items[6].node->macroDecl.body;
+        REQUIRE(nodeIs(scale, FloatLit));
+        CHECK(scale->floatLiteral.value == 0.5);
+        auto demoName = items[7].node->macroDecl.body;
+        REQUIRE(nodeIs(demoName, StringLit));
+        CHECK(text(demoName->stringLiteral.value) == "demo");
+        CHECK(text(items[8].name) == "DEMO_LIMIT");
+        CHECK(text(items[8].target) == "DEMO_MAX");
+        CHECK(items[8].loc.begin.col == 1);
+    }
+
+    SUBCASE("Types the cache cannot hold are rejected")
+    {
+        const Type *members[] = {getPrimitiveType(types, prtI32),
+                                 getPrimitiveType(types, prtF64)};
+        auto tuple = makeTupleType(types, members, 2, flgNone);
+        header.addDeclaration(makeVarDecl(pool.get(),
+                                          &header.loc,
+                                          flgPublic | flgExtern,
+                                          header.str("demo_pair"),
+                                          header.typeRef(tuple),
+                                          NULL,
+                                          NULL,
+                                          tuple));
+        msgpack_sbuffer sbuf;
+        msgpack_packer packer;
+        msgpack_sbuffer_init(&sbuf);
+        msgpack_packer_init(&packer, &sbuf, msgpack_sbuffer_write);
+        CHECK_FALSE(cxy::cHeaderEncodeItems(&packer, header.recording));
+        msgpack_sbuffer_destroy(&sbuf);
+    }
+
+    SUBCASE("Malformed entries are rejected")
+    {
+        CHeaderRecording decoded;
+        msgpack_object nil = {.type = MSGPACK_OBJECT_NIL};
+        CHECK_FALSE(cxy::cHeaderDecodeItems(
+            pool.get(), &strings, decodedTypes, nil, nil, decoded));
+
+        // Items referring to types missing from the table
+        msgpack_sbuffer sbuf;
+        encode(&sbuf, header.recording);
+        CHECK_FALSE(
+            decode(sbuf, pool.get(), &strings, decodedTypes, decoded, 1));
+        msgpack_sbuffer_destroy(&sbuf);
+    }
+
+    freeTypeTable(decodedTypes);
+    freeTypeTable(types);
+    freeStrPool(&strings);
+}
@@ -0,0 +1,67 @@
+/**
+ * Parser Tests: Binary AST Codec
+ *
+ * Tests that parsed programs survive a round trip through the binary
+ * encoding used by the persistent module cache.
+ */
+
+#include "doctest.h"
+#include "parser_utils.hpp"
+#include "utils/ast.hpp"
+
+#include "lang/frontend/codec.h"
+
+#include "msgpack.h"
+
+using namespace cxy::parser::test;
+using namespace cxy::test;
+
+namespace {
+
+AstNode *roundTrip(AstNode *node, MemPool *pool, StrPool *strings)
+{
+    msgpack_sbuffer sbuf;
+    msgpack_sbuffer_init(&sbuf);
+    REQUIRE(binaryEncodeAstNode(&sbuf, node, nullptr));
+    AstNode *decoded = binaryDecodeAstNode(sbuf.data, sbuf.size, pool, strings);
+    msgpack_sbuffer_destroy(&sbuf);
+    return decoded;
+}
+
+} // namespace
+
+TEST_CASE("Binary AST codec round trip") {
+    ParserTestFixture fixture;
+    MemPoolWrapper pool;
+    StrPool strings = newStrPool(pool.get());
+
+    SUBCASE("Declarations and statements") {
+        auto node = fixture.parseProgram(R"(
+            module demo
+            pub struct Point { x: i32 = 0; y: i32 }
+            enum Color { Red, Green = 3 }
+            pub func add[T](a: T, b: T = 1): T => a + b
+            func demo(items: [i32]) {
+                var total: i64 = 0
+                for const i, v in items { total += v }
+                while total > 10 { total -= 0x10 }
+                if (total == 0) { return }
+                println(f"total {total}", 1.5, 'c', true, null)
+            }
+        )");
+        REQUIRE(node != nullptr);
+
+        auto decoded = roundTrip(node, pool.get(), &strings);
+        REQUIRE(decoded != nullptr);
+        CHECK(ASTTestUtils::toString(decoded, CompareOptions::strict()) ==
+              ASTTestUtils::toString(node, CompareOptions::strict()));
+        CHECK(decoded->loc.fileName == makeString(&strings, "test.cxy"));
+    }
+
+    SUBCASE("Malformed input is rejected") {
+        const char garbage[] = {'\x93', '\x01', '\x02'};
+        CHECK(binaryDecodeAstNode(garbage, sizeof(garbage), pool.get(), &strings) == nullptr);
+    }
+
+    freeStrPool(&strings);
+}
@@ -0,0 +1,405 @@
+/**
+ * Unit Tests: Biased Reference Counting Model
+ *
+ * A C model of the reference counting protocol in runtime/builtins.cxy
+ * (`__mem`, `__smart_ptr_get/drop`, `__smart_ptr_merge`, the per thread
+ * queues and slot recycling). The model mirrors the runtime line by line,
+ * with fewer slots so that recycling is exercised, and is hammered from
+ * several threads to check that every object is freed exactly once.
+ */
+
+#include "doctest.h"
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr uint16_t RC_THREADS = 8;
+constexpr uint16_t RC_SLOT_BITS = 10;
+constexpr uint16_t RC_SLOT_MASK = 0x3FF;
+constexpr uint16_t RC_GENERATION_MASK = 0x3F;
+constexpr uint16_t RC_NO_THREAD = 0xFFFF;
+constexpr uint16_t RC_REFS_MAX = 0xFFFF;
+constexpr int32_t RC_MERGED = 1;
+constexpr int32_t RC_QUEUED = 2;
+constexpr int32_t RC_SLAB_MASK = 0x3C;
+constexpr int32_t RC_ONE = 64;
+// Every object carries a slab size class, the counts must ignore it
+constexpr int32_t RC_SLAB = 3 << 2;
+
+#define FETCH_ADD(P, V) __atomic_fetch_add((P), (V), __ATOMIC_ACQ_REL)
+#define FETCH_OR(P, V) __atomic_fetch_or((P), (V), __ATOMIC_ACQ_REL)
+#define LOAD(P) __atomic_load_n((P), __ATOMIC_ACQUIRE)
+#define STORE(P, V) __atomic_store_n((P), (V), __ATOMIC_RELEASE)
+#define EXCHANGE(P, V) __atomic_exchange_n((P), (V), __ATOMIC_ACQ_REL)
+#define CAS(P, E, D)                                                           \
+    __atomic_compare_exchange_n(                                               \
+        (P), (E), (D), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+struct Mem {
+    uint16_t refs;
+    uint16_t owner;
+    int32_t shared;
+    std::atomic<int> frees;
+};
+
+struct Link {
+    Link *next;
+    Mem *mem;
+};
+
+struct Thread {
+    Link *queue;
+    uint16_t generation;
+    void (*waker)(void *);
+    void *wakerArg;
+};
+
+Thread threads[RC_THREADS];
+int64_t nextThread = 1;
+thread_local uint16_t self = 0;
+
+std::atomic<int> doubleFrees{0};
+
+void exitThread();
+
+struct ExitHook {
+    bool armed = false;
+    ~ExitHook()
+    {
+        if (armed)
+            exitThread();
+    }
+};
+
+Link *closed(Thread *thread) { return reinterpret_cast<Link *>(thread); }
+
+void release(Mem *mem)
+{
+    if (mem->frees.fetch_add(1) != 0)
+        doubleFrees++;
+}
+
+uint16_t attach()
+{
+    uint16_t slot = 0;
+    int64_t next = FETCH_ADD(&nextThread, 1);
+    if (next < int64_t(RC_THREADS - 1)) {
+        slot = uint16_t(next);
+    }
+    else {
+        for (uint16_t i = 1; i < RC_THREADS - 1; i++) {
+            Thread *thread = &threads[i];
+            Link *expected = closed(thread);
+            if (CAS(&thread->queue, &expected, nullptr)) {
+                thread->generation =
+                    (thread->generation + 1) & RC_GENERATION_MASK;
+                slot = i;
+                break;
+            }
+        }
+        if (slot == 0)
+            return RC_NO_THREAD;
+    }
+
+    // stands in for the pthread key of __cxy_thread_on_exit
+    static thread_local ExitHook hook;
+    hook.armed = true;
+    return uint16_t((threads[slot].generation << RC_SLOT_BITS) | slot);
+}
+
+uint16_t threadId()
+{
+    if (self == 0)
+        self = attach();
+    return self;
+}
+
+void merge(Mem *mem)
+{
+    int32_t delta = -RC_QUEUED;
+    if ((FETCH_OR(&mem->shared, 0) & RC_MERGED) == 0) {
+        delta += int32_t(mem->refs) * RC_ONE + RC_MERGED;
+        mem->refs = 0;
+    }
+    if (((FETCH_ADD(&mem->shared, delta) + delta) & ~RC_SLAB_MASK) ==
+        RC_MERGED)
+        release(mem);
+}
+
+void mergeList(Link *link)
+{
+    while (link != nullptr) {
+        Link *next = link->next;
+        merge(link->mem);
+        delete link;
+        link = next;
+    }
+}
+
+void enqueue(Mem *mem)
+{
+    Thread *thread = &threads[mem->owner & RC_SLOT_MASK];
+    Link *head = LOAD(&thread->queue);
+    if (head == closed(thread)) {
+        merge(mem);
+        return;
+    }
+    Link *link = new Link{nullptr, mem};
+    while (true) {
+        if (head == closed(thread)) {
+            delete link;
+            merge(mem);
+            return;
+        }
+        link->next = head;
+        if (CAS(&thread->queue, &head, link))
+            break;
+    }
+    if (head == nullptr) {
+        void *arg = LOAD(&thread->wakerArg);
+        if (arg != nullptr)
+            thread->waker(arg);
+    }
+}
+
+void collect()
+{
+    uint16_t id = self;
+    if (id != 0 && id != RC_NO_THREAD) {
+        Thread *thread = &threads[id & RC_SLOT_MASK];
+        if (LOAD(&thread->queue) != nullptr)
+            mergeList(EXCHANGE(&thread->queue, nullptr));
+    }
+}
+
+void setWaker(void (*waker)(void *), void *arg)
+{
+    uint16_t id = threadId();
+    if (id != RC_NO_THREAD) {
+        Thread *thread = &threads[id & RC_SLOT_MASK];
+        thread->waker = waker;
+        STORE(&thread->wakerArg, arg);
+    }
+}
+
+void exitThread()
+{
+    uint16_t id = self;
+    self = RC_NO_THREAD;
+    if (id != 0 && id != RC_NO_THREAD) {
+        Thread *thread = &threads[id & RC_SLOT_MASK];
+        STORE(&thread->wakerArg, static_cast<void *>(nullptr));
+        mergeList(EXCHANGE(&thread->queue, closed(thread)));
+    }
+}
+
+Mem *alloc()
+{
+    Mem *mem = new Mem{};
+    uint16_t owner = threadId();
+    if (owner != RC_NO_THREAD) {
+        mem->owner = owner;
+        mem->refs = 1;
+        mem->shared = RC_SLAB;
+        collect();
+    }
+    else {
+        mem->owner = 0;
+        mem->refs = 0;
+        mem->shared = RC_SLAB + RC_ONE + RC_MERGED;
+    }
+    return mem;
+}
+
+void get(Mem *mem)
+{
+    if (mem->owner == self && mem->refs != 0 && mem->refs != RC_REFS_MAX)
+        mem->refs++;
+    else
+        FETCH_ADD(&mem->shared, RC_ONE);
+}
+
+void dropShared(Mem *mem)
+{
+    int32_t shared = FETCH_ADD(&mem->shared, -RC_ONE) - RC_ONE;
+    if ((shared & RC_MERGED) != 0) {
+        if ((shared & ~RC_SLAB_MASK) == RC_MERGED)
+            release(mem);
+    }
+    else if (shared < 0 && (shared & RC_QUEUED) == 0) {
+        if ((FETCH_OR(&mem->shared, RC_QUEUED) & RC_QUEUED) == 0)
+            enqueue(mem);
+    }
+}
+
+void drop(Mem *mem)
+{
+    if (mem->owner == self && mem->refs != 0) {
+        if (--mem->refs != 0)
+            return;
+        if ((FETCH_ADD(&mem->shared, RC_MERGED) & ~RC_SLAB_MASK) == 0)
+            release(mem);
+        return;
+    }
+    dropShared(mem);
+}
+
+} // namespace
+
+TEST_CASE("RC model: references released by other threads")
+{
+    std::vector<Mem *> objects;
+    std::thread owner([&objects] {
+        for (int round = 0; round < 100; round++) {
+            Mem *mem = alloc();
+            objects.push_back(mem);
+            std::vector<std::thread> workers;
+            for (int i = 0; i < 4; i++) {
+                get(mem);
+                workers.emplace_back([mem] {
+                    for (int j = 0; j < 2000; j++) {
+                        get(mem);
+                        get(mem);
+                        drop(mem);
+                        drop(mem);
+                    }
+                    drop(mem);
+                });
+            }
+            for (int j = 0; j < 1000; j++) {
+                get(mem);
+                drop(mem);
+            }
+            drop(mem);
+            for (auto &worker : workers)
+                worker.join();
+            collect();
+        }
+    });
+    owner.join();
+
+    for (auto *mem : objects) {
+        CHECK(mem->frees == 1);
+        delete mem;
+    }
+    CHECK(doubleFrees == 0);
+}
+
+TEST_CASE("RC model: objects of an exited owner")
+{
+    // The owner exits without handing anything over, the last thread to
+    // release an object merges and frees it
+    for (int round = 0; round < 20; round++) {
+        Mem *objects[8];
+        std::thread maker([&objects] {
+            for (auto &mem : objects) {
+                mem = alloc();
+                get(mem);
+            }
+            for (auto &mem : objects)
+                drop(mem);
+        });
+        maker.join();
+
+        std::thread releaser([&objects] {
+            for (auto *mem : objects)
+                drop(mem);
+        });
+        releaser.join();
+
+        for (auto *mem : objects) {
+            CHECK(mem->frees == 1);
+            delete mem;
+        }
+    }
+    CHECK(doubleFrees == 0);
+}
+
+TEST_CASE("RC model: slots are recycled")
+{
+    // Many more threads than slots, each leaves an object for the next
+    // thread to release while it might already use the same slot. The
+    // generation wraps, so ids only need to differ within its period
+    std::vector<uint16_t> ids;
+    Mem *pending = nullptr;
+    for (uint32_t round = 0; round < 4 * RC_GENERATION_MASK; round++) {
+        uint16_t id = 0;
+        std::thread worker([&pending, &id] {
+            Mem *mem = alloc();
+            id = self;
+            if (pending != nullptr)
+                drop(pending);
+            pending = mem;
+        });
+        worker.join();
+        REQUIRE(id != RC_NO_THREAD);
+        ids.push_back(id);
+        size_t first = ids.size() > RC_GENERATION_MASK
+                           ? ids.size() - RC_GENERATION_MASK
+                           : 0;
+        for (size_t i = first; i + 1 < ids.size(); i++)
+            CHECK(ids[i] != id);
+    }
+    drop(pending);
+    CHECK(pending->frees == 1);
+    CHECK(doubleFrees == 0);
+}
+
+TEST_CASE("RC model: owner is woken when an object is queued")
+{
+    std::atomic<int> wakeups{0};
+    std::atomic<Mem *> shared{nullptr};
+    std::atomic<bool> released{false};
+
+    std::thread owner([&] {
+        setWaker([](void *arg) { (*static_cast<std::atomic<int> *>(arg))++; },
+                 &wakeups);
+        Mem *mem = alloc();
+        get(mem);
+        shared = mem;
+        drop(mem);
+        // blocked, only the waker tells that an object must be merged
+        while (wakeups == 0)
+            std::this_thread::yield();
+        collect();
+        CHECK(mem->frees == 1);
+        released = true;
+    });
+
+    std::thread releaser([&] {
+        Mem *mem;
+        while ((mem = shared.load()) == nullptr)
+            std::this_thread::yield();
+        drop(mem);
+    });
+
+    releaser.join();
+    owner.join();
+    CHECK(released);
+    delete shared.load();
+}
+
+TEST_CASE("RC model: owner references beyond the local count spill over")
+{
+    std::thread owner([] {
+        Mem *mem = alloc();
+        for (int i = 0; i < 70000; i++)
+            get(mem);
+        CHECK(mem->refs == RC_REFS_MAX);
+        CHECK((mem->shared & ~RC_SLAB_MASK) ==
+              (70001 - RC_REFS_MAX) * RC_ONE);
+        for (int i = 0; i < 70000; i++)
+            drop(mem);
+        CHECK(mem->frees == 0);
+        drop(mem);
+        CHECK(mem->frees == 1);
+        CHECK((mem->shared & RC_SLAB_MASK) == RC_SLAB);
+        delete mem;
+    });
+    owner.join();
+    CHECK(doubleFrees == 0);
+}
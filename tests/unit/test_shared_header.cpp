@@ -0,0 +1,98 @@
+/**
+ * Unit Tests: Shared Header Dependencies
+ *
+ * The objects of split unit builds are cached under a key made of the unit
+ * and of the shared header declarations it depends on. Changing a
+ * declaration the unit does not reach must keep the key, changing one it
+ * reaches, even through another declaration, must not.
+ */
+
+#include "doctest.h"
+
+extern "C" {
+#include "lang/backend/c/codegen.h"
+}
+
+#include <string>
+#include <utility>
+
+namespace {
+
+const std::string PROLOGUE = "#pragma once\n\n#include <stdint.h>\n";
+
+std::pair<HashCode, HashCode> unitKey(const std::string &tail,
+                                      const std::string &unit,
+                                      const std::string &prologue = PROLOGUE)
+{
+    std::string text = prologue + tail;
+    SharedHeader *header =
+        newSharedHeader(text.data(), text.size(), prologue.size());
+    HashCode lo = hashInit(), hi = hashInit();
+    hashUnitDependencies(header, unit.data(), unit.size(), &lo, &hi);
+    freeSharedHeader(header);
+    return {lo, hi};
+}
+
+const std::string POINT = "typedef struct Point Point;\n"
+                          "struct Point { int32_t x; int32_t y; };\n";
+const std::string SHAPE = "typedef struct Shape Shape;\n"
+                          "struct Shape { Point origin; };\n";
+const std::string COLOR =
+    "typedef enum { Color_Red = 0, Color_Blue } Color;\n";
+const std::string DECLS = "void Shape_draw(Shape *this);\n"
+                          "extern Color defaultColor;\n";
+
+const std::string UNIT = "#include \"app.h\"\n"
+                         "void Shape_draw(Shape *this) { /* Color */ }\n";
+
+} // namespace
+
+TEST_CASE("Shared header: unrelated declarations do not change the key")
+{
+    auto key = unitKey(POINT + SHAPE + COLOR + DECLS, UNIT);
+    auto other = unitKey(
+        POINT + SHAPE +
+            "typedef enum { Color_Red = 0, Color_Blue, Color_Green } Color;\n" +
+            DECLS,
+        UNIT);
+    CHECK(key == other);
+
+    // names in comments and literals are not references
+    std::string literal = "#include \"app.h\"\n"
+                          "const char *name(void) { return \"defaultColor\"; }\n";
+    CHECK(unitKey(COLOR + DECLS, literal) ==
+          unitKey("typedef enum { Color_Red = 0 } Color;\n" + DECLS, literal));
+}
+
+TEST_CASE("Shared header: declarations reached transitively change the key")
+{
+    auto key = unitKey(POINT + SHAPE + COLOR + DECLS, UNIT);
+    auto changed = unitKey("typedef struct Point Point;\n"
+                           "struct Point { int64_t x; int64_t y; };\n" +
+                               SHAPE + COLOR + DECLS,
+                           UNIT);
+    CHECK(key != changed);
+
+    auto prototype = unitKey(POINT + SHAPE + COLOR +
+                                 "void Shape_draw(const Shape *this);\n"
+                                 "extern Color defaultColor;\n",
+                             UNIT);
+    CHECK(key != prototype);
+}
+
+TEST_CASE("Shared header: the order of the declarations does not matter")
+{
+    auto key = unitKey(POINT + SHAPE + COLOR + DECLS, UNIT);
+    CHECK(key == unitKey(COLOR + POINT + SHAPE + DECLS, UNIT));
+    CHECK(key == unitKey(DECLS + SHAPE + COLOR + POINT, UNIT));
+}
+
+TEST_CASE("Shared header: the prologue and the unit are part of the key")
+{
+    auto key = unitKey(POINT + SHAPE + COLOR + DECLS, UNIT);
+    CHECK(key != unitKey(POINT + SHAPE + COLOR + DECLS,
+                         UNIT,
+                         "#pragma once\n\n#include <stddef.h>\n"));
+    CHECK(key != unitKey(POINT + SHAPE + COLOR + DECLS,
+                         UNIT + "int Shape_area(void) { return 0; }\n"));
+}
@@ -1,14 +1,16 @@
 /**
  * Unit Tests: Core Utils
  *
- * Tests for core utility functions, specifically the strtou128 function
- * for parsing 128-bit unsigned integers from strings.
+ * Tests for core utility functions: the strtou128 function for parsing
+ * 128-bit unsigned integers from strings and the execParallel job runner.
  */
 
 #include "doctest.h"
 #include "core/utils.h"
 #include <errno.h>
 #include <cstring>
+#include <sys/wait.h>
+#include <unistd.h>
 
 TEST_CASE("strtou128 Basic Parsing") {
     char *endptr;
@@ -372,3 +374,54 @@ TEST_CASE("Format Round-trip Consistency") {
         REQUIRE(*endptr == '\0');
     }
 }
+
+TEST_CASE("execParallel") {
+    SUBCASE("All commands succeed") {
+        const char *commands[] = {"true", "exit 0", "true", "true", "true"};
+        REQUIRE(execParallel(commands, 5, 2) == -1);
+    }
+
+    SUBCASE("Reports the first failing command") {
+        const char *commands[] = {"true", "sleep 0.1; exit 1", "exit 2", "true"};
+        REQUIRE(execParallel(commands, 4, 4) == 1);
+    }
+
+    SUBCASE("Runs commands concurrently") {
+        char dir[] = "/tmp/cxy-exec-XXXXXX";
+        REQUIRE(mkdtemp(dir) != nullptr);
+        // Each command waits for the other one to start, serial execution
+        // would time out and fail
+        char first[256], second[256];
+        snprintf(first, sizeof(first),
+                 "touch %s/a; for i in $(seq 50); do "
+                 "[ -f %s/b ] && exit 0; sleep 0.1; done; exit 1",
+                 dir, dir);
+        snprintf(second, sizeof(second),
+                 "touch %s/b; for i in $(seq 50); do "
+                 "[ -f %s/a ] && exit 0; sleep 0.1; done; exit 1",
+                 dir, dir);
+        const char *commands[] = {first, second};
+        REQUIRE(execParallel(commands, 2, 2) == -1);
+
+        char cleanup[128];
+        snprintf(cleanup, sizeof(cleanup), "rm -rf %s", dir);
+        REQUIRE(system(cleanup) == 0);
+    }
+
+    SUBCASE("Leaves unrelated children alone") {
+        pid_t other = fork();
+        REQUIRE(other >= 0);
+        if (other == 0)
+            _exit(7);
+
+        // Give the unrelated child time to exit before the jobs run
+        usleep(50000);
+        const char *commands[] = {"true", "sleep 0.1", "true"};
+        REQUIRE(execParallel(commands, 3, 2) == -1);
+
+        int status = 0;
+        REQUIRE(waitpid(other, &status, 0) == other);
+        REQUIRE(WIFEXITED(status));
+        REQUIRE(WEXITSTATUS(status) == 7);
+    }
+}